@@ -1,7 +1,9 @@
 #define M61_DISABLE 1
 #include "m61.hh"
+#include <algorithm>
 #include <unordered_map>
 #include <vector>
+#include <new>
 #include <sys/mman.h>
 
 
@@ -11,12 +13,80 @@
 
 using base_allocation = std::pair<uintptr_t, size_t>;
 
-// `allocs` is a hash table mapping active pointer address to allocation size.
-// `frees` is a vector of freed allocations.
-static std::unordered_map<uintptr_t, size_t> allocs;
-static std::vector<base_allocation> frees;
+// The tables below use the system allocator directly, so they keep working
+// when global operator new is routed to m61 (see `m61new.cc`).
+template <typename T>
+struct system_allocator {
+    using value_type = T;
+    system_allocator() noexcept = default;
+    template <typename U> system_allocator(const system_allocator<U>&) noexcept {}
+    T* allocate(size_t n) {
+        if (T* ptr = reinterpret_cast<T*>(malloc(n * sizeof(T)))) {
+            return ptr;
+        }
+        throw std::bad_alloc();
+    }
+    void deallocate(T* ptr, size_t) {
+        free(ptr);
+    }
+};
+template <typename T, typename U>
+inline bool operator==(const system_allocator<T>&, const system_allocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+inline bool operator!=(const system_allocator<T>&, const system_allocator<U>&) {
+    return false;
+}
+
+// `allocs` is a hash table mapping active pointer address to the size of
+// its underlying block, which is rounded up to a size class (four per power
+// of two), so it may be up to 25% bigger than requested.
+// `frees[c]` holds freed blocks of size class `c`. Bit `c % 64` of
+// `frees_mask[c / 64]` is set iff `frees[c]` is nonempty.
+static const unsigned NFREE_CLASSES = 4 * 56 + 1;    // through 2^60
+static const unsigned FREE_SEARCH_CLASSES = 4;  // waste at most 2x
+static const size_t FREE_CLASS_LIMIT = size_t(1) << 60;
+static const size_t ALLOCS_RESERVE = 1 << 14;
+static std::unordered_map<uintptr_t, size_t, std::hash<uintptr_t>,
+                          std::equal_to<uintptr_t>,
+                          system_allocator<std::pair<const uintptr_t, size_t>>> allocs;
+static std::vector<base_allocation, system_allocator<base_allocation>> frees[NFREE_CLASSES];
+static uint64_t frees_mask[(NFREE_CLASSES + 63) / 64];
 static int disabled;
 
+// Return the size class for `sz` bytes, 0 < `sz` <= `FREE_CLASS_LIMIT`.
+static inline unsigned free_class(size_t sz) {
+    if (sz <= 16) {
+        return 0;
+    }
+    unsigned p = 63 - __builtin_clzll(sz - 1);
+    return (p - 3) * 4 + (((sz - 1) >> (p - 2)) & 3) - 3;
+}
+
+// Return the block size of size class `c`.
+static inline size_t free_class_size(unsigned c) {
+    if (c == 0) {
+        return 16;
+    }
+    unsigned p = (c + 3) / 4 + 3;
+    return size_t(5 + (c + 3) % 4) << (p - 2);
+}
+
+// Return the smallest size class in [`c`, `c + FREE_SEARCH_CLASSES`) with
+// a freed block, or -1 if there is none.
+static int find_free_class(unsigned c) {
+    unsigned end = std::min(c + FREE_SEARCH_CLASSES, NFREE_CLASSES);
+    while (c < end) {
+        if (uint64_t bits = frees_mask[c / 64] >> (c % 64)) {
+            c += __builtin_ctzll(bits);
+            return c < end ? c : -1;
+        }
+        c = (c / 64 + 1) * 64;
+    }
+    return -1;
+}
+
 static unsigned alloc_random() {
     static uint64_t x = 8973443640547502487ULL;
     x = x * 6364136223846793005ULL + 1ULL;
@@ -35,30 +105,39 @@ void* base_malloc(size_t sz) {
     static int base_alloc_atexit_installed = 0;
     if (!base_alloc_atexit_installed) {
         atexit(base_allocator_atexit);
+        allocs.reserve(ALLOCS_RESERVE);
         base_alloc_atexit_installed = 1;
     }
 
-    // try to use a previously-freed block 75% of the time
+    if (sz > FREE_CLASS_LIMIT) {
+        --disabled;
+        return nullptr;
+    }
+
+    // try to use a previously-freed block 75% of the time: a random block
+    // from the smallest nearby size class that has one
     unsigned r = alloc_random();
-    if (r % 4 != 0) {
-        for (unsigned ntries = 0; ntries < 10 && ntries < frees.size(); ++ntries) {
-            auto& f = frees[alloc_random() % frees.size()];
-            if (f.second >= sz) {
-                allocs.insert(f);
-                ptr = f.first;
-                f = frees.back();
-                frees.pop_back();
-                break;
-            }
+    unsigned c = free_class(sz ? sz : 1);
+    size_t bsz = free_class_size(c);
+    int fc;
+    if (r % 4 != 0 && (fc = find_free_class(c)) >= 0) {
+        auto& bucket = frees[fc];
+        auto& f = bucket[alloc_random() % bucket.size()];
+        ptr = f.first;
+        bsz = f.second;
+        f = bucket.back();
+        bucket.pop_back();
+        if (bucket.empty()) {
+            frees_mask[fc / 64] &= ~(uint64_t(1) << (fc % 64));
         }
     }
 
     if (!ptr) {
         // need a new allocation
-        ptr = reinterpret_cast<uintptr_t>(malloc(sz ? sz : 1));
+        ptr = reinterpret_cast<uintptr_t>(malloc(bsz));
     }
     if (ptr) {
-        allocs[reinterpret_cast<uintptr_t>(ptr)] = sz;
+        allocs[ptr] = bsz;
     }
 
     --disabled;
@@ -73,7 +152,9 @@ void base_free(void* ptr) {
         ++disabled;
         auto it = allocs.find(reinterpret_cast<uintptr_t>(ptr));
         if (it != allocs.end()) {
-            frees.push_back(*it);
+            unsigned c = free_class(it->second);
+            frees[c].push_back(*it);
+            frees_mask[c / 64] |= uint64_t(1) << (c % 64);
             allocs.erase(it);
         } else {
             fprintf(stderr, "ERROR: invalid free of %p at %p", ptr,
@@ -89,7 +170,9 @@ void base_allocator_disable(bool d) {
 
 static void base_allocator_atexit() {
     // clean up freed memory to shut up leak detector
-    for (auto& alloc : frees) {
-        free(reinterpret_cast<void*>(alloc.first));
+    for (auto& bucket : frees) {
+        for (auto& alloc : bucket) {
+            free(reinterpret_cast<void*>(alloc.first));
+        }
     }
 }
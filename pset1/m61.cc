@@ -5,130 +5,1869 @@
 #include <cstring>
 #include <cstdio>
 #include <cinttypes>
+#include <cstddef>
 #include <cassert>
 #include <limits.h>
-#include <vector>
 #include <string.h>
-#include <map>
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/// M61_CHECK_LEVEL
+///    Selects at compile time how much work each m61 call does:
+///
+///    - `M61_CHECK_FULL` (the default): statistics, leak and heavy-hitter
+///      reports, and every memory-bug check.
+///    - `M61_CHECK_STATS`: statistics (including the heap range) and
+///      reports, but no validation. Frees trust their pointers, blocks
+///      carry no canaries, and the check options (guard pages, quarantine,
+///      sweeps) have no effect.
+///    - `M61_CHECK_NONE`: a plain allocator. Statistics read as zero and
+///      the leak and heavy-hitter reports are empty.
+///
+///    Disabled work is removed by `if constexpr`, not skipped at runtime.
+///    The test suite expects `M61_CHECK_FULL`.
+#define M61_CHECK_NONE      0
+#define M61_CHECK_STATS     1
+#define M61_CHECK_FULL      2
+#ifndef M61_CHECK_LEVEL
+#define M61_CHECK_LEVEL     M61_CHECK_FULL
+#endif
+static_assert(M61_CHECK_LEVEL >= M61_CHECK_NONE && M61_CHECK_LEVEL <= M61_CHECK_FULL,
+              "M61_CHECK_LEVEL must be M61_CHECK_NONE, _STATS, or _FULL");
+static constexpr bool CHECK_STATS = M61_CHECK_LEVEL >= M61_CHECK_STATS;
+static constexpr bool CHECK_FULL = M61_CHECK_LEVEL >= M61_CHECK_FULL;
+
+struct m61_shard;
+
+/// m61_header
+///    Metadata for an allocation, stored in-band immediately before the
+///    pointer returned to the user. Active blocks are chained on their
+///    owning shard's doubly-linked list so the leak report can find them
+///    without a separate index. `check` encodes the block's state and its
+///    own address, so a header copied to another location (or random data)
+///    does not look valid. Each block records the canary layout it was
+///    allocated with, so check options can change while blocks are live.
+///    `front` is the optional front canary, adjacent to the user data. The
+///    allocation site is an interned ID (see `site_intern`).
+struct alignas(std::max_align_t) m61_header {
+    m61_header* prev;
+    m61_header* next;
+    unsigned long long sz;
+    m61_shard* shard;           // shard whose active list holds this block
+    uintptr_t check;
+    uint32_t site;              // allocation site ID
+    uint8_t canary_align;       // trailing canary alignment (1, 8, or 16)
+    uint8_t canary_len;         // trailing canary length after padding
+    uint16_t flags;             // HF_ flags
+    uint32_t offset;            // bytes from the underlying allocation or
+                                //   mapping to the header
+    uint32_t npages;            // mapping size in pages (mapped blocks)
+    uint64_t front;
+};
+
+#define HF_FRONT_CANARY     0x1     // `front` holds a canary
+#define HF_GUARD_PAGE       0x2     // block is mmapped, ending at a guard page
+#define HF_BOOKMARK         0x4     // not a block; a leak summary's cursor
+#define HF_MAPPED           0x8     // block is mmapped and resized by mremap
+#define HF_ALIGNED          0x10    // block is `offset` bytes into a base
+                                    //   allocation, for extra alignment
+
+static_assert(sizeof(m61_header) % alignof(std::max_align_t) == 0,
+              "m61_header must preserve malloc alignment");
+static_assert(sizeof(m61_header) <= 64, "m61_header should stay compact");
+
+static const uintptr_t HEADER_ACTIVE = 0x61A11C8EDB10C4ULL;
+static const uintptr_t HEADER_FREED = 0x61F4EED0B10C4ULL;
+
+/// Size classes
+///    Small blocks are rounded up to a size class and recycled through
+///    per-class free lists instead of going back to `base_free`. Classes
+///    are 16 bytes apart up to 128 bytes, then four per power of two up to
+///    `SIZE_CLASS_MAX`; larger blocks go straight to the base allocator.
+///    Cached blocks keep their freed header, so double frees are still
+///    caught, and free-list links reuse the header's `next` pointer.
+static const size_t SIZE_CLASS_MAX = 16384;
+static const unsigned NSIZE_CLASSES = 36;
+
+/// Allocation sites
+///    Blocks name their allocation site by a 32-bit ID rather than a
+///    `file` pointer and `line`. `site_intern` maps a `file:line` pair to
+///    its ID, consulting a small per-shard cache first and the shared
+///    `site_index` (under `site_lock`) on a miss. Sites with equal file
+///    names share an ID even if their `file` pointers differ. IDs index
+///    `site_chunks`, whose chunks are published once and never move, so
+///    `site_get` needs no lock. ID 0 stands in for every site after the
+///    table fills.
+struct m61_site {
+    const char* file;
+    long line;
+};
+
+static const unsigned SITE_CHUNK_SHIFT = 12;
+static const unsigned SITE_CHUNK_SIZE = 1U << SITE_CHUNK_SHIFT;
+static const unsigned SITE_NCHUNKS = 1024;
+static const unsigned SITE_CACHE_SIZE = 64;
+
+static m61_site site_chunk0[SITE_CHUNK_SIZE] = {{"?", 0}};
+static std::atomic<m61_site*> site_chunks[SITE_NCHUNKS] = {{site_chunk0}};
+static uint32_t site_count = 1;
+static std::mutex site_lock;
+
+/// m61_shard
+///    Per-thread allocator state. Each thread claims a shard the first time
+///    it allocates; the shard holds that thread's free-list cache and its
+///    share of the statistics. Only the owning thread writes the counters,
+///    so they are relaxed atomics that `m61_get_statistics` sums on demand.
+///    Writers bracket each group of related updates with `stats_update`,
+///    which makes `seq` odd for the duration; readers retry a shard whose
+///    `seq` was odd or changed, so a snapshot never mixes half of one
+///    update with the rest of the counts, and readers never block writers.
+///    `lock` protects `active_head`, since another thread may free a block
+///    this shard allocated; it is uncontended in the common case. Shards
+///    are never destroyed: when a thread exits its shard is released for
+///    reuse, keeping its counts.
+struct m61_shard {
+    std::atomic<unsigned> seq{0};
+    std::atomic<unsigned long long> ntotal{0};
+    std::atomic<unsigned long long> nactive{0};
+    std::atomic<unsigned long long> active_size{0};
+    std::atomic<unsigned long long> total_size{0};
+    std::atomic<unsigned long long> nfail{0};
+    std::atomic<unsigned long long> fail_size{0};
+    std::atomic<unsigned long long> narenas{0};
+    std::atomic<unsigned long long> arena_ntotal{0};
+    std::atomic<unsigned long long> arena_total_size{0};
+    std::atomic<unsigned long long> arena_active_size{0};
+    std::atomic<unsigned long long> arena_reserved{0};
+    std::atomic<unsigned long long> nmapped{0};
+    std::atomic<unsigned long long> mapped_size{0};
+    std::atomic<unsigned long long> quarantined{0};
+    std::atomic<unsigned long long> malloc_latency[M61_LATENCY_BUCKETS] = {};
+    std::atomic<unsigned long long> free_latency[M61_LATENCY_BUCKETS] = {};
+    unsigned malloc_latency_countdown = M61_LATENCY_SAMPLE;
+    unsigned free_latency_countdown = M61_LATENCY_SAMPLE;
+
+    m61_header* free_lists[NSIZE_CLASSES] = {};
+
+    std::mutex lock;
+    m61_header* active_head = nullptr;
+
+    struct {
+        const char* file;
+        long line;
+        uint32_t site;
+    } site_cache[SITE_CACHE_SIZE] = {};     // recently interned sites
+
+    // freed blocks awaiting reuse, oldest first; see `quarantine_push`
+    m61_header* quarantine_head = nullptr;
+    m61_header* quarantine_tail = nullptr;
+
+    unsigned long sweep_countdown = 0;  // frees until next heap sweep
+    long long hh_countdown = 0;     // bytes until next heavy-hitter sample
+    uint64_t hh_random = 0;         // sampling interval generator state
+
+    std::atomic<bool> in_use{true};
+    m61_shard* next_shard = nullptr;
+};
+
+static std::atomic<m61_shard*> all_shards{nullptr};
+static thread_local m61_shard* my_shard = nullptr;
+
+// The heap range is shared so the free path can reject wild pointers
+// without visiting every shard. It changes only when a fresh block
+// extends it.
+static std::atomic<uintptr_t> heap_min{LONG_MAX};
+static std::atomic<uintptr_t> heap_max{0};
+
+// The base allocator is not thread-safe; it is only reached when a
+// thread's cache misses or for large blocks.
+static std::mutex base_lock;
+
+/// Heavy-hitter sampling
+///    Allocations are sampled by bytes: each shard counts down a random
+///    interval averaging `HH_SAMPLE_BYTES`, and every interval that expires
+///    credits `HH_SAMPLE_BYTES` to the allocating site. Allocations at least
+///    that large are always credited with their exact size. The credits
+///    feed a Space-Saving sketch of `HH_NCOUNTERS` sites, which keeps any
+///    site holding more than 1/`HH_NCOUNTERS` of sampled bytes with an
+///    overestimate of at most `error`. Only the sampling path takes
+///    `hh_lock`; unsampled allocations just decrement the countdown.
+static const long long HH_SAMPLE_BYTES = 1024;
+static const unsigned HH_NCOUNTERS = 64;
+static const double HH_REPORT_THRESHOLD = 0.05;
+
+struct hh_counter {
+    uint32_t site;
+    unsigned long long bytes;
+    unsigned long long error;
+};
+static hh_counter hh_counters[HH_NCOUNTERS];
+static unsigned hh_ncounters = 0;
+static std::mutex hh_lock;
+
+/// Canaries
+///    The bytes after each block's data hold a trailing canary: padding
+///    bytes up to `canary_align`, then `canary_len` bytes of `CANARY`. The
+///    default 4-byte canary is unaligned and starts right at the end of the
+///    data; 8- and 16-byte canaries are aligned words. Guard-page blocks
+///    only pad to 16 bytes, since the guard page catches longer overruns.
+///    The first four `CANARY` bytes are the traditional 0xBADBEEF.
+static const unsigned char CANARY[16] = {
+    0xEF, 0xBE, 0xAD, 0x0B, 0x61, 0xCA, 0x4A, 0x7E,
+    0xD0, 0x0D, 0xFE, 0xED, 0x61, 0xC0, 0xFF, 0xEE
+};
+static const unsigned char CANARY_PAD = 0xCB;
+static const uint64_t FRONT_CANARY = 0xF407CA4A7EF407CAULL;
+static const size_t CANARY_MAX = 2 * sizeof(CANARY);
+
+// Check options; see `m61_set_check_options`.
+static std::atomic<unsigned> opt_canary_size{4};
+static std::atomic<bool> opt_front_canary{false};
+static std::atomic<unsigned long> opt_sweep_interval{0};
+static std::atomic<size_t> opt_guard_page_min{0};
+static std::atomic<size_t> opt_quarantine_bytes{0};
+static const size_t PAGESIZE = 4096;
+
+/// Mapped blocks
+///    Blocks of at least `MMAP_THRESHOLD` bytes get their own anonymous
+///    mapping, so big buffers don't fragment the base heap, their memory
+///    goes back to the OS when freed, and `m61_realloc` can resize them
+///    with mremap. Up to `MAP_CACHE_SLOTS` released mappings, totaling at
+///    most `MAP_CACHE_BYTES`, are kept for reuse so buffers that churn
+///    don't pay for mmap and page faults every time.
+static const size_t MMAP_THRESHOLD = 128 << 10;
+static const unsigned MAP_CACHE_SLOTS = 8;
+static const size_t MAP_CACHE_BYTES = 16 << 20;
+
+struct map_cache_entry {
+    void* map;
+    size_t len;
+};
+static map_cache_entry map_cache[MAP_CACHE_SLOTS];
+static unsigned map_cache_count = 0;
+static std::atomic<unsigned long long> map_cache_bytes{0};
+static std::mutex map_cache_lock;
+
+// Guard-page and mapped blocks live outside the base allocator's heap.
+// `mapped_min` and `mapped_max` bound them, and `mapped_blocks` records
+// each one's user pointer so wild pointers in that range are rejected
+// without touching memory.
+template <typename T> struct m61_base_allocator;
+static std::atomic<uintptr_t> mapped_min{LONG_MAX};
+static std::atomic<uintptr_t> mapped_max{0};
+static std::mutex mapped_lock;
+using mapped_set = std::unordered_set<uintptr_t, std::hash<uintptr_t>,
+                                      std::equal_to<uintptr_t>,
+                                      m61_base_allocator<uintptr_t>>;
+static mapped_set* mapped_blocks;
+
+
+/// m61_base_allocator
+///    Lets m61's internal containers allocate from the base allocator.
+
+template <typename T>
+struct m61_base_allocator {
+    using value_type = T;
+    m61_base_allocator() noexcept = default;
+    template <typename U> m61_base_allocator(const m61_base_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        std::lock_guard<std::mutex> guard(base_lock);
+        void* ptr = base_malloc(n * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) {
+        std::lock_guard<std::mutex> guard(base_lock);
+        base_free(ptr);
+    }
+};
+template <typename T, typename U>
+inline bool operator==(const m61_base_allocator<T>&, const m61_base_allocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+inline bool operator!=(const m61_base_allocator<T>&, const m61_base_allocator<U>&) {
+    return false;
+}
+
+
+/// site_key_hash, site_key_equal
+///    Compare `file:line` keys by file name rather than pointer.
+
+struct site_key_hash {
+    size_t operator()(const m61_site& k) const {
+        size_t h = 14695981039346656037ULL;
+        for (const char* s = k.file; s && *s; ++s) {
+            h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+        }
+        return h ^ std::hash<long>()(k.line);
+    }
+};
+struct site_key_equal {
+    bool operator()(const m61_site& a, const m61_site& b) const {
+        return a.line == b.line
+            && (a.file == b.file
+                || (a.file && b.file && strcmp(a.file, b.file) == 0));
+    }
+};
+using site_map = std::unordered_map<
+    m61_site, uint32_t, site_key_hash, site_key_equal,
+    m61_base_allocator<std::pair<const m61_site, uint32_t>>>;
+static site_map* site_index;
+
+
+/// site_get(site)
+///    Return the `file:line` for site ID `site`.
+
+static inline const m61_site& site_get(uint32_t site) {
+    return site_chunks[site >> SITE_CHUNK_SHIFT].load(std::memory_order_acquire)
+        [site & (SITE_CHUNK_SIZE - 1)];
+}
+
+
+/// site_intern(shard, file, line)
+///    Return the site ID for `file:line`, creating it if necessary.
+
+static uint32_t site_intern(m61_shard* shard, const char* file, long line) {
+    if constexpr (!CHECK_STATS) {
+        return 0;
+    }
+    unsigned slot = (((uintptr_t) file >> 3) ^ (unsigned long) line)
+        % SITE_CACHE_SIZE;
+    auto& cached = shard->site_cache[slot];
+    if (cached.file == file && cached.line == line && file) {
+        return cached.site;
+    }
+
+    uint32_t site;
+    {
+        std::lock_guard<std::mutex> guard(site_lock);
+        if (!site_index) {
+            site_index = new (m61_base_allocator<site_map>().allocate(1)) site_map;
+        }
+        auto it = site_index->find({file, line});
+        if (it != site_index->end()) {
+            site = it->second;
+        } else if (site_count == SITE_CHUNK_SIZE * SITE_NCHUNKS) {
+            site = 0;
+        } else {
+            site = site_count;
+            unsigned chunk = site >> SITE_CHUNK_SHIFT;
+            m61_site* sites = site_chunks[chunk].load(std::memory_order_relaxed);
+            if (!sites) {
+                sites = m61_base_allocator<m61_site>().allocate(SITE_CHUNK_SIZE);
+            }
+            sites[site & (SITE_CHUNK_SIZE - 1)] = {file, line};
+            site_chunks[chunk].store(sites, std::memory_order_release);
+            ++site_count;
+            site_index->insert({{file, line}, site});
+        }
+    }
+    cached.file = file;
+    cached.line = line;
+    cached.site = site;
+    return site;
+}
+
+
+/// counter_add(c, delta)
+///    Add `delta` to a counter that only the calling thread writes.
+
+static inline void counter_add(std::atomic<unsigned long long>& c,
+                               unsigned long long delta) {
+    if constexpr (CHECK_STATS) {
+        c.store(c.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+    }
+}
+
+
+/// stats_update
+///    Marks a group of counter updates on the calling thread's shard as one
+///    unit for `m61_get_statistics` (see `m61_shard`).
+
+struct stats_update {
+    m61_shard* shard;
+    explicit stats_update(m61_shard* s)
+        : shard(s) {
+        if constexpr (CHECK_STATS) {
+            shard->seq.store(shard->seq.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+    }
+    ~stats_update() {
+        if constexpr (CHECK_STATS) {
+            shard->seq.store(shard->seq.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_release);
+        }
+    }
+};
+
+
+/// latency_timer
+///    Adds the time between its construction and destruction to one of a
+///    shard's latency histograms. Reading the clock twice costs about as
+///    much as a cached malloc, so only one operation in
+///    `M61_LATENCY_SAMPLE` is timed (counted down by `countdown`), and it
+///    is credited `M61_LATENCY_SAMPLE` times.
+
+struct latency_timer {
+    m61_shard* shard;
+    std::atomic<unsigned long long>* histogram;
+    bool sampled = false;
+    struct timespec start;
+
+    latency_timer(m61_shard* s, std::atomic<unsigned long long>* h,
+                  unsigned& countdown)
+        : shard(s), histogram(h) {
+        if constexpr (CHECK_STATS) {
+            if (--countdown == 0) {
+                countdown = M61_LATENCY_SAMPLE;
+                sampled = true;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+            }
+        }
+    }
+    ~latency_timer() {
+        if (!CHECK_STATS || !sampled) {
+            return;
+        }
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        unsigned long long ns = (end.tv_sec - start.tv_sec) * 1000000000ULL
+            + end.tv_nsec - start.tv_nsec;
+        unsigned b = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+        b = std::min(b, M61_LATENCY_BUCKETS - 1);
+        stats_update u(shard);
+        counter_add(histogram[b], M61_LATENCY_SAMPLE);
+    }
+};
+
+
+/// shard_release
+///    Returns the calling thread's shard to the pool when the thread exits.
+
+struct shard_release {
+    ~shard_release() {
+        if (my_shard) {
+            my_shard->in_use.store(false, std::memory_order_release);
+            my_shard = nullptr;
+        }
+    }
+};
+static thread_local shard_release my_shard_release;
+
+
+/// current_shard()
+///    Return the calling thread's shard, claiming an idle one or creating
+///    a new one on first use.
+
+static m61_shard* current_shard() {
+    if (m61_shard* shard = my_shard) {
+        return shard;
+    }
+    (void) &my_shard_release;   // register the thread-exit release
+    m61_shard* shard = all_shards.load(std::memory_order_acquire);
+    for (; shard; shard = shard->next_shard) {
+        bool idle = false;
+        if (shard->in_use.compare_exchange_strong(idle, true)) {
+            break;
+        }
+    }
+    if (!shard) {
+        {
+            std::lock_guard<std::mutex> guard(base_lock);
+            shard = new (base_malloc(sizeof(m61_shard))) m61_shard;
+        }
+        shard->next_shard = all_shards.load(std::memory_order_relaxed);
+        while (!all_shards.compare_exchange_weak(shard->next_shard, shard,
+                                                 std::memory_order_release)) {
+        }
+    }
+    my_shard = shard;
+    return shard;
+}
+
+
+/// hh_interval(shard)
+///    Return the next sampling interval for `shard`, uniform in
+///    [1, 2 * HH_SAMPLE_BYTES] so periodic allocation patterns don't alias.
+
+static long long hh_interval(m61_shard* shard) {
+    if (!shard->hh_random) {
+        shard->hh_random = 0x9E3779B97F4A7C15ULL ^ (uintptr_t) shard;
+    }
+    uint64_t x = shard->hh_random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    shard->hh_random = x;
+    return 1 + (long long) (x % (2 * HH_SAMPLE_BYTES));
+}
+
+
+/// hh_sample(shard, sz, site)
+///    Called when `shard`'s countdown expires during an allocation of `sz`
+///    bytes at site ID `site`. Credits the site once per expired interval.
+///    Allocations of at least `HH_SAMPLE_BYTES` skip sampling and are
+///    credited exactly.
+
+static void hh_sample(m61_shard* shard, size_t sz, uint32_t site) {
+    unsigned long long bytes = 0;
+    if (sz >= (size_t) HH_SAMPLE_BYTES) {
+        shard->hh_countdown += (long long) sz;
+        bytes = sz;
+    } else if (!shard->hh_random) {
+        // first sample on this shard: start the countdown
+        shard->hh_countdown += hh_interval(shard);
+        if (shard->hh_countdown > 0) {
+            return;
+        }
+    }
+    while (shard->hh_countdown <= 0) {
+        bytes += HH_SAMPLE_BYTES;
+        shard->hh_countdown += hh_interval(shard);
+    }
+
+    std::lock_guard<std::mutex> guard(hh_lock);
+    unsigned i, min = 0;
+    for (i = 0; i != hh_ncounters; ++i) {
+        if (hh_counters[i].site == site) {
+            break;
+        }
+        if (hh_counters[i].bytes < hh_counters[min].bytes) {
+            min = i;
+        }
+    }
+    if (i == hh_ncounters) {
+        if (hh_ncounters < HH_NCOUNTERS) {
+            ++hh_ncounters;
+            hh_counters[i] = {site, 0, 0};
+        } else {
+            // evict the smallest site; the newcomer inherits its count
+            i = min;
+            hh_counters[i].site = site;
+            hh_counters[i].error = hh_counters[i].bytes;
+        }
+    }
+    hh_counters[i].bytes += bytes;
+}
+
+
+/// record_failure(sz)
+///    Count a failed allocation attempt of `sz` bytes.
+
+static void record_failure(size_t sz) {
+    m61_shard* shard = current_shard();
+    stats_update u(shard);
+    counter_add(shard->nfail, 1);
+    counter_add(shard->fail_size, sz);
+}
+
+
+/// extend_heap_range(lo, hi)
+///    Widen the shared heap range to include [`lo`, `hi`].
+
+static void extend_heap_range(uintptr_t lo, uintptr_t hi,
+                              std::atomic<uintptr_t>& rmin = heap_min,
+                              std::atomic<uintptr_t>& rmax = heap_max) {
+    uintptr_t x = rmin.load(std::memory_order_relaxed);
+    while (lo < x && !rmin.compare_exchange_weak(x, lo, std::memory_order_relaxed)) {
+    }
+    x = rmax.load(std::memory_order_relaxed);
+    while (hi > x && !rmax.compare_exchange_weak(x, hi, std::memory_order_relaxed)) {
+    }
+}
+
+
+/// header_check(h, magic)
+///    Return the check word for header `h` in the state named by `magic`.
+
+static inline uintptr_t header_check(const m61_header* h, uintptr_t magic) {
+    return magic ^ reinterpret_cast<uintptr_t>(h) ^ h->sz
+        ^ ((uintptr_t) h->flags << 48) ^ ((uintptr_t) h->canary_len << 40)
+        ^ ((uintptr_t) h->canary_align << 32);
+}
+
+
+/// size_class(data_size)
+///    Return the size class index for a data area of `data_size` bytes,
+///    or `NSIZE_CLASSES` if the block is too large to be cached.
+
+static inline unsigned size_class(size_t data_size) {
+    if (data_size <= 128) {
+        return (data_size - 1) / 16;
+    } else if (data_size > SIZE_CLASS_MAX) {
+        return NSIZE_CLASSES;
+    }
+    unsigned p = 63 - __builtin_clzll(data_size - 1);
+    return 8 + (p - 7) * 4 + (((data_size - 1) >> (p - 2)) & 3);
+}
+
+
+/// size_class_size(sc)
+///    Return the data area size of blocks in size class `sc`.
+
+static inline size_t size_class_size(unsigned sc) {
+    if (sc < 8) {
+        return (sc + 1) * 16;
+    }
+    unsigned p = 7 + (sc - 8) / 4;
+    return size_t(5 + (sc - 8) % 4) << (p - 2);
+}
+
+
+/// canary_pad(sz, align)
+///    Return the number of padding bytes between `sz` bytes of data and an
+///    `align`-aligned trailing canary.
+
+static inline size_t canary_pad(size_t sz, unsigned align) {
+    return ((sz + align - 1) & ~size_t(align - 1)) - sz;
+}
+
+
+/// block_data_size(h)
+///    Return the data area size needed for header `h`'s data and canary,
+///    rounded so the next header stays aligned and small overruns land in
+///    padding rather than in the base allocator's metadata.
+
+static inline size_t block_data_size(const m61_header* h) {
+    size_t sz = h->sz + canary_pad(h->sz, h->canary_align) + h->canary_len;
+    sz = std::max(sz, size_t(1));   // zero-byte blocks without canaries
+    return (sz + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+}
+
+
+/// write_canaries(h)
+///    Write block `h`'s trailing canary, and its front canary if enabled.
+
+static inline void write_canaries(m61_header* h) {
+    if constexpr (!CHECK_FULL) {
+        return;
+    }
+    unsigned char* end = (unsigned char*) (h + 1) + h->sz;
+    size_t pad = canary_pad(h->sz, h->canary_align);
+    if (pad) {
+        memset(end, CANARY_PAD, pad);
+    }
+    memcpy(end + pad, CANARY, h->canary_len);
+    if (h->flags & HF_FRONT_CANARY) {
+        h->front = FRONT_CANARY ^ (uintptr_t) h;
+    }
+}
+
+
+/// canaries_intact(h)
+///    Return true iff block `h`'s canaries are unmodified.
+
+static inline bool canaries_intact(const m61_header* h) {
+    if constexpr (!CHECK_FULL) {
+        return true;
+    }
+    const unsigned char* end = (const unsigned char*) (h + 1) + h->sz;
+    size_t pad = canary_pad(h->sz, h->canary_align);
+    for (size_t i = 0; i != pad; ++i) {
+        if (end[i] != CANARY_PAD) {
+            return false;
+        }
+    }
+    return memcmp(end + pad, CANARY, h->canary_len) == 0
+        && (!(h->flags & HF_FRONT_CANARY)
+            || h->front == (FRONT_CANARY ^ (uintptr_t) h));
+}
+
+
+/// register_mapped(h, lo, hi)
+///    Record that mapped block `h` occupies addresses [`lo`, `hi`).
+
+static void register_mapped(m61_header* h, uintptr_t lo, uintptr_t hi) {
+    {
+        std::lock_guard<std::mutex> guard(mapped_lock);
+        if (!mapped_blocks) {
+            mapped_blocks = new (m61_base_allocator<mapped_set>().allocate(1)) mapped_set;
+        }
+        mapped_blocks->insert((uintptr_t) (h + 1));
+    }
+    extend_heap_range(lo, hi, mapped_min, mapped_max);
+}
+
+
+/// unregister_mapped(h)
+///    Forget mapped block `h`.
+
+static void unregister_mapped(m61_header* h) {
+    std::lock_guard<std::mutex> guard(mapped_lock);
+    mapped_blocks->erase((uintptr_t) (h + 1));
+}
+
+
+/// guard_alloc(tmpl)
+///    Return a new header for a guard-page block shaped like `*tmpl`. The
+///    block is mmapped so its data ends at most 15 bytes before a PROT_NONE
+///    page. Returns `nullptr` on failure.
+
+static m61_header* guard_alloc(const m61_header* tmpl) {
+    size_t dsz = block_data_size(tmpl);
+    size_t maplen = ((sizeof(m61_header) + dsz + PAGESIZE - 1) & ~(PAGESIZE - 1))
+        + PAGESIZE;
+    void* map = mmap(nullptr, maplen, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t guard = (uintptr_t) map + maplen - PAGESIZE;
+    if (mprotect((void*) guard, PAGESIZE, PROT_NONE) != 0) {
+        munmap(map, maplen);
+        return nullptr;
+    }
+    m61_header* h = (m61_header*) (guard - dsz) - 1;
+    h->offset = (uintptr_t) h - (uintptr_t) map;
+    h->npages = maplen / PAGESIZE;
+    register_mapped(h, (uintptr_t) map, guard);
+    return h;
+}
+
+
+/// map_data_offset(align)
+///    Return the offset of a mapped block's data from the start of its
+///    mapping, given data alignment `align`.
+
+static inline size_t map_data_offset(size_t align) {
+    align = std::max(align, alignof(std::max_align_t));
+    return (sizeof(m61_header) + align - 1) & ~(align - 1);
+}
+
+
+/// map_alloc(tmpl, align)
+///    Return a new header for a mapped block shaped like `*tmpl`, with data
+///    aligned to `align` (at most `PAGESIZE`) near the start of its own
+///    mapping. Reuses a cached mapping if one fits. Returns `nullptr` on
+///    failure.
+
+static m61_header* map_alloc(const m61_header* tmpl, size_t align) {
+    size_t dataoff = map_data_offset(align);
+    size_t maplen = (dataoff + block_data_size(tmpl) + PAGESIZE - 1)
+        & ~(PAGESIZE - 1);
+
+    // use the smallest cached mapping that isn't much too big
+    void* map = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(map_cache_lock);
+        unsigned best = map_cache_count;
+        for (unsigned i = 0; i != map_cache_count; ++i) {
+            if (map_cache[i].len >= maplen
+                && map_cache[i].len / 2 < maplen
+                && (best == map_cache_count
+                    || map_cache[i].len < map_cache[best].len)) {
+                best = i;
+            }
+        }
+        if (best != map_cache_count) {
+            map = map_cache[best].map;
+            maplen = map_cache[best].len;
+            map_cache[best] = map_cache[--map_cache_count];
+            map_cache_bytes.fetch_sub(maplen, std::memory_order_relaxed);
+        }
+    }
+    if (!map) {
+        map = mmap(nullptr, maplen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+
+    m61_header* h = (m61_header*) ((char*) map + dataoff) - 1;
+    h->offset = dataoff - sizeof(m61_header);
+    h->npages = maplen / PAGESIZE;
+    register_mapped(h, (uintptr_t) map, (uintptr_t) map + maplen);
+    return h;
+}
+
+
+/// map_free(h)
+///    Release guard-page or mapped block `h`'s mapping, keeping it in the
+///    mapping cache if there is room.
+
+static void map_free(m61_header* h) {
+    unregister_mapped(h);
+    void* map = (char*) h - h->offset;
+    size_t maplen = (size_t) h->npages * PAGESIZE;
+    if (h->flags & HF_MAPPED) {
+        std::lock_guard<std::mutex> guard(map_cache_lock);
+        if (map_cache_count != MAP_CACHE_SLOTS
+            && map_cache_bytes.load(std::memory_order_relaxed) + maplen
+               <= MAP_CACHE_BYTES) {
+            map_cache[map_cache_count] = {map, maplen};
+            ++map_cache_count;
+            map_cache_bytes.fetch_add(maplen, std::memory_order_relaxed);
+            return;
+        }
+    }
+    munmap(map, maplen);
+}
+
+
+/// is_mapped_block(uptr)
+///    Return true iff `uptr` is the user pointer of a live guard-page or
+///    mapped block.
+
+static bool is_mapped_block(uintptr_t uptr) {
+    if (uptr < mapped_min.load(std::memory_order_relaxed)
+        || uptr > mapped_max.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(mapped_lock);
+    return mapped_blocks && mapped_blocks->count(uptr);
+}
+
+
+/// Quarantine
+///    When `quarantine_bytes` is set, freed blocks are not reused right
+///    away. Their data is filled with `POISON` and they join the freeing
+///    thread's FIFO; once the FIFO holds more than `quarantine_bytes`, the
+///    oldest blocks are checked for writes since they were freed and then
+///    released for reuse. Mapped blocks skip the quarantine, since their
+///    memory is unmapped or handed to the mapping cache.
+static const unsigned char POISON = 0xDF;
+
+
+/// poison_intact(h)
+///    Return true iff freed block `h`'s data still holds only `POISON`.
+
+static bool poison_intact(const m61_header* h) {
+    const unsigned char* data = (const unsigned char*) (h + 1);
+    size_t n = block_data_size(h);
+    uint64_t word;
+    memset(&word, POISON, sizeof(word));
+    size_t i = 0;
+    for (; i + sizeof(word) <= n; i += sizeof(word)) {
+        uint64_t x;
+        memcpy(&x, data + i, sizeof(x));
+        if (x != word) {
+            return false;
+        }
+    }
+    for (; i != n; ++i) {
+        if (data[i] != POISON) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/// quarantine_check(h)
+///    Report a memory bug if quarantined block `h` was modified.
+
+static void quarantine_check(const m61_header* h) {
+    if (!poison_intact(h)) {
+        const m61_site& site = site_get(h->site);
+        fprintf(stderr, "MEMORY BUG: %s:%lu: detected write to freed block %p allocated here\n",
+                site.file, site.line, (void*) (h + 1));
+        exit(-1);
+    }
+}
+
+
+/// sweep_shard(shard, owned)
+///    Check the canaries of every active block allocated by `shard`, and
+///    if the caller owns `shard` (`owned`), its quarantined blocks.
+
+static void sweep_shard(m61_shard* shard, bool owned) {
+    if (owned) {
+        for (m61_header* h = shard->quarantine_head; h; h = h->next) {
+            quarantine_check(h);
+        }
+    }
+    std::lock_guard<std::mutex> guard(shard->lock);
+    for (m61_header* h = shard->active_head; h; h = h->next) {
+        if (!(h->flags & HF_BOOKMARK) && !canaries_intact(h)) {
+            const m61_site& site = site_get(h->site);
+            fprintf(stderr, "MEMORY BUG: %s:%lu: detected wild write in active block %p allocated here\n",
+                    site.file, site.line, (void*) (h + 1));
+            exit(-1);
+        }
+    }
+}
+
+
+/// block_alloc(shard, shape, align)
+///    Return memory for a block shaped like `*shape` whose data is aligned
+///    to `align`, recording in `shape` how it was obtained. Uses `shard`'s
+///    free lists if possible. Over-aligned blocks never use guard pages.
+///    Returns `nullptr` on failure.
+
+static m61_header* block_alloc(m61_shard* shard, m61_header* shape,
+                               size_t align) {
+    size_t data_size = block_data_size(shape);
+    shape->offset = shape->npages = 0;
+    if (shape->flags & HF_GUARD_PAGE
+        || (shape->sz >= MMAP_THRESHOLD && align <= PAGESIZE)) {
+        m61_header* h;
+        if (shape->flags & HF_GUARD_PAGE) {
+            h = guard_alloc(shape);
+        } else {
+            shape->flags |= HF_MAPPED;
+            h = map_alloc(shape, align);
+        }
+        if (h) {
+            shape->offset = h->offset;
+            shape->npages = h->npages;
+        }
+        return h;
+    } else if (align > alignof(std::max_align_t)) {
+        shape->flags = (shape->flags & ~HF_GUARD_PAGE) | HF_ALIGNED;
+        if (data_size + align > ULONG_MAX - sizeof(m61_header)) {
+            return nullptr;
+        }
+        uintptr_t raw;
+        {
+            std::lock_guard<std::mutex> guard(base_lock);
+            raw = (uintptr_t) base_malloc(sizeof(m61_header) + align + data_size);
+        }
+        if (!raw) {
+            return nullptr;
+        }
+        uintptr_t data = (raw + sizeof(m61_header) + align - 1) & ~(align - 1);
+        m61_header* h = (m61_header*) data - 1;
+        shape->offset = data - sizeof(m61_header) - raw;
+        return h;
+    }
+
+    unsigned sc = size_class(data_size);
+    if (sc < NSIZE_CLASSES && shard->free_lists[sc]) {
+        m61_header* h = shard->free_lists[sc];
+        shard->free_lists[sc] = h->next;
+        return h;
+    }
+    if (sc < NSIZE_CLASSES) {
+        data_size = size_class_size(sc);
+    }
+    std::lock_guard<std::mutex> guard(base_lock);
+    return (m61_header*) base_malloc(sizeof(m61_header) + data_size);
+}
+
+
+/// block_release(shard, h)
+///    Return freed block `h`'s memory, caching it on `shard` if possible.
+
+static void block_release(m61_shard* shard, m61_header* h) {
+    if (h->flags & (HF_GUARD_PAGE | HF_MAPPED)) {
+        map_free(h);
+    } else if (h->flags & HF_ALIGNED) {
+        std::lock_guard<std::mutex> guard(base_lock);
+        base_free((char*) h - h->offset);
+    } else if (unsigned sc = size_class(block_data_size(h));
+               sc < NSIZE_CLASSES) {
+        h->next = shard->free_lists[sc];
+        shard->free_lists[sc] = h;
+    } else {
+        std::lock_guard<std::mutex> guard(base_lock);
+        base_free(h);
+    }
+}
+
+
+/// quarantine_budget()
+///    Return the current quarantine size limit, or 0 if freed blocks
+///    should be released immediately.
+
+static inline size_t quarantine_budget() {
+    if constexpr (!CHECK_FULL) {
+        return 0;
+    }
+    return opt_quarantine_bytes.load(std::memory_order_relaxed);
+}
+
+
+/// quarantine_push(shard, h)
+///    Poison freed block `h` and add it to `shard`'s quarantine.
+
+static void quarantine_push(m61_shard* shard, m61_header* h) {
+    size_t n = block_data_size(h);
+    memset(h + 1, POISON, n);
+    h->next = nullptr;
+    if (shard->quarantine_tail) {
+        shard->quarantine_tail->next = h;
+    } else {
+        shard->quarantine_head = h;
+    }
+    shard->quarantine_tail = h;
+    stats_update u(shard);
+    counter_add(shard->quarantined, n);
+}
+
+
+/// quarantine_trim(shard, budget)
+///    Release `shard`'s oldest quarantined blocks until it holds at most
+///    `budget` bytes, checking each for writes since it was freed.
+
+static void quarantine_trim(m61_shard* shard, size_t budget) {
+    if constexpr (!CHECK_FULL) {
+        return;
+    }
+    while (shard->quarantine_head
+           && shard->quarantined.load(std::memory_order_relaxed) > budget) {
+        m61_header* h = shard->quarantine_head;
+        shard->quarantine_head = h->next;
+        if (!h->next) {
+            shard->quarantine_tail = nullptr;
+        }
+        quarantine_check(h);
+        {
+            stats_update u(shard);
+            counter_add(shard->quarantined, -block_data_size(h));
+        }
+        block_release(shard, h);
+    }
+}
+
+
+/// block_shape(sz, align)
+///    Return a header template for a new block of `sz` bytes aligned to
+///    `align`, following the current check options.
+
+static m61_header block_shape(size_t sz, size_t align) {
+    m61_header shape;
+    shape.sz = sz;
+    if constexpr (!CHECK_FULL) {
+        shape.flags = 0;
+        shape.canary_align = 1;
+        shape.canary_len = 0;
+        return shape;
+    }
+    shape.flags = opt_front_canary.load(std::memory_order_relaxed) ? HF_FRONT_CANARY : 0;
+    size_t guard_min = opt_guard_page_min.load(std::memory_order_relaxed);
+    if (guard_min && sz >= guard_min && align <= alignof(std::max_align_t)) {
+        shape.flags |= HF_GUARD_PAGE;
+        shape.canary_align = alignof(std::max_align_t);
+        shape.canary_len = 0;
+    } else {
+        unsigned csize = opt_canary_size.load(std::memory_order_relaxed);
+        shape.canary_align = csize == 4 ? 1 : csize;
+        shape.canary_len = csize;
+    }
+    return shape;
+}
+
+
+/// init_header(h, shape, shard, site)
+///    Initialize the header of new active block `h` from `shape`, and
+///    write its canaries. Does not link it into `shard`'s active list.
+
+static inline void init_header(m61_header* h, const m61_header& shape,
+                               m61_shard* shard, uint32_t site) {
+    h->site = site;
+    h->sz = shape.sz;
+    h->shard = shard;
+    h->canary_align = shape.canary_align;
+    h->canary_len = shape.canary_len;
+    h->flags = shape.flags;
+    h->offset = shape.offset;
+    h->npages = shape.npages;
+    h->check = header_check(h, HEADER_ACTIVE);
+    write_canaries(h);
+}
+
+
+/// Tracing
+///    While a trace is running, allocator calls log records to a lock-free
+///    ring of `TRACE_RING` slots. Each slot's `seq` says whose turn it is: a
+///    writer that reserved position `pos` waits for `seq == pos`, fills the
+///    slot, then sets `seq = pos + 1`; the flush thread waits for that,
+///    copies the record out, and sets `seq = pos + TRACE_RING` to pass the
+///    slot to the next writer. A full ring makes writers wait for the
+///    flush thread rather than drop records, so a trace is complete.
+///    Frees are logged before the block is released and allocations after
+///    the block is obtained, so one address's records are always ordered.
+
+static const size_t TRACE_RING = 1 << 16;
+
+struct trace_slot {
+    std::atomic<uint64_t> seq;
+    m61_trace_record rec;
+};
+
+static trace_slot trace_ring[TRACE_RING];
+static std::atomic<uint64_t> trace_head{0};
+static std::atomic<bool> trace_on{false};
+static std::atomic<unsigned> trace_writers{0};
+static unsigned long long trace_epoch;
+
+
+/// trace_now()
+///    Return the current time in nanoseconds since the trace started.
+
+static inline uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec - trace_epoch;
+}
+
+
+/// tracing()
+///    Return true if allocator calls should be logged.
+
+static inline bool tracing() {
+    if constexpr (!CHECK_STATS) {
+        return false;
+    }
+    return trace_on.load(std::memory_order_relaxed);
+}
+
+
+/// trace_log(recs, n)
+///    Log the `n` records in `recs` to consecutive positions in the ring,
+///    setting their timestamps. Does nothing if the trace has stopped.
+
+static void trace_log(m61_trace_record* recs, size_t n) {
+    // `trace_writers` lets `m61_trace_stop` wait for reservations to fill
+    trace_writers.fetch_add(1);
+    if (trace_on.load()) {
+        uint64_t now = trace_now();
+        uint64_t pos = trace_head.fetch_add(n, std::memory_order_relaxed);
+        for (size_t i = 0; i != n; ++i, ++pos) {
+            trace_slot& slot = trace_ring[pos % TRACE_RING];
+            while (slot.seq.load(std::memory_order_acquire) != pos) {
+                sched_yield();
+            }
+            slot.rec = recs[i];
+            slot.rec.time = now;
+            slot.seq.store(pos + 1, std::memory_order_release);
+        }
+    }
+    trace_writers.fetch_sub(1, std::memory_order_release);
+}
+
+
+/// trace_record(op, ptr, sz, site, align)
+///    Return a trace record for operation `op` on `ptr`.
+
+static inline m61_trace_record trace_record(unsigned op, const void* ptr,
+                                            size_t sz, uint32_t site,
+                                            size_t align = 0) {
+    m61_trace_record rec;
+    rec.time = 0;
+    rec.ptr = (uintptr_t) ptr;
+    rec.size = sz;
+    rec.site = site;
+    rec.op = op;
+    rec.align_shift = align ? __builtin_ctzll(align) : 0;
+    rec.padding = 0;
+    return rec;
+}
+
+
+/// trace_alloc(op, ptr, sz, align)
+///    Log allocation `op` of `sz` bytes, which returned `ptr`.
+
+static void trace_alloc(unsigned op, void* ptr, size_t sz, size_t align = 0) {
+    m61_trace_record rec = trace_record(op, ptr, sz,
+                                        ((m61_header*) ptr - 1)->site, align);
+    trace_log(&rec, 1);
+}
+
+
+/// trace_batch(op, ptrs, n)
+///    Log operation `op` (`M61_TRACE_MALLOC` or `M61_TRACE_FREE`) on each
+///    non-null active block in `ptrs[0..n-1]`.
+
+static void trace_batch(unsigned op, void* const* ptrs, size_t n) {
+    m61_trace_record recs[64];
+    size_t nrecs = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (ptrs[i]) {
+            const m61_header* h = (const m61_header*) ptrs[i] - 1;
+            recs[nrecs] = trace_record(op, ptrs[i], h->sz, h->site);
+            ++nrecs;
+        }
+        if (nrecs == 64 || (i == n - 1 && nrecs)) {
+            trace_log(recs, nrecs);
+            nrecs = 0;
+        }
+    }
+}
+
+
+/// trace_free(h)
+///    Log that active block `h` is being freed.
+
+static void trace_free(const m61_header* h) {
+    m61_trace_record rec = trace_record(M61_TRACE_FREE, h + 1, h->sz, h->site);
+    trace_log(&rec, 1);
+}
+
+
+/// allocate(sz, align, file, line)
+///    Allocate and register a block of `sz` bytes aligned to `align` (0
+///    for the default).
+
+static void* allocate(size_t sz, size_t align, const char* file, long line) {
+    if (sz >= (ULONG_MAX - CANARY_MAX - sizeof(m61_header) - PAGESIZE)) {
+        record_failure(sz);
+        return nullptr;
+    }
+    m61_shard* shard = current_shard();
+    latency_timer timer(shard, shard->malloc_latency,
+                        shard->malloc_latency_countdown);
+
+    m61_header shape = block_shape(sz, align);
+    m61_header* h = block_alloc(shard, &shape, align);
+    if (!h) {
+        record_failure(sz);
+        return nullptr;
+    }
+
+    init_header(h, shape, shard, site_intern(shard, file, line));
+    if constexpr (CHECK_STATS) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        h->prev = nullptr;
+        h->next = shard->active_head;
+        if (shard->active_head) {
+            shard->active_head->prev = h;
+        }
+        shard->active_head = h;
+    }
+
+    uintptr_t uintptr_memory = (uintptr_t) (h + 1);
+
+    {
+        stats_update u(shard);
+        counter_add(shard->ntotal, 1);
+        counter_add(shard->nactive, 1);
+        counter_add(shard->total_size, sz);
+        counter_add(shard->active_size, sz);
+        if (h->npages) {
+            counter_add(shard->nmapped, 1);
+            counter_add(shard->mapped_size, (size_t) h->npages * PAGESIZE);
+        }
+    }
+
+    if constexpr (CHECK_STATS) {
+        shard->hh_countdown -= (long long) sz;
+        if (shard->hh_countdown <= 0) {
+            hh_sample(shard, sz, h->site);
+        }
+    }
+
+    if constexpr (CHECK_STATS) {
+        if (!(h->flags & (HF_GUARD_PAGE | HF_MAPPED))
+            && (uintptr_memory < heap_min.load(std::memory_order_relaxed)
+                || uintptr_memory + sz > heap_max.load(std::memory_order_relaxed))) {
+            extend_heap_range(uintptr_memory, uintptr_memory + sz);
+        }
+    }
+    return (void*) uintptr_memory;
+}
+
+
+/// m61_malloc(sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
+///    The memory is not initialized. If `sz == 0`, then m61_malloc must
+///    return a unique, newly-allocated pointer value. The allocation
+///    request was at location `file`:`line`.
+
+void* m61_malloc(size_t sz, const char* file, long line) {
+    void* ptr = allocate(sz, 0, file, line);
+    if (ptr && tracing()) {
+        trace_alloc(M61_TRACE_MALLOC, ptr, sz);
+    }
+    return ptr;
+}
+
+
+/// find_containing_block(uptr)
+///    Return the active block whose data contains address `uptr`, or
+///    `nullptr` if there is none. This walks every active block, so it is
+///    only used to explain errors.
+
+static m61_header* find_containing_block(uintptr_t uptr) {
+    for (m61_shard* shard = all_shards.load(std::memory_order_acquire);
+         shard;
+         shard = shard->next_shard) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        for (m61_header* h = shard->active_head; h; h = h->next) {
+            uintptr_t data = (uintptr_t) (h + 1);
+            if (uptr >= data && uptr < data + h->sz) {
+                return h;
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+/// checked_header(ptr, op, file, line)
+///    Return the header of active block `ptr`, which is being passed to
+///    `op` ("free" or "realloc") at `file`:`line`. Reports a memory bug
+///    and exits if `ptr` is not an intact active block.
+
+static m61_header* checked_header(void* ptr, const char* op,
+                                  const char* file, long line) {
+    if constexpr (!CHECK_FULL) {
+        return (m61_header*) ptr - 1;
+    }
+    uintptr_t uptr = (uintptr_t) ptr;
+
+    if ((uptr < heap_min.load(std::memory_order_relaxed)
+         || uptr > heap_max.load(std::memory_order_relaxed))
+        && !is_mapped_block(uptr)) {
+        if (uptr >= mapped_min.load(std::memory_order_relaxed)
+            && uptr <= mapped_max.load(std::memory_order_relaxed)) {
+            fprintf(stderr, "MEMORY BUG: %s:%lu: invalid %s of pointer %p, not allocated\n", file, line, op, ptr);
+        } else {
+            fprintf(stderr, "MEMORY BUG: %s:%lu: invalid %s of pointer %p, not in heap\n", file, line, op, ptr);
+        }
+        exit(-1);
+    }
+
+    m61_header* h = (m61_header*) ptr - 1;
+    if (uptr % alignof(std::max_align_t) != 0
+        || h->check != header_check(h, HEADER_ACTIVE)) {
+        if (uptr % alignof(std::max_align_t) == 0
+            && h->check == header_check(h, HEADER_FREED)) {
+            fprintf(stderr, "MEMORY BUG: %s:%lu: invalid %s of pointer %p, double free\n", file, line, op, ptr);
+            exit(-1);
+        }
+        fprintf(stderr, "MEMORY BUG: %s:%lu: invalid %s of pointer %p, not allocated\n", file, line, op, ptr);
+        if (m61_header* container = find_containing_block(uptr)) {
+            const m61_site& site = site_get(container->site);
+            fprintf(stderr, "  %s:%lu: %p is %zu bytes inside a %llu byte region allocated here\n",
+                   site.file, site.line, ptr,
+                   (size_t) (uptr - (uintptr_t) (container + 1)), container->sz);
+        }
+        exit(-1);
+    }
+
+    // Wild write check
+    if (!canaries_intact(h)) {
+        fprintf(stderr, "MEMORY BUG: %s:%lu: detected wild write during %s of pointer %p\n", file, line, op, ptr);
+        exit(-1);
+    }
+    return h;
+}
+
+
+/// sweep_claimed(shard)
+///    Sweep `shard`, which may belong to another thread. A shard whose
+///    thread has exited is claimed for the duration, so its quarantined
+///    blocks are checked and trimmed to the current budget too; nobody
+///    else would ever look at them.
+
+static void sweep_claimed(m61_shard* shard) {
+    if (shard == my_shard) {
+        sweep_shard(shard, true);
+        return;
+    }
+    bool idle = false;
+    if (!shard->in_use.compare_exchange_strong(idle, true)) {
+        sweep_shard(shard, false);
+        return;
+    }
+    sweep_shard(shard, true);
+    quarantine_trim(shard, quarantine_budget());
+    shard->in_use.store(false, std::memory_order_release);
+}
+
+
+// Next shard for a periodic sweep to visit besides the sweeper's own;
+// `nullptr` means start over at `all_shards`.
+static std::atomic<m61_shard*> sweep_cursor{nullptr};
+
+/// sweep_tick(shard, nfrees)
+///    Count `nfrees` frees toward `shard`'s next periodic sweep. Each sweep
+///    covers `shard` and then the shard at `sweep_cursor`, which rotates
+///    through every shard, so blocks held by idle and exited threads'
+///    shards are checked too.
+
+static void sweep_tick(m61_shard* shard, unsigned long nfrees) {
+    if constexpr (!CHECK_FULL) {
+        return;
+    }
+    if (unsigned long interval = opt_sweep_interval.load(std::memory_order_relaxed)) {
+        if (shard->sweep_countdown == 0 || shard->sweep_countdown > interval) {
+            shard->sweep_countdown = interval;
+        }
+        if (nfrees >= shard->sweep_countdown) {
+            shard->sweep_countdown = 0;
+            sweep_shard(shard, true);
+            m61_shard* cursor = sweep_cursor.load(std::memory_order_acquire);
+            m61_shard* next;
+            do {
+                next = cursor ? cursor : all_shards.load(std::memory_order_acquire);
+            } while (!sweep_cursor.compare_exchange_weak(
+                         cursor, next->next_shard, std::memory_order_acq_rel));
+            if (next != shard) {
+                sweep_claimed(next);
+            }
+        } else {
+            shard->sweep_countdown -= nfrees;
+        }
+    }
+}
+
+
+/// free_block(shard, h)
+///    Free validated active block `h` on behalf of `shard`'s thread.
+
+static void free_block(m61_shard* shard, m61_header* h) {
+    {
+        stats_update u(shard);
+        counter_add(shard->nactive, -1);
+        counter_add(shard->active_size, -h->sz);
+        if (h->npages) {
+            counter_add(shard->nmapped, -1);
+            counter_add(shard->mapped_size, -((size_t) h->npages * PAGESIZE));
+        }
+    }
+
+    if constexpr (CHECK_STATS) {
+        m61_shard* owner = h->shard;
+        std::lock_guard<std::mutex> guard(owner->lock);
+        if (h->prev) {
+            h->prev->next = h->next;
+        } else {
+            owner->active_head = h->next;
+        }
+        if (h->next) {
+            h->next->prev = h->prev;
+        }
+    }
+    h->check = header_check(h, HEADER_FREED);
+    size_t budget = quarantine_budget();
+    if (budget && !(h->flags & (HF_GUARD_PAGE | HF_MAPPED))) {
+        quarantine_push(shard, h);
+    } else {
+        block_release(shard, h);
+    }
+    quarantine_trim(shard, budget);
+    sweep_tick(shard, 1);
+}
 
-struct metadata_node {
-    const char* file;
-    long line;
-    unsigned long long sz;
-};
 
+/// m61_free(ptr, file, line)
+///    Free the memory space pointed to by `ptr`, which must have been
+///    returned by a previous call to m61_malloc. If `ptr == NULL`,
+///    does nothing. The free was called at location `file`:`line`.
 
-static std::map<uintptr_t, metadata_node*> metadata;
-static std::set<uintptr_t> free_list;
-static unsigned long long ntotal = 0;
-static unsigned long long nactive = 0;
-static unsigned long long active_size = 0;
-static unsigned long long total_size = 0;
-static unsigned long long fail_size = 0;
-static unsigned long long nfail = 0;
-static uintptr_t heap_min = LONG_MAX;
-static uintptr_t heap_max = 0;
-static int BOUNDARY_CHECK = 0xBADBEEF;
-static size_t BOUNDARY_CHECK_SIZE = sizeof(int);
+void m61_free(void* ptr, const char* file, long line) {
+    if (!ptr) return;
+    m61_shard* shard = current_shard();
+    latency_timer timer(shard, shard->free_latency,
+                        shard->free_latency_countdown);
+    m61_header* h = checked_header(ptr, "free", file, line);
+    if (tracing()) {
+        trace_free(h);
+    }
+    free_block(shard, h);
+}
 
 
-/// m61_malloc(sz, file, line)
-///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
-///    The memory is not initialized. If `sz == 0`, then m61_malloc must
-///    return a unique, newly-allocated pointer value. The allocation
-///    request was at location `file`:`line`.
+/// m61_free_sized(ptr, sz, file, line)
+///    Like `m61_free`, but the caller also passes the block's size, which
+///    must match the size it was allocated with.
 
-void* m61_malloc(size_t sz, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
+void m61_free_sized(void* ptr, size_t sz, const char* file, long line) {
+    if (!ptr) return;
+    m61_shard* shard = current_shard();
+    latency_timer timer(shard, shard->free_latency,
+                        shard->free_latency_countdown);
+    m61_header* h = checked_header(ptr, "free", file, line);
+    if (CHECK_FULL && h->sz != sz) {
+        fprintf(stderr, "MEMORY BUG: %s:%lu: invalid free of pointer %p, size %zu does not match allocated size %llu\n",
+                file, line, ptr, sz, h->sz);
+        exit(-1);
+    }
+    if (tracing()) {
+        trace_free(h);
+    }
+    free_block(shard, h);
+}
 
-    if (sz >= (ULONG_MAX - BOUNDARY_CHECK_SIZE)) {
-        ++nfail;
-        fail_size += sz;
-        return nullptr;
+
+
+
+/// m61_malloc_batch(n, sz, out, file, line)
+///    Allocate `n` blocks of `sz` bytes each, storing pointers to them in
+///    `out[0]` through `out[n-1]`. Returns `n` on success; on failure,
+///    allocates nothing and returns 0. Blocks are freed individually or
+///    with `m61_free_batch`. The request was at location `file`:`line`.
+
+size_t m61_malloc_batch(size_t n, size_t sz, void** out,
+                        const char* file, long line) {
+    if (n == 0) {
+        return 0;
+    }
+    if (sz >= (ULONG_MAX - CANARY_MAX - sizeof(m61_header) - PAGESIZE)
+        || n > ULONG_MAX / (sizeof(m61_header) + sz + CANARY_MAX)) {
+        record_failure(sz);
+        return 0;
+    }
+    m61_shard* shard = current_shard();
+    m61_header shape = block_shape(sz, 0);
+    unsigned sc = shape.flags & HF_GUARD_PAGE || sz >= MMAP_THRESHOLD
+        ? NSIZE_CLASSES : size_class(block_data_size(&shape));
+    if (sc == NSIZE_CLASSES) {
+        // blocks too big to share an allocation
+        for (size_t i = 0; i != n; ++i) {
+            out[i] = m61_malloc(sz, file, line);
+            if (!out[i]) {
+                m61_free_batch(out, i, file, line);
+                return 0;
+            }
+        }
+        return n;
     }
+    latency_timer timer(shard, shard->malloc_latency,
+                        shard->malloc_latency_countdown);
 
-    void* memory = base_malloc(sz + BOUNDARY_CHECK_SIZE);
+    // take cached blocks, then carve the rest from one base allocation
+    size_t i = 0;
+    for (; i != n && shard->free_lists[sc]; ++i) {
+        m61_header* h = shard->free_lists[sc];
+        shard->free_lists[sc] = h->next;
+        out[i] = h + 1;
+    }
+    if (i != n) {
+        size_t stride = sizeof(m61_header) + size_class_size(sc);
+        char* chunk;
+        {
+            std::lock_guard<std::mutex> guard(base_lock);
+            chunk = (char*) base_malloc((n - i) * stride);
+        }
+        if (!chunk) {
+            while (i != 0) {
+                m61_header* h = (m61_header*) out[--i] - 1;
+                h->next = shard->free_lists[sc];
+                shard->free_lists[sc] = h;
+            }
+            record_failure(sz);
+            return 0;
+        }
+        for (; i != n; ++i, chunk += stride) {
+            out[i] = (m61_header*) chunk + 1;
+        }
+    }
 
-    if (!memory) {
-        ++nfail;
-        fail_size += sz;
-        return nullptr;
+    shape.offset = shape.npages = 0;
+    uint32_t site = site_intern(shard, file, line);
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+    m61_header* prev = nullptr;
+    for (i = 0; i != n; ++i) {
+        m61_header* h = (m61_header*) out[i] - 1;
+        init_header(h, shape, shard, site);
+        h->prev = prev;
+        if (prev) {
+            prev->next = h;
+        }
+        prev = h;
+        lo = std::min(lo, (uintptr_t) out[i]);
+        hi = std::max(hi, (uintptr_t) out[i] + sz);
+    }
+    if constexpr (CHECK_STATS) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        prev->next = shard->active_head;
+        if (shard->active_head) {
+            shard->active_head->prev = prev;
+        }
+        shard->active_head = (m61_header*) out[0] - 1;
+    }
+
+    {
+        stats_update u(shard);
+        counter_add(shard->ntotal, n);
+        counter_add(shard->nactive, n);
+        counter_add(shard->total_size, n * sz);
+        counter_add(shard->active_size, n * sz);
     }
 
-    uintptr_t uintptr_memory = (uintptr_t) memory;
+    if (tracing()) {
+        trace_batch(M61_TRACE_MALLOC, out, n);
+    }
+
+    if constexpr (CHECK_STATS) {
+        shard->hh_countdown -= (long long) (n * sz);
+        if (shard->hh_countdown <= 0) {
+            hh_sample(shard, n * sz, site);
+        }
+    }
 
-    // Check if its in the free list and clear for reuse if it is
-    if (free_list.find(uintptr_memory) != free_list.end()) {
-        free_list.erase(uintptr_memory);
+    if constexpr (CHECK_STATS) {
+        if (lo < heap_min.load(std::memory_order_relaxed)
+            || hi > heap_max.load(std::memory_order_relaxed)) {
+            extend_heap_range(lo, hi);
+        }
     }
+    return n;
+}
 
-    // Write boundary check
-    int* temp = (int*)(uintptr_memory + sz);
-    temp[0] = BOUNDARY_CHECK;
 
-    ++ntotal;
-    ++nactive;
-    // Your code here.
-    total_size += sz;
-    active_size += sz;
+/// m61_free_batch(ptrs, n, file, line)
+///    Free the `n` blocks in `ptrs`, skipping null pointers. Equivalent to
+///    freeing each one, but updates shared state once per batch. The free
+///    was called at location `file`:`line`.
 
-    metadata_node* meta = (struct metadata_node*) base_malloc(sizeof(struct metadata_node));
-    meta->line = line;
-    meta->file = file;
-    meta->sz = sz;
-    metadata.insert(std::pair<uintptr_t, metadata_node*>(uintptr_memory, meta));
+void m61_free_batch(void** ptrs, size_t n, const char* file, long line) {
+    m61_shard* shard = current_shard();
+    latency_timer timer(shard, shard->free_latency,
+                        shard->free_latency_countdown);
+
+    // validate, and mark freed so duplicates in the batch are caught
+    unsigned long long nfreed = 0, freed_size = 0, nmapped = 0, mapped_size = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        m61_header* h = checked_header(ptrs[i], "free", file, line);
+        h->check = header_check(h, HEADER_FREED);
+        ++nfreed;
+        freed_size += h->sz;
+        if (h->npages) {
+            ++nmapped;
+            mapped_size += (size_t) h->npages * PAGESIZE;
+        }
+    }
+    {
+        stats_update u(shard);
+        counter_add(shard->nactive, -nfreed);
+        counter_add(shard->active_size, -freed_size);
+        counter_add(shard->nmapped, -nmapped);
+        counter_add(shard->mapped_size, -mapped_size);
+    }
+    if (tracing()) {
+        trace_batch(M61_TRACE_FREE, ptrs, n);
+    }
 
-    if (uintptr_memory < heap_min)
-        heap_min = uintptr_memory;
+    // unlink, holding each owner's lock across consecutive blocks; only
+    // one lock is held at a time, so batches freed concurrently in
+    // opposite shard orders can't deadlock
+    if constexpr (CHECK_STATS) {
+        std::unique_lock<std::mutex> guard;
+        m61_shard* owner = nullptr;
+        for (size_t i = 0; i != n; ++i) {
+            if (!ptrs[i]) {
+                continue;
+            }
+            m61_header* h = (m61_header*) ptrs[i] - 1;
+            if (h->shard != owner) {
+                if (guard) {
+                    guard.unlock();
+                }
+                owner = h->shard;
+                guard = std::unique_lock<std::mutex>(owner->lock);
+            }
+            if (h->prev) {
+                h->prev->next = h->next;
+            } else {
+                owner->active_head = h->next;
+            }
+            if (h->next) {
+                h->next->prev = h->prev;
+            }
+        }
+    }
 
-    if (uintptr_memory + sz > heap_max)
-        heap_max =  uintptr_memory + sz;
-    return memory;
+    size_t budget = quarantine_budget();
+    for (size_t i = 0; i != n; ++i) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        m61_header* h = (m61_header*) ptrs[i] - 1;
+        if (budget && !(h->flags & (HF_GUARD_PAGE | HF_MAPPED))) {
+            quarantine_push(shard, h);
+        } else {
+            block_release(shard, h);
+        }
+    }
+    quarantine_trim(shard, budget);
+    sweep_tick(shard, nfreed);
 }
 
 
-/// m61_free(ptr, file, line)
-///    Free the memory space pointed to by `ptr`, which must have been
-///    returned by a previous call to m61_malloc. If `ptr == NULL`,
-///    does nothing. The free was called at location `file`:`line`.
+/// resize_block(h, sz)
+///    Try to change active block `h`'s size to `sz` without copying. Small
+///    and base blocks can use the slack in their size class; mapped blocks
+///    are resized with mremap, which may move them. Returns the block's
+///    (possibly new) header, or `nullptr` if the block must be copied.
 
-void m61_free(void* ptr, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    if (!ptr) return;
+static m61_header* resize_block(m61_header* h, size_t sz) {
+    m61_header shape = *h;
+    shape.sz = sz;
+    size_t new_size = block_data_size(&shape);
+    size_t old_size = block_data_size(h);
 
-    uintptr_t uptr = (uintptr_t) ptr;
+    m61_shard* owner = h->shard;
+    std::lock_guard<std::mutex> guard(owner->lock);
+    if (h->flags & HF_GUARD_PAGE) {
+        // the data must keep ending at the guard page
+        if (new_size != old_size) {
+            return nullptr;
+        }
+    } else if (h->flags & HF_MAPPED) {
+        // keep the mapping if it fits without wasting more than half
+        uint32_t offset = h->offset;
+        void* old_map = (char*) h - offset;
+        size_t old_len = (size_t) h->npages * PAGESIZE;
+        size_t new_len = (offset + sizeof(m61_header) + new_size + PAGESIZE - 1)
+            & ~(PAGESIZE - 1);
+        if (new_len > old_len || new_len <= old_len / 2) {
+            void* map = mremap(old_map, old_len, new_len, MREMAP_MAYMOVE);
+            if (map == MAP_FAILED) {
+                return nullptr;
+            }
+            if (map != old_map) {
+                unregister_mapped(h);
+                h = (m61_header*) ((char*) map + offset);
+                if constexpr (CHECK_STATS) {
+                    if (h->prev) {
+                        h->prev->next = h;
+                    } else {
+                        owner->active_head = h;
+                    }
+                    if (h->next) {
+                        h->next->prev = h;
+                    }
+                }
+            }
+            h->npages = new_len / PAGESIZE;
+            register_mapped(h, (uintptr_t) map, (uintptr_t) map + new_len);
+        }
+    } else {
+        size_t capacity = old_size;
+        unsigned sc = size_class(old_size);
+        if (!(h->flags & HF_ALIGNED) && sc < NSIZE_CLASSES) {
+            capacity = size_class_size(sc);
+        }
+        if (new_size > capacity) {
+            return nullptr;
+        }
+    }
 
-    if (free_list.find(uptr) != free_list.end()) {
-        printf("MEMORY BUG: %s:%lu: invalid free of pointer %p, double free", file, line, ptr);
-        exit(-1);
+    h->sz = sz;
+    h->check = header_check(h, HEADER_ACTIVE);
+    write_canaries(h);
+    return h;
+}
+
+
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the block at `ptr` to `sz` bytes, preserving its
+///    contents up to the smaller of the old and new sizes. Grows or shrinks
+///    in place when possible; otherwise moves the block. Returns the new
+///    pointer, or `nullptr` on failure (leaving `ptr` intact). If `ptr` is
+///    `nullptr`, acts like `m61_malloc`; if `sz == 0`, frees `ptr` and
+///    returns `nullptr`. The request was at location `file`:`line`.
+
+void* m61_realloc(void* ptr, size_t sz, const char* file, long line) {
+    if (!ptr) {
+        return m61_malloc(sz, file, line);
+    } else if (sz == 0) {
+        m61_free(ptr, file, line);
+        return nullptr;
+    }
+    m61_header* h = checked_header(ptr, "realloc", file, line);
+    if (sz >= (ULONG_MAX - CANARY_MAX - sizeof(m61_header) - PAGESIZE)) {
+        record_failure(sz);
+        return nullptr;
     }
 
-    auto meta = metadata.find(uptr);
-    if (meta != metadata.end()) {
-        // Wild write check
-        int* temp = (int*)(uptr + meta->second->sz);
-        if (temp[0] != BOUNDARY_CHECK) {
-            printf("MEMORY BUG: %s:%lu: detected wild write during free of pointer %p", file, line, ptr);
-            exit(-1);
+    size_t old_sz = h->sz;
+    size_t old_mapped = (size_t) h->npages * PAGESIZE;
+    m61_trace_record recs[2];
+    recs[0] = trace_record(M61_TRACE_FREE, ptr, old_sz, h->site);
+    if (m61_header* nh = resize_block(h, sz)) {
+        m61_shard* shard = current_shard();
+        {
+            stats_update u(shard);
+            counter_add(shard->active_size, sz - old_sz);
+            if (sz > old_sz) {
+                counter_add(shard->total_size, sz - old_sz);
+            }
+            counter_add(shard->mapped_size, (size_t) nh->npages * PAGESIZE - old_mapped);
         }
+        uintptr_t data = (uintptr_t) (nh + 1);
+        if (CHECK_STATS && !(nh->flags & (HF_GUARD_PAGE | HF_MAPPED))
+            && data + sz > heap_max.load(std::memory_order_relaxed)) {
+            extend_heap_range(data, data + sz);
+        }
+        if (tracing()) {
+            recs[1] = trace_record(M61_TRACE_MALLOC, nh + 1, sz, nh->site);
+            trace_log(recs, 2);
+        }
+        return nh + 1;
+    }
 
-        --nactive;
-        active_size -= meta->second->sz;
-        metadata.erase(meta);
-        base_free((void*) meta->second);
-        meta->second = nullptr;
-        free_list.insert(uptr);
-    } else {
-        if (uptr < heap_min || uptr > heap_max) {
-            printf("MEMORY BUG: %s:%lu: invalid free of pointer %p, not in heap", file, line, ptr);
-            exit(-1);
-        } else {
-            printf("MEMORY BUG: %s:%lu: invalid free of pointer %p, not allocated", file, line, ptr);
-            exit(-1);
+    void* nptr = allocate(sz, 0, file, line);
+    if (nptr) {
+        memcpy(nptr, ptr, std::min(sz, old_sz));
+        if (tracing()) {
+            recs[1] = trace_record(M61_TRACE_MALLOC, nptr, sz,
+                                   ((m61_header*) nptr - 1)->site);
+            trace_log(recs, 2);
         }
+        m61_shard* shard = current_shard();
+        latency_timer timer(shard, shard->free_latency,
+                            shard->free_latency_countdown);
+        free_block(shard, h);
+    }
+    return nptr;
+}
+
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    aligned to `align`, which must be a power of two. Returns `nullptr`
+///    on failure. The request was at location `file`:`line`.
+
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line) {
+    if (align == 0 || (align & (align - 1)) != 0 || align > (1U << 31)) {
+        return nullptr;
+    }
+    void* ptr = allocate(sz, align, file, line);
+    if (ptr && tracing()) {
+        trace_alloc(M61_TRACE_ALIGNED, ptr, sz, align);
+    }
+    return ptr;
+}
+
+
+/// m61_posix_memalign(ptr, align, sz, file, line)
+///    Like `m61_aligned_alloc`, but stores the pointer in `*ptr` and
+///    returns 0 on success, `EINVAL` if `align` is not a power of two
+///    multiple of `sizeof(void*)`, and `ENOMEM` on allocation failure.
+
+int m61_posix_memalign(void** ptr, size_t align, size_t sz,
+                       const char* file, long line) {
+    if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0
+        || align > (1U << 31)) {
+        return EINVAL;
     }
-    base_free(ptr);
+    void* p = allocate(sz, align, file, line);
+    if (!p) {
+        return ENOMEM;
+    }
+    if (tracing()) {
+        trace_alloc(M61_TRACE_ALIGNED, p, sz, align);
+    }
+    *ptr = p;
+    return 0;
 }
 
 
@@ -144,33 +1883,313 @@ void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line) {
     size_t total = nmemb * sz;
     // detect overflow
     if (nmemb != 0 && (total / nmemb) != sz) {
-        ++nfail;
-        fail_size += sz;
+        record_failure(sz);
         return nullptr;
     }
 
-    void* ptr = m61_malloc(total, file, line);
+    void* ptr = allocate(total, 0, file, line);
     if (ptr) {
         memset(ptr, 0, total);
+        if (tracing()) {
+            trace_alloc(M61_TRACE_CALLOC, ptr, total);
+        }
+    }
+    return ptr;
+}
+
+
+/// m61_arena_chunk
+///    A contiguous region of arena memory. Allocations are bumped upward
+///    from the end of the header until `size` bytes are used.
+struct alignas(std::max_align_t) m61_arena_chunk {
+    m61_arena_chunk* next;
+    size_t size;                // usable bytes after this header
+};
+
+/// m61_arena
+///    `chunks` lists every chunk; `current` is the one being bumped, with
+///    `pos` bytes used. Chunks before `current` are full. Oversized chunks,
+///    made for allocations bigger than `chunk_size`, are kept on `large`.
+struct m61_arena {
+    size_t chunk_size;
+    m61_arena_chunk* chunks;
+    m61_arena_chunk* current;
+    size_t pos;
+    m61_arena_chunk* large;
+    unsigned long long active_size;
+};
+
+static const size_t ARENA_DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+
+/// arena_new_chunk(size)
+///    Return a new arena chunk with `size` usable bytes, or `nullptr` if
+///    the base allocator fails.
+
+static m61_arena_chunk* arena_new_chunk(size_t size) {
+    m61_arena_chunk* c;
+    {
+        std::lock_guard<std::mutex> guard(base_lock);
+        c = (m61_arena_chunk*) base_malloc(sizeof(m61_arena_chunk) + size);
+    }
+    if (c) {
+        c->next = nullptr;
+        c->size = size;
+        m61_shard* shard = current_shard();
+        stats_update u(shard);
+        counter_add(shard->arena_reserved, sizeof(m61_arena_chunk) + size);
+    }
+    return c;
+}
+
+
+/// arena_free_chunks(c)
+///    Return the chunk list starting at `c` to the base allocator.
+
+static void arena_free_chunks(m61_arena_chunk* c) {
+    m61_shard* shard = current_shard();
+    while (c) {
+        m61_arena_chunk* next = c->next;
+        {
+            stats_update u(shard);
+            counter_add(shard->arena_reserved, -(sizeof(m61_arena_chunk) + c->size));
+        }
+        std::lock_guard<std::mutex> guard(base_lock);
+        base_free(c);
+        c = next;
+    }
+}
+
+
+/// m61_arena_create(chunk_size)
+///    Return a new empty arena that obtains memory `chunk_size` bytes at a
+///    time (0 means a default size).
+
+m61_arena* m61_arena_create(size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = ARENA_DEFAULT_CHUNK_SIZE;
+    }
+    chunk_size = (chunk_size + alignof(std::max_align_t) - 1)
+        & ~(alignof(std::max_align_t) - 1);
+    m61_arena* arena;
+    {
+        std::lock_guard<std::mutex> guard(base_lock);
+        arena = (m61_arena*) base_malloc(sizeof(m61_arena));
+    }
+    if (!arena) {
+        return nullptr;
+    }
+    arena->chunk_size = chunk_size;
+    arena->chunks = arena->current = arena->large = nullptr;
+    arena->pos = 0;
+    arena->active_size = 0;
+    {
+        m61_shard* shard = current_shard();
+        stats_update u(shard);
+        counter_add(shard->narenas, 1);
+    }
+    return arena;
+}
+
+
+/// m61_arena_alloc(arena, sz)
+///    Return a pointer to `sz` bytes from `arena`, valid until the arena is
+///    reset or destroyed.
+
+void* m61_arena_alloc(m61_arena* arena, size_t sz) {
+    m61_shard* shard = current_shard();
+    if (sz > ULONG_MAX - sizeof(m61_arena_chunk) - alignof(std::max_align_t)) {
+        record_failure(sz);
+        return nullptr;
+    }
+    size_t asz = (sz + alignof(std::max_align_t) - 1)
+        & ~(alignof(std::max_align_t) - 1);
+    if (asz == 0) {
+        // zero-sized allocations still get unique addresses
+        asz = alignof(std::max_align_t);
+    }
+
+    void* ptr;
+    if (asz > arena->chunk_size) {
+        m61_arena_chunk* c = arena_new_chunk(asz);
+        if (!c) {
+            record_failure(sz);
+            return nullptr;
+        }
+        c->next = arena->large;
+        arena->large = c;
+        ptr = c + 1;
+    } else {
+        if (!arena->current || arena->pos + asz > arena->current->size) {
+            // move to the next retained chunk, or add one
+            m61_arena_chunk* next = arena->current ? arena->current->next : arena->chunks;
+            if (!next) {
+                next = arena_new_chunk(arena->chunk_size);
+                if (!next) {
+                    record_failure(sz);
+                    return nullptr;
+                }
+                if (arena->current) {
+                    arena->current->next = next;
+                } else {
+                    arena->chunks = next;
+                }
+            }
+            arena->current = next;
+            arena->pos = 0;
+        }
+        ptr = (char*) (arena->current + 1) + arena->pos;
+        arena->pos += asz;
+    }
+
+    arena->active_size += sz;
+    {
+        stats_update u(shard);
+        counter_add(shard->arena_ntotal, 1);
+        counter_add(shard->arena_total_size, sz);
+        counter_add(shard->arena_active_size, sz);
     }
     return ptr;
 }
 
 
+/// m61_arena_reset(arena)
+///    Release every allocation made from `arena`, keeping its
+///    standard-sized chunks for reuse.
+
+void m61_arena_reset(m61_arena* arena) {
+    arena_free_chunks(arena->large);
+    arena->large = nullptr;
+    arena->current = arena->chunks;
+    arena->pos = 0;
+    {
+        m61_shard* shard = current_shard();
+        stats_update u(shard);
+        counter_add(shard->arena_active_size, -arena->active_size);
+    }
+    arena->active_size = 0;
+}
+
+
+/// m61_arena_destroy(arena)
+///    Release every allocation made from `arena` and the arena itself.
+
+void m61_arena_destroy(m61_arena* arena) {
+    if (!arena) {
+        return;
+    }
+    m61_arena_reset(arena);
+    arena_free_chunks(arena->chunks);
+    {
+        m61_shard* shard = current_shard();
+        stats_update u(shard);
+        counter_add(shard->narenas, -1);
+    }
+    std::lock_guard<std::mutex> guard(base_lock);
+    base_free(arena);
+}
+
+
+/// m61_get_check_options(opts)
+///    Store the current check options in `*opts`.
+
+void m61_get_check_options(m61_check_options* opts) {
+    opts->canary_size = opt_canary_size.load(std::memory_order_relaxed);
+    opts->front_canary = opt_front_canary.load(std::memory_order_relaxed);
+    opts->sweep_interval = opt_sweep_interval.load(std::memory_order_relaxed);
+    opts->guard_page_min = opt_guard_page_min.load(std::memory_order_relaxed);
+    opts->quarantine_bytes = opt_quarantine_bytes.load(std::memory_order_relaxed);
+}
+
+
+/// m61_set_check_options(opts)
+///    Change the check options. Blocks keep the options they were
+///    allocated with. Returns 0 on success and -1 if `opts` is invalid.
+
+int m61_set_check_options(const m61_check_options* opts) {
+    if (opts->canary_size != 4 && opts->canary_size != 8
+        && opts->canary_size != 16) {
+        return -1;
+    }
+    opt_canary_size.store(opts->canary_size, std::memory_order_relaxed);
+    opt_front_canary.store(opts->front_canary, std::memory_order_relaxed);
+    opt_sweep_interval.store(opts->sweep_interval, std::memory_order_relaxed);
+    opt_guard_page_min.store(opts->guard_page_min, std::memory_order_relaxed);
+    opt_quarantine_bytes.store(opts->quarantine_bytes, std::memory_order_relaxed);
+    return 0;
+}
+
+
+/// m61_check_heap()
+///    Check the canaries of every active block now.
+
+void m61_check_heap() {
+    for (m61_shard* shard = all_shards.load(std::memory_order_acquire);
+         shard;
+         shard = shard->next_shard) {
+        sweep_claimed(shard);
+    }
+}
+
+
 /// m61_get_statistics(stats)
 ///    Store the current memory statistics in `*stats`.
 
 void m61_get_statistics(m61_statistics* stats) {
-    // Stub: set all statistics to enormous numbers
-    // memset(stats, 255, sizeof(m61_statistics));
-	stats->nactive = nactive;
-	stats->active_size = active_size;
-	stats->total_size = total_size;
-	stats->fail_size = fail_size;
-    stats->nfail = nfail;
-    stats->ntotal = ntotal;
-    stats->heap_max = heap_max;
-    stats->heap_min = heap_min;
+    memset(stats, 0, sizeof(m61_statistics));
+    for (m61_shard* shard = all_shards.load(std::memory_order_acquire);
+         shard;
+         shard = shard->next_shard) {
+        m61_statistics s;
+        unsigned seq0, seq1;
+        do {
+            seq0 = shard->seq.load(std::memory_order_acquire);
+            s.nactive = shard->nactive.load(std::memory_order_relaxed);
+            s.active_size = shard->active_size.load(std::memory_order_relaxed);
+            s.ntotal = shard->ntotal.load(std::memory_order_relaxed);
+            s.total_size = shard->total_size.load(std::memory_order_relaxed);
+            s.nfail = shard->nfail.load(std::memory_order_relaxed);
+            s.fail_size = shard->fail_size.load(std::memory_order_relaxed);
+            s.narenas = shard->narenas.load(std::memory_order_relaxed);
+            s.arena_ntotal = shard->arena_ntotal.load(std::memory_order_relaxed);
+            s.arena_total_size = shard->arena_total_size.load(std::memory_order_relaxed);
+            s.arena_active_size = shard->arena_active_size.load(std::memory_order_relaxed);
+            s.arena_reserved = shard->arena_reserved.load(std::memory_order_relaxed);
+            s.nmapped = shard->nmapped.load(std::memory_order_relaxed);
+            s.mapped_size = shard->mapped_size.load(std::memory_order_relaxed);
+            s.quarantined = shard->quarantined.load(std::memory_order_relaxed);
+            for (unsigned i = 0; i != M61_LATENCY_BUCKETS; ++i) {
+                s.malloc_latency[i] = shard->malloc_latency[i].load(std::memory_order_relaxed);
+                s.free_latency[i] = shard->free_latency[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            seq1 = shard->seq.load(std::memory_order_relaxed);
+        } while ((seq0 & 1) || seq0 != seq1);
+
+        stats->nactive += s.nactive;
+        stats->active_size += s.active_size;
+        stats->ntotal += s.ntotal;
+        stats->total_size += s.total_size;
+        stats->nfail += s.nfail;
+        stats->fail_size += s.fail_size;
+        stats->narenas += s.narenas;
+        stats->arena_ntotal += s.arena_ntotal;
+        stats->arena_total_size += s.arena_total_size;
+        stats->arena_active_size += s.arena_active_size;
+        stats->arena_reserved += s.arena_reserved;
+        stats->nmapped += s.nmapped;
+        stats->mapped_size += s.mapped_size;
+        stats->quarantined += s.quarantined;
+        for (unsigned i = 0; i != M61_LATENCY_BUCKETS; ++i) {
+            stats->malloc_latency[i] += s.malloc_latency[i];
+            stats->free_latency[i] += s.free_latency[i];
+        }
+    }
+    stats->mapped_cached = map_cache_bytes.load(std::memory_order_relaxed);
+    stats->heap_min = std::min(heap_min.load(std::memory_order_relaxed),
+                               mapped_min.load(std::memory_order_relaxed));
+    stats->heap_max = std::max(heap_max.load(std::memory_order_relaxed),
+                               mapped_max.load(std::memory_order_relaxed));
 }
 
 
@@ -193,10 +2212,307 @@ void m61_print_statistics() {
 ///    memory.
 
 void m61_print_leak_report() {
-    // Your code here.
-    for(auto iter = metadata.begin(); iter != metadata.end(); ++iter) {
-        printf("LEAK CHECK: %s:%lu: allocated object %p with size %llu\n", iter->second->file, iter->second->line, (void*)(iter->first), iter->second->sz);
+    for (m61_shard* shard = all_shards.load(std::memory_order_acquire);
+         shard;
+         shard = shard->next_shard) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        for (m61_header* h = shard->active_head; h; h = h->next) {
+            if (h->flags & HF_BOOKMARK) {
+                continue;
+            }
+            const m61_site& site = site_get(h->site);
+            printf("LEAK CHECK: %s:%lu: allocated object %p with size %llu\n", site.file, site.line, (void*) (h + 1), h->sz);
+        }
+    }
+}
+
+
+/// Leak summaries
+///    `m61_print_leak_summary` walks each shard's active list in batches of
+///    `LEAK_BATCH` blocks. Between batches it parks a bookmark header in the
+///    list and drops the shard's lock, so allocation and free (which may
+///    unlink the bookmark's neighbors, but never the bookmark itself) keep
+///    running. Each batch is copied out under the lock and merged into the
+///    per-site totals after it is released. Blocks allocated after the walk
+///    starts may be missed; every block active for the whole walk is
+///    counted exactly once.
+
+static const unsigned LEAK_BATCH = 512;
+static const size_t LEAK_BUFSZ = 8192;
+
+struct leak_site {
+    uint32_t site;
+    unsigned long long count;
+    unsigned long long bytes;
+};
+
+using leak_site_map = std::unordered_map<
+    uint32_t, leak_site, std::hash<uint32_t>, std::equal_to<uint32_t>,
+    m61_base_allocator<std::pair<const uint32_t, leak_site>>>;
+
+
+/// leak_walk_shard(shard, sites)
+///    Add `shard`'s active blocks to `sites`.
+
+static void leak_walk_shard(m61_shard* shard, leak_site_map& sites) {
+    m61_header mark;
+    mark.flags = HF_BOOKMARK;
+    mark.site = 0;
+    mark.sz = 0;
+    mark.check = 0;
+    mark.prev = nullptr;
+
+    std::unique_lock<std::mutex> guard(shard->lock);
+    mark.next = shard->active_head;
+    if (mark.next) {
+        mark.next->prev = &mark;
+    }
+    shard->active_head = &mark;
+
+    leak_site batch[LEAK_BATCH];
+    while (true) {
+        // copy out a batch
+        unsigned n = 0, nvisited = 0;
+        m61_header* h = mark.next;
+        for (; h && nvisited != LEAK_BATCH; h = h->next, ++nvisited) {
+            if (!(h->flags & HF_BOOKMARK)) {
+                batch[n] = {h->site, 1, h->sz};
+                ++n;
+            }
+        }
+
+        // move the bookmark before `h`
+        if (mark.prev) {
+            mark.prev->next = mark.next;
+        } else {
+            shard->active_head = mark.next;
+        }
+        if (mark.next) {
+            mark.next->prev = mark.prev;
+        }
+        if (h) {
+            mark.prev = h->prev;
+            mark.next = h;
+            mark.prev->next = &mark;
+            h->prev = &mark;
+        }
+
+        guard.unlock();
+        for (unsigned i = 0; i != n; ++i) {
+            leak_site& site = sites[batch[i].site];
+            site.site = batch[i].site;
+            site.count += 1;
+            site.bytes += batch[i].bytes;
+        }
+        if (!h) {
+            return;
+        }
+        guard.lock();
+    }
+}
+
+
+/// leak_write(fd, buf, len)
+///    Write `len` bytes of `buf` to `fd`, retrying short writes. Returns
+///    false on error.
+
+static bool leak_write(int fd, const char* buf, size_t len) {
+    while (len != 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            return false;
+        }
+        buf += w;
+        len -= w;
+    }
+    return true;
+}
+
+
+/// m61_print_leak_summary(fd)
+///    Write a report of active blocks, grouped by allocation site, to `fd`.
+
+void m61_print_leak_summary(int fd) {
+    leak_site_map sites;
+    for (m61_shard* shard = all_shards.load(std::memory_order_acquire);
+         shard;
+         shard = shard->next_shard) {
+        leak_walk_shard(shard, sites);
+    }
+
+    std::vector<leak_site, m61_base_allocator<leak_site>> sorted;
+    sorted.reserve(sites.size());
+    unsigned long long count = 0, bytes = 0;
+    for (auto& it : sites) {
+        sorted.push_back(it.second);
+        count += it.second.count;
+        bytes += it.second.bytes;
+    }
+    sites.clear();
+    std::sort(sorted.begin(), sorted.end(), [] (const leak_site& a, const leak_site& b) {
+        return a.bytes > b.bytes
+            || (a.bytes == b.bytes && a.count > b.count);
+    });
+
+    if (fd == STDOUT_FILENO) {
+        fflush(stdout);
+    }
+    char buf[LEAK_BUFSZ];
+    size_t len = 0;
+    for (auto& site : sorted) {
+        if (len > LEAK_BUFSZ - 256) {
+            leak_write(fd, buf, len);
+            len = 0;
+        }
+        int n = snprintf(buf + len, LEAK_BUFSZ - len,
+                         "LEAK SUMMARY: %s:%ld: %llu bytes in %llu objects\n",
+                         site_get(site.site).file, site_get(site.site).line,
+                         site.bytes, site.count);
+        len += std::min((size_t) n, LEAK_BUFSZ - len - 1);
+    }
+    int n = snprintf(buf + len, LEAK_BUFSZ - len,
+                     "LEAK SUMMARY: total %llu bytes in %llu objects\n",
+                     bytes, count);
+    len += std::min((size_t) n, LEAK_BUFSZ - len - 1);
+    leak_write(fd, buf, len);
+}
+
+
+/// Trace files
+///    A flush thread drains the trace ring into the trace file in batches
+///    of up to `TRACE_BATCH` records, sleeping briefly when the ring is
+///    empty. `m61_trace_stop` waits for every reserved slot to be filled,
+///    lets the flush thread drain them, and then appends the site table.
+
+static const size_t TRACE_BATCH = 256;
+static std::mutex trace_lock;
+static int trace_fd = -1;
+static std::thread* trace_flusher;
+static std::atomic<bool> trace_stopping{false};
+static bool trace_failed;
+
+
+/// trace_flush_loop()
+///    Body of the flush thread.
+
+static void trace_flush_loop() {
+    static m61_trace_record buf[TRACE_BATCH];
+    uint64_t tail = 0;
+    while (true) {
+        bool stopping = trace_stopping.load(std::memory_order_acquire);
+        size_t n = 0;
+        while (n != TRACE_BATCH) {
+            trace_slot& slot = trace_ring[tail % TRACE_RING];
+            if (slot.seq.load(std::memory_order_acquire) != tail + 1) {
+                break;
+            }
+            buf[n] = slot.rec;
+            ++n;
+            slot.seq.store(tail + TRACE_RING, std::memory_order_release);
+            ++tail;
+        }
+        if (n != 0) {
+            if (!leak_write(trace_fd, (const char*) buf, n * sizeof(buf[0]))) {
+                trace_failed = true;
+            }
+        } else if (stopping) {
+            return;
+        } else {
+            struct timespec delay = {0, 100000};
+            nanosleep(&delay, nullptr);
+        }
+    }
+}
+
+
+/// m61_trace_start(filename)
+///    Start logging allocator calls to the trace file `filename`.
+
+int m61_trace_start(const char* filename) {
+    if constexpr (!CHECK_STATS) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_fd >= 0) {
+        return -1;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    m61_trace_file_header fh;
+    memcpy(fh.magic, M61_TRACE_MAGIC, sizeof(fh.magic));
+    fh.version = M61_TRACE_VERSION;
+    fh.record_size = sizeof(m61_trace_record);
+    if (!leak_write(fd, (const char*) &fh, sizeof(fh))) {
+        close(fd);
+        return -1;
+    }
+
+    for (size_t i = 0; i != TRACE_RING; ++i) {
+        trace_ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    trace_head.store(0, std::memory_order_relaxed);
+    trace_fd = fd;
+    trace_failed = false;
+    trace_stopping.store(false, std::memory_order_relaxed);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_epoch = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    trace_flusher = new (m61_base_allocator<std::thread>().allocate(1))
+        std::thread(trace_flush_loop);
+    trace_on.store(true);
+    return 0;
+}
+
+
+/// m61_trace_stop()
+///    Stop tracing, and finish and close the trace file.
+
+int m61_trace_stop() {
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_fd < 0) {
+        return -1;
+    }
+    trace_on.store(false);
+    while (trace_writers.load(std::memory_order_acquire) != 0) {
+        sched_yield();
+    }
+    trace_stopping.store(true, std::memory_order_release);
+    trace_flusher->join();
+    trace_flusher->~thread();
+    m61_base_allocator<std::thread>().deallocate(trace_flusher, 1);
+    trace_flusher = nullptr;
+
+    // site table
+    std::lock_guard<std::mutex> site_guard(site_lock);
+    m61_trace_record end = trace_record(M61_TRACE_SITES, nullptr, site_count, 0);
+    end.time = trace_now();
+    bool ok = !trace_failed
+        && leak_write(trace_fd, (const char*) &end, sizeof(end));
+    char buf[LEAK_BUFSZ];
+    size_t len = 0;
+    for (uint32_t id = 0; ok && id != site_count; ++id) {
+        const m61_site& site = site_get(id);
+        m61_trace_site ts = {id, site.file ? (uint32_t) strlen(site.file) : 0,
+                             site.line};
+        if (len + sizeof(ts) + ts.file_len > LEAK_BUFSZ) {
+            ok = leak_write(trace_fd, buf, len);
+            len = 0;
+        }
+        if (sizeof(ts) + ts.file_len > LEAK_BUFSZ) {
+            ts.file_len = 0;
+        }
+        memcpy(buf + len, &ts, sizeof(ts));
+        memcpy(buf + len + sizeof(ts), site.file, ts.file_len);
+        len += sizeof(ts) + ts.file_len;
     }
+    ok = ok && leak_write(trace_fd, buf, len);
+    ok = close(trace_fd) == 0 && ok;
+    trace_fd = -1;
+    return ok ? 0 : -1;
 }
 
 
@@ -204,5 +2520,30 @@ void m61_print_leak_report() {
 ///    Print a report of heavily-used allocation locations.
 
 void m61_print_heavy_hitter_report() {
-    // Your heavy-hitters code here
+    m61_statistics stats;
+    m61_get_statistics(&stats);
+
+    hh_counter sites[HH_NCOUNTERS];
+    unsigned nsites;
+    {
+        std::lock_guard<std::mutex> guard(hh_lock);
+        nsites = hh_ncounters;
+        memcpy(sites, hh_counters, sizeof(hh_counter) * nsites);
+    }
+    std::sort(sites, sites + nsites, [] (const hh_counter& a, const hh_counter& b) {
+        return a.bytes > b.bytes;
+    });
+
+    // each counter's `bytes` estimates the bytes its site allocated, so
+    // compare it with the bytes actually allocated
+    double total = std::max(stats.total_size, 1ULL);
+    for (unsigned i = 0; i != nsites; ++i) {
+        double share = sites[i].bytes / total;
+        if (share < HH_REPORT_THRESHOLD) {
+            break;
+        }
+        const m61_site& site = site_get(sites[i].site);
+        printf("HEAVY HITTER: %s:%ld: %llu bytes (~%.1f%%)\n",
+               site.file, site.line, sites[i].bytes, share * 100);
+    }
 }
@@ -15,15 +15,54 @@ void* m61_malloc(size_t sz, const char* file, long line);
 ///    Free the memory space pointed to by `ptr`.
 void m61_free(void* ptr, const char* file, long line);
 
+/// m61_free_sized(ptr, sz, file, line)
+///    Like `m61_free`, but also checks that `ptr` was allocated with `sz`
+///    bytes.
+void m61_free_sized(void* ptr, size_t sz, const char* file, long line);
+
 /// m61_calloc(nmemb, sz, file, line)
 ///    Return a pointer to newly-allocated dynamic memory big enough to
 ///    hold an array of `nmemb` elements of `sz` bytes each. The memory
 ///    should be initialized to zero.
 void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line);
 
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the dynamic memory at `ptr` to `sz` bytes,
+///    preserving its contents, and return its new location, or `nullptr`
+///    on failure. Grows in place when the block has room, and resizes
+///    large blocks with mremap rather than copying.
+void* m61_realloc(void* ptr, size_t sz, const char* file, long line);
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    aligned to `align`, a power of two.
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line);
+
+/// m61_posix_memalign(ptr, align, sz, file, line)
+///    Store a pointer to `sz` bytes aligned to `align` in `*ptr`. Returns 0
+///    on success or an error number.
+int m61_posix_memalign(void** ptr, size_t align, size_t sz,
+                       const char* file, long line);
+
+/// m61_malloc_batch(n, sz, out, file, line)
+///    Allocate `n` blocks of `sz` bytes each into `out[0..n-1]`, touching
+///    shared metadata and statistics once per batch. Returns `n`, or 0 if
+///    nothing could be allocated.
+size_t m61_malloc_batch(size_t n, size_t sz, void** out,
+                        const char* file, long line);
+
+/// m61_free_batch(ptrs, n, file, line)
+///    Free the `n` blocks in `ptrs` (null entries are skipped), touching
+///    shared metadata and statistics once per batch.
+void m61_free_batch(void** ptrs, size_t n, const char* file, long line);
+
 
 /// m61_statistics
 ///    Structure tracking memory statistics.
+#define M61_LATENCY_BUCKETS 32U
+#ifndef M61_LATENCY_SAMPLE
+#define M61_LATENCY_SAMPLE 64U          // time 1 call in this many
+#endif
 struct m61_statistics {
     unsigned long long nactive;         // # active allocations
     unsigned long long active_size;     // # bytes in active allocations
@@ -33,25 +72,176 @@ struct m61_statistics {
     unsigned long long fail_size;       // # bytes in failed alloc attempts
     uintptr_t heap_min;                 // smallest allocated addr
     uintptr_t heap_max;                 // largest allocated addr
+    unsigned long long narenas;         // # live arenas
+    unsigned long long arena_ntotal;    // # total arena allocations
+    unsigned long long arena_total_size;    // # bytes in total arena allocs
+    unsigned long long arena_active_size;   // # bytes in arena allocs since
+                                            //   their arena's last reset
+    unsigned long long arena_reserved;  // # bytes held by arena chunks
+    unsigned long long nmapped;         // # active blocks with their own
+                                        //   mapping
+    unsigned long long mapped_size;     // # bytes mapped for those blocks
+    unsigned long long mapped_cached;   // # bytes in released mappings kept
+                                        //   for reuse
+    unsigned long long quarantined;     // # bytes in freed blocks held in
+                                        //   quarantine
+    unsigned long long malloc_latency[M61_LATENCY_BUCKETS];
+                                        // # m61_malloc calls taking
+                                        //   [2^i, 2^(i+1)) ns (bucket 0
+                                        //   includes 0 ns; the last bucket
+                                        //   is unbounded); each thread
+                                        //   times every
+                                        //   M61_LATENCY_SAMPLEth call and
+                                        //   counts it that many times
+    unsigned long long free_latency[M61_LATENCY_BUCKETS];
+                                        // # m61_free calls, likewise
 };
 
 /// m61_get_statistics(stats)
-///    Store the current memory statistics in `*stats`.
+///    Store the current memory statistics in `*stats`. The snapshot is
+///    consistent per thread and never blocks allocation, so it is safe to
+///    call from a monitoring thread.
 void m61_get_statistics(m61_statistics* stats);
 
 /// m61_print_statistics()
 ///    Print the current memory statistics.
 void m61_print_statistics();
 
+/// m61_check_options
+///    Controls how much boundary checking m61 does, trading overhead for
+///    coverage.
+struct m61_check_options {
+    unsigned canary_size;       // trailing canary: 4 (unaligned, default),
+                                //   8, or 16 (aligned words)
+    bool front_canary;          // also guard the word before each block
+    unsigned long sweep_interval;   // check every active block of a thread
+                                //   after this many of its frees, and of
+                                //   one other thread's (in rotation, so
+                                //   idle and exited threads' blocks are
+                                //   checked too); 0 means check each
+                                //   block only when freed
+    size_t guard_page_min;      // blocks at least this big end at an
+                                //   inaccessible page; 0 disables
+    size_t quarantine_bytes;    // each thread holds up to this many bytes
+                                //   of freed blocks, poisoned, before
+                                //   reuse, and reports writes to them;
+                                //   0 disables
+};
+
+/// m61_get_check_options(opts)
+///    Store the current check options in `*opts`.
+void m61_get_check_options(m61_check_options* opts);
+
+/// m61_set_check_options(opts)
+///    Change the check options for future allocations. Returns 0 on
+///    success and -1 if `opts` is invalid.
+int m61_set_check_options(const m61_check_options* opts);
+
+/// m61_check_heap()
+///    Check the canaries of every active block now, reporting the first
+///    one that was overwritten.
+void m61_check_heap();
+
+
+/// m61_arena
+///    A bump allocator for objects that die together. Allocations are
+///    carved from large chunks and are never freed individually; instead
+///    `m61_arena_reset` releases all of them at once. An arena must not be
+///    used by more than one thread at a time.
+struct m61_arena;
+
+/// m61_arena_create(chunk_size)
+///    Return a new empty arena that obtains memory `chunk_size` bytes at a
+///    time (0 means a default size). Returns `nullptr` on failure.
+m61_arena* m61_arena_create(size_t chunk_size = 0);
+
+/// m61_arena_alloc(arena, sz)
+///    Return a pointer to `sz` bytes of uninitialized memory from `arena`,
+///    aligned like `m61_malloc` memory. The memory remains valid until the
+///    arena is reset or destroyed. Returns `nullptr` on failure.
+void* m61_arena_alloc(m61_arena* arena, size_t sz);
+
+/// m61_arena_reset(arena)
+///    Release every allocation made from `arena`. The arena keeps its
+///    standard-sized chunks for reuse.
+void m61_arena_reset(m61_arena* arena);
+
+/// m61_arena_destroy(arena)
+///    Release every allocation made from `arena` and the arena itself.
+void m61_arena_destroy(m61_arena* arena);
+
+
 /// m61_print_leak_report()
 ///    Print a report of all currently-active allocated blocks of dynamic
 ///    memory.
 void m61_print_leak_report();
 
+/// m61_print_leak_summary(fd)
+///    Write a report of currently-active blocks, grouped by allocation site
+///    with counts and total bytes, to file descriptor `fd`. Unlike
+///    `m61_print_leak_report`, this is cheap to run in a live process:
+///    other threads keep allocating and freeing while it walks.
+void m61_print_leak_summary(int fd);
+
 /// m61_print_heavy_hitter_report()
 ///    Print a report of heavily-used allocation locations.
 void m61_print_heavy_hitter_report();
 
+
+/// m61 traces
+///    A trace file logs allocator calls for offline replay (see
+///    `m61replay`). It holds an `m61_trace_file_header`, then one
+///    `m61_trace_record` per operation in the order the operations took
+///    effect, then an `M61_TRACE_SITES` record whose `size` is the number
+///    of allocation sites. Each site is an `m61_trace_site` followed by its
+///    `file_len`-byte file name.
+#define M61_TRACE_MAGIC     "M61TRACE"
+#define M61_TRACE_VERSION   1U
+
+enum m61_trace_op {
+    M61_TRACE_MALLOC = 1,       // `ptr` = m61_malloc(`size`)
+    M61_TRACE_CALLOC = 2,       // `ptr` = m61_calloc for `size` total bytes
+    M61_TRACE_ALIGNED = 3,      // `ptr` = m61_aligned_alloc
+                                //   (1 << `align_shift`, `size`)
+    M61_TRACE_FREE = 4,         // m61_free(`ptr`); a realloc is logged as
+                                //   a FREE followed by a MALLOC
+    M61_TRACE_SITES = 5         // end of records; `size` = # sites
+};
+
+struct m61_trace_file_header {
+    char magic[8];              // `M61_TRACE_MAGIC`
+    uint32_t version;           // `M61_TRACE_VERSION`
+    uint32_t record_size;       // `sizeof(m61_trace_record)`
+};
+
+struct m61_trace_record {
+    uint64_t time;              // ns since tracing started
+    uint64_t ptr;               // block address
+    uint64_t size;              // requested size
+    uint32_t site;              // the block's allocation site
+    uint8_t op;                 // `m61_trace_op`
+    uint8_t align_shift;
+    uint16_t padding;
+};
+
+struct m61_trace_site {
+    uint32_t site;
+    uint32_t file_len;
+    int64_t line;
+};
+
+/// m61_trace_start(filename)
+///    Start logging allocator calls to the trace file `filename`. Returns 0
+///    on success and -1 if tracing is already on, the file cannot be
+///    created, or m61 was built with `M61_CHECK_NONE`.
+int m61_trace_start(const char* filename);
+
+/// m61_trace_stop()
+///    Stop tracing, and finish and close the trace file. Returns 0 on
+///    success and -1 if writing the file failed.
+int m61_trace_stop();
+
+
 /// `m61.cc` should use these functions rather than malloc() and free().
 void* base_malloc(size_t sz);
 void base_free(void* ptr);
@@ -63,33 +253,58 @@ void base_allocator_disable(bool is_disabled);
 #define malloc(sz)          m61_malloc((sz), __FILE__, __LINE__)
 #define free(ptr)           m61_free((ptr), __FILE__, __LINE__)
 #define calloc(nmemb, sz)   m61_calloc((nmemb), (sz), __FILE__, __LINE__)
+#define realloc(ptr, sz)    m61_realloc((ptr), (sz), __FILE__, __LINE__)
+#define aligned_alloc(align, sz) \
+    m61_aligned_alloc((align), (sz), __FILE__, __LINE__)
+#define posix_memalign(ptr, align, sz) \
+    m61_posix_memalign((ptr), (align), (sz), __FILE__, __LINE__)
 #endif
 
 
 /// This magic class lets standard C++ containers use your debugging allocator,
-/// instead of the system allocator.
+/// instead of the system allocator. An allocator constructed from an
+/// `m61_arena` allocates from that arena; its deallocations do nothing,
+/// since the arena releases everything on reset.
 template <typename T>
 class m61_allocator {
 public:
     using value_type = T;
     m61_allocator() noexcept = default;
+    explicit m61_allocator(m61_arena* arena) noexcept : arena_(arena) {}
     m61_allocator(const m61_allocator<T>&) noexcept = default;
-    template <typename U> m61_allocator(m61_allocator<U>&) noexcept {}
+    template <typename U> m61_allocator(const m61_allocator<U>& x) noexcept
+        : arena_(x.arena()) {}
 
     T* allocate(size_t n) {
+        if (arena_) {
+            void* ptr = m61_arena_alloc(arena_, n * sizeof(T));
+            if (!ptr) {
+                throw std::bad_alloc();
+            }
+            return reinterpret_cast<T*>(ptr);
+        }
         return reinterpret_cast<T*>(m61_malloc(n * sizeof(T), "?", 0));
     }
     void deallocate(T* ptr, size_t) {
-        m61_free(ptr, "?", 0);
+        if (!arena_) {
+            m61_free(ptr, "?", 0);
+        }
+    }
+
+    m61_arena* arena() const noexcept {
+        return arena_;
     }
+
+private:
+    m61_arena* arena_ = nullptr;
 };
 template <typename T, typename U>
-inline constexpr bool operator==(const m61_allocator<T>&, const m61_allocator<U>&) {
-    return true;
+inline bool operator==(const m61_allocator<T>& a, const m61_allocator<U>& b) {
+    return a.arena() == b.arena();
 }
 template <typename T, typename U>
-inline constexpr bool operator!=(const m61_allocator<T>&, const m61_allocator<U>&) {
-    return false;
+inline bool operator!=(const m61_allocator<T>& a, const m61_allocator<U>& b) {
+    return a.arena() != b.arena();
 }
 
 #endif
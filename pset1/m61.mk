@@ -0,0 +1,27 @@
+# m61.mk
+#    Lets another pset run its programs on m61, to profile their heap
+#    behavior: `make M61=1` compiles m61 from this directory and links it
+#    under every program. Include this file before `build/rules.mk`, and
+#    add `$(M61_OBJS)` to each program's objects.
+#
+#    In an M61 build, global operator new and delete go through m61, with
+#    allocations attributed to their callers (see `m61new.cc`); `malloc`
+#    and friends do too in source files that include "m61.hh" last when
+#    `M61` is defined. The programs report statistics, heavy hitters, and
+#    active blocks when they exit (see `m61report.cc`). `CHECKLEVEL`
+#    works as in this directory's GNUmakefile.
+
+M61DIR := $(dir $(lastword $(MAKEFILE_LIST)))
+
+ifeq ($(M61),1)
+DEFS += -DM61=1 -DM61_NEW_CALLERS=1 -I$(M61DIR)
+ ifneq ($(CHECKLEVEL),)
+DEFS += -DM61_CHECK_LEVEL=M61_CHECK_$(shell echo $(CHECKLEVEL) | tr a-z A-Z)
+ endif
+M61_OBJS = m61-m61.o m61-basealloc.o m61-m61new.o m61-m61report.o
+endif
+
+# `$(BUILDSTAMP)` is defined by `build/rules.mk`, which comes later
+.SECONDEXPANSION:
+m61-%.o: $(M61DIR)%.cc $$(BUILDSTAMP)
+	$(call run,$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(DEPCFLAGS) $(O) -o $@ -c,COMPILE,$<)
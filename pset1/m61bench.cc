@@ -0,0 +1,367 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+// m61bench: Allocator throughput and latency benchmarks.
+//
+//    Runs standard workloads against m61, the base allocator, and the
+//    system allocator, and prints one JSON object per run. Each run is a
+//    separate process, so `peak_rss_kb` reflects only that run.
+//    Latency percentiles come from one sampled operation out of every
+//    `SAMPLE_EVERY`.
+
+
+static const unsigned SAMPLE_EVERY = 16;
+static const size_t NSAMPLES = 1 << 16;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Allocators under test
+
+struct bench_allocator {
+    const char* name;
+    void* (*allocate)(size_t sz);
+    void (*deallocate)(void* ptr);
+};
+
+static void* m61_allocate(size_t sz) {
+    return m61_malloc(sz, __FILE__, __LINE__);
+}
+static void m61_deallocate(void* ptr) {
+    m61_free(ptr, __FILE__, __LINE__);
+}
+
+// The base allocator is not thread-safe, so serialize it as m61 does.
+static std::mutex base_lock;
+static void* base_allocate(size_t sz) {
+    std::lock_guard<std::mutex> guard(base_lock);
+    return base_malloc(sz);
+}
+static void base_deallocate(void* ptr) {
+    std::lock_guard<std::mutex> guard(base_lock);
+    base_free(ptr);
+}
+
+// Parenthesized names bypass m61.hh's macros.
+static void* system_allocate(size_t sz) {
+    return (malloc)(sz);
+}
+static void system_deallocate(void* ptr) {
+    (free)(ptr);
+}
+
+static const bench_allocator allocators[] = {
+    {"m61", m61_allocate, m61_deallocate},
+    {"base", base_allocate, base_deallocate},
+    {"system", system_allocate, system_deallocate}
+};
+static const bench_allocator* alloc;
+
+
+/// bench_stl_allocator<T>
+///    STL allocator for the base and system allocators; the m61 runs use
+///    `m61_allocator<T>`.
+
+template <typename T>
+struct bench_stl_allocator {
+    using value_type = T;
+    bench_stl_allocator() noexcept = default;
+    template <typename U> bench_stl_allocator(const bench_stl_allocator<U>&) noexcept {}
+    T* allocate(size_t n) {
+        return reinterpret_cast<T*>(alloc->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t) {
+        alloc->deallocate(ptr);
+    }
+};
+template <typename T, typename U>
+inline bool operator==(const bench_stl_allocator<T>&, const bench_stl_allocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+inline bool operator!=(const bench_stl_allocator<T>&, const bench_stl_allocator<U>&) {
+    return false;
+}
+
+
+/// bench_thread
+///    Per-thread operation count and latency samples.
+
+struct bench_thread {
+    unsigned long long nops = 0;
+    unsigned nsamples = 0;
+    std::unique_ptr<unsigned[]> samples{new unsigned[NSAMPLES]};
+
+    // Call `f` and count it as one operation.
+    template <typename F> void op(F f) {
+        if (nops++ % SAMPLE_EVERY != 0 || nsamples == NSAMPLES) {
+            f();
+            return;
+        }
+        unsigned long long t0 = now_ns();
+        f();
+        samples[nsamples++] = std::min(now_ns() - t0, (unsigned long long) UINT_MAX);
+    }
+};
+
+
+// Workloads
+
+static double scale = 1.0;
+static int nthreads = 4;
+
+static unsigned long long scaled(unsigned long long n) {
+    return std::max((unsigned long long) (n * scale), 1ULL);
+}
+
+/// prodcons: one thread allocates blocks and hands them through a ring
+///    buffer to another thread, which frees them.
+static void workload_prodcons(std::vector<bench_thread>& ths) {
+    const unsigned long long n = scaled(1000000);
+    const unsigned RING = 1024;
+    static std::atomic<void*> ring[RING];
+    std::atomic<unsigned long long> head{0}, tail{0};
+
+    ths.resize(2);
+    std::thread producer([&] {
+        std::minstd_rand rng(61);
+        for (unsigned long long i = 0; i != n; ++i) {
+            while (i - tail.load(std::memory_order_acquire) >= RING) {
+                std::this_thread::yield();
+            }
+            size_t sz = 16 + rng() % 497;
+            void* ptr;
+            ths[0].op([&] { ptr = alloc->allocate(sz); });
+            memset(ptr, 0, std::min(sz, (size_t) 64));
+            ring[i % RING].store(ptr, std::memory_order_relaxed);
+            head.store(i + 1, std::memory_order_release);
+        }
+    });
+    for (unsigned long long i = 0; i != n; ++i) {
+        while (head.load(std::memory_order_acquire) == i) {
+            std::this_thread::yield();
+        }
+        void* ptr = ring[i % RING].load(std::memory_order_relaxed);
+        ths[1].op([&] { alloc->deallocate(ptr); });
+        tail.store(i + 1, std::memory_order_release);
+    }
+    producer.join();
+}
+
+/// larson: threads repeatedly replace random slots of an array of blocks
+///    with blocks of random size; between rounds each thread passes its
+///    array to the next, so many blocks are freed by a different thread
+///    than the one that allocated them.
+static void workload_larson(std::vector<bench_thread>& ths) {
+    const unsigned NSLOTS = 1000, NROUNDS = 10;
+    const unsigned long long per_round = scaled(100000);
+    std::vector<std::vector<void*>> slots(nthreads, std::vector<void*>(NSLOTS, nullptr));
+    std::vector<std::thread> workers;
+
+    ths.resize(nthreads);
+    for (unsigned round = 0; round != NROUNDS; ++round) {
+        for (int t = 0; t != nthreads; ++t) {
+            workers.emplace_back([&, t, round] {
+                std::minstd_rand rng(t * 100 + round + 1);
+                std::vector<void*>& mine = slots[(t + round) % nthreads];
+                for (unsigned long long i = 0; i != per_round; ++i) {
+                    void*& slot = mine[rng() % NSLOTS];
+                    size_t sz = 16 + rng() % 1009;
+                    if (slot) {
+                        ths[t].op([&] { alloc->deallocate(slot); });
+                    }
+                    ths[t].op([&] { slot = alloc->allocate(sz); });
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        workers.clear();
+    }
+    for (auto& v : slots) {
+        for (void* ptr : v) {
+            if (ptr) {
+                alloc->deallocate(ptr);
+            }
+        }
+    }
+}
+
+/// stl: map inserts and erases, vector growth, and list churn through an
+///    STL allocator.
+template <template <typename> class A>
+static void stl_run(bench_thread& th) {
+    const unsigned long long n = scaled(200000);
+    std::minstd_rand rng(61);
+    std::map<int, int, std::less<int>, A<std::pair<const int, int>>> m;
+    std::list<int, A<int>> l;
+    for (unsigned long long i = 0; i != n; ++i) {
+        int key = rng() % 50000;
+        th.op([&] {
+            auto it = m.find(key);
+            if (it == m.end()) {
+                m.emplace(key, (int) i);
+            } else {
+                m.erase(it);
+            }
+        });
+        th.op([&] {
+            l.push_back(key);
+            if (l.size() > 1000) {
+                l.pop_front();
+            }
+        });
+        if (i % 1000 == 0) {
+            th.op([&] {
+                std::vector<int, A<int>> v;
+                for (int j = 0; j != 1000; ++j) {
+                    v.push_back(j);
+                }
+            });
+        }
+    }
+}
+
+static void workload_stl(std::vector<bench_thread>& ths) {
+    ths.resize(1);
+    if (alloc->allocate == m61_allocate) {
+        stl_run<m61_allocator>(ths[0]);
+    } else {
+        stl_run<bench_stl_allocator>(ths[0]);
+    }
+}
+
+struct bench_workload {
+    const char* name;
+    void (*run)(std::vector<bench_thread>&);
+};
+
+static const bench_workload workloads[] = {
+    {"prodcons", workload_prodcons},
+    {"larson", workload_larson},
+    {"stl", workload_stl}
+};
+
+
+/// run_one(w)
+///    Run workload `w` with the current allocator and print its results.
+
+static void run_one(const bench_workload* w) {
+    std::vector<bench_thread> ths;
+    ths.reserve(std::max(nthreads, 2));
+    unsigned long long t0 = now_ns();
+    w->run(ths);
+    double seconds = (now_ns() - t0) / 1e9;
+
+    unsigned long long nops = 0;
+    std::vector<unsigned> samples;
+    for (auto& th : ths) {
+        nops += th.nops;
+        samples.insert(samples.end(), th.samples.get(), th.samples.get() + th.nsamples);
+    }
+    unsigned p50 = 0, p99 = 0;
+    if (!samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        p50 = samples[samples.size() / 2];
+        p99 = samples[std::min(samples.size() - 1, (size_t) (samples.size() * 0.99))];
+    }
+
+    struct rusage usage;
+    int r = getrusage(RUSAGE_SELF, &usage);
+    assert(r == 0);
+
+    printf("{\"allocator\": \"%s\", \"workload\": \"%s\", \"threads\": %zu, "
+           "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"p50_ns\": %u, \"p99_ns\": %u, \"peak_rss_kb\": %ld}",
+           alloc->name, w->name, ths.size(), nops, seconds,
+           nops / std::max(seconds, 1e-9), p50, p99, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+
+static void usage() {
+    fprintf(stderr, "Usage: m61bench [-a ALLOCATOR] [-w WORKLOAD] [-n SCALE] [-j NTHREADS]\n"
+            "  ALLOCATOR: m61, base, or system (default all)\n"
+            "  WORKLOAD: prodcons, larson, or stl (default all)\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* only_alloc = nullptr;
+    const char* only_workload = nullptr;
+    int ch;
+    while ((ch = getopt(argc, argv, "a:w:n:j:")) != -1) {
+        if (ch == 'a') {
+            only_alloc = optarg;
+        } else if (ch == 'w') {
+            only_workload = optarg;
+        } else if (ch == 'n') {
+            scale = strtod(optarg, nullptr);
+        } else if (ch == 'j') {
+            nthreads = strtol(optarg, nullptr, 10);
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc || scale <= 0 || nthreads <= 0) {
+        usage();
+    }
+
+    bool any = false;
+    printf("[");
+    for (auto& a : allocators) {
+        if (only_alloc && strcmp(only_alloc, a.name) != 0) {
+            continue;
+        }
+        for (auto& w : workloads) {
+            if (only_workload && strcmp(only_workload, w.name) != 0) {
+                continue;
+            }
+            printf(any ? ",\n " : "\n ");
+            fflush(stdout);
+            any = true;
+
+            // run in a child so peak RSS covers only this run
+            pid_t p = fork();
+            assert(p >= 0);
+            if (p == 0) {
+                alloc = &a;
+                run_one(&w);
+                _exit(0);
+            }
+            int status;
+            pid_t wp = waitpid(p, &status, 0);
+            assert(wp == p);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "m61bench: %s/%s failed\n", a.name, w.name);
+                exit(1);
+            }
+        }
+    }
+    if (!any) {
+        usage();
+    }
+    printf("\n]\n");
+}
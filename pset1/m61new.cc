@@ -0,0 +1,211 @@
+#define M61_DISABLE 1
+#include "m61.hh"
+#include <algorithm>
+#include <new>
+
+// m61new.cc
+//    Link this file into a program to route global operator new and
+//    delete through m61, so C++ code that uses `new` directly gets the
+//    same checking, statistics, and leak reports as `malloc`. Every form
+//    is replaced: plain, array, nothrow, aligned, and sized. Sized deletes
+//    check that the size matches the allocation.
+//
+//    Allocations made here are attributed to `M61_NEW_SITE`, since
+//    operator new does not know its caller's file and line. If built with
+//    `M61_NEW_CALLERS` (as `m61.mk` does), the site's line is instead the
+//    address of the nearest caller in the main program, relative to where
+//    the program was loaded, so `addr2line -e PROGRAM -f -C 0xLINE`
+//    (LINE in hex) names the caller. Calls from shared libraries, such as
+//    libstdc++'s `std::string`, are attributed to the main-program frame
+//    that called into the library.
+
+#if M61_NEW_CALLERS
+#include <link.h>
+#include <unwind.h>
+
+/// main_program
+///    Where the main program's code was loaded.
+
+static struct {
+    uintptr_t bias;             // load address
+    uintptr_t text_min;         // executable segments are in
+    uintptr_t text_max;         //   [text_min, text_max)
+} main_program;
+
+static int find_main_program(dl_phdr_info* info, size_t, void*) {
+    // the first object is the main program
+    main_program.bias = info->dlpi_addr;
+    main_program.text_min = UINTPTR_MAX;
+    for (int i = 0; i != info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+            uintptr_t start = info->dlpi_addr + ph.p_vaddr;
+            main_program.text_min = std::min(main_program.text_min, start);
+            main_program.text_max = std::max(main_program.text_max,
+                                             start + ph.p_memsz);
+        }
+    }
+    return 1;
+}
+
+static bool in_main_program(uintptr_t pc) {
+    static bool found = (dl_iterate_phdr(find_main_program, nullptr), true);
+    (void) found;
+    return pc >= main_program.text_min && pc < main_program.text_max;
+}
+
+
+/// new_caller(ra), delete_caller(ra)
+///    Return the line for an allocation whose caller returns to `ra`: the
+///    offset of the nearest return address in the main program, or 0.
+///    Frees only use their line in error messages, so `delete_caller`
+///    doesn't look past a library caller.
+
+struct caller_search {
+    uintptr_t ra;               // operator new's return address
+    bool past_ra;               // set once the walk reaches `ra`'s frame
+    uintptr_t pc;               // result
+};
+
+static _Unwind_Reason_Code find_caller(_Unwind_Context* ctx, void* arg) {
+    auto cs = reinterpret_cast<caller_search*>(arg);
+    uintptr_t pc = _Unwind_GetIP(ctx);
+    if (pc == cs->ra) {
+        cs->past_ra = true;
+    } else if (cs->past_ra && in_main_program(pc)) {
+        cs->pc = pc;
+        return _URC_END_OF_STACK;
+    }
+    return _URC_NO_REASON;
+}
+
+static long new_caller(void* ra) {
+    uintptr_t pc = reinterpret_cast<uintptr_t>(ra);
+    if (!in_main_program(pc)) {
+        caller_search cs = {pc, false, 0};
+        _Unwind_Backtrace(find_caller, &cs);
+        if (!cs.pc) {
+            return 0;
+        }
+        pc = cs.pc;
+    }
+    // a return address follows its call; name the call
+    return pc - 1 - main_program.bias;
+}
+
+static long delete_caller(void* ra) {
+    uintptr_t pc = reinterpret_cast<uintptr_t>(ra);
+    return in_main_program(pc) ? pc - 1 - main_program.bias : 0;
+}
+
+#define M61_NEW_SITE \
+    "<operator new>", new_caller(__builtin_return_address(0))
+#define M61_DELETE_SITE \
+    "<operator new>", delete_caller(__builtin_return_address(0))
+#else
+#define M61_NEW_SITE "<operator new>", 0
+#define M61_DELETE_SITE M61_NEW_SITE
+#endif
+
+
+/// new_allocate(sz, align, file, line)
+///    Allocate `sz` bytes aligned to `align` (0 for the default) for site
+///    `file:line`, calling the new-handler until allocation succeeds.
+///    Returns `nullptr` if there is no new-handler.
+
+static void* new_allocate(size_t sz, size_t align,
+                          const char* file, long line) {
+    while (true) {
+        void* ptr = align ? m61_aligned_alloc(align, sz, file, line)
+            : m61_malloc(sz, file, line);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            return nullptr;
+        }
+        handler();
+    }
+}
+
+static void* new_or_throw(size_t sz, size_t align,
+                          const char* file, long line) {
+    if (void* ptr = new_allocate(sz, align, file, line)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+static void* new_nothrow(size_t sz, size_t align,
+                         const char* file, long line) noexcept {
+    try {
+        return new_allocate(sz, align, file, line);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+
+void* operator new(size_t sz) {
+    return new_or_throw(sz, 0, M61_NEW_SITE);
+}
+void* operator new[](size_t sz) {
+    return new_or_throw(sz, 0, M61_NEW_SITE);
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept {
+    return new_nothrow(sz, 0, M61_NEW_SITE);
+}
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
+    return new_nothrow(sz, 0, M61_NEW_SITE);
+}
+void* operator new(size_t sz, std::align_val_t align) {
+    return new_or_throw(sz, (size_t) align, M61_NEW_SITE);
+}
+void* operator new[](size_t sz, std::align_val_t align) {
+    return new_or_throw(sz, (size_t) align, M61_NEW_SITE);
+}
+void* operator new(size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return new_nothrow(sz, (size_t) align, M61_NEW_SITE);
+}
+void* operator new[](size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return new_nothrow(sz, (size_t) align, M61_NEW_SITE);
+}
+
+
+void operator delete(void* ptr) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete(void* ptr, size_t sz) noexcept {
+    m61_free_sized(ptr, sz, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr, size_t sz) noexcept {
+    m61_free_sized(ptr, sz, M61_DELETE_SITE);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_DELETE_SITE);
+}
+void operator delete(void* ptr, size_t sz, std::align_val_t) noexcept {
+    m61_free_sized(ptr, sz, M61_DELETE_SITE);
+}
+void operator delete[](void* ptr, size_t sz, std::align_val_t) noexcept {
+    m61_free_sized(ptr, sz, M61_DELETE_SITE);
+}
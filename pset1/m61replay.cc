@@ -0,0 +1,184 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+// m61replay: Replay an m61 trace file against m61.
+//
+//    Reads a trace written by `m61_trace_start`, then performs its
+//    operations in order with `m61_malloc`, `m61_calloc`,
+//    `m61_aligned_alloc`, and `m61_free`, attributed to the sites they
+//    came from. Prints one JSON object with the replay's timing. The
+//    trace is parsed before the clock starts, so the timing covers the
+//    allocator calls and pointer bookkeeping only.
+
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: m61replay [-s] [-l] TRACEFILE\n"
+            "  -s  print m61 statistics after the replay\n"
+            "  -l  print a leak summary of blocks the trace never freed\n");
+    exit(1);
+}
+
+static void fail(const char* filename, const char* msg) {
+    fprintf(stderr, "m61replay: %s: %s\n", filename, msg);
+    exit(1);
+}
+
+
+/// trace
+///    A parsed trace file.
+
+struct trace {
+    std::vector<m61_trace_record> records;
+    std::unordered_map<uint32_t, std::pair<std::string, long>> sites;
+    std::vector<const char*> site_files;    // by site ID, for m61 calls
+    std::vector<long> site_lines;
+};
+
+static void read_trace(const char* filename, trace& t) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fail(filename, strerror(errno));
+    }
+    m61_trace_file_header fh;
+    if (fread(&fh, sizeof(fh), 1, f) != 1
+        || memcmp(fh.magic, M61_TRACE_MAGIC, sizeof(fh.magic)) != 0) {
+        fail(filename, "not an m61 trace");
+    } else if (fh.version != M61_TRACE_VERSION
+               || fh.record_size != sizeof(m61_trace_record)) {
+        fail(filename, "unsupported trace version");
+    }
+
+    m61_trace_record rec;
+    while (true) {
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            fail(filename, "truncated trace (was m61_trace_stop called?)");
+        } else if (rec.op == M61_TRACE_SITES) {
+            break;
+        }
+        t.records.push_back(rec);
+    }
+
+    uint32_t max_site = 0;
+    for (uint64_t i = 0; i != rec.size; ++i) {
+        m61_trace_site ts;
+        if (fread(&ts, sizeof(ts), 1, f) != 1) {
+            fail(filename, "truncated site table");
+        }
+        std::string file(ts.file_len, '\0');
+        if (ts.file_len && fread(&file[0], ts.file_len, 1, f) != 1) {
+            fail(filename, "truncated site table");
+        }
+        t.sites[ts.site] = {file, (long) ts.line};
+        max_site = std::max(max_site, ts.site);
+    }
+    fclose(f);
+
+    // m61 keeps site file names, so they must outlive the replay
+    t.site_files.assign(max_site + 1, "?");
+    t.site_lines.assign(max_site + 1, 0);
+    for (auto& it : t.sites) {
+        t.site_files[it.first] = it.second.first.c_str();
+        t.site_lines[it.first] = it.second.second;
+    }
+}
+
+
+int main(int argc, char** argv) {
+    bool print_stats = false, print_leaks = false;
+    int ch;
+    while ((ch = getopt(argc, argv, "sl")) != -1) {
+        if (ch == 's') {
+            print_stats = true;
+        } else if (ch == 'l') {
+            print_leaks = true;
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    const char* filename = argv[optind];
+
+    trace t;
+    read_trace(filename, t);
+
+    // map traced addresses to replayed blocks
+    std::unordered_map<uint64_t, void*> live;
+    live.reserve(t.records.size());
+    unsigned long long nfailed = 0, nunmatched = 0;
+    unsigned long long t0 = now_ns();
+    for (auto& rec : t.records) {
+        const char* file = "?";
+        long line = 0;
+        if (rec.site < t.site_files.size()) {
+            file = t.site_files[rec.site];
+            line = t.site_lines[rec.site];
+        }
+        if (rec.op == M61_TRACE_FREE) {
+            auto it = live.find(rec.ptr);
+            if (it == live.end()) {
+                ++nunmatched;
+                continue;
+            }
+            m61_free(it->second, file, line);
+            live.erase(it);
+            continue;
+        }
+
+        void* ptr;
+        if (rec.op == M61_TRACE_MALLOC) {
+            ptr = m61_malloc(rec.size, file, line);
+        } else if (rec.op == M61_TRACE_CALLOC) {
+            ptr = m61_calloc(1, rec.size, file, line);
+        } else if (rec.op == M61_TRACE_ALIGNED) {
+            ptr = m61_aligned_alloc((size_t) 1 << rec.align_shift, rec.size,
+                                    file, line);
+        } else {
+            fail(filename, "unknown trace operation");
+        }
+        if (!ptr) {
+            ++nfailed;
+            continue;
+        }
+        void*& slot = live[rec.ptr];
+        if (slot) {
+            // address reused before its free was traced
+            ++nunmatched;
+            m61_free(slot, file, line);
+        }
+        slot = ptr;
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"trace\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"failed\": %llu, \"unmatched\": %llu, "
+           "\"live\": %zu, \"peak_rss_kb\": %ld}\n",
+           filename, t.records.size(), seconds,
+           t.records.size() / std::max(seconds, 1e-9), nfailed, nunmatched,
+           live.size(), usage.ru_maxrss);
+    if (print_stats) {
+        m61_print_statistics();
+    }
+    if (print_leaks) {
+        fflush(stdout);
+        m61_print_leak_summary(STDOUT_FILENO);
+    }
+}
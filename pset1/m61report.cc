@@ -0,0 +1,103 @@
+#define M61_DISABLE 1
+#include "m61.hh"
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// m61report.cc
+//    Link this file into a program that runs on m61 (see `m61.mk`) to
+//    report its heap behavior when it exits, or when SIGINT or SIGTERM
+//    kills it: statistics, heavy hitters, and a summary of the blocks
+//    still active, by allocation site. The report goes to standard error,
+//    or is appended to the file named by the `M61_REPORT` environment
+//    variable.
+//
+//    The signal handlers are installed only if the program hasn't
+//    installed its own first, and a program that installs its own later
+//    replaces them. Printing from a signal handler is not async-signal-
+//    safe; this is a profiling aid, so the report is a best effort.
+
+
+/// report_fd()
+///    Return the file descriptor to write the report to.
+
+static int report_fd() {
+    if (const char* path = getenv("M61_REPORT")) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+    return dup(STDERR_FILENO);
+}
+
+
+/// print_report()
+///    Print the report. m61's printing functions write to standard output,
+///    so standard output is redirected to the report meanwhile.
+
+static void print_report() {
+    static bool printed = false;
+    if (printed) {
+        return;
+    }
+    printed = true;
+
+    int fd = report_fd();
+    if (fd < 0) {
+        return;
+    }
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+
+    m61_statistics stats;
+    m61_get_statistics(&stats);
+    printf("M61 REPORT: pid %d\n", (int) getpid());
+    m61_print_statistics();
+    printf("arenas:      live   %10llu   allocs %10llu   bytes %10llu\n",
+           stats.narenas, stats.arena_ntotal, stats.arena_total_size);
+    printf("mapped:      active %10llu   bytes  %10llu   cached %9llu\n",
+           stats.nmapped, stats.mapped_size, stats.mapped_cached);
+    m61_print_heavy_hitter_report();
+    fflush(stdout);
+    m61_print_leak_summary(fd);
+
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    close(fd);
+}
+
+
+static void report_signal_handler(int signo) {
+    print_report();
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+
+/// m61_report_init
+///    Arrange for the report at startup.
+
+namespace {
+struct m61_report_init {
+    m61_report_init() {
+        atexit(print_report);
+        static const int signos[] = {SIGINT, SIGTERM};
+        for (int signo : signos) {
+            struct sigaction sa;
+            if (sigaction(signo, nullptr, &sa) == 0
+                && sa.sa_handler == SIG_DFL) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = report_signal_handler;
+                sigemptyset(&sa.sa_mask);
+                sigaction(signo, &sa, nullptr);
+            }
+        }
+    }
+};
+m61_report_init report_init;
+}
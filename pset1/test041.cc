@@ -0,0 +1,44 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <thread>
+// Concurrent allocation and cross-thread frees.
+
+static void* ptrs[4][1000];
+
+static void allocate(int t) {
+    for (int i = 0; i != 1000; ++i) {
+        ptrs[t][i] = malloc(i % 100 + 1);
+        memset(ptrs[t][i], t, i % 100 + 1);
+    }
+}
+
+static void release(int t) {
+    // free the blocks another thread allocated
+    for (int i = 0; i != 1000; ++i) {
+        if (i % 10 != 0) {
+            free(ptrs[(t + 1) % 4][i]);
+        }
+    }
+}
+
+int main() {
+    std::thread ths[4];
+    for (int t = 0; t != 4; ++t) {
+        ths[t] = std::thread(allocate, t);
+    }
+    for (int t = 0; t != 4; ++t) {
+        ths[t].join();
+    }
+    for (int t = 0; t != 4; ++t) {
+        ths[t] = std::thread(release, t);
+    }
+    for (int t = 0; t != 4; ++t) {
+        ths[t].join();
+    }
+    m61_print_statistics();
+}
+
+//! alloc count: active        400   total       4000   fail          0
+//! alloc size:  active      18400   total     202000   fail          0
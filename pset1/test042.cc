@@ -0,0 +1,18 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Heavy hitter report for a skewed workload.
+
+int main() {
+    for (int i = 0; i != 100000; ++i) {
+        void* big = malloc(90);
+        void* small = malloc(10);
+        free(big);
+        free(small);
+    }
+    m61_print_heavy_hitter_report();
+}
+
+//! HEAVY HITTER: test042.cc:9: ??{\d+}?? bytes (~??{[89]\d\.\d}??%)
+//! HEAVY HITTER: test042.cc:10: ??{\d+}?? bytes (~??{1?\d\.\d}??%)
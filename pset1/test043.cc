@@ -0,0 +1,51 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <vector>
+// Arena allocation, reset, and containers bound to an arena.
+
+int main() {
+    m61_arena* arena = m61_arena_create(4096);
+    assert(arena);
+
+    for (int round = 0; round != 3; ++round) {
+        char* ptrs[100];
+        for (int i = 0; i != 100; ++i) {
+            ptrs[i] = (char*) m61_arena_alloc(arena, i + 1);
+            assert(((uintptr_t) ptrs[i] & 15) == 0);
+            memset(ptrs[i], i, i + 1);
+        }
+        for (int i = 0; i != 100; ++i) {
+            assert(ptrs[i][i] == (char) i);
+        }
+        // an allocation bigger than a chunk
+        char* big = (char*) m61_arena_alloc(arena, 10000);
+        memset(big, 0, 10000);
+
+        std::vector<int, m61_allocator<int>> v{m61_allocator<int>(arena)};
+        for (int i = 0; i != 1000; ++i) {
+            v.push_back(i);
+        }
+
+        m61_statistics stat;
+        m61_get_statistics(&stat);
+        assert(stat.narenas == 1);
+        assert(stat.arena_active_size >= 5050 + 10000 + 4000);
+        m61_arena_reset(arena);
+    }
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.arena_total_size >= 3 * (5050 + 10000 + 4000));
+    printf("arenas %llu, active %llu\n", stat.narenas, stat.arena_active_size);
+    m61_arena_destroy(arena);
+    m61_get_statistics(&stat);
+    printf("arenas %llu, reserved %llu\n", stat.narenas, stat.arena_reserved);
+    m61_print_statistics();
+}
+
+//! arenas 1, active 0
+//! arenas 0, reserved 0
+//! alloc count: active          0   total          0   fail          0
+//! alloc size:  active          0   total          0   fail          0
@@ -0,0 +1,32 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Aligned canaries, guard-page blocks, and heap sweeps.
+
+int main() {
+    m61_check_options opts;
+    m61_get_check_options(&opts);
+    assert(opts.canary_size == 4 && opts.guard_page_min == 0);
+    opts.canary_size = 12;
+    assert(m61_set_check_options(&opts) == -1);
+    opts.canary_size = 16;
+    opts.front_canary = true;
+    opts.guard_page_min = 8192;
+    assert(m61_set_check_options(&opts) == 0);
+
+    // guard-page blocks behave like ordinary blocks
+    for (int i = 0; i != 10; ++i) {
+        char* big = (char*) malloc(10000 + i);
+        memset(big, i, 10000 + i);
+        free(big);
+    }
+    m61_check_heap();
+
+    char* p = (char*) malloc(20);
+    memset(p, 0, 20);
+    p[23] = 1;                    // lands in the padding before the canary
+    m61_check_heap();
+}
+
+//! MEMORY BUG: test044.cc:26: detected wild write in active block ??? allocated here
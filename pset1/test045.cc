@@ -0,0 +1,68 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <atomic>
+#include <thread>
+// Statistics snapshots taken while other threads allocate.
+
+static std::atomic<bool> done{false};
+
+static void work() {
+    for (int round = 0; round != 200; ++round) {
+        void* ptrs[100];
+        for (int i = 0; i != 100; ++i) {
+            ptrs[i] = malloc(8);
+        }
+        for (int i = 0; i != 100; ++i) {
+            free(ptrs[i]);
+        }
+    }
+}
+
+static unsigned long long sum(const unsigned long long* h) {
+    unsigned long long n = 0;
+    for (unsigned i = 0; i != M61_LATENCY_BUCKETS; ++i) {
+        n += h[i];
+    }
+    return n;
+}
+
+static void monitor(unsigned long long* nsnapshots) {
+    while (!done) {
+        m61_statistics stat;
+        m61_get_statistics(&stat);
+        assert(stat.active_size == 8 * stat.nactive);
+        assert(stat.total_size == 8 * stat.ntotal);
+        assert(sum(stat.malloc_latency) <= stat.ntotal);
+        ++*nsnapshots;
+    }
+}
+
+int main() {
+    unsigned long long nsnapshots = 0;
+    std::thread mon(monitor, &nsnapshots);
+    std::thread ths[4];
+    for (int t = 0; t != 4; ++t) {
+        ths[t] = std::thread(work);
+    }
+    for (int t = 0; t != 4; ++t) {
+        ths[t].join();
+    }
+    done = true;
+    mon.join();
+    assert(nsnapshots > 0);
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    // each of the 4 workers times every M61_LATENCY_SAMPLEth call
+    unsigned long long nfree = stat.ntotal - stat.nactive;
+    assert(sum(stat.malloc_latency) <= stat.ntotal
+           && stat.ntotal - sum(stat.malloc_latency) < 4 * M61_LATENCY_SAMPLE);
+    assert(sum(stat.free_latency) <= nfree
+           && nfree - sum(stat.free_latency) < 4 * M61_LATENCY_SAMPLE);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total      80000   fail          0
+//! alloc size:  active          0   total     640000   fail          0
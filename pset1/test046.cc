@@ -0,0 +1,26 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+// Leak summary grouped by allocation site.
+
+int main() {
+    void* ptrs[2000];
+    for (int i = 0; i != 2000; ++i) {
+        ptrs[i] = malloc(10);
+    }
+    for (int i = 0; i != 2000; i += 2) {
+        free(ptrs[i]);
+    }
+    for (int i = 0; i != 5; ++i) {
+        (void) malloc(100);
+    }
+    (void) malloc(2000);
+    m61_print_leak_summary(STDOUT_FILENO);
+}
+
+//! LEAK SUMMARY: test046.cc:11: 10000 bytes in 1000 objects
+//! LEAK SUMMARY: test046.cc:19: 2000 bytes in 1 objects
+//! LEAK SUMMARY: test046.cc:17: 500 bytes in 5 objects
+//! LEAK SUMMARY: total 12500 bytes in 1006 objects
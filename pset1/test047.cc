@@ -0,0 +1,18 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+// Allocation sites with equal file names are interned together.
+
+int main() {
+    char file[] = "site.cc";
+    (void) m61_malloc(10, "site.cc", 1);
+    (void) m61_malloc(20, file, 1);
+    (void) m61_malloc(30, file, 2);
+    m61_print_leak_summary(STDOUT_FILENO);
+}
+
+//! LEAK SUMMARY: site.cc:1: 30 bytes in 2 objects
+//! LEAK SUMMARY: site.cc:2: 30 bytes in 1 objects
+//! LEAK SUMMARY: total 60 bytes in 3 objects
@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+// Realloc in place, by copying, and by mremap; aligned allocation.
+
+int main() {
+    char* p = (char*) realloc(nullptr, 20);
+    memset(p, 'a', 20);
+    char* q = (char*) realloc(p, 24);   // fits in the same size class
+    assert(q == p);
+    memset(q + 20, 'b', 4);
+
+    q = (char*) realloc(q, 100);
+    assert(memcmp(q, "aaaaaaaaaaaaaaaaaaaabbbb", 24) == 0);
+
+    q = (char*) realloc(q, 200000);     // moves to its own mapping
+    memset(q + 100, 'c', 200000 - 100);
+    q = (char*) realloc(q, 400000);     // grows with mremap
+    assert(q[23] == 'b' && q[199999] == 'c');
+    q = (char*) realloc(q, 1000);
+    assert(q[999] == 'c');
+    free(q);
+
+    void* a = aligned_alloc(64, 100);
+    assert(a && ((uintptr_t) a & 63) == 0);
+    void* b;
+    assert(posix_memalign(&b, 3, 10) == EINVAL);
+    assert(posix_memalign(&b, 4096, 10) == 0);
+    assert(((uintptr_t) b & 4095) == 0);
+    free(a);
+    free(b);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total          5   fail          0
+//! alloc size:  active          0   total     400234   fail          0
@@ -0,0 +1,15 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Realloc of a freed pointer.
+
+int main() {
+    void* ptr = malloc(2001);
+    free(ptr);
+    ptr = realloc(ptr, 3000);
+    m61_print_statistics();
+}
+
+//! MEMORY BUG???: invalid realloc of pointer ???, double free
+//! ???
@@ -0,0 +1,36 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Large blocks get their own mappings, which are cached for reuse.
+
+int main() {
+    m61_statistics stat;
+    char* big = (char*) malloc(1 << 20);
+    memset(big, 1, 1 << 20);
+    m61_get_statistics(&stat);
+    assert(stat.nmapped == 1);
+    assert(stat.mapped_size >= (1 << 20) && stat.mapped_size < (1 << 20) + 8192);
+    assert((uintptr_t) big >= stat.heap_min && (uintptr_t) big <= stat.heap_max);
+
+    free(big);
+    m61_get_statistics(&stat);
+    assert(stat.nmapped == 0 && stat.mapped_size == 0);
+    assert(stat.mapped_cached >= (1 << 20));
+
+    char* again = (char*) malloc((1 << 20) - 100);
+    assert(again == big);
+    m61_get_statistics(&stat);
+    assert(stat.nmapped == 1 && stat.mapped_cached == 0);
+    free(again);
+
+    // small blocks stay in the base heap
+    char* small = (char*) malloc(100);
+    m61_get_statistics(&stat);
+    assert(stat.nmapped == 0);
+    free(small);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total          3   fail          0
+//! alloc size:  active          0   total    2097152   fail          0
@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Quarantine keeps freed blocks poisoned and catches later writes.
+
+int main() {
+    m61_check_options opts;
+    m61_get_check_options(&opts);
+    opts.quarantine_bytes = 4096;
+    assert(m61_set_check_options(&opts) == 0);
+
+    // quarantine stays within budget, and blocks are eventually reused
+    for (int i = 0; i != 10000; ++i) {
+        void* ptr = malloc(50);
+        free(ptr);
+    }
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.quarantined > 0 && stat.quarantined <= 4096);
+
+    char* ptr = (char*) malloc(100);
+    free(ptr);
+    ptr[10] = 'x';                  // use after free
+    for (int i = 0; i != 100; ++i) {
+        free(malloc(50));
+    }
+}
+
+//! MEMORY BUG: test051.cc:22: detected write to freed block ??? allocated here
@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Batched allocation and free.
+
+int main() {
+    void* ptrs[100];
+    assert(m61_malloc_batch(100, 40, ptrs, __FILE__, __LINE__) == 100);
+    for (int i = 0; i != 100; ++i) {
+        assert(((uintptr_t) ptrs[i] & 15) == 0);
+        memset(ptrs[i], i, 40);
+    }
+    for (int i = 0; i != 100; ++i) {
+        for (int j = 0; j != 40; ++j) {
+            assert(((unsigned char*) ptrs[i])[j] == i);
+        }
+    }
+    for (int i = 0; i != 100; i += 2) {
+        free(ptrs[i]);
+        ptrs[i] = nullptr;
+    }
+    m61_free_batch(ptrs, 100, __FILE__, __LINE__);
+
+    // large blocks too
+    assert(m61_malloc_batch(3, 200000, ptrs, __FILE__, __LINE__) == 3);
+    m61_free_batch(ptrs, 3, __FILE__, __LINE__);
+    m61_print_statistics();
+    fflush(stdout);
+
+    assert(m61_malloc_batch(2, 40, ptrs, __FILE__, __LINE__) == 2);
+    ptrs[1] = ptrs[0];
+    m61_free_batch(ptrs, 2, __FILE__, __LINE__);
+}
+
+//! alloc count: active          0   total        103   fail          0
+//! alloc size:  active          0   total     604000   fail          0
+//! MEMORY BUG: test052.cc:33: invalid free of pointer ???, double free
@@ -0,0 +1,48 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+// Global operator new and delete route through m61 (links m61new.o).
+
+struct alignas(64) wide {
+    char data[100];
+};
+
+int main() {
+    m61_statistics before, after;
+    m61_get_statistics(&before);
+
+    int* ip = new int(61);
+    delete ip;
+    int* ia = new int[100];
+    delete[] ia;
+    wide* w = new wide;
+    assert(((uintptr_t) w & 63) == 0);
+    delete w;
+    volatile size_t hugesz = (size_t) -1 / 2;
+    char* huge = new (std::nothrow) char[hugesz];
+    assert(!huge);
+    {
+        std::vector<std::string> v;
+        for (int i = 0; i != 10; ++i) {
+            v.push_back(std::string(100, 'a' + i));
+        }
+    }
+
+    m61_get_statistics(&after);
+    assert(after.nactive == before.nactive);
+    assert(after.ntotal - before.ntotal >= 13);
+    assert(after.nfail - before.nfail == 1);
+    printf("ok\n");
+    fflush(stdout);
+
+    // sized delete checks the size
+    int* p = new int;
+    ::operator delete(p, 3);
+}
+
+//! ok
+//! MEMORY BUG: <operator new>:0: invalid free of pointer ???, size 3 does not match allocated size 4
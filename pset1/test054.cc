@@ -0,0 +1,96 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+// Allocation tracing to a binary trace file.
+
+static const char* op_name(unsigned op) {
+    static const char* names[] = {"?", "MALLOC", "CALLOC", "ALIGNED", "FREE"};
+    return op < 5 ? names[op] : "?";
+}
+
+int main() {
+    char filename[] = "/tmp/test054.XXXXXX";
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    close(fd);
+
+    void* before = malloc(1);
+    assert(m61_trace_start(filename) == 0);
+    assert(m61_trace_start(filename) == -1);
+    char* a = (char*) malloc(10);
+    int* b = (int*) calloc(4, sizeof(int));
+    void* c = aligned_alloc(64, 100);
+    a = (char*) realloc(a, 20);
+    void* d[3];
+    assert(m61_malloc_batch(3, 8, d, __FILE__, __LINE__) == 3);
+    m61_free_batch(d, 3, __FILE__, __LINE__);
+    free(b);
+    free(c);
+    free(a);
+    free(before);
+    assert(m61_trace_stop() == 0);
+    assert(m61_trace_stop() == -1);
+    (void) malloc(3);   // not traced
+
+    FILE* f = fopen(filename, "r");
+    assert(f);
+    m61_trace_file_header fh;
+    assert(fread(&fh, sizeof(fh), 1, f) == 1);
+    assert(memcmp(fh.magic, M61_TRACE_MAGIC, 8) == 0
+           && fh.version == M61_TRACE_VERSION
+           && fh.record_size == sizeof(m61_trace_record));
+
+    std::vector<m61_trace_record> recs;
+    m61_trace_record rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1 && rec.op != M61_TRACE_SITES) {
+        recs.push_back(rec);
+    }
+    assert(rec.op == M61_TRACE_SITES);
+    std::vector<std::string> files(rec.size + 1);
+    std::vector<long> lines(rec.size + 1);
+    for (uint64_t i = 0; i != rec.size; ++i) {
+        m61_trace_site ts;
+        assert(fread(&ts, sizeof(ts), 1, f) == 1 && ts.site < rec.size);
+        files[ts.site].resize(ts.file_len);
+        assert(fread(&files[ts.site][0], 1, ts.file_len, f) == ts.file_len);
+        lines[ts.site] = ts.line;
+    }
+    assert(fgetc(f) == EOF);
+    fclose(f);
+    unlink(filename);
+
+    uint64_t last_time = 0;
+    for (auto& r : recs) {
+        assert(r.time >= last_time);
+        last_time = r.time;
+        printf("%s %llu %s:%ld", op_name(r.op), (unsigned long long) r.size,
+               files[r.site].c_str(), lines[r.site]);
+        if (r.op == M61_TRACE_ALIGNED) {
+            printf(" align %u", 1U << r.align_shift);
+        }
+        if (r.ptr == (uintptr_t) a) {
+            printf(" a");
+        }
+        printf("\n");
+    }
+}
+
+//! MALLOC 10 test054.cc:24
+//! CALLOC 16 test054.cc:25
+//! ALIGNED 100 test054.cc:26 align 64
+//! FREE 10 test054.cc:24
+//! MALLOC 20 test054.cc:27 a
+//! MALLOC 8 test054.cc:29
+//! MALLOC 8 test054.cc:29
+//! MALLOC 8 test054.cc:29
+//! FREE 8 test054.cc:29
+//! FREE 8 test054.cc:29
+//! FREE 8 test054.cc:29
+//! FREE 16 test054.cc:25
+//! FREE 100 test054.cc:26
+//! FREE 20 test054.cc:27 a
+//! FREE 1 test054.cc:21
@@ -15,6 +15,8 @@
 #include <cassert>
 #include <cinttypes>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <random>
 #include <algorithm>
 #if defined(_MSDOS) || defined(_WIN32)
@@ -46,6 +48,7 @@ struct elf_info {
     const char* shstrtab() const;
     const char* section_display_name(unsigned i) const;
     uint64_t first_offset() const;
+    bool has_gap(uint64_t start, uint64_t end) const;
     elf_symbol* symtab() const;
     elf_symbol* find_symbol(const char* name, elf_symbol* after = nullptr) const;
     void sort_symtab();
@@ -215,6 +218,25 @@ uint64_t elf_info::first_offset() const {
     return o;
 }
 
+bool elf_info::has_gap(uint64_t start, uint64_t end) const {
+    // true iff file bytes [start, end) belong to no section and not to
+    // the section header table
+    if (end > size_
+        || (eh_->e_shoff < end
+            && eh_->e_shoff + eh_->e_shnum * sizeof(*sht_) > start)) {
+        return false;
+    }
+    for (unsigned i = 0; i != eh_->e_shnum; ++i) {
+        if (sht_[i].sh_type != ELF_SHT_NULL
+            && sht_[i].sh_type != ELF_SHT_NOBITS
+            && sht_[i].sh_offset < end
+            && sht_[i].sh_offset + sht_[i].sh_size > start) {
+            return false;
+        }
+    }
+    return true;
+}
+
 elf_symbol* elf_info::symtab() const {
     if (!symtab_) {
         unsigned i = find_section(".symtab");
@@ -328,6 +350,62 @@ void elf_info::shift_sections(size_t offset, ptrdiff_t diff) {
 }
 
 
+// symindex
+//    The lookup index that `lookup_symbol` binary-searches: named code
+//    and data symbols in address order, as parallel arrays of start
+//    addresses, sizes, and name offsets, followed by a string table
+//    holding just those names. The arrays are laid out in that order,
+//    so the address array, which the search touches most, is dense.
+
+struct symindex {
+    std::vector<uint64_t> addr;
+    std::vector<uint32_t> size;
+    std::vector<uint32_t> name;
+    std::string strtab;
+
+    void build(const elf_info& ei);
+    size_t nbytes() const {
+        return addr.size() * 16 + strtab.size();
+    }
+    void write(char* dst) const;
+};
+
+void symindex::build(const elf_info& ei) {
+    std::unordered_map<std::string, uint32_t> names;
+    strtab.assign(1, '\0');
+    ei.symtab();
+    for (unsigned i = 1; i < ei.nsymtab_; ++i) {
+        auto& sym = ei.symtab_[i];
+        const char* symname = ei.symstrtab_ + sym.st_name;
+        if ((sym.st_info & ELF_STT_MASK) > ELF_STT_FUNC
+            || sym.st_value == 0
+            || sym.st_shndx == ELF_SHN_UNDEF
+            || sym.st_shndx >= ei.eh_->e_shnum
+            || !*symname) {
+            continue;
+        }
+        // `sort_symtab` put these symbols in address order
+        assert(addr.empty() || addr.back() <= sym.st_value);
+        auto it = names.find(symname);
+        if (it == names.end()) {
+            it = names.emplace(symname, strtab.size()).first;
+            strtab.append(symname, strlen(symname) + 1);
+        }
+        addr.push_back(sym.st_value);
+        size.push_back(std::min(sym.st_size, uint64_t(UINT32_MAX)));
+        name.push_back(it->second);
+    }
+}
+
+void symindex::write(char* dst) const {
+    size_t n = addr.size();
+    memcpy(dst, addr.data(), n * 8);
+    memcpy(dst + n * 8, size.data(), n * 4);
+    memcpy(dst + n * 12, name.data(), n * 4);
+    memcpy(dst + n * 16, strtab.data(), strtab.size());
+}
+
+
 static void usage() {
     fprintf(stderr, "Usage: mkchickadeesymtab [-s SYMTABREF] [IMAGE]\n");
     exit(1);
@@ -335,7 +413,8 @@ static void usage() {
 
 static unsigned rewrite_symtabref(elf_info& ei, const char* name,
                                   uint64_t& loadaddr, size_t strtab_off,
-                                  size_t size) {
+                                  size_t size, size_t index_off,
+                                  size_t nindex) {
     auto sym = ei.find_symbol(name);
     unsigned nfound = 0;
     while (sym) {
@@ -367,11 +446,17 @@ static unsigned rewrite_symtabref(elf_info& ei, const char* name,
             elf_symtabref stref;
             memcpy(&stref, ei.data_ + stref_off, sizeof(stref));
 
+            uint64_t index = loadaddr + index_off;
             elf_symtabref xstref = {
                 reinterpret_cast<elf_symbol*>(loadaddr),
                 ei.nsymtab_,
                 reinterpret_cast<char*>(loadaddr + strtab_off),
-                size
+                size,
+                reinterpret_cast<uint64_t*>(index),
+                reinterpret_cast<uint32_t*>(index + nindex * 8),
+                reinterpret_cast<uint32_t*>(index + nindex * 12),
+                reinterpret_cast<char*>(index + nindex * 16),
+                nindex
             };
             if (memcmp(ei.data_ + stref_off, &xstref, sizeof(xstref)) != 0) {
                 memcpy(ei.data_ + stref_off, &xstref, sizeof(xstref));
@@ -494,24 +579,54 @@ int main(int argc, char** argv) {
         }
     }
 
+    // sort symbol table by address
+    ei.sort_symtab();
+
     // figure out allocation range
     uint64_t first_offset = ei.sht_[symtabndx].sh_offset;
     uint64_t strtab_offset = ei.sht_[symtabndx + 1].sh_offset;
-    uint64_t last_offset = ei.sht_[symtabndx + 1].sh_offset
+    uint64_t strtab_end = ei.sht_[symtabndx + 1].sh_offset
         + ei.sht_[symtabndx + 1].sh_size;
 
+    // insert the lookup index after the string table, shifting later
+    // sections by whole pages to keep their alignment. An image this
+    // program already processed holds the same index there; leave it be,
+    // so the image isn't rewritten
+    symindex index;
+    index.build(ei);
+    uint64_t index_offset = (strtab_end + 7) & ~uint64_t(7);
+    uint64_t last_offset = index_offset + index.nbytes();
+    std::string indexdata(last_offset - strtab_end, '\0');
+    index.write(&indexdata[index_offset - strtab_end]);
+    if (!ei.has_gap(strtab_end, last_offset)
+        || memcmp(&ei.data_[strtab_end], indexdata.data(),
+                  indexdata.size()) != 0) {
+        if (strtab_end < ei.size_) {
+            ei.shift_sections(strtab_end,
+                              (last_offset - strtab_end + 0xFFF) & ~0xFFFUL);
+        } else {
+            ei.grow(last_offset);
+            ei.size_ = last_offset;
+        }
+        memcpy(&ei.data_[strtab_end], indexdata.data(), indexdata.size());
+        ei.changed_ = true;
+        if (verbose) {
+            fprintf(stderr, "%s: adding %zu-symbol lookup index\n",
+                    ei.filename_, index.addr.size());
+        }
+    }
+
     // find `lsymtab_name`
     if (!rewrite_symtabref(ei, lsymtab_name, loadaddr,
                            strtab_offset - first_offset,
-                           last_offset - first_offset)
+                           strtab_end - first_offset,
+                           index_offset - first_offset,
+                           index.addr.size())
         && lsymtab_set) {
         fprintf(stderr, "%s: no `%s` symbol found\n", ei.filename_, lsymtab_name);
         exit(1);
     }
 
-    // sort symbol table by address
-    ei.sort_symtab();
-
     // mark symbol table as allocated
     if (loadaddr && !(ei.sht_[symtabndx].sh_flags & ELF_SHF_ALLOC)) {
         ei.sht_[symtabndx].sh_flags |= ELF_SHF_ALLOC;
@@ -70,12 +70,18 @@ struct elf_symbol {
     uint64_t st_size;
 };
 
-// in-memory reference to debug symbol table + string table
+// in-memory reference to debug symbol table + string table, plus a
+// lookup index of the named code and data symbols, sorted by address
 struct elf_symtabref {
     elf_symbol* sym;
     size_t nsym;
     char* strtab;
     size_t size;
+    uint64_t* index_addr;       // start addresses, ascending
+    uint32_t* index_size;       // sizes (0 = unknown)
+    uint32_t* index_name;       // name offsets in `index_strtab`
+    char* index_strtab;
+    size_t nindex;
 };
 
 // Values for elf_header::e_type
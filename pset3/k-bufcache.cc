@@ -0,0 +1,272 @@
+#include "kernel.hh"
+
+// k-bufcache.cc
+//
+//    The RAM disk, the buffer cache in front of it, and the flat file
+//    system behind `sys_read` and `sys_write`.
+
+
+// RAM disk
+//    The disk is `DISK_BLOCKS` blocks of `BLOCKSIZE` bytes, stored in
+//    pages allocated on demand: `disk_alloc` gives a block memory before
+//    it is first written, and a block without memory reads as zeros, so
+//    empty files cost nothing. The buffer cache reaches the disk only
+//    through `disk_read` and `disk_write`, which count whole-block
+//    transfers in `kstats`, so a driver for a real device could take its
+//    place without changing the cache.
+
+#define BLOCKS_PER_PAGE (PAGESIZE / BLOCKSIZE)
+#define DISK_BLOCKS     (1 + NFILES * FILE_BLOCKS)
+#define DISK_PAGES      ((DISK_BLOCKS + BLOCKS_PER_PAGE - 1) / BLOCKS_PER_PAGE)
+
+static char* disk_pages[DISK_PAGES];
+
+// disk_alloc(bn)
+//    Make sure block `bn` has memory. Returns false if memory ran out.
+
+static bool disk_alloc(unsigned bn) {
+    assert(bn < DISK_BLOCKS);
+    char*& dp = disk_pages[bn / BLOCKS_PER_PAGE];
+    if (!dp && (dp = reinterpret_cast<char*>(kalloc(PAGESIZE)))) {
+        memset_page(dp, 0);
+    }
+    return dp != nullptr;
+}
+
+static char* disk_block(unsigned bn) {
+    assert(bn < DISK_BLOCKS);
+    char* dp = disk_pages[bn / BLOCKS_PER_PAGE];
+    return dp ? dp + (bn % BLOCKS_PER_PAGE) * BLOCKSIZE : nullptr;
+}
+
+static void disk_read(unsigned bn, void* buf) {
+    if (const char* data = disk_block(bn)) {
+        memcpy(buf, data, BLOCKSIZE);
+    } else {
+        memset(buf, 0, BLOCKSIZE);
+    }
+    ++this_cpu()->stats.disk_reads;
+}
+
+static void disk_write(unsigned bn, const void* buf) {
+    char* data = disk_block(bn);
+    assert(data);               // see `disk_alloc`
+    memcpy(data, buf, BLOCKSIZE);
+    ++this_cpu()->stats.disk_writes;
+}
+
+
+// Buffer cache
+//    `NBUF` buffers hold recently used disk blocks on an LRU list, most
+//    recently used first. Lookups walk the list from the front, so hot
+//    blocks are found quickly. A miss takes the least recently used
+//    buffer, writing its old block back first if it is dirty. Writes
+//    only dirty their buffer (write-back); a write that replaces a
+//    block's contents skips reading them from disk first. When a CPU is
+//    idle, `schedule` calls `bufcache_writeback` to clean dirty buffers,
+//    so later misses seldom wait for a write. `bufcache_lock` protects
+//    the buffers, the list, and the disk.
+
+#define NBUF 32
+
+struct buffer {
+    unsigned bn;                // block number, or `DISK_BLOCKS` if unused
+    bool dirty;
+    buffer* prev;               // LRU list links
+    buffer* next;
+    char data[BLOCKSIZE];
+};
+
+static buffer bufs[NBUF];
+static buffer* lru_head;        // most recently used
+static buffer* lru_tail;        // least recently used
+static spinlock bufcache_lock;
+
+static void lru_unlink(buffer* b) {
+    (b->prev ? b->prev->next : lru_head) = b->next;
+    (b->next ? b->next->prev : lru_tail) = b->prev;
+}
+
+static void lru_push_front(buffer* b) {
+    b->prev = nullptr;
+    b->next = lru_head;
+    (lru_head ? lru_head->prev : lru_tail) = b;
+    lru_head = b;
+}
+
+
+// bufcache_get(bn, fill)
+//    Return the buffer holding block `bn`, moved to the front of the LRU
+//    list. On a miss, the block is read from disk only if `fill` is true;
+//    otherwise the caller must overwrite every byte it will later read.
+//    Call with `bufcache_lock` held.
+
+static buffer* bufcache_get(unsigned bn, bool fill) {
+    kstats& st = this_cpu()->stats;
+    buffer* b = lru_head;
+    while (b && b->bn != bn) {
+        b = b->next;
+    }
+    if (b) {
+        ++st.bufcache_hits;
+    } else {
+        ++st.bufcache_misses;
+        b = lru_tail;
+        if (b->dirty) {
+            disk_write(b->bn, b->data);
+            b->dirty = false;
+        }
+        b->bn = bn;
+        if (fill) {
+            disk_read(bn, b->data);
+        }
+    }
+    if (b != lru_head) {
+        lru_unlink(b);
+        lru_push_front(b);
+    }
+    return b;
+}
+
+
+// bufcache_writeback()
+//    Write one dirty buffer back to disk, the least recently used first.
+//    Returns true iff a buffer was written. Called by `schedule` when
+//    idle.
+
+bool bufcache_writeback() {
+    spinlock_guard guard(bufcache_lock);
+    for (buffer* b = lru_tail; b; b = b->prev) {
+        if (b->dirty) {
+            disk_write(b->bn, b->data);
+            b->dirty = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// File system
+//    Files are numbered 0 to `NFILES - 1`. Disk block 0 holds the size
+//    of each file, and file `f` owns the `FILE_BLOCKS` blocks starting at
+//    block `1 + f * FILE_BLOCKS`. At boot, each file holds a copy of the
+//    ELF file of the program image with the same number (see
+//    `program_image`), so processes can load program data lazily, and
+//    the other files are empty. Reads and writes go through the buffer
+//    cache, including those of block 0.
+
+static uint32_t* file_sizes(buffer* b) {
+    return reinterpret_cast<uint32_t*>(b->data);
+}
+
+
+// file_read(fileno, off, buf, sz)
+//    Copy up to `sz` bytes of file `fileno`, starting at byte `off`, into
+//    kernel memory at `buf`. Returns the number of bytes copied, which is
+//    less than `sz` only at end of file, or -1 if there is no such file.
+
+ssize_t file_read(unsigned fileno, size_t off, void* buf, size_t sz) {
+    if (fileno >= NFILES) {
+        return -1;
+    }
+    spinlock_guard guard(bufcache_lock);
+    size_t size = file_sizes(bufcache_get(0, true))[fileno];
+    if (off >= size) {
+        return 0;
+    }
+    sz = min(sz, size - off);
+
+    char* dst = reinterpret_cast<char*>(buf);
+    for (size_t pos = off; pos != off + sz; ) {
+        size_t boff = pos % BLOCKSIZE;
+        size_t n = min(BLOCKSIZE - boff, off + sz - pos);
+        buffer* b = bufcache_get(1 + fileno * FILE_BLOCKS + pos / BLOCKSIZE,
+                                 true);
+        memcpy(dst, b->data + boff, n);
+        dst += n;
+        pos += n;
+    }
+    return sz;
+}
+
+
+// file_write(fileno, off, buf, sz)
+//    Copy `sz` bytes from kernel memory at `buf` into file `fileno`,
+//    starting at byte `off` and extending the file if necessary. Returns
+//    the number of bytes copied, which is less than `sz` only if the
+//    file would grow past `FILE_MAXSIZE` or the disk ran out of memory.
+//    Returns -1 if there is no such file or `off` is past the end of the
+//    file, which would leave a hole.
+
+ssize_t file_write(unsigned fileno, size_t off, const void* buf, size_t sz) {
+    if (fileno >= NFILES) {
+        return -1;
+    }
+    spinlock_guard guard(bufcache_lock);
+    size_t size = file_sizes(bufcache_get(0, true))[fileno];
+    if (off > size) {
+        return -1;
+    }
+    sz = min(sz, FILE_MAXSIZE - off);
+
+    const char* src = reinterpret_cast<const char*>(buf);
+    size_t pos = off;
+    while (pos != off + sz) {
+        size_t boff = pos % BLOCKSIZE;
+        size_t n = min(BLOCKSIZE - boff, off + sz - pos);
+        unsigned bn = 1 + fileno * FILE_BLOCKS + pos / BLOCKSIZE;
+        if (!disk_alloc(bn)) {
+            break;
+        }
+        // no need to read a block whose old contents can't be seen again
+        bool fill = boff != 0 || (n != BLOCKSIZE && pos < size);
+        buffer* b = bufcache_get(bn, fill);
+        memcpy(b->data + boff, src, n);
+        b->dirty = true;
+        src += n;
+        pos += n;
+    }
+
+    if (pos > size) {
+        buffer* b = bufcache_get(0, true);
+        file_sizes(b)[fileno] = pos;
+        b->dirty = true;
+    }
+    return pos - off;
+}
+
+
+// init_bufcache()
+//    Format the RAM disk with the program images and set up the empty
+//    buffer cache. Called once, at boot.
+
+void init_bufcache() {
+    bool ok = disk_alloc(0);
+    assert(ok);
+    uint32_t* sizes = reinterpret_cast<uint32_t*>(disk_block(0));
+
+    for (int f = 0; f != NFILES; ++f) {
+        program_image pgm(f);
+        size_t size = pgm.file_size();
+        if (size > FILE_MAXSIZE) {
+            log_printf("program %d does not fit in file %d\n", f, f);
+            size = 0;
+        }
+        for (size_t pos = 0; pos < size; pos += BLOCKSIZE) {
+            unsigned bn = 1 + f * FILE_BLOCKS + pos / BLOCKSIZE;
+            ok = disk_alloc(bn);
+            assert(ok);
+            memcpy(disk_block(bn), pgm.file_data() + pos,
+                   min(size_t(BLOCKSIZE), size - pos));
+        }
+        sizes[f] = size;
+    }
+
+    lru_head = lru_tail = nullptr;
+    for (auto& b : bufs) {
+        b.bn = DISK_BLOCKS;
+        b.dirty = false;
+        lru_push_front(&b);
+    }
+}
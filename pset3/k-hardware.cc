@@ -20,7 +20,6 @@ pcistate pcistate::state;
 static void init_kernel_memory();
 static void init_interrupts();
 static void init_constructors();
-static void init_cpu_hardware();
 static void stash_kernel_data(bool restore);
 extern "C" { extern void exception_entry(); }
 extern "C" { extern void syscall_entry(); }
@@ -40,7 +39,7 @@ void init_hardware() {
     init_constructors();
 
     // initialize this CPU
-    init_cpu_hardware();
+    init_cpu_hardware(&cpus[0]);
 }
 
 
@@ -89,12 +88,14 @@ static void set_gate(x86_64_gatedescriptor* gate, uintptr_t addr,
 }
 
 x86_64_pagetable kernel_pagetable[5];
-static uint64_t gdt_segments[7];
+cpustate cpus[MAXCPU];
+std::atomic<int> ncpu;
 
 void init_kernel_memory() {
     stash_kernel_data(false);
 
     // initialize segment descriptors for kernel code and data
+    uint64_t* gdt_segments = cpus[0].gdt_segments;
     gdt_segments[0] = 0;
     set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
@@ -127,14 +128,12 @@ void init_kernel_memory() {
     kernel_pagetable[1].entry[3] =
         (3UL << 30) | PTE_P | PTE_W | PTE_PS;
 
-    // user-accessible mappings for physical memory,
-    // except that (for debuggability) nullptr is totally inaccessible
-    for (vmiter it(kernel_pagetable);
-         it.va() < MEMSIZE_PHYSICAL;
-         it += PAGESIZE) {
-        if (it.va() != 0) {
-            it.map(it.va(), PTE_P | PTE_W | PTE_U);
-        }
+    // user-accessible mappings for physical memory, written straight into
+    // the level-1 pages, except that (for debuggability) nullptr is
+    // totally inaccessible
+    for (uintptr_t pa = PAGESIZE; pa < MEMSIZE_PHYSICAL; pa += PAGESIZE) {
+        kernel_pagetable[3 + pa / LARGEPAGESIZE].entry[pageindex(pa, 0)] =
+            pa | PTE_P | PTE_W | PTE_U;
     }
 
     wrcr3(kptr2pa(kernel_pagetable));
@@ -191,10 +190,13 @@ void init_constructors() {
 }
 
 
-static x86_64_taskstate taskstate;
+void init_cpu_hardware(cpustate* c) {
+    c->self = c;
+    c->index = c - cpus;
+    c->kstack_top = KERNEL_STACK_TOP - c->index * PAGESIZE;
 
-void init_cpu_hardware() {
     // initialize per-CPU segments
+    uint64_t* gdt_segments = c->gdt_segments;
     gdt_segments[0] = 0;
     set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
@@ -205,15 +207,15 @@ void init_cpu_hardware() {
     set_app_segment(&gdt_segments[SEGSEL_APP_DATA >> 3],
                     X86SEG_W, 3);
     set_sys_segment(&gdt_segments[SEGSEL_TASKSTATE >> 3],
-                    (uintptr_t) &taskstate, sizeof(taskstate),
+                    (uintptr_t) &c->taskstate, sizeof(c->taskstate),
                     X86SEG_TSS, 0);
 
     // taskstate lets the kernel receive interrupts
-    memset(&taskstate, 0, sizeof(taskstate));
-    taskstate.ts_rsp[0] = KERNEL_STACK_TOP;
+    memset(&c->taskstate, 0, sizeof(c->taskstate));
+    c->taskstate.ts_rsp[0] = c->kstack_top;
 
     x86_64_pseudodescriptor gdt, idt;
-    gdt.limit = sizeof(gdt_segments) - 1;
+    gdt.limit = sizeof(c->gdt_segments) - 1;
     gdt.base = (uint64_t) gdt_segments;
     idt.limit = sizeof(interrupt_descriptors) - 1;
     idt.base = (uint64_t) interrupt_descriptors;
@@ -226,9 +228,12 @@ void init_cpu_hardware() {
                    "m" (idt.limit)
                  : "memory", "cc");
 
-    // initialize segments
+    // initialize segments; then point the %gs base at `c` (loading
+    // %gs resets the base, so this order matters)
     asm volatile("movw %%ax, %%fs; movw %%ax, %%gs"
                  : : "a" ((uint16_t) SEGSEL_KERN_DATA));
+    wrmsr(MSR_IA32_GS_BASE, reinterpret_cast<uint64_t>(c));
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
 
 
     // set up control registers
@@ -269,9 +274,53 @@ void init_cpu_hardware() {
 }
 
 
+// init_smp()
+//    Start the application processors with the INIT-SIPI-SIPI sequence,
+//    broadcast to every other CPU. They run `ap_entry`, which
+//    `init_smp` copies to `AP_ENTRY_ADDR`; each claims its CPU index
+//    from `ap_next_cpu`. Waits briefly for the CPUs to come up.
+
+extern "C" { extern char ap_entry[], ap_entry_end[]; }
+std::atomic<int> ap_next_cpu = 1;       // next index for `ap_entry64`
+
+static void delay_cycles(uint64_t n) {
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < n) {
+        pause();
+    }
+}
+
+static void send_ipi_others(lapicstate::ipi_type_t type, int vector = 0) {
+    auto& lapic = lapicstate::get();
+    lapic.ipi_others(type, vector);
+    while (lapic.ipi_pending()) {
+        pause();
+    }
+}
+
+void init_smp() {
+    extern char _kernel_end[];
+    assert((uintptr_t) _kernel_end <= KERNEL_STACK_TOP - MAXCPU * PAGESIZE);
+    assert(size_t(ap_entry_end - ap_entry) <= PAGESIZE);
+    memcpy(pa2kptr<void*>(AP_ENTRY_ADDR), ap_entry, ap_entry_end - ap_entry);
+
+    send_ipi_others(lapicstate::ipi_init);
+    delay_cycles(10000000);
+    for (int i = 0; i != 2; ++i) {
+        send_ipi_others(lapicstate::ipi_startup, AP_ENTRY_ADDR / PAGESIZE);
+        delay_cycles(200000);
+    }
+
+    for (int i = 0; i != 100 && ncpu < MAXCPU; ++i) {
+        delay_cycles(1000000);
+    }
+    log_printf("%d CPUs running\n", ncpu.load());
+}
+
+
 // init_timer(rate)
-//    Set the timer interrupt to fire `rate` times a second. Disables the
-//    timer interrupt if `rate <= 0`.
+//    Set this CPU's timer interrupt to fire `rate` times a second.
+//    Disables the timer interrupt if `rate <= 0`.
 
 void init_timer(int rate) {
     auto& lapic = lapicstate::get();
@@ -289,7 +338,7 @@ void init_timer(int rate) {
 x86_64_pagetable* kalloc_pagetable() {
     x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
     if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pageentry_t) * 512);
+        memset_page(pt, 0);
     }
     return pt;
 }
@@ -339,8 +388,9 @@ bool allocatable_physical_address(uintptr_t pa) {
     return !reserved_physical_address(pa)
         && (pa < KERNEL_START_ADDR
             || pa >= round_up((uintptr_t) _kernel_end, PAGESIZE))
-        && (pa < KERNEL_STACK_TOP - PAGESIZE
+        && (pa < KERNEL_STACK_TOP - MAXCPU * PAGESIZE
             || pa >= KERNEL_STACK_TOP)
+        && (pa < AP_ENTRY_ADDR || pa >= AP_ENTRY_ADDR + PAGESIZE)
         && pa < MEMSIZE_PHYSICAL;
 }
 
@@ -618,13 +668,18 @@ void log_printf(const char* format, ...) {
 // The `mkchickadeesymtab` program fills this structure in.
 #define SYMTAB_ADDR 0x1000000
 elf_symtabref symtab = {
-    reinterpret_cast<elf_symbol*>(SYMTAB_ADDR), 0, nullptr, 0
+    reinterpret_cast<elf_symbol*>(SYMTAB_ADDR), 0, nullptr, 0,
+    nullptr, nullptr, nullptr, nullptr, 0
 };
 
 // lookup_symbol(addr, name, start)
 //    Use the debugging symbol table to look up `addr`. Return the
 //    corresponding symbol name (usually a function name) in `*name`
 //    and the first address in that symbol in `*start`.
+//
+//    This binary-searches the compact address index that
+//    `mkchickadeesymtab` builds, so a lookup touches a few cache lines
+//    of 8-byte addresses rather than whole `elf_symbol`s.
 
 __no_asan
 bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
@@ -634,31 +689,33 @@ bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
             SYMTAB_ADDR | PTE_P | PTE_W | PTE_PS;
     }
 
+    // find the last symbol starting at or before `addr`
     size_t l = 0;
-    size_t r = symtab.nsym;
+    size_t r = symtab.nindex;
     while (l < r) {
         size_t m = l + ((r - l) >> 1);
-        auto& sym = symtab.sym[m];
-        if (sym.st_value <= addr
-            && (m + 1 == symtab.nsym || addr < (&sym)[1].st_value)
-            && (sym.st_size == 0 || addr <= sym.st_value + sym.st_size)) {
-            if (!sym.st_value) {
-                return false;
-            }
-            if (name) {
-                *name = symtab.strtab + sym.st_name;
-            }
-            if (start) {
-                *start = sym.st_value;
-            }
-            return true;
-        } else if (sym.st_value < addr) {
+        if (symtab.index_addr[m] <= addr) {
             l = m + 1;
         } else {
             r = m;
         }
     }
-    return false;
+    if (l == 0) {
+        return false;
+    }
+    --l;
+    uintptr_t symstart = symtab.index_addr[l];
+    uint32_t symsize = symtab.index_size[l];
+    if (symsize != 0 && addr > symstart + symsize) {
+        return false;
+    }
+    if (name) {
+        *name = symtab.index_strtab + symtab.index_name[l];
+    }
+    if (start) {
+        *start = symstart;
+    }
+    return true;
 }
 
 
@@ -741,14 +798,26 @@ int error_vprintf(int cpos, int color, const char* format, va_list val) {
 
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
+//    Check for the user typing a control key. 'a', 'f', 'e', 'b', 's',
+//    and 'd' cause a soft reboot where the kernel runs the allocator
+//    programs, "fork", "forkexit", "syscallbench", "share", or
+//    "filebench", respectively. 'p'
+//    writes the profiler's histogram to `log.txt` (see `profile_dump`).
+//    Control-C or 'q' exit the virtual machine.
 //    Returns key typed or -1 for no key.
 
 int check_keyboard() {
+    // Only one CPU at a time reads the keyboard.
+    static spinlock keyboard_lock;
+    if (!keyboard_lock.try_lock()) {
+        return -1;
+    }
     int c = keyboard_readc();
-    if (c == 'a' || c == 'f' || c == 'e') {
+    keyboard_lock.unlock();
+    if (c == 'a' || c == 'f' || c == 'e' || c == 'b' || c == 's'
+        || c == 'd') {
+        // Stop the other CPUs; the rebooted kernel restarts them.
+        send_ipi_others(lapicstate::ipi_init);
         // Turn off the timer interrupt.
         init_timer(-1);
         // Install a temporary page table to carry us through the
@@ -769,6 +838,12 @@ int check_keyboard() {
             argument = "allocators";
         } else if (c == 'e') {
             argument = "forkexit";
+        } else if (c == 'b') {
+            argument = "syscallbench";
+        } else if (c == 's') {
+            argument = "share";
+        } else if (c == 'd') {
+            argument = "filebench";
         }
         uintptr_t argument_ptr = (uintptr_t) argument;
         assert(argument_ptr < 0x100000000L);
@@ -784,6 +859,8 @@ int check_keyboard() {
         // restart kernel
         asm volatile("movl $0x2BADB002, %%eax; jmp kernel_entry"
                      : : "b" (multiboot_info) : "memory");
+    } else if (c == 'p') {
+        profile_dump();
     } else if (c == 0x03 || c == 'q') {
         poweroff();
     }
@@ -891,6 +968,12 @@ extern uint8_t _binary_obj_p_fork_start[];
 extern uint8_t _binary_obj_p_fork_end[];
 extern uint8_t _binary_obj_p_forkexit_start[];
 extern uint8_t _binary_obj_p_forkexit_end[];
+extern uint8_t _binary_obj_p_syscallbench_start[];
+extern uint8_t _binary_obj_p_syscallbench_end[];
+extern uint8_t _binary_obj_p_share_start[];
+extern uint8_t _binary_obj_p_share_end[];
+extern uint8_t _binary_obj_p_filebench_start[];
+extern uint8_t _binary_obj_p_filebench_end[];
 
 struct ramimage {
     const char* name;
@@ -902,14 +985,20 @@ struct ramimage {
     { "allocator3", _binary_obj_p_allocator3_start, _binary_obj_p_allocator3_end },
     { "allocator4", _binary_obj_p_allocator4_start, _binary_obj_p_allocator4_end },
     { "fork", _binary_obj_p_fork_start, _binary_obj_p_fork_end },
-    { "forkexit", _binary_obj_p_forkexit_start, _binary_obj_p_forkexit_end }
+    { "forkexit", _binary_obj_p_forkexit_start, _binary_obj_p_forkexit_end },
+    { "syscallbench", _binary_obj_p_syscallbench_start, _binary_obj_p_syscallbench_end },
+    { "share", _binary_obj_p_share_start, _binary_obj_p_share_end },
+    { "filebench", _binary_obj_p_filebench_start, _binary_obj_p_filebench_end }
 };
 
 program_image::program_image(int program_number) {
     elf_ = nullptr;
+    size_ = 0;
     if (program_number >= 0
         && size_t(program_number) < sizeof(ramimages) / sizeof(ramimages[0])) {
         elf_ = (elf_header*) ramimages[program_number].begin;
+        size_ = (uint8_t*) ramimages[program_number].end
+            - (uint8_t*) ramimages[program_number].begin;
         assert(elf_->e_magic == ELF_MAGIC);
     } else {
         elf_ = nullptr;
@@ -932,6 +1021,12 @@ uintptr_t program_image::entry() const {
 bool program_image::empty() const {
     return !elf_ || elf_->e_phnum == 0;
 }
+const char* program_image::file_data() const {
+    return reinterpret_cast<const char*>(elf_);
+}
+size_t program_image::file_size() const {
+    return size_;
+}
 static elf_program* elf_header_program(elf_header* elf, bool end) {
     if (elf) {
         elf_program* ph = reinterpret_cast<elf_program*>
@@ -1060,6 +1155,17 @@ static void stash_kernel_data(bool reboot) {
 }
 
 
+// `cpustate` members have fixed offsets
+static_assert(offsetof(cpustate, self) == 0, "cpustate::self has bad offset");
+static_assert(offsetof(cpustate, current) == CPUSTATE_CURRENT,
+              "cpustate::current has bad offset");
+static_assert(offsetof(cpustate, user_cr3) == CPUSTATE_USER_CR3,
+              "cpustate::user_cr3 has bad offset");
+static_assert(offsetof(cpustate, syscall_rsp) == CPUSTATE_SYSCALL_RSP,
+              "cpustate::syscall_rsp has bad offset");
+static_assert(offsetof(cpustate, kstack_top) == CPUSTATE_KSTACK_TOP,
+              "cpustate::kstack_top has bad offset");
+
 // `proc` members have fixed offsets
 static_assert(offsetof(proc, pagetable) == 0, "proc::pagetable has bad offset");
 static_assert(offsetof(proc, state) == 12, "proc::state has bad offset");
@@ -16,10 +16,6 @@ class memusage {
     // shows virtual addresses in the range [0, max_view_va)
     static constexpr uintptr_t max_view_va = 768 * PAGESIZE;
 
-    memusage()
-        : v_(nullptr) {
-    }
-
     // Flag bits for memory types:
     static constexpr unsigned f_kernel = 1;     // kernel-restricted
     static constexpr unsigned f_user = 2;       // user-accessible
@@ -37,95 +33,123 @@ class memusage {
     // both as kernel-only and process-associated.
 
 
-    // refresh the memory map from current state
-    void refresh();
-
     // return the symbol (character & color) associated with `pa`
     uint16_t symbol_at(uintptr_t pa) const;
 
   private:
-    unsigned* v_;
+    // The usage map is maintained incrementally by the `memusage_*`
+    // functions below, which page table changes call, so reading a
+    // frame's flags never walks a page table. `lock_` serializes
+    // updates from different CPUs.
+    static spinlock lock_;
+    static unsigned v_[maxpa / PAGESIZE];       // flags per frame
+    static unsigned ptflags_[NPAGES];           // flags from page tables
+    static uint16_t nmaps_[NPAGES][NPROC];      // # user mappings per pid
+    static uint8_t owner_[NPAGES];              // pid owning a root page
+                                                // table (0 = kernel)
+
+    // recompute the flags for physical page `pn`
+    static void update(uintptr_t pn);
 
-    // add `flags` to the page containing `pa`
-    // This is safe to call even if `pa >= maxpa`.
-    void mark(uintptr_t pa, unsigned flags) {
-        if (pa < maxpa) {
-            v_[pa / PAGESIZE] |= flags;
-        }
-    }
     // return one of the processes set in a mark
     static int marked_pid(unsigned v) {
         return lsb(v >> 2);
     }
     // print an error about a page table
     void page_error(uintptr_t pa, const char* desc, int pid) const;
+
+    friend void memusage_register(x86_64_pagetable*, pid_t);
+    friend void memusage_ptpage(x86_64_pagetable*, uintptr_t);
+    friend void memusage_usermap(x86_64_pagetable*, uintptr_t, int);
+    friend void memusage_free(uintptr_t);
 };
 
+spinlock memusage::lock_;
+unsigned memusage::v_[maxpa / PAGESIZE];
+unsigned memusage::ptflags_[NPAGES];
+uint16_t memusage::nmaps_[NPAGES][NPROC];
+uint8_t memusage::owner_[NPAGES];
 
-// memusage::refresh()
-//    Calculate the current physical usage map, using the current process
-//    table.
 
-void memusage::refresh() {
-    if (!v_) {
-        v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE));
-        assert(v_ != nullptr);
+// memusage::update(pn)
+//    Recompute the flags word for physical page `pn` from its page table
+//    flags and its per-process user mapping counts.
+
+void memusage::update(uintptr_t pn) {
+    unsigned f = ptflags_[pn];
+    for (pid_t pid = 0; pid < NPROC; ++pid) {
+        if (nmaps_[pn][pid] != 0) {
+            f |= f_user | f_process(pid);
+        }
     }
+    v_[pn] = f;
+}
 
-    memset(v_, 0, (maxpa / PAGESIZE) * sizeof(*v_));
 
-    // mark kernel page tables
-    for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
-        mark(it.pa(), f_kernel);
-    }
-    mark(kptr2pa(kernel_pagetable), f_kernel);
-
-    // mark pages accessible from each process's page table
-    bool any = false;
-    for (int pid = 1; pid < NPROC; ++pid) {
-        proc* p = &ptable[pid];
-        if (p->state != P_FREE
-            && p->pagetable
-            && p->pagetable != kernel_pagetable) {
-            any = true;
-
-            for (ptiter it(p); it.va() < VA_LOWEND; it.next()) {
-                mark(it.pa(), f_kernel | f_process(pid));
-            }
-            mark(kptr2pa(p->pagetable), f_kernel | f_process(pid));
-
-            for (vmiter it(p); it.va() < VA_LOWEND; ) {
-                if (it.user()) {
-                    mark(it.pa(), f_user | f_process(pid));
-                    it.next();
-                } else {
-                    it.next_range();
-                }
-            }
-        }
+// memusage_register(pt, pid)
+//    Record that root page table `pt` belongs to process `pid`.
+
+void memusage_register(x86_64_pagetable* pt, pid_t pid) {
+    uintptr_t pn = kptr2pa(pt) / PAGESIZE;
+    assert(pn < NPAGES);
+    spinlock_guard guard(memusage::lock_);
+    memusage::owner_[pn] = pid;
+    memusage::ptflags_[pn] = memusage::f_kernel | memusage::f_process(pid);
+    memusage::update(pn);
+}
+
+
+// memusage_ptpage(pt, pa)
+//    Record that `pa` became a page table page in the page table rooted
+//    at `pt`.
+
+void memusage_ptpage(x86_64_pagetable* pt, uintptr_t pa) {
+    spinlock_guard guard(memusage::lock_);
+    uintptr_t root = kptr2pa(pt) / PAGESIZE;
+    pid_t pid = root < NPAGES ? memusage::owner_[root] : 0;
+    if (pa < MEMSIZE_PHYSICAL) {
+        memusage::ptflags_[pa / PAGESIZE] =
+            memusage::f_kernel | memusage::f_process(pid);
+        memusage::update(pa / PAGESIZE);
     }
+}
 
-    // if no different process page tables, use physical address instead
-    if (!any) {
-        for (vmiter it(kernel_pagetable); it.va() < VA_LOWEND; ) {
-            if (it.user()
-                && it.pa() < MEMSIZE_PHYSICAL
-                && pages[it.pa() / PAGESIZE].used()) {
-                unsigned owner = (it.pa() - PROC_START_ADDR) / 0x40000;
-                mark(it.pa(), f_user | f_process(owner + 1));
-                it.next();
-            } else {
-                it.next_range();
-            }
-        }
+
+// memusage_usermap(pt, pa, delta)
+//    Record that the page table rooted at `pt` gained (`delta == 1`) or
+//    lost (`delta == -1`) a user-accessible mapping of physical page `pa`.
+//    User mappings in the kernel's page tables aren't tracked.
+
+void memusage_usermap(x86_64_pagetable* pt, uintptr_t pa, int delta) {
+    spinlock_guard guard(memusage::lock_);
+    uintptr_t root = kptr2pa(pt) / PAGESIZE;
+    pid_t pid = root < NPAGES ? memusage::owner_[root] : 0;
+    if (pid == 0 || pa >= MEMSIZE_PHYSICAL) {
+        return;
+    }
+    uint16_t& n = memusage::nmaps_[pa / PAGESIZE][pid];
+    assert(delta > 0 || n != 0);
+    n += delta;
+    if (n == (delta > 0 ? 1 : 0)) {
+        memusage::update(pa / PAGESIZE);
     }
+}
+
 
-    // mark my own memory
-    if (any) {
-        mark(kptr2pa(v_), f_kernel);
+// memusage_free(pa)
+//    Record that physical page `pa` was freed; it no longer holds a page
+//    table.
+
+void memusage_free(uintptr_t pa) {
+    if (pa < MEMSIZE_PHYSICAL) {
+        spinlock_guard guard(memusage::lock_);
+        memusage::owner_[pa / PAGESIZE] = 0;
+        memusage::ptflags_[pa / PAGESIZE] = 0;
+        memusage::update(pa / PAGESIZE);
     }
 }
 
+
 void memusage::page_error(uintptr_t pa, const char* desc, int pid) const {
     const char* fmt = pid >= 0
         ? "PAGE TABLE ERROR: %lx: %s (pid %d)\n"
@@ -229,9 +253,8 @@ void console_memviewer(proc* vmp) {
     // Process 0 must never be used.
     assert(ptable[0].state == P_FREE);
 
-    // track physical memory
+    // track physical memory (kept up to date by page table changes)
     static memusage mu;
-    mu.refresh();
 
     // print physical memory
     console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY\n");
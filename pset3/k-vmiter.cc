@@ -69,28 +69,51 @@ int vmiter::try_map(uintptr_t pa, int perm) {
     if (pa == (uintptr_t) -1 && perm == 0) {
         pa = 0;
     }
-    assert(!(va_ & PAGEOFFMASK));
+    // large pages are installed at level 1
+    int target_level = (perm & PTE_P) && (perm & PTE_PS) ? 1 : 0;
+    uintptr_t sz = pageoffmask(target_level) + 1;
+    assert(!(va_ & (sz - 1)));
     if (perm & PTE_P) {
         assert(pa != (uintptr_t) -1);
         assert((pa & PTE_PAMASK) == pa);
+        assert(!(pa & (sz - 1)));
     } else {
         assert(!(pa & PTE_P));
     }
     assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
 
-    while (level_ > 0 && perm) {
+    while (level_ > target_level && perm) {
         assert(!(*pep_ & PTE_P));
         x86_64_pagetable* pt = (x86_64_pagetable*) kalloc(PAGESIZE);
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
+        memset_page(pt, 0);
+        memusage_ptpage(pt_, (uintptr_t) pt);
         *pep_ = (uintptr_t) pt | PTE_P | PTE_W | PTE_U;
         down();
     }
+    assert(level_ >= target_level);
 
-    if (level_ == 0) {
+    // unmapping a large page clears its level-1 entry
+    if (level_ == target_level
+        || (!(perm & PTE_P) && (*pep_ & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))) {
+        assert(!(va_ & pageoffmask(level_)));
+        // tell the memory viewer about changed user mappings
+        x86_64_pageentry_t old = *pep_;
+        uintptr_t oldsz = pageoffmask(level_) + 1;
         *pep_ = pa | perm;
+        if ((old & perm_ & (PTE_P | PTE_U)) == (PTE_P | PTE_U)) {
+            uintptr_t oldpa = old & (level_ ? PTE_PS_PAMASK : PTE_PAMASK);
+            for (uintptr_t off = 0; off != oldsz; off += PAGESIZE) {
+                memusage_usermap(pt_, oldpa + off, -1);
+            }
+        }
+        if ((perm & perm_ & (PTE_P | PTE_U)) == (PTE_P | PTE_U)) {
+            for (uintptr_t off = 0; off != sz; off += PAGESIZE) {
+                memusage_usermap(pt_, pa + off, +1);
+            }
+        }
     }
     return 0;
 }
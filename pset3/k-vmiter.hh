@@ -53,6 +53,9 @@ class vmiter {
     // Map current virtual address to `pa` with permissions `perm`.
     // The current virtual address must be page-aligned. Calls `kalloc`
     // to allocate page table pages if necessary; panics on failure.
+    // If `perm` includes `PTE_PS`, installs a 2MB large page instead: the
+    // virtual address and `pa` must be `LARGEPAGESIZE`-aligned, and no
+    // level-1 page table may already cover the address.
     inline void map(uintptr_t pa, int perm);
     // Same, but map a kernel pointer
     inline void map(void* kptr, int perm);
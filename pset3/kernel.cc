@@ -14,21 +14,68 @@
 //  v                                         v
 // +-----+--------------------+----------------+--------------------+---------/
 // |     | Kernel      Kernel |       :    I/O | App 1        App 1 | App 2
-// |     | Code + Data  Stack |  ...  : Memory | Code + Data  Stack | Code ...
+// |     | Code + Data  Stacks|  ...  : Memory | Code + Data  Stack | Code ...
 // +-----+--------------------+----------------+--------------------+---------/
 // 0  0x40000              0x80000 0xA0000 0x100000             0x140000
 //                                             ^
 //                                             | \___ PROC_SIZE ___/
 //                                      PROC_START_ADDR
+//
+// Each CPU has a one-page kernel stack; the stacks sit just below
+// `KERNEL_STACK_TOP`. The code that starts the other CPUs lives at
+// `AP_ENTRY_ADDR`.
 
 #define PROC_SIZE 0x40000       // initial state only
 
 proc ptable[NPROC];             // array of process descriptors
                                 // Note that `ptable[0]` is never used.
-proc* current;                  // pointer to currently executing proc
+static spinlock ptable_lock;    // protects allocating `ptable` slots
+
+// Each CPU's running process is `current()` (see `cpustate`).
+
+// TLB state
+//    The kernel's mappings below `PROC_START_ADDR` are the same in every
+//    page table, so they are global (`PTE_G`) and survive %cr3 loads. If
+//    the CPU supports process-context IDs, each process's TLB entries are
+//    also tagged with PCID `pid` (the kernel uses PCID 0), so switching
+//    page tables doesn't flush the TLB. Changing a process's page table
+//    marks it stale on every CPU (`tlb_stale`); each CPU flushes the
+//    process's PCID the next time it returns to it. The assembly entry
+//    and exit code loads `kernel_cr3` and the CPU's `user_cr3`.
+
+extern uintptr_t kernel_cr3;    // defined in k-exception.S
+static bool use_pcid;           // true iff PCIDs are enabled
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
-static std::atomic<unsigned long> ticks; // # timer interrupts so far
+static std::atomic<unsigned long> ticks; // # timer interrupts on CPU 0
+
+
+// Scheduler state
+//    Runnable processes wait in a multilevel feedback queue: one FIFO run
+//    queue per priority level, with level 0 the highest. A process at
+//    level `prio` runs for up to `1 << prio` timer ticks. Using up the
+//    slice moves it down a level; yielding early moves it up one, so
+//    processes that mostly yield, like `p-allocator`, stay ahead of
+//    CPU-bound ones. Every `BOOST_TICKS`, all processes return to level 0,
+//    so no process starves. The running process is not on a queue.
+//
+//    Each CPU has its own run queues and time, protected by a spinlock.
+//    A CPU with nothing runnable steals the first process from another
+//    CPU's queues, so processes spread across CPUs.
+
+#define NPRIO 3
+#define BOOST_TICKS HZ
+
+struct runqueue {
+    proc* head;
+    proc* tail;
+};
+struct cpu_runqueues {
+    spinlock lock;
+    runqueue q[NPRIO];
+    unsigned long ticks;        // # timer interrupts on this CPU
+};
+static cpu_runqueues runqs[MAXCPU];
 
 
 // Memory state
@@ -36,27 +83,144 @@ static std::atomic<unsigned long> ticks; // # timer interrupts so far
 //    `pages[pa / PAGESIZE]`. In the handout code, each `pages` entry
 //    holds an `refcount` member, which is 0 for free pages.
 //    You can change this as you see fit.
+//
+//    Allocatable memory is managed by a buddy allocator. Memory is split
+//    into aligned blocks of 2^order pages; the first page of each block
+//    records its `order`. Free blocks are linked, by order, into
+//    doubly-linked free lists through `free_prev` and `free_next`, so a
+//    specific block can be unlinked in constant time. Every page of an
+//    allocated block has a nonzero `refcount`.
+//
+//    `pages_lock` protects the free lists and the zeroed pool below.
+//    Reference counts are atomic, so taking or dropping a reference needs
+//    no lock.
 
+static spinlock pages_lock;
 pageinfo pages[NPAGES];
+static uint16_t free_head[KALLOC_MAXORDER + 1]; // first free block per order
+static unsigned nfree;                          // # free pages
+
+// Per-CPU page caches
+//    Each CPU keeps a small cache of free single pages in front of the
+//    buddy allocator. Only its own CPU touches a cache, and interrupts
+//    are off in the kernel, so single-page `kalloc` and `kfree` usually
+//    take no lock. An empty cache refills `PCACHE_BATCH` pages at once
+//    under `pages_lock`; a full one drains `PCACHE_BATCH` pages back. An
+//    idle CPU drains its whole cache, so free pages don't stay stranded
+//    away from CPUs that need them. Cached pages have refcount 0 but are
+//    not on the free lists.
+
+#define PCACHE_SIZE 16
+#define PCACHE_BATCH 8
+
+struct pagecache {
+    uint16_t pn[PCACHE_SIZE];
+    std::atomic<unsigned> n;
+};
+static pagecache pcaches[MAXCPU];
+
+// Copy-on-write pages
+//    `fork` shares writable user pages between parent and child. Both
+//    mappings become read-only and are marked `PTE_COW`; the first write
+//    takes a page fault, and `cow_fault` gives the writer its own copy.
+
+#define PTE_COW PTE_OS1
+
+// Demand-zero pages
+//    `sys_page_alloc` maps the shared, always-zero `zero_page` copy-on-write
+//    instead of allocating a frame. Reads see zeros for free; the first
+//    write faults, and `cow_fault` allocates and zeroes a private page.
+//    The kernel holds a reference to `zero_page`, so it is never freed,
+//    and every other reference is a page promised to a process. Free
+//    pages on the buddy lists and in the pre-zeroed pool back those
+//    promises: allocations that don't fulfill a promise may not take
+//    them below the number promised (see `kalloc_promised`).
+
+static void* zero_page;
+
+// zero_page_promised()
+//    Return the number of pages promised to demand-zero mappings.
+
+static unsigned zero_page_promised() {
+    return zero_page ? pages[kptr2pa(zero_page) / PAGESIZE].refcount - 1 : 0;
+}
+
+// Pre-zeroed pages
+//    When nothing is runnable, `schedule` zeroes free pages into the
+//    `zeroed_pages` pool (see `idle_zero_page`). `kalloc_zeroed` takes
+//    from the pool when it can, which moves the zeroing for new user
+//    pages off the fault and syscall paths. Pooled pages count as free.
+
+#define NZEROED 32
+static void* zeroed_pages[NZEROED];
+static unsigned nzeroed;
+
+// Shared pages
+//    `sys_share_page` registers a process's page in `shared_pages` and
+//    returns its index, which any process can pass to `sys_map_shared`
+//    to map the same frame. Shared mappings are marked `PTE_SHARED`, so
+//    `fork` leaves them writable and shared instead of copy-on-write.
+//    Each registered frame holds a reference for the table; a slot whose
+//    frame is mapped nowhere else is reused when the table fills up.
+
+#define PTE_SHARED PTE_OS2
+#define NSHARED 16
+static void* shared_pages[NSHARED];
+static spinlock shared_lock;
+
 
+static spinlock memshow_lock;  // see `memshow`
 
 [[noreturn]] void schedule();
 [[noreturn]] void run(proc* p);
 void exception(regstate* regs);
 uintptr_t syscall(regstate* regs);
-void memshow();
+void memshow(bool force = false);
+
+
+// kernel_map_perm(va)
+//    Return the permissions for `va` in the kernel's identity map.
+
+static int kernel_map_perm(uintptr_t va) {
+    if (va == 0) {
+        // nullptr is inaccessible even to the kernel
+        return 0;
+    } else if (va < PROC_START_ADDR && va != CONSOLE_ADDR) {
+        // kernel memory is inaccessible to processes
+        return PTE_P | PTE_W | PTE_G;
+    } else if (va < PROC_START_ADDR) {
+        return PTE_P | PTE_W | PTE_U | PTE_G;
+    } else {
+        return PTE_P | PTE_W | PTE_U;
+    }
+}
 
 
 // kernel_start(command)
 //    Initialize the hardware and processes and start running. The `command`
 //    string is an optional string passed from the boot loader.
 
-static void process_setup(pid_t pid, const char* program_name);
+static void init_kalloc();
+static void init_tlb();
+static uintptr_t proc_cr3(proc* p);
+static void* kalloc_promised(size_t sz, bool promised);
+static void* kalloc_zeroed(bool promised = false);
+static void free_pagetable(x86_64_pagetable* pt);
+static void process_setup(pid_t pid, const program_image& pgm);
+static void sched_setprio(proc* p, int prio);
+static void rq_push(proc* p, int cpuindex);
+static void sched_boost();
+static void init_profile();
 
 void kernel_start(const char* command) {
     // initialize hardware
     init_hardware();
     log_printf("Starting WeensyOS\n");
+    init_kalloc();
+    zero_page = kalloc_zeroed();
+    assert(zero_page);
+    init_bufcache();
+    init_profile();
 
     ticks = 1;
     init_timer(HZ);
@@ -64,34 +228,199 @@ void kernel_start(const char* command) {
     // clear screen
     console_clear();
 
-    // (re-)initialize kernel page table
-    for (vmiter it(kernel_pagetable);
-         it.va() < MEMSIZE_PHYSICAL;
-         it += PAGESIZE) {
-        if (it.va() != 0) {
-            it.map(it.va(), PTE_P | PTE_W | PTE_U);
-        } else {
-            // nullptr is inaccessible even to the kernel
-            it.map(it.va(), 0);
+    // (re-)initialize kernel page table by filling its level-1 pages
+    // (`kernel_pagetable[3]` and `[4]`) directly rather than walking to
+    // each entry; a 2MB range whose pages all get the same permissions
+    // becomes one large page instead
+    static_assert(MEMSIZE_PHYSICAL <= 2 * LARGEPAGESIZE,
+                  "kernel_pagetable has two level-1 pages");
+    for (uintptr_t va = 0; va < MEMSIZE_PHYSICAL; va += LARGEPAGESIZE) {
+        x86_64_pagetable* l1 = &kernel_pagetable[3 + va / LARGEPAGESIZE];
+        uintptr_t end = min(va + LARGEPAGESIZE, uintptr_t(MEMSIZE_PHYSICAL));
+        int perm = kernel_map_perm(va);
+        bool large = perm && end == va + LARGEPAGESIZE;
+        for (uintptr_t a = va; a != end; a += PAGESIZE) {
+            int aperm = kernel_map_perm(a);
+            large = large && aperm == perm;
+            l1->entry[pageindex(a, 0)] = aperm ? a | aperm : 0;
         }
+        kernel_pagetable[2].entry[va / LARGEPAGESIZE] = large
+            ? va | perm | PTE_PS
+            : kptr2pa(l1) | PTE_P | PTE_W | PTE_U;
     }
+    init_tlb();
 
     // set up process descriptors
     for (pid_t i = 0; i < NPROC; i++) {
         ptable[i].pid = i;
         ptable[i].state = P_FREE;
     }
-    if (command && !program_image(command).empty()) {
-        process_setup(1, command);
+    program_image pgm(command ? command : "");
+    if (!pgm.empty()) {
+        process_setup(1, pgm);
     } else {
-        process_setup(1, "allocator");
-        process_setup(2, "allocator2");
-        process_setup(3, "allocator3");
-        process_setup(4, "allocator4");
+        process_setup(1, program_image("allocator"));
+        process_setup(2, program_image("allocator2"));
+        process_setup(3, program_image("allocator3"));
+        process_setup(4, program_image("allocator4"));
+    }
+
+    // Start the other CPUs, then switch to the first process
+    ncpu = 1;
+    init_smp();
+    schedule();
+}
+
+
+// ap_start(cpuindex)
+//    Initialize application processor `cpuindex` and start running
+//    processes on it. Called by `ap_entry64` in `k-exception.S`, on the
+//    CPU's own kernel stack.
+
+void ap_start(int cpuindex) {
+    init_cpu_hardware(&cpus[cpuindex]);
+    init_tlb();
+    init_timer(HZ);
+    ++ncpu;
+    schedule();
+}
+
+
+// free_push(pn, order), free_unlink(pn)
+//    Add the block at page number `pn` to the free list for `order`, or
+//    remove the free block at `pn` from its free list.
+
+static void free_push(uint16_t pn, int order) {
+    pages[pn].order = order;
+    pages[pn].free = true;
+    pages[pn].free_prev = NPAGES;
+    pages[pn].free_next = free_head[order];
+    if (free_head[order] != NPAGES) {
+        pages[free_head[order]].free_prev = pn;
+    }
+    free_head[order] = pn;
+    nfree += 1U << order;
+}
+
+static void free_unlink(uint16_t pn) {
+    pageinfo& pg = pages[pn];
+    assert(pg.free);
+    if (pg.free_prev != NPAGES) {
+        pages[pg.free_prev].free_next = pg.free_next;
+    } else {
+        free_head[pg.order] = pg.free_next;
+    }
+    if (pg.free_next != NPAGES) {
+        pages[pg.free_next].free_prev = pg.free_prev;
+    }
+    pg.free = false;
+    nfree -= 1U << pg.order;
+}
+
+
+// free_block(pn, order)
+//    Return the block of 2^`order` pages at `pn` to the allocator,
+//    merging it with its buddy for as long as the buddy is free too.
+
+static void free_block(uint16_t pn, int order) {
+    while (order < KALLOC_MAXORDER) {
+        uint16_t buddy = pn ^ (1U << order);
+        if (!pages[buddy].free || pages[buddy].order != order) {
+            break;
+        }
+        free_unlink(buddy);
+        pn &= ~(1U << order);
+        ++order;
+    }
+    free_push(pn, order);
+}
+
+
+// init_kalloc()
+//    Build the free lists from every allocatable page. Freeing pages from
+//    the bottom of memory up coalesces them into the largest blocks their
+//    alignment allows.
+
+static void init_kalloc() {
+    for (int order = 0; order <= KALLOC_MAXORDER; ++order) {
+        free_head[order] = NPAGES;
+    }
+    for (uintptr_t pa = 0; pa != MEMSIZE_PHYSICAL; pa += PAGESIZE) {
+        if (allocatable_physical_address(pa)
+            && !pages[pa / PAGESIZE].used()) {
+            free_block(pa / PAGESIZE, 0);
+        }
     }
+}
 
-    // Switch to the first process using run()
-    run(&ptable[1]);
+
+// buddy_alloc(order)
+//    Remove a block of 2^`order` pages from the free lists and return its
+//    first page number, or -1 if no block is large enough. The smallest
+//    nonempty free list that fits supplies the block, and the unused
+//    halves are split off and freed. Call with `pages_lock` held.
+
+static int buddy_alloc(int want) {
+    int order = want;
+    while (order <= KALLOC_MAXORDER && free_head[order] == NPAGES) {
+        ++order;
+    }
+    if (order > KALLOC_MAXORDER) {
+        return -1;
+    }
+    uint16_t pn = free_head[order];
+    free_unlink(pn);
+    while (order > want) {
+        --order;
+        free_push(pn + (1U << order), order);
+    }
+    pages[pn].order = want;
+    return pn;
+}
+
+
+// pcache_refill(pc), pcache_drain(pc, n)
+//    Move up to `PCACHE_BATCH` free pages from the buddy allocator into
+//    this CPU's cache `pc`, or return `n` pages from `pc` to the buddy
+//    allocator. A refill leaves the pages promised to demand-zero
+//    mappings on the free lists.
+
+static void pcache_refill(pagecache& pc) {
+    spinlock_guard guard(pages_lock);
+    unsigned n = pc.n;
+    int pn;
+    while (n != PCACHE_BATCH
+           && nfree + nzeroed > zero_page_promised()
+           && (pn = buddy_alloc(0)) >= 0) {
+        pc.pn[n] = pn;
+        ++n;
+    }
+    pc.n = n;
+}
+
+static void pcache_drain(pagecache& pc, unsigned n) {
+    if (pc.n == 0) {
+        return;
+    }
+    spinlock_guard guard(pages_lock);
+    unsigned pcn = pc.n;
+    for (; n != 0 && pcn != 0; --n) {
+        --pcn;
+        free_block(pc.pn[pcn], 0);
+    }
+    pc.n = pcn;
+}
+
+
+// kalloc_order(sz)
+//    Return the smallest order whose blocks hold `sz` bytes.
+
+static int kalloc_order(size_t sz) {
+    int order = 0;
+    while (((size_t) PAGESIZE << order) < sz) {
+        ++order;
+    }
+    return order;
 }
 
 
@@ -99,88 +428,468 @@ void kernel_start(const char* command) {
 //    Kernel memory allocator. Allocates `sz` contiguous bytes and
 //    returns a pointer to the allocated memory, or `nullptr` on failure.
 //
-//    The returned memory is initialized to 0xCC, which corresponds to
-//    the x86 instruction `int3` (this may help you debug). You'll
-//    probably want to reset it to something more useful.
-//
-//    On WeensyOS, `kalloc` is a page-based allocator: if `sz > PAGESIZE`
-//    the allocation fails; if `sz < PAGESIZE` it allocates a whole page
-//    anyway.
+//    In debug builds (`make KALLOC_DEBUG=1`), the returned memory is
+//    initialized to 0xCC, which corresponds to the x86 instruction `int3`
+//    (this may help you debug). Otherwise its contents are unspecified;
+//    use `kalloc_zeroed` for a zeroed page.
 //
-//    The handout code returns the next allocatable free page it can find.
-//    It checks all pages. (You could maybe make this faster!)
+//    On WeensyOS, `kalloc` is a buddy allocator: it rounds `sz` up to a
+//    power-of-two number of pages, and the result is aligned to that
+//    size. It runs in O(KALLOC_MAXORDER) time however full memory is.
+//    Single pages come from this CPU's page cache when possible. `kalloc`
+//    never takes the free pages promised to demand-zero mappings.
 
 void* kalloc(size_t sz) {
-    if (sz > PAGESIZE) {
+    return kalloc_promised(sz, false);
+}
+
+
+// kalloc_promised(sz, promised)
+//    Like `kalloc`, but if `promised` is true, the allocation fulfills a
+//    promise made by `zero_page_reserve` and may use the promised pages.
+//    Other allocations fail rather than leave fewer free pages than are
+//    promised. Cached pages don't back promises, so the check is only
+//    needed when pages leave the buddy lists or the pre-zeroed pool.
+
+static void* kalloc_promised(size_t sz, bool promised) {
+    if (sz > MEMSIZE_PHYSICAL) {
         return nullptr;
     }
+    int want = kalloc_order(sz);
+    int pn = -1;
+    if (want == 0) {
+        pagecache& pc = pcaches[this_cpu()->index];
+        if (pc.n == 0) {
+            pcache_refill(pc);
+        }
+        if (pc.n != 0) {
+            pn = pc.pn[--pc.n];
+            pages[pn].order = 0;
+        }
+    }
+    if (pn < 0) {
+        spinlock_guard guard(pages_lock);
+        if (!promised
+            && nfree + nzeroed < zero_page_promised() + (1U << want)) {
+            return nullptr;
+        }
+        pn = buddy_alloc(want);
+        if (pn < 0) {
+            // a pre-zeroed page is better than failing
+            if (want != 0 || nzeroed == 0) {
+                return nullptr;
+            }
+            ++this_cpu()->stats.kallocs;
+            return zeroed_pages[--nzeroed];
+        }
+    }
+    ++this_cpu()->stats.kallocs;
 
-    for (uintptr_t pa = 0; pa != MEMSIZE_PHYSICAL; pa += PAGESIZE) {
-        if (allocatable_physical_address(pa)
-            && !pages[pa / PAGESIZE].used()) {
-            ++pages[pa / PAGESIZE].refcount;
-            memset((void*) pa, 0xCC, PAGESIZE);
-            return (void*) pa;
+    for (uint16_t i = 0; i != (1U << want); ++i) {
+        assert(!pages[pn + i].used());
+        pages[pn + i].refcount = 1;
+    }
+    uintptr_t pa = (uintptr_t) pn * PAGESIZE;
+#if KALLOC_DEBUG
+    for (uintptr_t off = 0; off != PAGESIZE << want; off += PAGESIZE) {
+        memset_page((void*) (pa + off), 0xCC);
+    }
+#endif
+    return (void*) pa;
+}
+
+
+// kalloc_zeroed(promised)
+//    Allocate a page of zeroed memory, from the pre-zeroed pool if
+//    possible. Returns `nullptr` on failure. `promised` is as for
+//    `kalloc_promised`.
+
+static void* kalloc_zeroed(bool promised) {
+    if (nzeroed != 0) {
+        spinlock_guard guard(pages_lock);
+        if (nzeroed != 0
+            && (promised || nfree + nzeroed > zero_page_promised())) {
+            ++this_cpu()->stats.kallocs;
+            return zeroed_pages[--nzeroed];
         }
     }
-    return nullptr;
+    void* kp = kalloc_promised(PAGESIZE, promised);
+    if (kp) {
+        memset_page(kp, 0);
+    }
+    return kp;
+}
+
+
+// idle_zero_page()
+//    Zero one free page into the pre-zeroed pool, unless the pool is
+//    full or memory is exhausted. Returns true iff a page was added.
+//    Called by `schedule` when idle.
+
+static bool idle_zero_page() {
+    if (nzeroed == NZEROED) {
+        return false;
+    }
+    void* kp = kalloc(PAGESIZE);
+    if (kp) {
+        memset_page(kp, 0);
+        spinlock_guard guard(pages_lock);
+        if (nzeroed != NZEROED) {
+            zeroed_pages[nzeroed] = kp;
+            ++nzeroed;
+            return true;
+        }
+    }
+    kfree(kp);
+    return false;
 }
 
 
 // kfree(kptr)
 //    Free `kptr`, which must have been previously returned by `kalloc`.
-//    If `kptr == nullptr` does nothing.
+//    If `kptr == nullptr` does nothing. When the reference count of the
+//    block's first page drops to zero, the whole block is freed and
+//    coalesced with its free buddies. Single pages go to this CPU's page
+//    cache instead, unless it is full.
 
 void kfree(void* kptr) {
-    (void) kptr;
-    assert(false /* your code here */);
+    if (!kptr) {
+        return;
+    }
+    ++this_cpu()->stats.kfrees;
+    uintptr_t pa = (uintptr_t) kptr;
+    uint16_t pn = pa / PAGESIZE;
+    assert((pa & PAGEOFFMASK) == 0);
+    assert(allocatable_physical_address(pa));
+    assert(pages[pn].used());
+    if (--pages[pn].refcount != 0) {
+        return;
+    }
+    int order = pages[pn].order;
+    for (uint16_t i = 1; i != (1U << order); ++i) {
+        assert(pages[pn + i].refcount == 1);
+        pages[pn + i].refcount = 0;
+    }
+    for (uint16_t i = 0; i != (1U << order); ++i) {
+        memusage_free((uintptr_t) (pn + i) * PAGESIZE);
+    }
+    if (order == 0) {
+        pagecache& pc = pcaches[this_cpu()->index];
+        if (pc.n == PCACHE_SIZE) {
+            pcache_drain(pc, PCACHE_BATCH);
+        }
+        pc.pn[pc.n] = pn;
+        ++pc.n;
+        return;
+    }
+    spinlock_guard guard(pages_lock);
+    free_block(pn, order);
 }
 
 
-// process_setup(pid, program_name)
-//    Load application program `program_name` as process number `pid`.
-//    This loads the application's code and data into memory, sets its
-//    %rip and %rsp, gives it a stack page, and marks it as runnable.
+// proc_pagetable(pid)
+//    Return a new page table for process `pid` that contains the kernel's
+//    mappings for addresses below `PROC_START_ADDR`, or `nullptr` if out
+//    of memory.
 
-void process_setup(pid_t pid, const char* program_name) {
+static x86_64_pagetable* proc_pagetable(pid_t pid) {
+    x86_64_pagetable* pt = kalloc_pagetable();
+    if (!pt) {
+        return nullptr;
+    }
+    memusage_register(pt, pid);
+    for (vmiter src(kernel_pagetable), dst(pt);
+         src.va() < PROC_START_ADDR;
+         src += PAGESIZE, dst += PAGESIZE) {
+        if (dst.try_map(src.pa(), src.perm()) < 0) {
+            free_pagetable(pt);
+            return nullptr;
+        }
+    }
+    return pt;
+}
+
+
+// free_pagetable(pt)
+//    Unmap everything in process page table `pt`, releasing its user
+//    pages (freeing those no other process shares), then free `pt`'s page
+//    table pages.
+
+static void free_pagetable(x86_64_pagetable* pt) {
+    for (vmiter it(pt); it.va() < MEMSIZE_VIRTUAL; it.next()) {
+        if (it.present()) {
+            void* kp = it.user() && it.va() >= PROC_START_ADDR
+                ? it.kptr() : nullptr;
+            it.map(uintptr_t(0), 0);
+            kfree(kp);
+        }
+    }
+    for (ptiter it(pt); !it.done(); it.next()) {
+        kfree(it.kptr());
+    }
+    kfree(pt);
+}
+
+
+// process_setup(pid, pgm)
+//    Load application program image `pgm` as process number `pid`.
+//    This builds the process's page table, loads the application's code
+//    and data into newly allocated memory, sets its %rip and %rsp, gives
+//    it a stack page at the top of virtual memory, and marks it as
+//    runnable. New pages are zeroed only where no data is copied, so
+//    only bss and page tails cost a `memset`.
+
+void process_setup(pid_t pid, const program_image& pgm) {
     init_process(&ptable[pid], 0);
 
     // initialize process page table
-    ptable[pid].pagetable = kernel_pagetable;
-
-    // obtain reference to the program image
-    program_image pgm(program_name);
+    x86_64_pagetable* pt = proc_pagetable(pid);
+    assert(pt);
+    ptable[pid].pagetable = pt;
+    ptable[pid].tlb_stale = ~0U;
 
-    // allocate and map all memory
+    // allocate and map all memory, then copy instructions and data into
+    // place (segments may share a page)
     for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
+        int perm = PTE_P | PTE_U | (seg.writable() ? PTE_W : 0);
         for (uintptr_t a = round_down(seg.va(), PAGESIZE);
              a < seg.va() + seg.size();
              a += PAGESIZE) {
-            assert(!pages[a / PAGESIZE].used());
-            pages[a / PAGESIZE].refcount = 1;
+            uintptr_t lo = max(a, seg.va());
+            uintptr_t hi = min(a + PAGESIZE, seg.va() + seg.data_size());
+            vmiter it(pt, a);
+            if (!it.present()) {
+                char* kp = (char*) kalloc(PAGESIZE);
+                assert(kp);
+                if (lo < hi) {
+                    memset(kp, 0, lo - a);
+                    memset(kp + (hi - a), 0, a + PAGESIZE - hi);
+                } else {
+                    memset_page(kp, 0);
+                }
+                it.map(kp, perm);
+            } else if (perm & ~it.perm()) {
+                it.map(it.pa(), it.perm() | perm);
+            }
+
+            if (lo < hi) {
+                memcpy(it.kptr<char*>() + (lo - a),
+                       seg.data() + (lo - seg.va()), hi - lo);
+            }
         }
     }
 
-    // copy instructions and data into place
-    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
-        memset((void*) seg.va(), 0, seg.size());
-        memcpy((void*) seg.va(), seg.data(), seg.data_size());
-    }
-
     // mark entry point
     ptable[pid].regs.reg_rip = pgm.entry();
 
     // allocate stack
-    uintptr_t stack_addr = PROC_START_ADDR + PROC_SIZE * pid - PAGESIZE;
-    assert(!pages[stack_addr / PAGESIZE].used());
-    pages[stack_addr / PAGESIZE].refcount = 1;
+    uintptr_t stack_addr = MEMSIZE_VIRTUAL - PAGESIZE;
+    void* stack = kalloc_zeroed();
+    assert(stack);
+    vmiter(pt, stack_addr).map(stack, PTE_P | PTE_W | PTE_U);
     ptable[pid].regs.reg_rsp = stack_addr + PAGESIZE;
 
     // mark process as runnable
     ptable[pid].state = P_RUNNABLE;
+    sched_setprio(&ptable[pid], 0);
+    rq_push(&ptable[pid], (pid - 1) % MAXCPU);
 }
 
 
+// cow_fault(p, addr)
+//    Handle a write fault by process `p` on `addr`. If `addr` is a
+//    copy-on-write page, give `p` a private writable copy (or, if no
+//    other process still shares the page, just make it writable again)
+//    and return true. A demand-zero page gets a freshly zeroed page
+//    rather than a copy. Returns false if `addr` is not copy-on-write or
+//    memory runs out.
+
+static bool cow_fault(proc* p, uintptr_t addr) {
+    vmiter it(p, round_down(addr, PAGESIZE));
+    if (!it.user() || !(it.perm() & PTE_COW)) {
+        return false;
+    }
+    int perm = (it.perm() & ~PTE_COW) | PTE_W;
+    p->tlb_stale = ~0U;
+    if (pages[it.pa() / PAGESIZE].refcount == 1) {
+        it.map(it.pa(), perm);
+        ++this_cpu()->stats.cow_faults;
+        return true;
+    }
+    void* kp;
+    bool demand = it.kptr() == zero_page;
+    if (demand) {
+        // `zero_page_reserve` promised this page
+        kp = kalloc_zeroed(true);
+    } else if ((kp = kalloc(PAGESIZE))) {
+        memcpy(kp, it.kptr(), PAGESIZE);
+    }
+    if (!kp) {
+        return false;
+    }
+    kstats& st = this_cpu()->stats;
+    ++(demand ? st.demand_faults : st.cow_faults);
+    kfree(it.kptr());
+    it.map(kp, perm);
+    return true;
+}
+
+
+
+// Sampling profiler
+//    In profiling builds (`make KPROFILE=1`), every timer interrupt
+//    records the interrupted process and %rip into `prof_samples`, a
+//    ring shared by all CPUs that keeps the latest `NPROFSAMPLES`
+//    samples. Samples taken in the kernel (an idle CPU, since the kernel
+//    otherwise runs with interrupts off) have pid 0. Typing 'p' writes a
+//    histogram to `log.txt` and starts a new profile (see
+//    `profile_dump`). The ring comes from `kalloc` at boot: the kernel
+//    image must end below the kernel stacks (see `kernel.ld`), and a
+//    static ring would not fit.
+
+#if KPROFILE
+#define NPROFSAMPLES 4096
+
+struct prof_sample {
+    pid_t pid;
+    unsigned count;             // samples like this one (`profile_dump`)
+    uintptr_t rip;
+};
+static prof_sample* prof_samples;
+static unsigned long prof_nsamples;
+static spinlock prof_lock;      // protects `prof_samples`, `prof_nsamples`
+#endif
+
+// init_profile()
+//    Allocate the sample ring. Called once, at boot.
+
+static void init_profile() {
+#if KPROFILE
+    prof_samples = reinterpret_cast<prof_sample*>(
+        kalloc(NPROFSAMPLES * sizeof(prof_sample)));
+    if (!prof_samples) {
+        log_printf("profile: no memory for samples\n");
+    }
+#endif
+}
+
+static inline void profile_sample(pid_t pid, uintptr_t rip) {
+#if KPROFILE
+    if (prof_samples) {
+        spinlock_guard guard(prof_lock);
+        prof_samples[prof_nsamples % NPROFSAMPLES] = { pid, 1, rip };
+        ++prof_nsamples;
+    }
+#else
+    (void) pid, (void) rip;
+#endif
+}
+
+
+#if KPROFILE
+// prof_sort(s, n)
+//    Sort samples `s[0]` through `s[n - 1]` by pid and %rip, in place.
+//    A heapsort: it needs no memory and the kernel has no `std::sort`.
+
+static bool prof_less(const prof_sample& a, const prof_sample& b) {
+    return a.pid < b.pid || (a.pid == b.pid && a.rip < b.rip);
+}
+
+static void prof_sift(prof_sample* s, size_t i, size_t n) {
+    while (2 * i + 1 < n) {
+        size_t c = 2 * i + 1;
+        if (c + 1 < n && prof_less(s[c], s[c + 1])) {
+            ++c;
+        }
+        if (!prof_less(s[i], s[c])) {
+            return;
+        }
+        prof_sample tmp = s[i];
+        s[i] = s[c];
+        s[c] = tmp;
+        i = c;
+    }
+}
+
+static void prof_sort(prof_sample* s, size_t n) {
+    for (size_t i = n / 2; i != 0; --i) {
+        prof_sift(s, i - 1, n);
+    }
+    for (size_t end = n; end > 1; --end) {
+        prof_sample tmp = s[0];
+        s[0] = s[end - 1];
+        s[end - 1] = tmp;
+        prof_sift(s, 0, end - 1);
+    }
+}
+#endif
+
+
+// profile_dump()
+//    Write the profiler's samples to `log.txt` as a histogram, most
+//    frequent first. Kernel samples are grouped by function through
+//    `lookup_symbol`; user samples, whose symbols the kernel doesn't
+//    have, are grouped by process and %rip. The samples are counted in
+//    the ring itself, which is then emptied; sampling waits meanwhile.
+
+void profile_dump() {
+#if KPROFILE
+    static spinlock dump_lock;
+    if (!dump_lock.try_lock()) {
+        return;
+    }
+    spinlock_guard guard(prof_lock);
+    unsigned long taken = prof_nsamples;
+    size_t total = prof_samples ? min<unsigned long>(taken, NPROFSAMPLES) : 0;
+
+    // sort the samples so that samples to be counted together are
+    // adjacent, then collapse each run into its first sample
+    for (size_t i = 0; i != total; ++i) {
+        if (prof_samples[i].pid == 0) {
+            lookup_symbol(prof_samples[i].rip, nullptr, &prof_samples[i].rip);
+        }
+    }
+    prof_sort(prof_samples, total);
+    size_t nruns = 0;
+    for (size_t i = 0; i != total; ++i) {
+        if (nruns != 0
+            && !prof_less(prof_samples[nruns - 1], prof_samples[i])) {
+            ++prof_samples[nruns - 1].count;
+        } else {
+            prof_samples[nruns] = prof_samples[i];
+            ++nruns;
+        }
+    }
+
+    log_printf("profile: %lu samples (of %lu taken)\n", total, taken);
+    for (int line = 0; line != 30 && nruns != 0; ++line) {
+        size_t best = 0;
+        for (size_t r = 1; r != nruns; ++r) {
+            if (prof_samples[r].count > prof_samples[best].count) {
+                best = r;
+            }
+        }
+        prof_sample& run = prof_samples[best];
+        if (run.count == 0) {
+            break;
+        }
+        const char* name;
+        if (run.pid == 0 && lookup_symbol(run.rip, &name, nullptr)) {
+            log_printf("  %5u %3lu%%  kernel  %s\n",
+                       run.count, run.count * 100 / total, name);
+        } else {
+            log_printf("  %5u %3lu%%  pid %-3d %p\n",
+                       run.count, run.count * 100 / total, run.pid, run.rip);
+        }
+        run.count = 0;
+    }
+    prof_nsamples = 0;
+    dump_lock.unlock();
+#else
+    log_printf("profile: build with `make KPROFILE=1` to profile\n");
+#endif
+}
+
 
 // exception(regs)
 //    Exception handler (for interrupts, traps, and faults).
@@ -191,10 +900,21 @@ void process_setup(pid_t pid, const char* program_name) {
 //    k-exception.S). That code saves more registers on the kernel's stack,
 //    then calls exception().
 //
-//    Note that hardware interrupts are disabled when the kernel is running.
+//    Note that hardware interrupts are disabled when the kernel is running,
+//    except while an idle CPU waits for work in `schedule`.
+
+static void timer_tick();
+static void kernel_exception(regstate* regs);
 
 void exception(regstate* regs) {
+    // Exceptions in kernel mode return to the interrupted kernel code.
+    if ((regs->reg_cs & 3) == 0) {
+        kernel_exception(regs);
+        return;
+    }
+
     // Copy the saved registers into the `current` process descriptor.
+    proc* current = ::current();
     current->regs = *regs;
     regs = &current->regs;
 
@@ -217,13 +937,26 @@ void exception(regstate* regs) {
     // Actually handle the exception.
     switch (regs->reg_intno) {
 
-    case INT_IRQ + IRQ_TIMER:
-        ++ticks;
-        lapicstate::get().ack();
+    case INT_IRQ + IRQ_TIMER: {
+        profile_sample(current->pid, regs->reg_rip);
+        timer_tick();
+        bool expired = --current->slice == 0;
+        if (expired) {
+            sched_setprio(current, current->prio + 1);
+        }
+        if (runqs[this_cpu()->index].ticks % BOOST_TICKS == 0) {
+            sched_boost();
+        }
+        if (!expired) {
+            break;              // keep running `current`
+        }
         schedule();
         break;                  /* will not be reached */
+    }
 
     case INT_PF: {
+        ++this_cpu()->stats.user_faults;
+
         // Analyze faulting address and access type.
         uintptr_t addr = rdcr2();
         const char* operation = regs->reg_errcode & PFERR_WRITE
@@ -231,9 +964,10 @@ void exception(regstate* regs) {
         const char* problem = regs->reg_errcode & PFERR_PRESENT
                 ? "protection problem" : "missing page";
 
-        if (!(regs->reg_errcode & PFERR_USER)) {
-            panic("Kernel page fault on %p (%s %s)!\n",
-                  addr, operation, problem);
+        if ((regs->reg_errcode & (PFERR_WRITE | PFERR_PRESENT))
+                == (PFERR_WRITE | PFERR_PRESENT)
+            && cow_fault(current, addr)) {
+            break;
         }
         console_printf(CPOS(24, 0), 0x0C00,
                        "Process %d page fault on %p (%s %s, rip=%p)!\n",
@@ -257,6 +991,43 @@ void exception(regstate* regs) {
 }
 
 
+// timer_tick()
+//    Count a timer interrupt on this CPU and acknowledge it.
+
+static void timer_tick() {
+    int index = this_cpu()->index;
+    if (index == 0) {
+        ++ticks;
+    }
+    ++runqs[index].ticks;
+    lapicstate::get().ack();
+}
+
+
+// kernel_exception(regs)
+//    Handle an exception taken in kernel mode. The only expected ones are
+//    timer interrupts that wake an idle CPU halted in `schedule`, so they
+//    count as idle ticks; anything else is a kernel bug.
+
+static void kernel_exception(regstate* regs) {
+    if (regs->reg_intno == INT_IRQ + IRQ_TIMER) {
+        ++this_cpu()->stats.idle_ticks;
+        profile_sample(0, regs->reg_rip);
+        timer_tick();
+    } else if (regs->reg_intno == INT_PF) {
+        ++this_cpu()->stats.kernel_faults;
+        panic("Kernel page fault on %p (%s %s, rip=%p)!\n",
+              rdcr2(), regs->reg_errcode & PFERR_WRITE ? "write" : "read",
+              regs->reg_errcode & PFERR_PRESENT
+              ? "protection problem" : "missing page",
+              regs->reg_rip);
+    } else {
+        panic("Unexpected kernel exception %d at %p!\n",
+              regs->reg_intno, regs->reg_rip);
+    }
+}
+
+
 // syscall(regs)
 //    System call handler.
 //
@@ -264,99 +1035,693 @@ void exception(regstate* regs) {
 //    The return value, if any, is returned to the user process in `%rax`.
 //
 //    Note that hardware interrupts are disabled when the kernel is running.
-
-int syscall_page_alloc(uintptr_t addr);
+//
+//    System calls are dispatched through `syscall_table`. Each entry's
+//    flags say which parts of the usual entry work the call can skip:
+//    `SYSF_NOSAVE` calls never reschedule or read `current->regs`, so the
+//    saved registers aren't copied into `current`; `SYSF_NOSHOW` calls
+//    skip the cursor update, `memshow`, and the keyboard check.
+
+#define SYSF_NOSAVE     0x1
+#define SYSF_NOSHOW     0x2
+
+struct syscall_desc {
+    uintptr_t (*handler)(regstate* regs);
+    int flags;
+};
+
+uintptr_t syscall_getpid(regstate* regs);
+uintptr_t syscall_yield(regstate* regs);
+uintptr_t syscall_panic(regstate* regs);
+uintptr_t syscall_page_alloc(regstate* regs);
+uintptr_t syscall_page_alloc_range(regstate* regs);
+uintptr_t syscall_share_page(regstate* regs);
+uintptr_t syscall_map_shared(regstate* regs);
+uintptr_t syscall_fork(regstate* regs);
+uintptr_t syscall_exit(regstate* regs);
+uintptr_t syscall_getstats(regstate* regs);
+uintptr_t syscall_read(regstate* regs);
+uintptr_t syscall_write(regstate* regs);
+
+// indexed by system call number (see `lib.hh`)
+static const syscall_desc syscall_table[] = {
+    { nullptr, 0 },
+    { syscall_getpid, SYSF_NOSAVE | SYSF_NOSHOW },      // SYSCALL_GETPID
+    { syscall_yield, 0 },                               // SYSCALL_YIELD
+    { syscall_panic, 0 },                               // SYSCALL_PANIC
+    { syscall_page_alloc, SYSF_NOSAVE },                // SYSCALL_PAGE_ALLOC
+    { syscall_fork, 0 },                                // SYSCALL_FORK
+    { syscall_exit, SYSF_NOSAVE },                      // SYSCALL_EXIT
+    { syscall_getstats, SYSF_NOSAVE | SYSF_NOSHOW },    // SYSCALL_GETSTATS
+    { syscall_page_alloc_range, SYSF_NOSAVE },          // SYSCALL_PAGE_ALLOC_RANGE
+    { syscall_share_page, SYSF_NOSAVE },                // SYSCALL_SHARE_PAGE
+    { syscall_map_shared, SYSF_NOSAVE },                // SYSCALL_MAP_SHARED
+    { syscall_read, SYSF_NOSAVE | SYSF_NOSHOW },        // SYSCALL_READ
+    { syscall_write, SYSF_NOSAVE | SYSF_NOSHOW },       // SYSCALL_WRITE
+};
+static_assert(arraysize(syscall_table) == NSYSCALL,
+              "syscall_table is indexed by system call number");
 
 uintptr_t syscall(regstate* regs) {
+    uintptr_t n = regs->reg_rax;
+    const syscall_desc* sc = nullptr;
+    if (n < arraysize(syscall_table) && syscall_table[n].handler) {
+        sc = &syscall_table[n];
+    }
+
     // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    proc* current = ::current();
+    if (!sc || !(sc->flags & SYSF_NOSAVE)) {
+        current->regs = *regs;
+        regs = &current->regs;
+    }
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: syscall %d at rip %p\n",
                   current->pid, regs->reg_rax, regs->reg_rip); */
 
-    // Show the current cursor location and memory state.
-    console_show_cursor(cursorpos);
-    memshow();
+    if (!sc || !(sc->flags & SYSF_NOSHOW)) {
+        // Show the current cursor location and memory state.
+        console_show_cursor(cursorpos);
+        memshow();
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
+        // If Control-C was typed, exit the virtual machine.
+        check_keyboard();
+    }
 
+    // Actually handle the system call.
+    if (!sc) {
+        panic("Unexpected system call %ld!\n", n);
+    }
+    ++this_cpu()->stats.syscalls[n];
+    uintptr_t r = sc->handler(regs);
+    this_cpu()->user_cr3 = proc_cr3(current);
+    return r;
+}
 
-    // Actually handle the exception.
-    switch (regs->reg_rax) {
 
-    case SYSCALL_PANIC:
-        panic(nullptr);         // does not return
+// syscall_getpid(regs), syscall_yield(regs), syscall_panic(regs)
+//    Handle the SYSCALL_GETPID, SYSCALL_YIELD, and SYSCALL_PANIC system
+//    calls.
 
-    case SYSCALL_GETPID:
-        return current->pid;
+uintptr_t syscall_getpid(regstate* regs) {
+    return current()->pid;
+}
 
-    case SYSCALL_YIELD:
-        current->regs.reg_rax = 0;
-        schedule();             // does not return
+uintptr_t syscall_yield(regstate* regs) {
+    regs->reg_rax = 0;
+    sched_setprio(current(), current()->prio - 1);
+    schedule();                 // does not return
+}
 
-    case SYSCALL_PAGE_ALLOC:
-        return syscall_page_alloc(current->regs.reg_rdi);
+uintptr_t syscall_panic(regstate* regs) {
+    panic(nullptr);             // does not return
+}
 
-    default:
-        panic("Unexpected system call %ld!\n", regs->reg_rax);
 
-    }
+// zero_page_reserve(n)
+//    Promise up to `n` free pages to new demand-zero mappings, so that
+//    their first writes cannot run out of memory. Each promise is a
+//    reference to `zero_page`, dropped by `kfree(zero_page)` when the
+//    mapping goes away. Returns the number of pages promised, which is
+//    less than `n` once every free page is already promised. Only pages
+//    on the buddy lists and in the pre-zeroed pool can be promised, since
+//    `kalloc_promised` keeps those from being taken; pages in the
+//    per-CPU caches are not counted.
+
+static unsigned zero_page_reserve(unsigned n) {
+    pageinfo& zpg = pages[kptr2pa(zero_page) / PAGESIZE];
+    spinlock_guard guard(pages_lock);
+    unsigned avail = nfree + nzeroed;
+    unsigned promised = zpg.refcount - 1;
+    n = avail > promised ? min(n, avail - promised) : 0;
+    zpg.refcount += n;
+    return n;
+}
+
 
-    panic("Should not get here!\n");
+// map_zero_page(it)
+//    Map `zero_page` copy-on-write at `it.va()` in place of whatever was
+//    there, using a reference taken by `zero_page_reserve`. Returns 0 on
+//    success; on failure, drops the reference and returns -1.
+
+static int map_zero_page(vmiter& it) {
+    void* old = it.user() ? it.kptr() : nullptr;
+    if (it.try_map(zero_page, PTE_P | PTE_U | PTE_COW) < 0) {
+        kfree(zero_page);
+        return -1;
+    }
+    kfree(old);
+    return 0;
 }
 
 
-// syscall_page_alloc(addr)
+// syscall_page_alloc(regs)
 //    Handles the SYSCALL_PAGE_ALLOC system call. This function
-//    should implement the specification for `sys_page_alloc`
-//    in `u-lib.hh` (but in the handout code, it does not).
+//    implements the specification for `sys_page_alloc` in `u-lib.hh`.
+//    The page is demand-zero: it maps `zero_page` copy-on-write, and a
+//    physical page is allocated only when the process first writes it.
+//    To keep that first write from running out of memory, the call fails
+//    once every free page is already promised to a demand-zero mapping.
+
+uintptr_t syscall_page_alloc(regstate* regs) {
+    uintptr_t addr = regs->reg_rdi;
+    if ((addr & PAGEOFFMASK) != 0
+        || addr < PROC_START_ADDR
+        || addr >= MEMSIZE_VIRTUAL
+        || zero_page_reserve(1) == 0) {
+        return -1;
+    }
+
+    vmiter it(current(), addr);
+    if (map_zero_page(it) < 0) {
+        return -1;
+    }
+    current()->tlb_stale = ~0U;
+    return 0;
+}
+
+
+// syscall_page_alloc_range(regs)
+//    Handles the SYSCALL_PAGE_ALLOC_RANGE system call, which implements
+//    `sys_page_alloc_range` in `u-lib.hh`. Like `syscall_page_alloc`,
+//    but maps up to `%rsi` demand-zero pages starting at `%rdi` in one
+//    kernel entry, walking the range with a single `vmiter`. Stops early
+//    at the end of virtual memory or when memory runs out. Returns the
+//    number of pages mapped, or -1 if the arguments are invalid.
+
+uintptr_t syscall_page_alloc_range(regstate* regs) {
+    uintptr_t addr = regs->reg_rdi;
+    size_t npages = regs->reg_rsi;
+    if ((addr & PAGEOFFMASK) != 0
+        || addr < PROC_START_ADDR
+        || addr >= MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+
+    npages = min(npages, (MEMSIZE_VIRTUAL - addr) / PAGESIZE);
+    unsigned reserved = zero_page_reserve(npages);
+    unsigned n = 0;
+    for (vmiter it(current(), addr); n != reserved; it += PAGESIZE) {
+        if (map_zero_page(it) < 0) {
+            break;
+        }
+        ++n;
+    }
+    // give back the promises of pages never tried (a failed
+    // `map_zero_page` already dropped its own)
+    if (n + 1 < reserved) {
+        pages[kptr2pa(zero_page) / PAGESIZE].refcount -= reserved - n - 1;
+    }
+    if (n != 0) {
+        current()->tlb_stale = ~0U;
+    }
+    return n;
+}
+
+
+// syscall_exit(regs)
+//    Handles the SYSCALL_EXIT system call. Unmaps the process's address
+//    space, dropping its reference to every user page (which frees the
+//    pages no other process shares), frees its page table pages, and
+//    releases its process slot. The system call runs on the kernel's
+//    page table, so freeing the process's is safe. Does not return.
+
+uintptr_t syscall_exit(regstate* regs) {
+    cpustate* c = this_cpu();
+    proc* p = c->current;
+    x86_64_pagetable* pt = p->pagetable;
+    memshow_lock.lock();
+    p->pagetable = nullptr;
+    memshow_lock.unlock();
+    free_pagetable(pt);
+
+    // once `state` is P_FREE, `fork` on another CPU may reuse the slot,
+    // so `schedule` must not see `p` as this CPU's process
+    c->current = nullptr;
+    ptable_lock.lock();
+    p->state = P_FREE;
+    ptable_lock.unlock();
+    schedule();
+}
+
+
+// syscall_share_page(regs)
+//    Handles the SYSCALL_SHARE_PAGE system call, which implements
+//    `sys_share_page` in `u-lib.hh`. A copy-on-write or demand-zero page
+//    first gets a private frame, so later writes by either side are seen
+//    by the other. Returns the page's index in `shared_pages`, or -1.
+
+uintptr_t syscall_share_page(regstate* regs) {
+    uintptr_t addr = regs->reg_rdi;
+    proc* current = ::current();
+    if ((addr & PAGEOFFMASK) != 0
+        || addr < PROC_START_ADDR
+        || addr >= MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+    vmiter it(current, addr);
+    if (!it.user()
+        || (!it.writable() && !cow_fault(current, addr))) {
+        return -1;
+    }
+    void* kp = it.kptr();
+
+    spinlock_guard guard(shared_lock);
+    int slot = -1;
+    for (int i = 0; i != NSHARED; ++i) {
+        if (shared_pages[i] == kp) {
+            return i;
+        } else if (slot < 0
+                   && (!shared_pages[i]
+                       || pages[kptr2pa(shared_pages[i]) / PAGESIZE]
+                          .refcount == 1)) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return -1;
+    }
+    kfree(shared_pages[slot]);
+    ++pages[kptr2pa(kp) / PAGESIZE].refcount;
+    shared_pages[slot] = kp;
+    it.map(kp, it.perm() | PTE_SHARED);
+    return slot;
+}
+
+
+// syscall_map_shared(regs)
+//    Handles the SYSCALL_MAP_SHARED system call, which implements
+//    `sys_map_shared` in `u-lib.hh`: maps shared page `%rdi` writable at
+//    `%rsi`, replacing any page mapped there. Returns 0 or -1.
+
+uintptr_t syscall_map_shared(regstate* regs) {
+    uintptr_t id = regs->reg_rdi;
+    uintptr_t addr = regs->reg_rsi;
+    proc* current = ::current();
+    if (id >= NSHARED
+        || (addr & PAGEOFFMASK) != 0
+        || addr < PROC_START_ADDR
+        || addr >= MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+    shared_lock.lock();
+    void* kp = shared_pages[id];
+    if (kp) {
+        ++pages[kptr2pa(kp) / PAGESIZE].refcount;
+    }
+    shared_lock.unlock();
+    if (!kp) {
+        return -1;
+    }
+
+    vmiter it(current, addr);
+    void* old = it.user() ? it.kptr() : nullptr;
+    if (it.try_map(kp, PTE_PWU | PTE_SHARED) < 0) {
+        kfree(kp);
+        return -1;
+    }
+    current->tlb_stale = ~0U;
+    kfree(old);
+    return 0;
+}
+
+
+// user_range_ok(p, addr, sz, write)
+//    Return true iff the `sz` bytes at `addr` are user memory of process
+//    `p`. If `write` is true, they must also be writable; copy-on-write
+//    and demand-zero pages in the range get private frames first, so the
+//    kernel can write through `vmiter::kptr()`. Checking the whole range
+//    before copying any of it keeps a system call from failing halfway.
 
-int syscall_page_alloc(uintptr_t addr) {
-    assert(!pages[addr / PAGESIZE].used());
-    pages[addr / PAGESIZE].refcount = 1;
-    memset((void*) addr, 0, PAGESIZE);
+static bool user_range_ok(proc* p, uintptr_t addr, size_t sz, bool write) {
+    if (addr < PROC_START_ADDR
+        || addr > MEMSIZE_VIRTUAL
+        || sz > MEMSIZE_VIRTUAL - addr) {
+        return false;
+    }
+    uintptr_t end = addr + sz;
+    for (vmiter it(p, addr); it.va() < end;
+         it.find(round_down(it.va(), PAGESIZE) + PAGESIZE)) {
+        if (!it.user()
+            || (write && !it.writable() && !cow_fault(p, it.va()))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// syscall_getstats(regs)
+//    Handles the SYSCALL_GETSTATS system call: sums every CPU's counters
+//    into the user's `kstats` at `%rdi`. The counters are read without
+//    locks, so a sum may miss increments racing with the call. Returns 0,
+//    or -1 if the buffer is not writable user memory.
+
+static void kstats_sum(kstats& st);
+
+uintptr_t syscall_getstats(regstate* regs) {
+    uintptr_t addr = regs->reg_rdi;
+    proc* current = ::current();
+    if (!user_range_ok(current, addr, sizeof(kstats), true)) {
+        return -1;
+    }
+
+    // the kernel runs on its own page table, so copy through `vmiter`
+    uintptr_t end = addr + sizeof(kstats);
+    kstats st;
+    kstats_sum(st);
+    const char* src = (const char*) &st;
+    for (vmiter it(current, addr); it.va() < end; ) {
+        size_t n = min(end - it.va(), PAGESIZE - (it.va() & PAGEOFFMASK));
+        memcpy(it.kptr(), src, n);
+        src += n;
+        it += n;
+    }
     return 0;
 }
 
+// syscall_read(regs), syscall_write(regs)
+//    Handle the SYSCALL_READ and SYSCALL_WRITE system calls, which
+//    implement `sys_read` and `sys_write` in `u-lib.hh`: file `%rdi`,
+//    buffer `%rsi`, size `%rdx`, file offset `%r10`. The buffer is copied
+//    one page-sized piece at a time through `vmiter`, since the kernel
+//    runs on its own page table.
+
+uintptr_t syscall_read(regstate* regs) {
+    unsigned fileno = regs->reg_rdi;
+    uintptr_t addr = regs->reg_rsi;
+    size_t sz = regs->reg_rdx;
+    size_t off = regs->reg_r10;
+    proc* current = ::current();
+    if (fileno >= NFILES
+        || !user_range_ok(current, addr, sz, true)) {
+        return -1;
+    }
+    size_t n = 0;
+    for (vmiter it(current, addr); n != sz; ) {
+        size_t want = min(sz - n, PAGESIZE - (it.va() & PAGEOFFMASK));
+        ssize_t r = file_read(fileno, off + n, it.kptr(), want);
+        n += r;
+        it += r;
+        if (size_t(r) != want) {
+            break;
+        }
+    }
+    return n;
+}
+
+uintptr_t syscall_write(regstate* regs) {
+    unsigned fileno = regs->reg_rdi;
+    uintptr_t addr = regs->reg_rsi;
+    size_t sz = regs->reg_rdx;
+    size_t off = regs->reg_r10;
+    proc* current = ::current();
+    if (fileno >= NFILES
+        || !user_range_ok(current, addr, sz, false)) {
+        return -1;
+    }
+    size_t n = 0;
+    for (vmiter it(current, addr); n != sz; ) {
+        size_t want = min(sz - n, PAGESIZE - (it.va() & PAGEOFFMASK));
+        ssize_t r = file_write(fileno, off + n, it.kptr(), want);
+        if (r < 0) {
+            return n ? n : -1;
+        }
+        n += r;
+        it += r;
+        if (size_t(r) != want) {
+            break;
+        }
+    }
+    return n;
+}
+
+
+static void kstats_sum(kstats& st) {
+    memset(&st, 0, sizeof(st));
+    for (int i = 0; i < MAXCPU; ++i) {
+        const unsigned long* src = (const unsigned long*) &cpus[i].stats;
+        unsigned long* dst = (unsigned long*) &st;
+        for (size_t j = 0; j != sizeof(kstats) / sizeof(long); ++j) {
+            dst[j] += src[j];
+        }
+    }
+}
+
+
+// syscall_fork(regs)
+//    Handles the SYSCALL_FORK system call. The child gets a copy of the
+//    parent's registers and shares all of its user pages; writable pages
+//    become copy-on-write in both processes, so fork costs only the new
+//    page table. Returns the child's pid to the parent and 0 to the
+//    child, or -1 if no process slot or memory is available. Each
+//    demand-zero page the child inherits is a new promise of a free page
+//    (see `zero_page_reserve`), so fork fails if those can't be promised.
+
+uintptr_t syscall_fork(regstate* regs) {
+    // claim a free process slot
+    proc* current = ::current();
+    pid_t pid = 1;
+    ptable_lock.lock();
+    while (pid < NPROC && ptable[pid].state != P_FREE) {
+        ++pid;
+    }
+    if (pid != NPROC) {
+        ptable[pid].state = P_BLOCKED;
+    }
+    ptable_lock.unlock();
+    if (pid == NPROC) {
+        return -1;
+    }
+
+    x86_64_pagetable* pt = proc_pagetable(pid);
+    if (!pt) {
+        ptable[pid].state = P_FREE;
+        return -1;
+    }
+    for (vmiter it(current, PROC_START_ADDR), child(pt, PROC_START_ADDR);
+         it.va() < MEMSIZE_VIRTUAL;
+         it.next(), child.find(it.va())) {
+        if (!it.user()) {
+            continue;
+        }
+        int perm = it.perm();
+        if ((perm & PTE_W) && !(perm & PTE_SHARED)) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            it.map(it.pa(), perm);
+            current->tlb_stale = ~0U;
+        }
+        bool zero = it.kptr() == zero_page;
+        if (zero && zero_page_reserve(1) == 0) {
+            free_pagetable(pt);
+            ptable[pid].state = P_FREE;
+            return -1;
+        }
+        if (child.try_map(it.pa(), perm) < 0) {
+            if (zero) {
+                kfree(zero_page);
+            }
+            free_pagetable(pt);
+            ptable[pid].state = P_FREE;
+            return -1;
+        }
+        if (!zero) {
+            ++pages[it.pa() / PAGESIZE].refcount;
+        }
+    }
+
+    proc* p = &ptable[pid];
+    p->pagetable = pt;
+    p->tlb_stale = ~0U;
+    p->regs = *regs;
+    p->regs.reg_rax = 0;
+    p->state = P_RUNNABLE;
+    sched_setprio(p, current->prio);
+    rq_push(p, this_cpu()->index);
+    return pid;
+}
+
+
+// rq_push(p, cpuindex), rq_pop(cpuindex)
+//    Append `p` to the run queue for its priority level on CPU
+//    `cpuindex` (unless it's already queued), or remove and return the
+//    first process in CPU `cpuindex`'s highest nonempty run queue
+//    (`nullptr` if all its queues are empty).
+
+static void rq_push(proc* p, int cpuindex) {
+    cpu_runqueues& rqs = runqs[cpuindex];
+    spinlock_guard guard(rqs.lock);
+    if (p->queued) {
+        return;
+    }
+    runqueue& rq = rqs.q[p->prio];
+    p->rq_next = nullptr;
+    p->queued = true;
+    if (rq.tail) {
+        rq.tail->rq_next = p;
+    } else {
+        rq.head = p;
+    }
+    rq.tail = p;
+}
+
+static proc* rq_pop(int cpuindex) {
+    cpu_runqueues& rqs = runqs[cpuindex];
+    spinlock_guard guard(rqs.lock);
+    for (int prio = 0; prio < NPRIO; ++prio) {
+        runqueue& rq = rqs.q[prio];
+        if (proc* p = rq.head) {
+            rq.head = p->rq_next;
+            if (!rq.head) {
+                rq.tail = nullptr;
+            }
+            p->queued = false;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+
+// sched_setprio(p, prio)
+//    Move process `p` to priority level `prio` and give it a full time
+//    slice for that level. If `p` is queued, it changes queues the next
+//    time it is pushed.
+
+static void sched_setprio(proc* p, int prio) {
+    p->prio = max(0, min(prio, NPRIO - 1));
+    p->slice = 1U << p->prio;
+}
+
+
+// sched_boost()
+//    Return this CPU's current process and every process on its run
+//    queues to priority level 0, appending the lower queues to level 0
+//    in priority order.
+
+static void sched_boost() {
+    cpu_runqueues& rqs = runqs[this_cpu()->index];
+    spinlock_guard guard(rqs.lock);
+    sched_setprio(current(), 0);
+    for (int prio = 0; prio < NPRIO; ++prio) {
+        for (proc* p = rqs.q[prio].head; p; p = p->rq_next) {
+            sched_setprio(p, 0);
+        }
+        if (prio == 0 || !rqs.q[prio].head) {
+            continue;
+        }
+        if (rqs.q[0].tail) {
+            rqs.q[0].tail->rq_next = rqs.q[prio].head;
+        } else {
+            rqs.q[0].head = rqs.q[prio].head;
+        }
+        rqs.q[0].tail = rqs.q[prio].tail;
+        rqs.q[prio].head = rqs.q[prio].tail = nullptr;
+    }
+}
+
 
 // schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Put this CPU's current process, if runnable, at the back of its run
+//    queue, then run the first runnable process from the highest
+//    nonempty run queue. If this CPU's queues are empty, steals a
+//    process from another CPU's. Processes found on a queue that are no
+//    longer runnable are dropped. If there are no runnable processes,
+//    zeroes free pages for later allocations and writes dirty buffers
+//    back to disk, then halts until the next interrupt.
 
 void schedule() {
-    pid_t pid = current->pid;
-    for (unsigned spins = 1; true; ++spins) {
-        pid = (pid + 1) % NPROC;
-        if (ptable[pid].state == P_RUNNABLE) {
-            run(&ptable[pid]);
+    cpustate* c = this_cpu();
+    proc* prev = c->current;
+    if (prev && prev->state == P_RUNNABLE) {
+        rq_push(prev, c->index);
+    }
+    // once queued, `current` may start running on another CPU
+    c->current = nullptr;
+
+    while (true) {
+        for (int i = 0; i < MAXCPU; ++i) {
+            while (proc* p = rq_pop((c->index + i) % MAXCPU)) {
+                if (p->state == P_RUNNABLE) {
+                    if (p != prev) {
+                        ++c->stats.context_switches;
+                    }
+                    run(p);
+                }
+            }
         }
 
         // If Control-C was typed, exit the virtual machine.
         check_keyboard();
 
-        // If spinning forever, show the memviewer.
-        if (spins % (1 << 12) == 0) {
+        // Nothing is runnable, so do some useful work, and give this
+        // CPU's cached pages back to the others.
+        bool worked = idle_zero_page();
+        worked = bufcache_writeback() || worked;
+        pcache_drain(pcaches[c->index], PCACHE_SIZE);
+
+        // With no work left, show the memviewer and sleep until an
+        // interrupt, at the latest this CPU's next timer tick. `sti` takes
+        // effect after the following instruction, so no interrupt can
+        // slip in before the `hlt`.
+        if (!worked) {
             memshow();
-            log_printf("%u\n", spins);
+            asm volatile("sti; hlt; cli" : : : "memory");
         }
     }
 }
 
 
+// init_tlb()
+//    Enable global pages on this CPU, and PCIDs if the CPU has them
+//    (CPUID leaf 1, %ecx bit 17). Call on each CPU after building the
+//    kernel page table.
+
+static void init_tlb() {
+    uint64_t cr4 = rdcr4() | CR4_PGE;
+    use_pcid = (cpuid(1).ecx & (1U << 17)) != 0;
+    if (use_pcid) {
+        cr4 |= CR4_PCIDE;
+    }
+    wrcr4(cr4);
+    kernel_cr3 = kptr2pa(kernel_pagetable) | (use_pcid ? CR3_NOFLUSH : 0);
+}
+
+
+// proc_cr3(p)
+//    Return the %cr3 value that switches this CPU to process `p`'s page
+//    table, flushing `p`'s old TLB entries if its page table changed
+//    since this CPU last ran it.
+
+static uintptr_t proc_cr3(proc* p) {
+    unsigned cpumask = 1U << this_cpu()->index;
+    uintptr_t cr3 = kptr2pa(p->pagetable);
+    if (use_pcid) {
+        cr3 |= p->pid & CR3_PCIDMASK;
+        if (!(p->tlb_stale & cpumask)) {
+            cr3 |= CR3_NOFLUSH;
+        }
+    }
+    p->tlb_stale &= ~cpumask;
+    return cr3;
+}
+
+
 // run(p)
-//    Run process `p`. This involves setting `current = p` and calling
-//    `exception_return` to restore its page table and registers.
+//    Run process `p` on this CPU. This involves setting `current()` to
+//    `p` and calling `exception_return` to restore its page table and
+//    registers.
 
 void run(proc* p) {
     assert(p->state == P_RUNNABLE);
-    current = p;
+    cpustate* c = this_cpu();
+    c->current = p;
 
     // Check the process's current pagetable.
     check_pagetable(p->pagetable);
+    c->user_cr3 = proc_cr3(p);
 
     // This function is defined in k-exception.S. It restores the process's
     // registers then jumps back to user mode.
@@ -368,15 +1733,28 @@ void run(proc* p) {
 }
 
 
-// memshow()
-//    Draw a picture of memory (physical and virtual) on the CGA console.
+// memshow(force)
+//    Draw a picture of memory (physical and virtual) on the CGA console,
+//    with a line of kernel counters (see `sys_getstats`) between them.
 //    Switches to a new process's virtual memory map every 0.25 sec.
 //    Uses `console_memviewer()`, a function defined in `k-memviewer.cc`.
+//
+//    Redrawing walks every process's page table, so unless `force` is
+//    true, `memshow` redraws at most once per timer tick; other calls
+//    return right away. Only one CPU draws at a time; the others skip
+//    the redraw. `memshow_lock` also keeps `sys_exit` from freeing a
+//    page table while it is being drawn.
 
-void memshow() {
+void memshow(bool force) {
     static unsigned last_ticks = 0;
+    static unsigned long drawn_ticks = 0;
     static int showing = 0;
 
+    if ((!force && ticks == drawn_ticks) || !memshow_lock.try_lock()) {
+        return;
+    }
+    drawn_ticks = ticks;
+
     // switch to a new process every 0.25 sec
     if (last_ticks == 0 || ticks - last_ticks >= HZ / 2) {
         last_ticks = ticks;
@@ -395,4 +1773,18 @@ void memshow() {
 
     extern void console_memviewer(proc* vmp);
     console_memviewer(p);
+
+    // kernel counters go on the blank row between the two maps
+    kstats st;
+    kstats_sum(st);
+    unsigned long nsyscalls = 0;
+    for (auto n : st.syscalls) {
+        nsyscalls += n;
+    }
+    console_printf(CPOS(9, 0), 0x0700,
+                   "sys %-7lu pf %-6lu cow %-6lu dz %-6lu cs %-7lu "
+                   "idle %-7lu",
+                   nsyscalls, st.user_faults, st.cow_faults,
+                   st.demand_faults, st.context_switches, st.idle_ticks);
+    memshow_lock.unlock();
 }
@@ -2,6 +2,7 @@
 #define WEENSYOS_KERNEL_HH
 #include "x86-64.h"
 #include "lib.hh"
+#include <atomic>
 #if WEENSYOS_PROCESS
 #error "kernel.hh should not be used by process code."
 #endif
@@ -28,6 +29,13 @@ struct proc {
     int state;                          // process state (see above)
     regstate regs;                      // process's current registers
     // The first 4 members of `proc` must not change, but you can add more.
+
+    int prio;                           // scheduling level (0 = highest)
+    unsigned slice;                     // timer ticks left in time slice
+    proc* rq_next;                      // next process in run queue
+    bool queued;                        // true iff on a run queue
+    unsigned tlb_stale;                 // bitmask of CPUs whose TLB may
+                                        // hold stale entries for `pagetable`
 };
 
 // Process table
@@ -37,9 +45,17 @@ extern proc ptable[NPROC];
 
 // Kernel start address
 #define KERNEL_START_ADDR       0x40000
-// Top of the kernel stack
+// Top of the kernel stack for CPU 0. CPU `i`'s one-page stack is the
+// page below `KERNEL_STACK_TOP - i * PAGESIZE`.
 #define KERNEL_STACK_TOP        0x80000
 
+// Maximum number of CPUs
+#define MAXCPU                  4
+
+// Physical address of the application processor startup code (see
+// `init_smp`). Must be page-aligned and below 1MB.
+#define AP_ENTRY_ADDR           0x8000
+
 // First application-accessible address
 #define PROC_START_ADDR         0x100000
 
@@ -47,12 +63,19 @@ extern proc ptable[NPROC];
 #define MEMSIZE_PHYSICAL        0x200000
 // Number of physical pages
 #define NPAGES                  (MEMSIZE_PHYSICAL / PAGESIZE)
+// Largest buddy allocator order (a block of 2^KALLOC_MAXORDER pages)
+#define KALLOC_MAXORDER         9
+static_assert((1 << KALLOC_MAXORDER) == NPAGES, "buddy orders cover memory");
 
 // Virtual memory size
 #define MEMSIZE_VIRTUAL         0x300000
 
 struct pageinfo {
-    uint8_t refcount;
+    std::atomic<uint16_t> refcount;
+    uint8_t order;              // block heads: block is 2^order pages
+    bool free;                  // true iff this page heads a free block
+    uint16_t free_prev;         // free list links, as page numbers;
+    uint16_t free_next;         // `NPAGES` ends the list
 
     bool used() const {
         return this->refcount != 0;
@@ -61,6 +84,91 @@ struct pageinfo {
 extern pageinfo pages[NPAGES];
 
 
+// Per-CPU state
+//    Each CPU has its own kernel stack, segment descriptors, and task
+//    state, and tracks the process it is running. While the kernel runs,
+//    the %gs base register points at the CPU's `cpustate`; the `swapgs`
+//    instruction exchanges it with the process's %gs base on entry and
+//    exit. The first members have fixed offsets for the assembly code.
+//    Each `cpustate` starts on its own cache line, so one CPU's counters
+//    don't bounce another CPU's line.
+
+struct alignas(64) cpustate {
+    cpustate* self;                     // this structure
+    proc* current;                      // process running on this CPU
+    uintptr_t user_cr3;                 // %cr3 for the next return to user
+    uintptr_t syscall_rsp;              // saved user %rsp in `syscall_entry`
+    uintptr_t kstack_top;               // top of this CPU's kernel stack
+    // The first 5 members of `cpustate` must not change.
+
+    int index;                          // index in `cpus`
+    uint64_t gdt_segments[7];
+    x86_64_taskstate taskstate;
+    kstats stats;                       // this CPU's counters
+};
+
+#define CPUSTATE_CURRENT        8       // offsetof(cpustate, current)
+#define CPUSTATE_USER_CR3       16      // offsetof(cpustate, user_cr3)
+#define CPUSTATE_SYSCALL_RSP    24      // offsetof(cpustate, syscall_rsp)
+#define CPUSTATE_KSTACK_TOP     32      // offsetof(cpustate, kstack_top)
+
+extern cpustate cpus[MAXCPU];
+extern std::atomic<int> ncpu;           // # CPUs that have started
+
+// this_cpu()
+//    Return the `cpustate` for the CPU running this code.
+inline cpustate* this_cpu() {
+    cpustate* c;
+    asm("movq %%gs:0, %0" : "=r" (c));
+    return c;
+}
+
+// current()
+//    Return the process running on this CPU.
+inline proc* current() {
+    return this_cpu()->current;
+}
+
+
+// spinlock
+//    A test-and-test-and-set lock. Interrupts are disabled whenever the
+//    kernel runs, so a CPU holding a spinlock is never preempted.
+
+struct spinlock {
+    void lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                pause();
+            }
+        }
+    }
+    bool try_lock() {
+        return !locked_.load(std::memory_order_relaxed)
+            && !locked_.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+
+  private:
+    std::atomic<bool> locked_;
+};
+
+struct spinlock_guard {
+    explicit spinlock_guard(spinlock& lk)
+        : lk_(lk) {
+        lk_.lock();
+    }
+    ~spinlock_guard() {
+        lk_.unlock();
+    }
+    NO_COPY_OR_ASSIGN(spinlock_guard)
+
+  private:
+    spinlock& lk_;
+};
+
+
 // Segment selectors
 #define SEGSEL_BOOT_CODE        0x8             // boot code segment
 #define SEGSEL_KERN_CODE        0x8             // kernel code segment
@@ -84,9 +192,20 @@ extern pageinfo pages[NPAGES];
 //    and writable to both kernel and application code.
 void init_hardware();
 
+// init_cpu_hardware(c)
+//    Initialize the CPU running this code, which becomes `c`: load its
+//    segments and task state, set up `syscall` and its local APIC, and
+//    point %gs at `c`. `init_hardware` does this for CPU 0.
+void init_cpu_hardware(cpustate* c);
+
+// init_smp()
+//    Start the other CPUs. Each runs `ap_entry` in `k-exception.S`, then
+//    `ap_start` in the kernel, on its own kernel stack.
+void init_smp();
+
 // init_timer(rate)
-//    Set the timer interrupt to fire `rate` times a second. Disables the
-//    timer interrupt if `rate <= 0`.
+//    Set this CPU's timer interrupt to fire `rate` times a second.
+//    Disables the timer interrupt if `rate <= 0`.
 void init_timer(int rate);
 
 
@@ -123,6 +242,16 @@ void set_pagetable(x86_64_pagetable* pagetable);
 //    table. Panic if any of the invariants are false.
 void check_page_table_mappings(x86_64_pagetable* pagetable);
 
+// memusage_register(pt, pid), memusage_ptpage(pt, pa),
+// memusage_usermap(pt, pa, delta), memusage_free(pa)
+//    Keep the memory viewer's usage map current (see `k-memviewer.cc`).
+//    Register a process's root page table before mapping anything in it;
+//    `vmiter::try_map` and `kfree` report the rest.
+void memusage_register(x86_64_pagetable* pt, pid_t pid);
+void memusage_ptpage(x86_64_pagetable* pt, uintptr_t pa);
+void memusage_usermap(x86_64_pagetable* pt, uintptr_t pa, int delta);
+void memusage_free(uintptr_t pa);
+
 // poweroff
 //    Turn off the virtual machine.
 [[noreturn]] void poweroff();
@@ -163,9 +292,10 @@ int keyboard_readc();
 #define KEY_DELETE      0311
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
+//    Check for the user typing a control key. 'a', 'f', 'e', 'b', 's', and
+//    'd' cause a soft reboot where the kernel runs the allocator programs,
+//    "fork", "forkexit", "syscallbench", "share", or "filebench",
+//    respectively. Control-C or 'q' exit the virtual machine.
 //    Returns key typed or -1 for no key.
 int check_keyboard();
 
@@ -200,8 +330,13 @@ struct program_image {
     // Return the user virtual address of the entry point instruction.
     uintptr_t entry() const;
 
+    // Return the image's whole ELF file, and its size in bytes.
+    const char* file_data() const;
+    size_t file_size() const;
+
   private:
     elf_header* elf_;
+    size_t size_;
 };
 
 struct program_image_segment {
@@ -253,6 +388,21 @@ void log_backtrace(const char* prefix, uintptr_t rsp, uintptr_t rbp);
 __no_asan
 bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start);
 
+// profile_dump
+//    Write a histogram of the timer-interrupt profiler's samples to the
+//    host's `log.txt` file. Profiling is on in `make KPROFILE=1` builds.
+void profile_dump();
+
+
+// init_bufcache, file_read, file_write, bufcache_writeback
+//    The RAM disk, buffer cache, and file system (see `k-bufcache.cc`).
+//    `file_read` and `file_write` copy to and from kernel memory and
+//    return the number of bytes copied, or -1 on error.
+void init_bufcache();
+ssize_t file_read(unsigned fileno, size_t off, void* buf, size_t sz);
+ssize_t file_write(unsigned fileno, size_t off, const void* buf, size_t sz);
+bool bufcache_writeback();
+
 
 // error_vprintf, error_printf
 //    Print debugging messages to the console and to the host's
@@ -14,12 +14,40 @@ extern "C" {
 // memcpy, memmove, memset, memcmp, memchr, strlen, strnlen, strcpy, strcmp,
 // strncmp, strchr, strtoul, strtol
 //    We must provide our own implementations.
+//
+//    `memcpy` and `memset` use `rep movsb` and `rep stosb` for large
+//    blocks on CPUs with enhanced REP MOVSB/STOSB (ERMS), which run at
+//    memory bandwidth. Otherwise they move 8 bytes at a time with
+//    `rep movsq` and `rep stosq`, then finish the tail by bytes.
+//    `memmove` copies 8-byte words, backward if the ranges overlap that
+//    way. The string instructions are written as inline assembly so the
+//    compiler can't turn the loops back into calls to these functions.
 
-void* memcpy(void* dst, const void* src, size_t n) {
-    const char* s = (const char*) src;
-    for (char* d = (char*) dst; n > 0; --n, ++s, ++d) {
-        *d = *s;
+#define REP_MIN 64              // use `rep` byte strings from this size
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+static bool have_erms() {
+    // 0 = unknown, 1 = no ERMS, 2 = ERMS (CPUID leaf 7, %ebx bit 9)
+    static int state;
+    if (state == 0) {
+        bool erms = cpuid(0).eax >= 7 && (cpuid(7, 0).ebx & (1U << 9));
+        state = erms ? 2 : 1;
     }
+    return state == 2;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    void* d = dst;
+    if (n >= REP_MIN && have_erms()) {
+        asm volatile("rep movsb"
+                     : "+D" (d), "+S" (src), "+c" (n) : : "memory");
+        return dst;
+    }
+    size_t nw = n / 8;
+    n %= 8;
+    asm volatile("rep movsq; movq %3, %%rcx; rep movsb"
+                 : "+D" (d), "+S" (src), "+c" (nw) : "r" (n) : "memory");
     return dst;
 }
 
@@ -27,11 +55,17 @@ void* memmove(void* dst, const void* src, size_t n) {
     const char* s = (const char*) src;
     char* d = (char*) dst;
     if (s < d && s + n > d) {
-        s += n, d += n;
+        while (n >= 8) {
+            n -= 8;
+            *(unaligned_u64*) (d + n) = *(const unaligned_u64*) (s + n);
+        }
         while (n-- > 0) {
-            *--d = *--s;
+            d[n] = s[n];
+        }
+    } else if (s != d) {
+        for (; n >= 8; n -= 8, s += 8, d += 8) {
+            *(unaligned_u64*) d = *(const unaligned_u64*) s;
         }
-    } else {
         while (n-- > 0) {
             *d++ = *s++;
         }
@@ -40,9 +74,17 @@ void* memmove(void* dst, const void* src, size_t n) {
 }
 
 void* memset(void* v, int c, size_t n) {
-    for (char* p = (char*) v; n > 0; ++p, --n) {
-        *p = c;
-    }
+    void* p = v;
+    if (n >= REP_MIN && have_erms()) {
+        asm volatile("rep stosb"
+                     : "+D" (p), "+c" (n) : "a" (c) : "memory");
+        return v;
+    }
+    uint64_t word = 0x0101010101010101UL * (unsigned char) c;
+    size_t nw = n / 8;
+    n %= 8;
+    asm volatile("rep stosq; movq %2, %%rcx; rep stosb"
+                 : "+D" (p), "+c" (nw) : "r" (n), "a" (word) : "memory");
     return v;
 }
 
@@ -216,6 +258,19 @@ long strtol(const char* s, char** endptr, int base) {
 } // extern "C"
 
 
+// memset_page(p, c)
+//    Set the page at `p` with `rep stosq`; a page is always a whole
+//    number of aligned 8-byte words.
+
+void* memset_page(void* p, int c) {
+    void* v = p;
+    size_t nw = PAGESIZE / 8;
+    uint64_t word = 0x0101010101010101UL * (unsigned char) c;
+    asm volatile("rep stosq" : "+D" (v), "+c" (nw) : "a" (word) : "memory");
+    return p;
+}
+
+
 // rand, srand
 
 static int rand_seed_set;
@@ -39,6 +39,11 @@ inline int tolower(int c);
 inline int toupper(int c);
 }
 
+// memset_page(p, c)
+//    Set every byte of the page-aligned page at `p` to `c` and return
+//    `p`. Faster than `memset` for whole pages.
+void* memset_page(void* p, int c);
+
 #define RAND_MAX 0x7FFFFFFF
 int rand();
 void srand(unsigned seed);
@@ -216,6 +221,44 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_PAGE_ALLOC      4
 #define SYSCALL_FORK            5
 #define SYSCALL_EXIT            6
+#define SYSCALL_GETSTATS        7
+#define SYSCALL_PAGE_ALLOC_RANGE 8
+#define SYSCALL_SHARE_PAGE      9
+#define SYSCALL_MAP_SHARED      10
+#define SYSCALL_READ            11
+#define SYSCALL_WRITE           12
+
+#define NSYSCALL                13      // one more than the largest number
+
+
+// File system geometry: `sys_read` and `sys_write` access files
+// 0 to `NFILES - 1`, each at most `FILE_MAXSIZE` bytes, stored in
+// disk blocks of `BLOCKSIZE` bytes.
+
+#define BLOCKSIZE               512
+#define NFILES                  16
+#define FILE_BLOCKS             63      // blocks per file
+#define FILE_MAXSIZE            (FILE_BLOCKS * BLOCKSIZE)
+
+
+// Kernel statistics: counters returned by `sys_getstats`. The kernel
+// keeps one set per CPU and sums them when asked.
+
+struct kstats {
+    unsigned long syscalls[NSYSCALL];   // system calls, by number
+    unsigned long user_faults;          // page faults in user mode
+    unsigned long kernel_faults;        // page faults in kernel mode
+    unsigned long cow_faults;           // ...resolved by copying a page
+    unsigned long demand_faults;        // ...resolved by a zeroed page
+    unsigned long context_switches;     // switches to a different process
+    unsigned long kallocs;              // successful `kalloc` calls
+    unsigned long kfrees;               // `kfree` calls on non-null pointers
+    unsigned long idle_ticks;           // timer ticks taken while idle
+    unsigned long bufcache_hits;        // block lookups found in the cache
+    unsigned long bufcache_misses;      // ...that needed a buffer
+    unsigned long disk_reads;           // blocks read from the disk
+    unsigned long disk_writes;          // blocks written to the disk
+};
 
 
 // CGA console printing
@@ -2,6 +2,10 @@
 #ifndef ALLOC_SLOWDOWN
 #define ALLOC_SLOWDOWN 100
 #endif
+// pages mapped per system call when the heap grows
+#ifndef ALLOC_BATCH
+#define ALLOC_BATCH 1
+#endif
 
 extern uint8_t end[];
 
@@ -26,13 +30,17 @@ void process_main() {
     // or (2) allocation fails (out of physical memory).
     while (true) {
         if (rand(0, ALLOC_SLOWDOWN - 1) < p) {
-            if (heap_top == stack_bottom
-                || sys_page_alloc(heap_top) < 0) {
+            size_t want = min<size_t>(ALLOC_BATCH,
+                                      (stack_bottom - heap_top) / PAGESIZE);
+            int n = want ? sys_page_alloc_range(heap_top, want) : 0;
+            if (n <= 0) {
                 break;
             }
-            *heap_top = p;               // check we can write to new page
+            for (int i = 0; i != n; ++i) {
+                *heap_top = p;           // check we can write to new page
+                heap_top += PAGESIZE;
+            }
             console[CPOS(24, 79)] = p;   // check we can write to console
-            heap_top += PAGESIZE;
         }
         sys_yield();
     }
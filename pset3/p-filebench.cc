@@ -0,0 +1,83 @@
+#include "u-lib.hh"
+#ifndef NRANDOM
+#define NRANDOM 4000
+#endif
+// file holding program 0 ("allocator"), and an empty file to write
+#define PROGRAM_FILE 0
+#define SCRATCH_FILE (NFILES - 1)
+
+// p-filebench
+//    Measure file I/O through the kernel's buffer cache, the way we
+//    benchmark io61: sequential reads of a program's file at several
+//    request sizes, then block-sized writes and random block reads of a
+//    scratch file bigger than the cache. Prints cycles per byte for each
+//    test, and the cache's hits and misses and the disk transfers, on
+//    the console.
+
+static char buf[PAGESIZE];
+
+// read_all(sz)
+//    Read all of `PROGRAM_FILE`, `sz` bytes per call, and return the
+//    number of bytes read.
+static size_t read_all(size_t sz) {
+    size_t off = 0;
+    ssize_t n;
+    while ((n = sys_read(PROGRAM_FILE, buf, sz, off)) > 0) {
+        off += n;
+    }
+    assert(n == 0);
+    return off;
+}
+
+void process_main() {
+    ssize_t n = sys_read(PROGRAM_FILE, buf, 4, 0);
+    assert(n == 4 && memcmp(buf, "\x7F" "ELF", 4) == 0);
+
+    kstats st0, st1;
+    sys_getstats(&st0);
+
+    static const size_t read_sizes[] = {1, BLOCKSIZE, PAGESIZE};
+    unsigned long read_cpb[3];
+    for (int i = 0; i != 3; ++i) {
+        uint64_t t0 = rdtsc();
+        size_t nbytes = read_all(read_sizes[i]);
+        read_cpb[i] = (rdtsc() - t0) / nbytes;
+    }
+
+    // append a block at a time, so no block is read before it's written
+    uint64_t t0 = rdtsc();
+    for (size_t off = 0; off != FILE_MAXSIZE; off += BLOCKSIZE) {
+        memset(buf, off / BLOCKSIZE, BLOCKSIZE);
+        n = sys_write(SCRATCH_FILE, buf, BLOCKSIZE, off);
+        assert(n == BLOCKSIZE);
+    }
+    unsigned long write_cpb = (rdtsc() - t0) / FILE_MAXSIZE;
+
+    t0 = rdtsc();
+    for (int i = 0; i != NRANDOM; ++i) {
+        int bn = rand(0, FILE_BLOCKS - 1);
+        n = sys_read(SCRATCH_FILE, buf, BLOCKSIZE, bn * BLOCKSIZE);
+        assert(n == BLOCKSIZE && buf[0] == char(bn)
+               && buf[BLOCKSIZE - 1] == char(bn));
+    }
+    unsigned long random_cpb = (rdtsc() - t0) / (NRANDOM * BLOCKSIZE);
+
+    sys_getstats(&st1);
+    console_printf(CPOS(23, 0), 0x0F00,
+                   "cycles/byte: read 1B %lu, %dB %lu, %luB %lu; "
+                   "write %lu; random %lu\n",
+                   read_cpb[0], BLOCKSIZE, read_cpb[1], PAGESIZE, read_cpb[2],
+                   write_cpb, random_cpb);
+    console_printf(CPOS(24, 0), 0x0F00,
+                   "buffer cache: %lu hits, %lu misses; "
+                   "disk: %lu reads, %lu writes",
+                   st1.bufcache_hits - st0.bufcache_hits,
+                   st1.bufcache_misses - st0.bufcache_misses,
+                   st1.disk_reads - st0.disk_reads,
+                   st1.disk_writes - st0.disk_writes);
+
+    // After measuring, do nothing forever
+    while (true) {
+        sys_yield();
+    }
+}
@@ -0,0 +1,60 @@
+#include "u-lib.hh"
+
+extern uint8_t end[];
+
+// p-share
+//    Pass a stream of bytes from a parent process to its child through
+//    an `spsc_ring` in a shared page. The child maps the page a second
+//    time with `sys_map_shared`, checks every byte it reads, and shows
+//    its progress on the console.
+
+void process_main() {
+    uint8_t* page = (uint8_t*) round_up((uintptr_t) end, PAGESIZE);
+    int r = sys_page_alloc(page);
+    assert(r == 0);
+    int id = sys_share_page(page);
+    assert(id >= 0);
+
+    pid_t p = sys_fork();
+    assert(p >= 0);
+    if (p == 0) {
+        // child: read through a second mapping of the same page
+        spsc_ring* ring = (spsc_ring*) (page + PAGESIZE);
+        r = sys_map_shared(id, ring);
+        assert(r == 0);
+        uint8_t expected = 0;
+        unsigned long nread = 0;
+        while (true) {
+            uint8_t buf[256];
+            size_t n = ring->read(buf, sizeof(buf));
+            if (n == 0) {
+                sys_yield();
+                continue;
+            }
+            for (size_t i = 0; i != n; ++i, ++expected) {
+                assert(buf[i] == expected);
+            }
+            nread += n;
+            if (nread % (1 << 20) < n) {
+                console_printf(CPOS(23, 0), 0x0F00,
+                               "child read %lu MB through the ring\n",
+                               nread >> 20);
+            }
+        }
+    }
+
+    // parent: write an endless counting sequence
+    spsc_ring* ring = (spsc_ring*) page;
+    uint8_t next = 0;
+    while (true) {
+        uint8_t buf[256];
+        for (size_t i = 0; i != sizeof(buf); ++i) {
+            buf[i] = next + i;
+        }
+        size_t n = ring->write(buf, sizeof(buf));
+        next += n;
+        if (n == 0) {
+            sys_yield();
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#include "u-lib.hh"
+#ifndef NITERATIONS
+#define NITERATIONS 100000
+#endif
+// pages per `sys_page_alloc_range` call
+#define RANGE_PAGES 16
+
+extern uint8_t end[];
+
+// p-syscallbench
+//    Measure the round-trip cost, in cycles, of some system calls and
+//    print the results on the console.
+
+void process_main() {
+    uint8_t* page = (uint8_t*) round_up((uintptr_t) end, PAGESIZE);
+
+    // warm up
+    for (int i = 0; i != 1000; ++i) {
+        sys_getpid();
+    }
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != NITERATIONS; ++i) {
+        sys_getpid();
+    }
+    uint64_t t1 = rdtsc();
+    for (int i = 0; i != NITERATIONS; ++i) {
+        sys_yield();
+    }
+    uint64_t t2 = rdtsc();
+    for (int i = 0; i != NITERATIONS; ++i) {
+        sys_page_alloc(page);
+    }
+    uint64_t t3 = rdtsc();
+    for (int i = 0; i != NITERATIONS / RANGE_PAGES; ++i) {
+        sys_page_alloc_range(page, RANGE_PAGES);
+    }
+    uint64_t t4 = rdtsc();
+
+    console_printf(CPOS(23, 0), 0x0F00,
+                   "cycles/call: getpid %lu, yield %lu, page_alloc %lu, "
+                   "per page in range %lu\n",
+                   (t1 - t0) / NITERATIONS, (t2 - t1) / NITERATIONS,
+                   (t3 - t2) / NITERATIONS, (t4 - t3) / NITERATIONS);
+
+    // After measuring, do nothing forever
+    while (true) {
+        sys_yield();
+    }
+}
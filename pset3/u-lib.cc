@@ -27,3 +27,34 @@ void assert_fail(const char* file, int line, const char* msg) {
                  file, line, msg);
     sys_panic(nullptr);
 }
+
+
+// spsc_ring::write(buf, sz), spsc_ring::read(buf, sz)
+//    The writer copies data in before publishing the new `tail_` with a
+//    release store; the reader's acquire load of `tail_` then sees the
+//    data. `head_` works the same way in the other direction, so the
+//    writer never overwrites bytes the reader hasn't copied out.
+
+size_t spsc_ring::write(const void* buf, size_t sz) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    size_t n = min(sz, capacity - (tail - head));
+    size_t off = tail % capacity;
+    size_t n1 = min(n, capacity - off);
+    memcpy(&buf_[off], buf, n1);
+    memcpy(buf_, (const char*) buf + n1, n - n1);
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+size_t spsc_ring::read(void* buf, size_t sz) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    size_t n = min(sz, size_t(tail - head));
+    size_t off = head % capacity;
+    size_t n1 = min(n, capacity - off);
+    memcpy(buf, &buf_[off], n1);
+    memcpy((char*) buf + n1, buf_, n - n1);
+    head_.store(head + n, std::memory_order_release);
+    return n;
+}
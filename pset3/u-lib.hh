@@ -2,6 +2,7 @@
 #define WEENSYOS_U_LIB_HH
 #include "lib.hh"
 #include "x86-64.h"
+#include <atomic>
 #if WEENSYOS_KERNEL
 #error "u-lib.hh should not be used by kernel code."
 #endif
@@ -62,7 +63,7 @@ __always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
     asm volatile ("syscall"
             : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2), "+r" (r10)
             :
-            : "cc", "rcx", "r8", "r9", "r11");
+            : "cc", "memory", "rcx", "r8", "r9", "r11");
     return rax;
 }
 
@@ -100,6 +101,36 @@ inline int sys_page_alloc(void* addr) {
     return make_syscall(SYSCALL_PAGE_ALLOC, (uintptr_t) addr);
 }
 
+// sys_page_alloc_range(addr, npages)
+//    Allocate `npages` pages of memory starting at address `addr`, as if
+//    by calling `sys_page_alloc` on each, but with one system call.
+//    Returns the number of pages allocated, which is less than `npages`
+//    if memory runs out or the range passes MEMSIZE_VIRTUAL; those pages
+//    are the first ones in the range. Returns -1 if `addr` is invalid.
+inline int sys_page_alloc_range(void* addr, size_t npages) {
+    return make_syscall(SYSCALL_PAGE_ALLOC_RANGE, (uintptr_t) addr, npages);
+}
+
+// sys_share_page(addr)
+//    Make the page at `addr` shareable and return its share ID, which
+//    any process can pass to `sys_map_shared` to map the same memory.
+//    Writes through either mapping are visible through both, and the
+//    page stays shared, not copied, across `sys_fork`. Returns -1 if
+//    `addr` is not a page-aligned, mapped page or too many pages are
+//    shared already.
+inline int sys_share_page(void* addr) {
+    return make_syscall(SYSCALL_SHARE_PAGE, (uintptr_t) addr);
+}
+
+// sys_map_shared(id, addr)
+//    Map the shared page with share ID `id` (from `sys_share_page`) at
+//    address `addr`, which must be page-aligned, >= PROC_START_ADDR, and
+//    < MEMSIZE_VIRTUAL. Any memory previously located at `addr` is freed.
+//    Returns 0 on success and -1 on failure.
+inline int sys_map_shared(int id, void* addr) {
+    return make_syscall(SYSCALL_MAP_SHARED, id, (uintptr_t) addr);
+}
+
 // sys_fork()
 //    Fork the current process. On success, return the child's process ID to
 //    the parent, and return 0 to the child. On failure, return -1.
@@ -107,6 +138,34 @@ inline pid_t sys_fork() {
     return make_syscall(SYSCALL_FORK);
 }
 
+// sys_getstats(st)
+//    Fill `*st` with the kernel's performance counters, summed over all
+//    CPUs. Returns 0 on success and -1 if `st` is not writable memory.
+inline int sys_getstats(kstats* st) {
+    return make_syscall(SYSCALL_GETSTATS, (uintptr_t) st);
+}
+
+// sys_read(fileno, buf, sz, off)
+//    Read up to `sz` bytes from file `fileno`, starting at byte `off`,
+//    into `buf`. Returns the number of bytes read, which is less than `sz`
+//    only at end of file, or -1 if `fileno` or `buf` is invalid. Files
+//    are numbered 0 to `NFILES - 1`; at boot, file N holds the ELF file
+//    of program N (0 is "allocator") and files past the last program are
+//    empty. Reads and writes go through the kernel's buffer cache.
+inline ssize_t sys_read(int fileno, void* buf, size_t sz, size_t off) {
+    return make_syscall(SYSCALL_READ, fileno, (uintptr_t) buf, sz, off);
+}
+
+// sys_write(fileno, buf, sz, off)
+//    Write `sz` bytes from `buf` to file `fileno`, starting at byte
+//    `off`, which must be at most the file's size. Returns the number of
+//    bytes written, which is less than `sz` only if the file reached
+//    `FILE_MAXSIZE` or the disk is out of memory, or -1 on error. Data
+//    reaches the disk later, when its buffer is reused or a CPU is idle.
+inline ssize_t sys_write(int fileno, const void* buf, size_t sz, size_t off) {
+    return make_syscall(SYSCALL_WRITE, fileno, (uintptr_t) buf, sz, off);
+}
+
 // sys_exit()
 //    Exit this process. Does not return.
 [[noreturn]] inline void sys_exit() {
@@ -128,4 +187,30 @@ inline pid_t sys_fork() {
     }
 }
 
+// spsc_ring
+//    A lock-free byte ring for one writing process and one reading
+//    process, sized to fit in a page shared with `sys_share_page` and
+//    `sys_map_shared`. Neither side makes a system call. `head_` and
+//    `tail_` count all bytes ever read and written; each is stored by
+//    only one side and sits on its own cache line. A zeroed page (such
+//    as a new `sys_page_alloc` page) is an empty ring.
+
+struct spsc_ring {
+    static constexpr size_t capacity = PAGESIZE / 2;
+
+    // Write up to `sz` bytes from `buf`; return the number written
+    // (0 if the ring is full). Only the writer may call this.
+    size_t write(const void* buf, size_t sz);
+
+    // Read up to `sz` bytes into `buf`; return the number read (0 if
+    // the ring is empty). Only the reader may call this.
+    size_t read(void* buf, size_t sz);
+
+  private:
+    alignas(64) std::atomic<uint32_t> head_;    // stored by the reader
+    alignas(64) std::atomic<uint32_t> tail_;    // stored by the writer
+    alignas(64) char buf_[capacity];
+};
+static_assert(sizeof(spsc_ring) <= PAGESIZE, "spsc_ring fits in a page");
+
 #endif
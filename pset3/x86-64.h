@@ -16,6 +16,7 @@
 #define PAGEINDEXBITS   9                      // # bits in a page index level
 #define PAGESIZE        (1UL << PAGEOFFBITS)   // Size of page in bytes
 #define PAGEOFFMASK     (PAGESIZE - 1)
+#define LARGEPAGESIZE   (PAGESIZE << PAGEINDEXBITS) // Size of 2MB page
 
 // Permission flags: define whether page is accessible
 #define PTE_P           0x1UL    // entry is Present
@@ -27,6 +28,7 @@
 #define PTE_D           0x40UL   // entry was Dirtied (written)
 // Other special-purpose flags
 #define PTE_PS          0x80UL   // entry has a large Page Size
+#define PTE_G           0x100UL  // entry is Global (if CR4_PGE)
 #define PTE_PWT         0x8UL
 #define PTE_PCD         0x10UL
 #define PTE_XD          0x8000000000000000UL // entry is eXecute Disabled
@@ -179,6 +181,11 @@ typedef struct x86_64_msr_t {
 #define CR4_PCE                 0x00000100      // Perfmonitor Counter Enable
 #define CR4_OSFXSR              0x00000200      // OS FXSAVE/FXRSTOR support
 #define CR4_VMXE                0x00004000      // VMX Enable
+#define CR4_PCIDE               0x00020000      // Process-Context IDs Enable
+
+// %cr3 flag bits
+#define CR3_PCIDMASK            0x0000000000000FFFUL // PCID (if CR4_PCIDE)
+#define CR3_NOFLUSH             0x8000000000000000UL // keep PCID's TLB entries
 
 // eflags bits (useful for rdeflags() and wreflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
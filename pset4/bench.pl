@@ -0,0 +1,219 @@
+#! /usr/bin/perl -w
+
+# bench.pl
+#    This program benchmarks the io61 test programs against the stdio
+#    and slow versions over a matrix of file sizes and `-b`/`-t` options.
+#    It prints a table of times and speedups, then appends the results
+#    to `bench-history.jsonl` (one JSON object per run). Each io61 time
+#    is compared with the previous run's, so buffering changes show up
+#    as wins or regressions.
+#
+#    Environment variables:
+#    BENCHSIZES     Comma-separated input sizes (default 4k,1m,16m,256m,2g).
+#    BENCHTRIALS    Trials per measurement; the fastest counts (default 3).
+#    BENCHSLOWMAX   Largest input size for the slow versions (default 1m).
+#    BENCHSTDIOMAX  Largest input size for the stdio versions (default:
+#                   no limit).
+#    BENCHONLY      Only run programs whose name matches this regex.
+#    BENCHHISTORY   History file (default bench-history.jsonl).
+#    BENCHTHRESHOLD Percent change vs. the last run flagged as a win or
+#                   regression (default 10).
+
+use Time::HiRes qw(gettimeofday tv_interval);
+use POSIX qw(strftime);
+use JSON::PP;
+
+sub nonemptyenv ($) {
+    my($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+sub parsesize ($) {
+    my($s) = @_;
+    my(%mult) = ("" => 1, "k" => 1 << 10, "m" => 1 << 20, "g" => 1 << 30);
+    $s =~ m{\A\s*(\d+)([kmg]?)\s*\z}i or die "bench.pl: bad size \"$s\"\n";
+    return $1 * $mult{lc($2)};
+}
+sub sizename ($) {
+    my($n) = @_;
+    foreach my $u (["g", 1 << 30], ["m", 1 << 20], ["k", 1 << 10]) {
+        return ($n / $u->[1]) . $u->[0] if $n >= $u->[1] && $n % $u->[1] == 0;
+    }
+    return $n;
+}
+
+my(@SIZES) = map { parsesize($_) }
+    split(/,/, nonemptyenv("BENCHSIZES") ? $ENV{"BENCHSIZES"} : "4k,1m,16m,256m,2g");
+my($TRIALS) = nonemptyenv("BENCHTRIALS") ? int($ENV{"BENCHTRIALS"}) : 3;
+$TRIALS = 3 if $TRIALS <= 0;
+my($SLOWMAX) = parsesize(nonemptyenv("BENCHSLOWMAX") ? $ENV{"BENCHSLOWMAX"} : "1m");
+my($STDIOMAX) = nonemptyenv("BENCHSTDIOMAX") ? parsesize($ENV{"BENCHSTDIOMAX"}) : undef;
+my($ONLY) = nonemptyenv("BENCHONLY") ? $ENV{"BENCHONLY"} : undef;
+my($HISTORY) = nonemptyenv("BENCHHISTORY") ? $ENV{"BENCHHISTORY"} : "bench-history.jsonl";
+my($THRESHOLD) = nonemptyenv("BENCHTHRESHOLD") ? $ENV{"BENCHTHRESHOLD"} + 0 : 10;
+
+my($Red, $Green, $Off) = ("\x1b[01;31m", "\x1b[01;32m", "\x1b[0m");
+$Red = $Green = $Off = "" if !-t STDOUT;
+
+
+# BENCHMARKS
+#    Each benchmark runs a program with `args` on every size between `min`
+#    and `max`. IN and OUT in `args` are replaced by the input and output
+#    files. Benchmarks with `nosize` run once, without an input file. The
+#    table and history name benchmarks by `label`, which defaults to `args`
+#    without the file arguments.
+
+my($M) = 1 << 20;
+my(@benchmarks) = (
+    { "program" => "cat61", "args" => "-o OUT IN" },
+    { "program" => "blockcat61", "args" => "-b 512 -o OUT IN" },
+    { "program" => "blockcat61", "args" => "-b 4096 -o OUT IN" },
+    { "program" => "blockcat61", "args" => "-b 65536 -o OUT IN" },
+    { "program" => "randblockcat61", "args" => "-o OUT IN" },
+    { "program" => "reordercat61", "args" => "-b 4096 -o OUT IN" },
+    { "program" => "reordercat61", "args" => "-b 65536 -o OUT IN", "min" => 65536 },
+    { "program" => "stridecat61", "args" => "-t 2 -o OUT IN", "max" => 64 * $M },
+    { "program" => "stridecat61", "args" => "-t 1024 -o OUT IN", "max" => 64 * $M },
+    { "program" => "stridecat61", "args" => "-b 4096 -t 1048576 -o OUT IN" },
+    { "program" => "ostridecat61", "args" => "-t 1024 -o OUT IN", "max" => 64 * $M },
+    { "program" => "ostridecat61", "args" => "-b 4096 -t 1048576 -o OUT IN" },
+    { "program" => "reverse61", "args" => "-o OUT IN", "max" => 64 * $M },
+    { "program" => "scattergather61", "args" => "-b 4096 -o OUT.1 -o OUT.2 -i IN -i IN",
+      "label" => "-b 4096, 2 in, 2 out" },
+    { "program" => "parcat61", "args" => "-o OUT IN" },
+    { "program" => "cksum61", "args" => "-b 65536 -o OUT IN" },
+    { "program" => "pipeexchange61", "args" => "", "nosize" => 1 }
+);
+
+my(@backends) = (["io61", ""], ["stdio", "stdio-"], ["slow", "slow-"]);
+
+
+sub makeinput ($) {
+    my($size) = @_;
+    my($fn) = "files/bench-" . sizename($size) . ".txt";
+    return $fn if -r $fn && -s $fn == $size;
+    open(WORDS, "<", "/usr/share/dict/words") or die "/usr/share/dict/words: $!\n";
+    my($words) = join("", <WORDS>);
+    close(WORDS);
+    open(IN, ">", $fn) or die "$fn: $!\n";
+    for (my $n = 0; $n < $size; $n += length($words)) {
+        print IN ($size - $n < length($words) ? substr($words, 0, $size - $n) : $words);
+    }
+    close(IN);
+    return $fn;
+}
+
+# Run `command` TRIALS times; return the fastest trial's wall-clock time
+# and its io61 profile, or undef if the command fails.
+sub measure ($) {
+    my($command) = @_;
+    my($best);
+    for (my $i = 0; $i < $TRIALS; ++$i) {
+        my($t0) = [gettimeofday()];
+        my($status) = system("sh", "-c", "$command >/dev/null 2>files/bench-profile.txt");
+        my($time) = tv_interval($t0);
+        return undef if $status != 0;
+        my($answer) = { "time" => $time };
+        if (open(PROFILE, "<", "files/bench-profile.txt")) {
+            my($buf) = join("", <PROFILE>);
+            close(PROFILE);
+            $buf =~ s/,\s*\"files\"\s*:\s*\[.*\]//s;
+            while ($buf =~ m,\"(syscalls|io_bytes)\"\s*:\s*(\d+),g) {
+                $answer->{$1} = $2 + 0;
+            }
+        }
+        $best = $answer if !defined($best) || $time < $best->{"time"};
+    }
+    return $best;
+}
+
+sub resultkey ($) {
+    my($r) = @_;
+    return join("\0", $r->{"program"}, $r->{"args"}, $r->{"size"}, $r->{"backend"});
+}
+
+sub fmtspeedup ($$) {
+    my($base, $t) = @_;
+    return defined($base) && defined($t) ? sprintf("%.2fx", $base / $t) : "-";
+}
+
+
+# Load the last run from the history
+my(%last);
+if (open(HISTORY, "<", $HISTORY)) {
+    my($line);
+    $line = $_ while (<HISTORY>);
+    close(HISTORY);
+    if (defined($line)) {
+        my($run) = eval { decode_json($line) };
+        foreach my $r ($run ? @{$run->{"results"}} : ()) {
+            $last{resultkey($r)} = $r->{"time"};
+        }
+    }
+}
+
+mkdir("files");
+my(@results);
+printf("%-16s %-28s %6s %10s %10s %10s %9s %9s %8s\n",
+       "PROGRAM", "ARGS", "SIZE", "IO61", "STDIO", "SLOW", "VS STDIO", "VS SLOW", "VS LAST");
+foreach my $bm (@benchmarks) {
+    next if defined($ONLY) && $bm->{"program"} !~ m/$ONLY/;
+    my($args) = $bm->{"label"};
+    if (!defined($args)) {
+        $args = $bm->{"args"};
+        $args =~ s/\s*(?:-[io] )?\b(?:IN|OUT)\b//g;
+    }
+    foreach my $size ($bm->{"nosize"} ? (-1) : @SIZES) {
+        next if (exists($bm->{"min"}) && $size < $bm->{"min"})
+            || (exists($bm->{"max"}) && $size > $bm->{"max"});
+        my($command) = $bm->{"args"};
+        if ($size >= 0) {
+            my($in) = makeinput($size);
+            $command =~ s/\bIN\b/$in/g;
+            $command =~ s/\bOUT\b/files\/bench-out/g;
+        }
+
+        my(%t);
+        foreach my $be (@backends) {
+            my($name, $prefix) = @$be;
+            next if $name eq "slow" && $size > $SLOWMAX;
+            next if $name eq "stdio" && defined($STDIOMAX) && $size > $STDIOMAX;
+            my($answer) = measure("./$prefix$bm->{program} $command");
+            if (!$answer) {
+                print STDERR "bench.pl: $prefix$bm->{program} $command failed\n";
+                next;
+            }
+            $t{$name} = $answer->{"time"};
+            push(@results, { "program" => $bm->{"program"}, "args" => $args,
+                             "size" => $size, "backend" => $name, %$answer });
+        }
+
+        my($vslast) = "-";
+        my($lt) = $last{resultkey({ "program" => $bm->{"program"}, "args" => $args,
+                                    "size" => $size, "backend" => "io61" })};
+        if (defined($lt) && defined($t{"io61"})) {
+            my($pct) = 100 * ($t{"io61"} - $lt) / $lt;
+            $vslast = sprintf("%+.0f%%", $pct);
+            if ($pct >= $THRESHOLD) {
+                $vslast = "$Red$vslast$Off";
+            } elsif ($pct <= -$THRESHOLD) {
+                $vslast = "$Green$vslast$Off";
+            }
+        }
+        printf("%-16s %-28s %6s %10s %10s %10s %9s %9s %8s\n",
+               $bm->{"program"}, $args, $size < 0 ? "-" : sizename($size),
+               map({ defined($t{$_}) ? sprintf("%.5fs", $t{$_}) : "-" } ("io61", "stdio", "slow")),
+               fmtspeedup($t{"stdio"}, $t{"io61"}), fmtspeedup($t{"slow"}, $t{"io61"}),
+               $vslast);
+    }
+}
+unlink(glob("files/bench-out*"), "files/bench-profile.txt");
+
+# Append this run to the history
+my($commit) = `git rev-parse --short HEAD 2>/dev/null`;
+chomp($commit);
+my($run) = { "date" => strftime("%Y-%m-%dT%H:%M:%S", localtime()),
+             "commit" => $commit, "trials" => $TRIALS, "results" => \@results };
+open(HISTORY, ">>", $HISTORY) or die "$HISTORY: $!\n";
+print HISTORY JSON::PP->new->canonical->encode($run), "\n";
+close(HISTORY);
+print "Results appended to $HISTORY.\n";
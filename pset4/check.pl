@@ -251,9 +251,11 @@ sub run_sh61 ($;%) {
         return $answer;
     }
 
-    $nb = POSIX::read(fileno(PR), $buf, 2000);
+    $nb = POSIX::read(fileno(PR), $buf, 65536);
     close(PR);
     $buf = $nb > 0 ? substr($buf, 0, $nb) : "";
+    # per-file statistics are not summarized
+    $buf =~ s/,\s*\"files\"\s*:\s*\[.*\]//s;
 
     while ($buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
         $answer->{$1} = $2;
@@ -922,6 +924,28 @@ enqueue(31,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+# PARALLEL I/O
+
+enqueue(32,
+    "./parcat61 -o files/out.txt files/text20meg.txt",
+    "regular large file, 1MB chunks, parallel");
+
+enqueue(33,
+    "./parcat61 -b 65536 -j 8 -o files/out.txt files/text5meg.txt",
+    "regular medium file, 64KB chunks, 8 threads");
+
+
+# FILTERS
+
+enqueue(34,
+    "./cksum61 -o files/out.txt files/text20meg.txt",
+    "regular large file, 4KB block I/O, checksummed");
+
+enqueue(35,
+    "cat files/text5meg.txt | ./cksum61 -b 65536 -o files/out.txt",
+    "piped medium file, 64KB block I/O, checksummed");
+
+
 run($sequentially);
 
 summary();
@@ -0,0 +1,201 @@
+#include "io61.hh"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+// checksum61.cc
+//    Checksums for io61 filters (see `io61_set_filter`): CRC-32C (the
+//    Castagnoli CRC used by iSCSI, ext4, and btrfs) and XXH64. These don't
+//    depend on the io61 implementation, so every version links them.
+//
+//    CRC-32C uses the SSE4.2 `crc32` instruction, 8 bytes at a time, when
+//    the CPU has it, and a lookup table otherwise.
+
+
+// crc32c_table
+//    The byte-at-a-time table for reflected CRC-32C.
+
+static const struct crc32c_table {
+    uint32_t t[256];
+    crc32c_table() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            }
+            t[i] = c;
+        }
+    }
+} crc32c_table;
+
+static uint32_t crc32c_portable(uint32_t c, const unsigned char* p, size_t n) {
+    for (; n != 0; --n, ++p) {
+        c = crc32c_table.t[(c ^ *p) & 0xFF] ^ (c >> 8);
+    }
+    return c;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t c, const unsigned char* p, size_t n) {
+    for (; n != 0 && (uintptr_t) p % 8 != 0; --n, ++p) {
+        c = _mm_crc32_u8(c, *p);
+    }
+#if defined(__x86_64__)
+    uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c64 = _mm_crc32_u64(c64, word);
+    }
+    c = c64;
+#endif
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        c = _mm_crc32_u32(c, word);
+    }
+    for (; n != 0; --n, ++p) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+#endif
+
+
+// io61_crc32c(crc, data, n)
+//    Return the CRC-32C of `crc`'s data followed by the `n` bytes at
+//    `data`. Start with `crc == 0`.
+
+uint32_t io61_crc32c(uint32_t crc, const void* data, size_t n) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+    if (have_sse42) {
+        return ~crc32c_sse42(~crc, p, n);
+    }
+#endif
+    return ~crc32c_portable(~crc, p, n);
+}
+
+
+// io61_xxh64
+//    Streaming XXH64. Four accumulators consume 32-byte stripes, which
+//    keeps four independent multiply chains in flight; `mem` holds a
+//    partial stripe between updates.
+
+static constexpr uint64_t xxh_p1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t xxh_p2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t xxh_p3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t xxh_p4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t xxh_p5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char* p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return xxh_rotl(acc + input * xxh_p2, 31) * xxh_p1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t acc) {
+    return (h ^ xxh_round(0, acc)) * xxh_p1 + xxh_p4;
+}
+
+io61_xxh64::io61_xxh64(uint64_t seed) {
+    v[0] = seed + xxh_p1 + xxh_p2;
+    v[1] = seed + xxh_p2;
+    v[2] = seed;
+    v[3] = seed - xxh_p1;
+    memsize = 0;
+    total = 0;
+}
+
+void io61_xxh64::update(const void* data, size_t n) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    total += n;
+    if (memsize + n < sizeof(mem)) {
+        memcpy(&mem[memsize], p, n);
+        memsize += n;
+        return;
+    }
+    if (memsize != 0) {
+        size_t k = sizeof(mem) - memsize;
+        memcpy(&mem[memsize], p, k);
+        for (int i = 0; i != 4; ++i) {
+            v[i] = xxh_round(v[i], xxh_read64(&mem[8 * i]));
+        }
+        p += k;
+        n -= k;
+        memsize = 0;
+    }
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    for (; n >= 32; n -= 32, p += 32) {
+        v0 = xxh_round(v0, xxh_read64(p));
+        v1 = xxh_round(v1, xxh_read64(p + 8));
+        v2 = xxh_round(v2, xxh_read64(p + 16));
+        v3 = xxh_round(v3, xxh_read64(p + 24));
+    }
+    v[0] = v0, v[1] = v1, v[2] = v2, v[3] = v3;
+    memcpy(mem, p, n);
+    memsize = n;
+}
+
+uint64_t io61_xxh64::digest() const {
+    uint64_t h;
+    if (total >= 32) {
+        h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12)
+            + xxh_rotl(v[3], 18);
+        for (int i = 0; i != 4; ++i) {
+            h = xxh_merge(h, v[i]);
+        }
+    } else {
+        h = v[2] + xxh_p5;      // v[2] is the seed
+    }
+    h += total;
+
+    const unsigned char* p = mem;
+    size_t n = memsize;
+    for (; n >= 8; n -= 8, p += 8) {
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * xxh_p1 + xxh_p4;
+    }
+    if (n >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        h = xxh_rotl(h ^ (word * xxh_p1), 23) * xxh_p2 + xxh_p3;
+        n -= 4;
+        p += 4;
+    }
+    for (; n != 0; --n, ++p) {
+        h = xxh_rotl(h ^ (*p * xxh_p5), 11) * xxh_p1;
+    }
+
+    h ^= h >> 33;
+    h *= xxh_p2;
+    h ^= h >> 29;
+    h *= xxh_p3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+// io61_checksum_filter(arg, data, n, off)
+//    An io61 filter that adds each chunk to the `io61_checksum` at `arg`.
+
+void io61_checksum_filter(void* arg, const unsigned char* data, size_t n,
+                          off_t off) {
+    io61_checksum* ck = reinterpret_cast<io61_checksum*>(arg);
+    if (ck->nbytes != 0 && off != ck->next) {
+        ck->ordered = false;
+    }
+    ck->crc32c = io61_crc32c(ck->crc32c, data, n);
+    ck->xxh64.update(data, n);
+    ck->nbytes += n;
+    ck->next = off + n;
+}
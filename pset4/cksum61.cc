@@ -0,0 +1,51 @@
+#include "io61.hh"
+
+// Usage: ./cksum61 [-b BLOCKSIZE] [-s SIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in blocks, like blockcat61, while
+//    checksum filters on both files compute the CRC-32C and XXH64 of the
+//    data as it streams through. Exits with status 1, after printing both
+//    checksums, if the data written doesn't match the data read. Default
+//    BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "b:s:o:i:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+
+    // Allocate buffer, open files
+    char* buf = new char[block_size];
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    io61_checksum inck, outck;
+    io61_set_filter(inf, io61_checksum_filter, &inck);
+    io61_set_filter(outf, io61_checksum_filter, &outck);
+
+    // Copy file data
+    while (args.input_size > 0) {
+        ssize_t amount = io61_read(inf, buf, std::min(block_size, args.input_size));
+        if (amount <= 0) {
+            break;
+        }
+        io61_write(outf, buf, amount);
+        args.input_size -= amount;
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    delete[] buf;
+
+    if (inck.crc32c != outck.crc32c || inck.xxh64.digest() != outck.xxh64.digest()
+        || inck.nbytes != outck.nbytes || !inck.ordered || !outck.ordered) {
+        for (io61_checksum* ck : {&inck, &outck}) {
+            fprintf(stderr, "cksum61: %s: crc32c %08x, xxh64 %016llx, %llu bytes%s\n",
+                    ck == &inck ? "read" : "written", ck->crc32c,
+                    (unsigned long long) ck->xxh64.digest(), ck->nbytes,
+                    ck->ordered ? "" : ", out of order");
+        }
+        exit(1);
+    }
+}
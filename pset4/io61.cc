@@ -1,20 +1,283 @@
 #include "io61.hh"
+#include "trace61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#if M61
+#include "m61.hh"
+#endif
 
-// io61.c
-//    YOUR CODE HERE!
+// io61.cc
+//    Buffered I/O on top of file descriptors.
 
 
 // io61_file
-//    Data structure for io61 file wrappers. Add your own stuff.
+//    Data structure for io61 file wrappers.
+//
+//    Each file has a single-slot cache holding bytes [tag, end_tag) of the
+//    file. `pos_tag` is the file position as seen by the user, with
+//    tag <= pos_tag <= end_tag and end_tag - tag <= bufsize (or the block
+//    size, for files with a block cache).
+//
+//    The cache of an ordinary buffered file is adaptive. It starts at
+//    `minbufsize` bytes, so files exchanging small messages and programs
+//    with many open files stay small. Every full refill or full write-out
+//    after the first in a seek-free run doubles it, up to `maxbufsize`,
+//    and each seek that is not part of a stride halves it again (see
+//    `io61_adapt`). Growth stops while the caches of all open files total
+//    `buffer_budget` bytes. Engine and block-cache files keep `chunksize`
+//    caches, and mapped files have none.
+//
+//    - A read-only file serves reads from cbuf[pos_tag - tag] and refills
+//      the cache at end_tag when pos_tag reaches it.
+//    - A write-only file appends to cbuf[pos_tag - tag] (so pos_tag ==
+//      end_tag) and writes the cache out when it fills, on flush, on seek,
+//      and on close.
+//
+//    The OS file position always equals end_tag for read-only files and tag
+//    for write-only files, except for files with a block cache, pooled
+//    read-only files, and write-only O_DIRECT files.
+//
+//    Files without a size (pipes, sockets, terminals) are in pipe mode.
+//    Their reads already return as soon as `read` delivers anything. In
+//    addition, output pipes are linked on `pipe_writers`, and before a read
+//    from a pipe blocks, all pending pipe output is flushed (see
+//    `io61_before_read`). A peer waiting on our output therefore can't
+//    deadlock with us, while writes issued between reads still coalesce.
+//
+//    A seekable read-only file that is not mapped gets a block cache (see
+//    `io61_blockcache`): several aligned blocks kept from earlier fills, so
+//    random readers that revisit nearby regions hit user-space memory.
+//    `cbuf` then points into the block cache, and reads use pread.
+//
+//    A seek on a seekable write-only file does not write the cache out;
+//    the cached bytes join `dirty`, a map from file offset to pending data
+//    in which overlapping and adjacent extents are merged (newer bytes
+//    win). Once `dirty` is nonempty, full caches join it too. The extents
+//    are written in offset order with pwrite when they exceed
+//    `dirty_limit` bytes and on flush, so random-order writes (as from
+//    reordercat61) become mostly sequential.
+//
+//    A read-only regular file is instead memory-mapped whole: `cbuf` points
+//    at the mapping, tag == 0, and end_tag is the file size, so reads copy
+//    straight from the page cache and seeks never make system calls. The
+//    mapping is advised sequential until seeks look random (see
+//    `io61_map_advise`). Mapped files must not shrink while open.
+//
+//    Callers that know their access pattern can pass it to `io61_advise`,
+//    which forwards it to the kernel and seeds these heuristics.
+//
+//    If the environment variable IO61_READAHEAD is set to a nonzero value,
+//    read-only files are not mapped. They instead get a read-ahead thread
+//    that fills a second buffer while the caller drains the first (see
+//    `io61_readahead`). The OS file position then runs ahead of end_tag.
+//
+//    Files opened with O_DIRECT (by passing O_DIRECT to io61_open_check, or
+//    by setting IO61_DIRECT to a nonzero value) bypass the page cache. They
+//    are never mapped, and their O_DIRECT transfers use the page-aligned
+//    caches at page-aligned offsets with page-multiple lengths, which suits
+//    any device's sector size. Transfers that can't be aligned go through
+//    `bfd`, a second descriptor for the file without O_DIRECT.
+//
+//    - A read-only O_DIRECT file uses the read-ahead thread, so sequential
+//      reading stays double-buffered. Its first seek switches it to a
+//      block cache, since nothing else would cache its data.
+//    - A write-only O_DIRECT file writes its cache with pwrite (so its OS
+//      file position is not maintained): whole pages directly, and an
+//      unaligned head, or the tail written by a flush, through `bfd` (see
+//      `io61_write_aligned`).
+//
+//    If IO61_URING is set to a nonzero value, files instead use an io_uring
+//    engine that reads ahead and writes behind in batches (see
+//    `io61_uring`). Its caches live in the engine's buffers, and seekable
+//    files use explicit offsets, so their OS file positions are not
+//    maintained.
+//
+//    A file can have a filter (see `io61_set_filter`) that sees the data
+//    streaming through it, one chunk at a time, while the chunk is in
+//    memory: a read file's cache after each fill, a write file's cache
+//    before it is written out, and the caller's buffer for reads and
+//    writes that bypass the cache. `ftag` marks how far a write file's
+//    cache has been filtered.
+//
+//    A write-only file passed to `io61_share` stops using its cache: each
+//    writing thread appends to a buffer of its own, which is written to the
+//    file in contiguous chunks of whole lines (see `io61_shared`).
+//
+//    If IO61_POOL is set to a byte count, io61 streams: the caches of all
+//    seekable files except O_DIRECT ones are fixed-size buffers from one
+//    pool of at most that many bytes, so memory stays bounded however many
+//    files are open (see `io61_pool`). A pooled file may lose its buffer to
+//    busier files, leaving it with an empty cache and bufsize == 0.
+//
+//    - A pooled read-only file is never mapped, block-cached, read ahead,
+//      or run on io_uring. It reads whole buffers with pread, in whichever
+//      direction `io61_window` predicts, so a reverse reader makes large
+//      backward reads. Its buffers stand in for kernel read-ahead, which is
+//      turned off, and pages a streaming reader has passed are dropped from
+//      the page cache. A file whose reader seeks without streaming is
+//      mapped instead, as if it weren't pooled (see `io61_pool_map`).
+//    - A pooled write-only file writes its cache out at every seek instead
+//      of keeping dirty extents.
+
+struct io61_readahead;
+struct io61_uring;
+struct io61_blockcache;
+struct io61_shared;
 
 struct io61_file {
     int fd;
+    int mode;                   // O_RDONLY or O_WRONLY
+    static constexpr off_t pagesize = 4096;
+    static constexpr off_t minbufsize = pagesize;
+    static constexpr off_t maxbufsize = 1 << 20;
+    static constexpr off_t chunksize = 32768;   // engine and block buffers
+    static constexpr size_t buffer_budget = 16 << 20;
+    off_t bufsize;              // cache capacity
+    bool adaptive;              // `bufsize` adapts (see above)
+    int nseq;                   // full transfers since the last seek
+    unsigned char* cbuf;        // cached data: `buf` or the mapping
+    off_t tag;                  // file offset of cbuf[0]
+    off_t end_tag;              // file offset one past the cached data
+    off_t pos_tag;              // file offset of the next byte to read/write
+    bool mapped;
+    bool seekable;
+    bool pipe;                  // no file size (see above)
+    bool direct;                // opened with O_DIRECT
+    int bfd;                    // `fd` without O_DIRECT, if `direct`
+    io61_file* next_pipe;       // next entry on `pipe_writers`
+    int advice;                 // current madvise advice for the mapping
+    int nfar;                   // recent far seeks (see `io61_map_advise`)
+    off_t seek_pos;             // target of the last seek
+    off_t stride;               // distance between the last two seeks
+    int nstride;                // # consecutive seeks by `stride`
+    io61_readahead* ra;         // read-ahead state, or nullptr
+    io61_uring* ur;             // io_uring engine, or nullptr
+    io61_blockcache* bc;        // block cache, or nullptr
+    io61_shared* sh;            // shared-writer state, or nullptr
+    bool pooled;                // cache comes from `io61_pool`
+    io61_file* pool_prev;       // links on the pool's activity list
+    io61_file* pool_next;
+    io61_filter_fn filter;      // filter, or nullptr
+    void* filter_arg;
+    off_t ftag;                 // cache before `ftag` has been filtered
+    const char* name;           // for profiling; nullptr if unknown
+    io61_stats stats;
+    static constexpr size_t dirty_limit = 8 << 20;
+    std::map<off_t, std::vector<unsigned char>> dirty;
+    std::string line;           // `io61_getline` data that spans fills
+    size_t ndirty;              // total bytes in `dirty`
+    unsigned char* buf;         // `bufsize` page-aligned bytes, or nullptr
+};
+
+static size_t buffer_bytes;     // total size of all files' `buf`s
+
+
+// io61_readahead
+//    Read-ahead state for a buffered read-only file. The thread owns the
+//    file descriptor and `spare`: whenever `spare` is empty (`!ready`), it
+//    reads the next bufsize bytes into it. `io61_fill` waits until `ready`,
+//    then swaps `spare` with the cache. `wakefd` is an eventfd that
+//    interrupts the thread's wait for input when the file is torn down.
+
+struct io61_readahead {
+    std::thread th;
+    std::mutex m;
+    std::condition_variable cv;
+    int wakefd;
+    bool ready = false;
+    bool stop = false;
+    ssize_t n;                  // result of the read into `spare`
+    int err;                    // errno if `n < 0`
+    unsigned char* spare;
+    alignas(4096) unsigned char buf[io61_file::chunksize];
 };
 
+static void io61_readahead_start(io61_file* f);
+static struct io61_pool* io61_pool_get();
+static int io61_pool_use(io61_file* f);
+static void io61_pool_release(io61_file* f);
+static bool io61_resize(io61_file* f, off_t size);
+static io61_uring* io61_uring_create(io61_file* f);
+static io61_blockcache* io61_blockcache_create();
+static ssize_t io61_shared_write(io61_file* f, const char* buf, size_t sz);
+static int io61_shared_flush(io61_file* f);
+static void io61_shared_destroy(io61_file* f);
+
+
+// io61_env_flag(name)
+//    Return true if environment variable `name` is set to a nonzero value.
+
+static bool io61_env_flag(const char* name) {
+    const char* value = getenv(name);
+    return value && strtol(value, nullptr, 0) != 0;
+}
+
+
+// io61_env_number(name, dflt)
+//    Return the value of environment variable `name` as a number, or
+//    `dflt` if it is unset.
+
+static long io61_env_number(const char* name, long dflt) {
+    const char* value = getenv(name);
+    return value ? strtol(value, nullptr, 0) : dflt;
+}
+
+
+static io61_file* pipe_writers;
+
+
+// io61_flush_pipe_writers()
+//    Flush every output pipe with pending data.
+
+static void io61_flush_pipe_writers() {
+    for (io61_file* w = pipe_writers; w; w = w->next_pipe) {
+        if (w->pos_tag != w->tag) {
+            io61_flush(w);
+        }
+    }
+}
+
+
+// io61_before_read(f)
+//    Called before a read from `f` that might block. If `f` is a pipe with
+//    no input ready and output pipes have pending data, flush them first:
+//    the peer may be waiting for that output before it answers.
+
+static void io61_before_read(io61_file* f) {
+    if (!f->pipe) {
+        return;
+    }
+    bool pending = false;
+    for (io61_file* w = pipe_writers; w && !pending; w = w->next_pipe) {
+        pending = w->pos_tag != w->tag;
+    }
+    if (!pending) {
+        return;
+    }
+    struct pollfd p = {f->fd, POLLIN, 0};
+    ++f->stats.syscalls;
+    if (poll(&p, 1, 0) != 1) {
+        io61_flush_pipe_writers();
+    }
+}
+
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
@@ -25,19 +288,1259 @@ io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     io61_file* f = new io61_file;
     f->fd = fd;
-    (void) mode;
+    f->mode = mode & O_ACCMODE;
+    f->direct = mode & O_DIRECT;
+    f->buf = f->cbuf = nullptr;
+    f->bufsize = 0;
+    f->adaptive = false;
+    f->nseq = 0;
+    f->mapped = false;
+    f->seek_pos = f->stride = f->nstride = 0;
+    f->ra = nullptr;
+    f->ur = nullptr;
+    f->bc = nullptr;
+    f->sh = nullptr;
+    f->pooled = false;
+    f->pool_prev = f->pool_next = nullptr;
+    f->filter = nullptr;
+    f->filter_arg = nullptr;
+    f->name = nullptr;
+    f->ndirty = 0;
+    f->stats.syscalls = 1;      // this lseek
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    f->seekable = off >= 0;
+    f->tag = f->end_tag = f->pos_tag = f->ftag = off < 0 ? 0 : off;
+    off_t size = io61_filesize(f);
+    ++f->stats.syscalls;
+    f->pipe = size < 0;
+    f->next_pipe = nullptr;
+    if (f->pipe && f->mode == O_WRONLY) {
+        f->next_pipe = pipe_writers;
+        pipe_writers = f;
+    }
+
+    f->bfd = -1;
+    if (f->direct) {
+        char path[40];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        f->bfd = open(path, f->mode | O_CLOEXEC);
+        ++f->stats.syscalls;
+        if (f->bfd < 0) {
+            // no way to do unaligned I/O: give up on O_DIRECT
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            f->stats.syscalls += 2;
+            f->direct = false;
+        }
+    }
+
+    if (!f->direct && f->seekable && !f->pipe && io61_pool_get()) {
+        // the cache comes from the pool at the first read or write
+        f->pooled = true;
+        if (f->mode == O_RDONLY) {
+            // pool buffers replace the kernel's read-ahead
+            posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+            ++f->stats.syscalls;
+        }
+        return f;
+    }
+    if (!f->direct && io61_env_flag("IO61_URING")
+        && (f->ur = io61_uring_create(f))) {
+        f->bufsize = f->chunksize;      // the engine's buffers
+        return f;
+    }
+    if (f->mode == O_RDONLY && (f->direct || io61_env_flag("IO61_READAHEAD"))) {
+        io61_resize(f, f->chunksize);
+        io61_readahead_start(f);
+        return f;
+    }
+
+    if (f->mode == O_RDONLY && size > 0) {
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ++f->stats.syscalls;
+        if (map != MAP_FAILED) {
+            f->cbuf = reinterpret_cast<unsigned char*>(map);
+            f->mapped = true;
+            f->tag = 0;
+            f->end_tag = size;
+            f->pos_tag = std::min(f->pos_tag, size);
+            f->advice = MADV_SEQUENTIAL;
+            f->nfar = 0;
+            madvise(map, size, f->advice);
+            ++f->stats.syscalls;
+        }
+    }
+    if (f->mode == O_RDONLY && !f->mapped && f->seekable) {
+        f->bc = io61_blockcache_create();
+    }
+    if (!f->mapped) {
+        f->adaptive = !f->bc;
+        io61_resize(f, f->adaptive ? f->minbufsize : f->chunksize);
+    }
     return f;
 }
 
 
-// io61_close(f)
-//    Close the io61_file `f` and release all its resources.
+// io61_resize(f, size)
+//    Give `f` a `size`-byte cache, keeping its cached data, which must fit.
+//    Returns false, leaving the cache alone, if growing it would exceed
+//    `buffer_budget` or memory is short. A file's first cache is always
+//    allocated.
+
+static bool io61_resize(io61_file* f, off_t size) {
+    if (f->buf && size > f->bufsize
+        && buffer_bytes + (size - f->bufsize) > f->buffer_budget) {
+        return false;
+    }
+    void* p = aligned_alloc(f->pagesize, size);
+    if (!p) {
+        if (!f->buf) {
+            throw std::bad_alloc();
+        }
+        return false;
+    }
+    unsigned char* buf = reinterpret_cast<unsigned char*>(p);
+    if (f->cbuf == f->buf) {
+        assert(f->end_tag - f->tag <= size);
+        if (f->buf) {
+            memcpy(buf, f->buf, f->end_tag - f->tag);
+        }
+        f->cbuf = buf;
+    }
+    if (f->buf) {
+        buffer_bytes -= f->bufsize;
+        free(f->buf);
+    }
+    f->buf = buf;
+    f->bufsize = size;
+    buffer_bytes += size;
+    return true;
+}
+
+
+// io61_adapt(f, seek)
+//    Adapt the cache size of `f` at a sequential refill or after its full
+//    cache was written out (`!seek`), or at a seek that is not part of a
+//    stride (`seek`). Any cached data must fit in half the cache.
+
+static void io61_adapt(io61_file* f, bool seek) {
+    if (!f->adaptive) {
+        return;
+    } else if (seek) {
+        f->nseq = 0;
+        if (f->bufsize > f->minbufsize) {
+            io61_resize(f, f->bufsize / 2);
+        }
+    } else if (++f->nseq >= 2 && f->bufsize < f->maxbufsize) {
+        io61_resize(f, f->bufsize * 2);
+    }
+}
+
+
+// io61_pool
+//    The buffer pool for streaming mode (see `io61_file`). IO61_POOL sets
+//    the total size, and IO61_POOL_BUFSIZE the size of each buffer (default
+//    `maxbufsize` or a quarter of the pool, whichever is smaller, rounded
+//    up to a multiple of the page size). There are at least two buffers.
+//    Buffers are allocated as files first need them and kept until exit.
+//
+//    Files holding buffers are kept on an activity list, most active
+//    first; a file moves to the front whenever it refills, seeks outside
+//    its cache, or writes its cache out. When no buffer is free, the least
+//    active file gives up its own: a write-only file writes its cache out
+//    first (if that fails, it keeps the buffer and reports the error at its
+//    next write), and a read-only file drops its cached data, which pread
+//    can read again later. The most active file never gives up its buffer,
+//    so data just filled, as by `io61_copy`, stays put while it is used.
+
+struct io61_pool {
+    off_t bufsize;              // bytes per buffer
+    size_t nbufs;               // buffers allowed
+    size_t nallocated = 0;      // buffers allocated so far
+    std::vector<unsigned char*> free;
+    io61_file* head = nullptr;  // files holding buffers, most active first
+    io61_file* tail = nullptr;
+};
+
+static io61_pool* pool;         // nullptr unless streaming
+
+
+// io61_pool_get()
+//    Return the buffer pool, creating it the first time if IO61_POOL is
+//    set, or nullptr if io61 is not streaming.
+
+static io61_pool* io61_pool_get() {
+    static bool initialized = false;
+    if (!initialized) {
+        initialized = true;
+        long size = io61_env_number("IO61_POOL", 0);
+        if (size > 0) {
+            long bufsize = io61_env_number("IO61_POOL_BUFSIZE",
+                                           std::min(long(io61_file::maxbufsize),
+                                                    size / 4));
+            bufsize = std::max(bufsize, long(io61_file::pagesize));
+            bufsize += -bufsize & (io61_file::pagesize - 1);
+            pool = new io61_pool;
+            pool->bufsize = bufsize;
+            pool->nbufs = std::max(size / bufsize, 2L);
+        }
+    }
+    return pool;
+}
+
+
+static void io61_pool_unlink(io61_file* f) {
+    (f->pool_prev ? f->pool_prev->pool_next : pool->head) = f->pool_next;
+    (f->pool_next ? f->pool_next->pool_prev : pool->tail) = f->pool_prev;
+    f->pool_prev = f->pool_next = nullptr;
+}
+
+static void io61_pool_push_front(io61_file* f) {
+    f->pool_prev = nullptr;
+    f->pool_next = pool->head;
+    (pool->head ? pool->head->pool_prev : pool->tail) = f;
+    pool->head = f;
+}
+
+
+// io61_pool_streaming(f)
+//    Return true if the seeks of pooled read-only file `f` form a stream:
+//    a run of seeks by less than a buffer, which `io61_window` turns into
+//    full-buffer reads in the seeks' direction.
+
+static bool io61_pool_streaming(io61_file* f) {
+    return f->nstride >= 2
+        && f->stride > -pool->bufsize && f->stride < pool->bufsize;
+}
+
+
+// io61_pool_map(f)
+//    Map pooled read-only file `f`, whose reader seeks without streaming
+//    (four cache misses in a row outside a stream), and give its buffer
+//    back. One buffer holds only one window, so such a reader would read
+//    a window per seek; the mapping keeps every page it touches, and
+//    those are page cache the kernel can reclaim, not pool memory.
+//    Returns false, leaving `f` pooled, if `f` can't be mapped.
+
+static bool io61_pool_map(io61_file* f) {
+    struct stat s;
+    ++f->stats.syscalls;
+    if (f->filter || fstat(f->fd, &s) != 0 || s.st_size <= 0) {
+        return false;
+    }
+    void* map = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    ++f->stats.syscalls;
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    io61_pool_release(f);
+    f->pooled = false;
+    f->cbuf = reinterpret_cast<unsigned char*>(map);
+    f->mapped = true;
+    f->tag = 0;
+    f->end_tag = s.st_size;
+    // the reader seeks far: no read-ahead (see `io61_map_advise`)
+    f->advice = MADV_RANDOM;
+    madvise(map, s.st_size, f->advice);
+    posix_fadvise(f->fd, 0, 0, POSIX_FADV_NORMAL);
+    f->stats.syscalls += 2;
+    return true;
+}
+
+
+// io61_drop_behind(f, off, len)
+//    If `f` is pooled, drop bytes [off, off + len), which `f`'s reader has
+//    been given, from the page cache. Callers drop only what a stream
+//    (sequential reads, or a run of short seeks as from reverse61) has
+//    passed, since such a reader won't want it again. Bytes merely cached
+//    are kept, since a file that loses its buffer reads them again.
+
+static void io61_drop_behind(io61_file* f, off_t off, off_t len) {
+    if (f->pooled && len > 0) {
+        posix_fadvise(f->fd, off, len, POSIX_FADV_DONTNEED);
+        ++f->stats.syscalls;
+    }
+}
+
+
+// io61_pool_reclaim(f)
+//    Take the buffer of pooled file `f`, leaving its cache empty, and
+//    return it. Returns nullptr if `f`'s cached writes can't be written.
+
+static unsigned char* io61_pool_reclaim(io61_file* f) {
+    if (f->mode == O_WRONLY && io61_flush(f) == -1) {
+        return nullptr;
+    }
+    if (f->mode == O_RDONLY && f->nseq != 0) {
+        io61_drop_behind(f, f->tag, f->pos_tag - f->tag);
+    }
+    f->tag = f->end_tag = f->pos_tag;
+    unsigned char* buf = f->buf;
+    io61_pool_unlink(f);
+    f->buf = f->cbuf = nullptr;
+    f->bufsize = 0;
+    return buf;
+}
+
+
+// io61_pool_use(f)
+//    Note activity on pooled file `f`, giving it a buffer if it has none:
+//    a free one, a new one, or the least active file's. Returns 0 on
+//    success and -1 if no buffer could be had.
+
+static int io61_pool_use(io61_file* f) {
+    assert(f->pooled);
+    if (f->buf) {
+        if (f != pool->head) {
+            io61_pool_unlink(f);
+            io61_pool_push_front(f);
+        }
+        return 0;
+    }
+
+    unsigned char* buf = nullptr;
+    if (!pool->free.empty()) {
+        buf = pool->free.back();
+        pool->free.pop_back();
+    } else if (pool->nallocated != pool->nbufs
+               && (buf = reinterpret_cast<unsigned char*>(
+                       aligned_alloc(io61_file::pagesize, pool->bufsize)))) {
+        ++pool->nallocated;
+    }
+    for (io61_file* v = pool->tail; !buf && v && v != pool->head;
+         v = v->pool_prev) {
+        buf = io61_pool_reclaim(v);
+    }
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    f->buf = f->cbuf = buf;
+    f->bufsize = pool->bufsize;
+    io61_pool_push_front(f);
+    return 0;
+}
+
+
+// io61_pool_release(f)
+//    Return the buffer of pooled file `f`, if any, to the pool.
+
+static void io61_pool_release(io61_file* f) {
+    if (f->buf) {
+        io61_pool_unlink(f);
+        pool->free.push_back(f->buf);
+        f->buf = f->cbuf = nullptr;
+        f->bufsize = 0;
+    }
+}
+
+
+// io61_filter_out(f)
+//    Pass the cached bytes of write-only file `f` that its filter hasn't
+//    seen to the filter. Called before the cache is written out.
+
+static void io61_filter_out(io61_file* f) {
+    off_t lo = std::max(f->ftag, f->tag);
+    if (f->filter && lo < f->pos_tag) {
+        f->filter(f->filter_arg, &f->cbuf[lo - f->tag], f->pos_tag - lo, lo);
+    }
+    f->ftag = f->pos_tag;
+}
+
+
+// io61_blockcache
+//    A cache of `nblocks` blocks of `blocksize` bytes, each holding the
+//    file data at a multiple of `blocksize`. `index` maps block numbers to
+//    blocks. Blocks are evicted in CLOCK order: `hand` sweeps the blocks,
+//    clearing reference bits, and takes the first unreferenced one.
+//
+//    IO61_CACHE_BLOCKS and IO61_CACHE_BLOCKSIZE set the block count (default
+//    8; 1 or less disables the cache) and size (default chunksize, rounded up
+//    to a multiple of the page size).
+
+struct io61_block {
+    off_t off = -1;             // file offset of data[0], or -1 if unused
+    off_t len = 0;
+    bool referenced = false;
+    unsigned char* data;
+};
+
+struct io61_blockcache {
+    off_t blocksize;
+    std::vector<io61_block> blocks;
+    std::unordered_map<off_t, unsigned> index;
+    unsigned hand = 0;
+    unsigned char* mem;         // storage for all blocks
+    size_t memsize;
+};
+
+
+// io61_blockcache_create()
+//    Return a new block cache sized by the environment, or nullptr if it
+//    is disabled or cannot be allocated.
+
+static io61_blockcache* io61_blockcache_create() {
+    long nblocks = io61_env_number("IO61_CACHE_BLOCKS", 8);
+    long blocksize = io61_env_number("IO61_CACHE_BLOCKSIZE", io61_file::chunksize);
+    if (nblocks <= 1 || blocksize <= 0) {
+        return nullptr;
+    }
+    blocksize += -blocksize & (io61_file::pagesize - 1);
+    size_t memsize = nblocks * blocksize;
+    void* mem = mmap(nullptr, memsize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    io61_blockcache* bc = new io61_blockcache;
+    bc->blocksize = blocksize;
+    bc->mem = reinterpret_cast<unsigned char*>(mem);
+    bc->memsize = memsize;
+    bc->blocks.resize(nblocks);
+    for (long i = 0; i != nblocks; ++i) {
+        bc->blocks[i].data = &bc->mem[i * blocksize];
+    }
+    bc->index.reserve(nblocks);
+    return bc;
+}
+
+
+// io61_pread_retry(f, buf, sz, off)
+//    Read up to `sz` bytes at file offset `off` into `buf`, retrying
+//    interrupted reads.
+
+static ssize_t io61_pread_retry(io61_file* f, unsigned char* buf, size_t sz,
+                                off_t off) {
+    while (true) {
+        ssize_t n = pread(f->fd, buf, sz, off);
+        ++f->stats.syscalls;
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+            f->stats.io_bytes += std::max(n, ssize_t(0));
+            return n;
+        }
+    }
+}
+
+
+// io61_blockcache_fill(f, len)
+//    `io61_fill` for files with a block cache. Aligned positions are served
+//    from the block cache, loading the block if it is missing; others (as
+//    from io61_window's page-sized stride windows) read `len` bytes into
+//    `f->buf`.
+
+static ssize_t io61_blockcache_fill(io61_file* f, off_t len) {
+    io61_blockcache* bc = f->bc;
+    if (f->end_tag % bc->blocksize != 0) {
+        ++f->stats.misses;
+        f->cbuf = f->buf;
+        ssize_t n = io61_pread_retry(f, f->buf, std::min(len, f->bufsize), f->end_tag);
+        f->end_tag += std::max(n, ssize_t(0));
+        return n;
+    }
+
+    off_t bn = f->end_tag / bc->blocksize;
+    io61_block* b;
+    auto it = bc->index.find(bn);
+    if (it != bc->index.end()) {
+        b = &bc->blocks[it->second];
+        ++f->stats.hits;
+    } else {
+        ++f->stats.misses;
+        while (true) {
+            b = &bc->blocks[bc->hand];
+            bc->hand = (bc->hand + 1) % bc->blocks.size();
+            if (!b->referenced) {
+                break;
+            }
+            b->referenced = false;
+        }
+        if (b->off >= 0) {
+            bc->index.erase(b->off / bc->blocksize);
+            b->off = -1;
+        }
+        ssize_t n = io61_pread_retry(f, b->data, bc->blocksize, f->end_tag);
+        if (n <= 0) {
+            return n;
+        }
+        b->off = f->end_tag;
+        b->len = n;
+        bc->index[bn] = b - bc->blocks.data();
+    }
+    b->referenced = true;
+    f->cbuf = b->data;
+    f->end_tag = b->off + b->len;
+    return b->len;
+}
+
+
+// io61_readahead_loop(f, ra)
+//    Body of `f`'s read-ahead thread.
+
+static void io61_readahead_loop(io61_file* f, io61_readahead* ra) {
+    std::unique_lock<std::mutex> guard(ra->m);
+    while (true) {
+        ra->cv.wait(guard, [&] { return ra->stop || !ra->ready; });
+        if (ra->stop) {
+            return;
+        }
+        guard.unlock();
+
+        // wait for input or teardown, so pipes don't block io61_close
+        struct pollfd p[2] = {{f->fd, POLLIN, 0}, {ra->wakefd, POLLIN, 0}};
+        ssize_t n;
+        while (true) {
+            int r = poll(p, 2, -1);
+            if (r > 0 && p[1].revents) {
+                n = 0;
+                break;
+            } else if (r > 0) {
+                n = read(f->fd, ra->spare, f->bufsize);
+                if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+                    break;
+                }
+            } else if (errno != EINTR) {
+                n = -1;
+                break;
+            }
+        }
+        int err = errno;
+
+        guard.lock();
+        ra->n = n;
+        ra->err = err;
+        ra->ready = true;
+        ra->cv.notify_all();
+    }
+}
+
+
+// io61_readahead_start(f)
+//    Start a read-ahead thread for `f`, whose cache must be empty.
+
+static void io61_readahead_start(io61_file* f) {
+    assert(f->mode == O_RDONLY && f->pos_tag == f->end_tag);
+    int wakefd = eventfd(0, EFD_CLOEXEC);
+    if (wakefd < 0) {
+        return;
+    }
+    io61_readahead* ra = new io61_readahead;
+    ra->wakefd = wakefd;
+    ra->spare = ra->buf;
+    f->ra = ra;
+    ra->th = std::thread(io61_readahead_loop, f, ra);
+}
+
+
+// io61_readahead_stop(f)
+//    Stop `f`'s read-ahead thread and drop its cached data. Afterwards the
+//    OS file position is wherever the thread left it.
+
+static void io61_readahead_stop(io61_file* f) {
+    io61_readahead* ra = f->ra;
+    {
+        std::lock_guard<std::mutex> guard(ra->m);
+        ra->stop = true;
+    }
+    ra->cv.notify_all();
+    uint64_t one = 1;
+    ssize_t r = write(ra->wakefd, &one, sizeof(one));
+    (void) r;
+    ra->th.join();
+    close(ra->wakefd);
+    delete ra;
+    f->ra = nullptr;
+    f->cbuf = f->buf;
+    f->tag = f->end_tag = f->pos_tag;
+}
+
+
+// io61_uring
+//    io_uring engine for a file. Each of the `depth` slots owns a buffer
+//    that is free, has an operation in flight, holds a completed read, or
+//    is the file's cache (`cbuf`).
+//
+//    - Reads are submitted as soon as they are queued. While the file is
+//      read sequentially, every free slot reads ahead past end_tag;
+//      `io61_fill` takes the completed slot at end_tag as the new cache.
+//      A fill that was not read ahead, as after a seek, reads directly.
+//    - Writes hand a full cache to the kernel and continue in a free slot.
+//      They are queued without a system call and submitted together when
+//      no slot is free or on flush, so a run of small writes (as from
+//      reordercat61) costs one system call per batch. Overlapping writes
+//      are serialized. A write error is reported by the next write, seek,
+//      or flush.
+//
+//    Non-seekable files (pipes) read and write at the OS file position and
+//    so keep at most one operation in flight.
+
+enum io61_slot_state {
+    slot_free, slot_inflight, slot_done, slot_cache
+};
+
+struct io61_slot {
+    io61_slot_state state = slot_free;
+    off_t off;                  // file offset of buf[0]
+    size_t start;               // unwritten data in flight: buf[start]...
+    size_t len;                 // ...through buf[start + len - 1]
+    ssize_t res;                // result of a completed read
+    alignas(4096) unsigned char buf[io61_file::chunksize];
+};
+
+struct io61_uring {
+    static constexpr unsigned depth = 8;
+    int fd;
+    bool seekable;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    void* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned npending = 0;      // queued but not yet submitted
+    unsigned ninflight = 0;     // submitted or queued, not completed
+    off_t next_off;             // offset of the next read-ahead
+    off_t last_end;             // end_tag after the last fill
+    int err = 0;                // first write-behind error
+    io61_slot slots[depth];
+};
+
+
+// io61_uring_create(f)
+//    Set up an io_uring engine for `f`. Returns nullptr if io_uring is
+//    unavailable, in which case `f` uses the default engine.
+
+static io61_uring* io61_uring_create(io61_file* f) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = syscall(__NR_io_uring_setup, io61_uring::depth, &p);
+    if (rfd < 0) {
+        return nullptr;
+    }
+    io61_uring* ur = new io61_uring;
+    ur->fd = rfd;
+    ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    ur->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+    ur->sq_ring = mmap(nullptr, ur->sq_ring_size, prot, flags, rfd,
+                       IORING_OFF_SQ_RING);
+    ur->cq_ring = mmap(nullptr, ur->cq_ring_size, prot, flags, rfd,
+                       IORING_OFF_CQ_RING);
+    ur->sqes = mmap(nullptr, ur->sqes_size, prot, flags, rfd, IORING_OFF_SQES);
+    if (ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED
+        || ur->sqes == MAP_FAILED) {
+        if (ur->sq_ring != MAP_FAILED) {
+            munmap(ur->sq_ring, ur->sq_ring_size);
+        }
+        if (ur->cq_ring != MAP_FAILED) {
+            munmap(ur->cq_ring, ur->cq_ring_size);
+        }
+        if (ur->sqes != MAP_FAILED) {
+            munmap(ur->sqes, ur->sqes_size);
+        }
+        close(rfd);
+        delete ur;
+        return nullptr;
+    }
+    unsigned char* sq = reinterpret_cast<unsigned char*>(ur->sq_ring);
+    unsigned char* cq = reinterpret_cast<unsigned char*>(ur->cq_ring);
+    ur->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    ur->sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    ur->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    ur->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    ur->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    ur->cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    ur->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    ur->seekable = lseek(f->fd, 0, SEEK_CUR) >= 0;
+    ur->next_off = ur->last_end = f->end_tag;
+    if (f->mode == O_WRONLY) {
+        ur->slots[0].state = slot_cache;
+        f->cbuf = ur->slots[0].buf;
+    }
+    return ur;
+}
+
+
+// io61_uring_queue(f, s, op, off, start, len)
+//    Queue operation `op` (IORING_OP_READ or IORING_OP_WRITE) on slot `s`
+//    of `f`, covering `len` bytes at `s->buf[start]`. `s->buf[0]` is at
+//    file offset `off`.
+
+static void io61_uring_queue(io61_file* f, io61_slot* s, int op,
+                             off_t off, size_t start, size_t len) {
+    io61_uring* ur = f->ur;
+    unsigned tail = *ur->sq_tail;
+    unsigned idx = tail & *ur->sq_mask;
+    io_uring_sqe* sqe = &reinterpret_cast<io_uring_sqe*>(ur->sqes)[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = f->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&s->buf[start]);
+    sqe->len = len;
+    sqe->off = ur->seekable ? off + start : -1;
+    sqe->user_data = s - ur->slots;
+    ur->sq_array[idx] = idx;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    s->state = slot_inflight;
+    s->off = off;
+    s->start = start;
+    s->len = len;
+    ++ur->npending;
+    ++ur->ninflight;
+}
+
+
+// io61_uring_enter(f, wait)
+//    Submit `f`'s queued operations. If `wait`, then also wait until at
+//    least one operation completes. Processes any completions; short
+//    writes are requeued for their remainder.
+
+static void io61_uring_enter(io61_file* f, bool wait) {
+    io61_uring* ur = f->ur;
+    assert(!wait || ur->ninflight > 0);
+    while (ur->npending > 0 || wait) {
+        int r = syscall(__NR_io_uring_enter, ur->fd, ur->npending, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        ++f->stats.syscalls;
+        if (r >= 0) {
+            ur->npending -= r;
+            break;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // the ring is unusable: fail everything in flight
+            int err = errno;
+            for (auto& s : ur->slots) {
+                if (s.state == slot_inflight) {
+                    s.state = f->mode == O_RDONLY ? slot_done : slot_free;
+                    s.res = -err;
+                }
+            }
+            ur->err = ur->err ? ur->err : err;
+            ur->npending = ur->ninflight = 0;
+            return;
+        }
+    }
+
+    unsigned head = *ur->cq_head;
+    while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe* cqe = &ur->cqes[head & *ur->cq_mask];
+        io61_slot* s = &ur->slots[cqe->user_data];
+        int res = cqe->res;
+        ++head;
+        --ur->ninflight;
+        f->stats.io_bytes += std::max(res, 0);
+        if (f->mode == O_RDONLY) {
+            s->state = slot_done;
+            s->res = res;
+        } else if (res > 0 && size_t(res) < s->len) {
+            io61_uring_queue(f, s, IORING_OP_WRITE, s->off, s->start + res,
+                             s->len - res);
+        } else {
+            if (res <= 0 && !ur->err) {
+                ur->err = res < 0 ? -res : EIO;
+            }
+            s->state = slot_free;
+        }
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+// io61_uring_drain(f)
+//    Wait for all of `f`'s operations to complete.
+
+static void io61_uring_drain(io61_file* f) {
+    while (f->ur->ninflight > 0) {
+        io61_uring_enter(f, true);
+    }
+}
+
+
+// io61_uring_fill(f, len)
+//    `io61_fill` for the io_uring engine.
+
+static ssize_t io61_uring_fill(io61_file* f, off_t len) {
+    io61_uring* ur = f->ur;
+    bool sequential = f->end_tag == ur->last_end;
+    io61_slot* want = nullptr;
+    for (auto& s : ur->slots) {
+        if (s.state == slot_cache) {
+            s.state = slot_free;
+        } else if (s.state != slot_free && s.off == f->end_tag) {
+            want = &s;
+        }
+    }
+    if (want) {
+        ++f->stats.hits;
+    } else {
+        // not read ahead: drop stale reads and read here synchronously,
+        // which is cheaper than a round trip through the ring
+        io61_uring_drain(f);
+        for (auto& s : ur->slots) {
+            s.state = slot_free;
+        }
+        want = &ur->slots[0];
+        want->state = slot_done;
+        want->off = f->end_tag;
+        io61_before_read(f);
+        do {
+            want->res = ur->seekable ? pread(f->fd, want->buf, len, f->end_tag)
+                : read(f->fd, want->buf, len);
+            ++f->stats.syscalls;
+        } while (want->res < 0 && (errno == EINTR || errno == EAGAIN));
+        if (want->res < 0) {
+            want->res = -errno;
+        } else {
+            f->stats.io_bytes += want->res;
+        }
+        ++f->stats.misses;
+        ur->next_off = f->end_tag + len;
+    }
+    if (want->state == slot_inflight && f->pipe) {
+        io61_flush_pipe_writers();
+    }
+    while (want->state == slot_inflight) {
+        io61_uring_enter(f, true);
+    }
+
+    ssize_t n = want->res;
+    if (n > 0) {
+        want->state = slot_cache;
+        f->cbuf = want->buf;
+        f->end_tag = f->tag + n;
+    } else {
+        want->state = slot_free;
+        if (n < 0) {
+            errno = -n;
+            n = -1;
+        }
+    }
+    ur->last_end = f->end_tag;
+
+    // read ahead of the new cache, in batches of at least half the slots
+    unsigned nfree = 0;
+    for (auto& s : ur->slots) {
+        nfree += s.state == slot_free;
+    }
+    if (sequential && n > 0 && (n == f->bufsize || !ur->seekable)
+        && (nfree >= ur->depth / 2 || ur->ninflight == 0)) {
+        for (auto& s : ur->slots) {
+            if (s.state != slot_free || (!ur->seekable && ur->ninflight > 0)) {
+                continue;
+            }
+            off_t off = ur->seekable ? ur->next_off : f->end_tag;
+            io61_uring_queue(f, &s, IORING_OP_READ, off, 0, f->bufsize);
+            ur->next_off = off + f->bufsize;
+        }
+        io61_uring_enter(f, false);
+    }
+    return n;
+}
+
+
+// io61_uring_spill(f)
+//    Start writing `f`'s write cache behind and continue in a free slot.
+//    Returns 0 on success and -1 if an earlier write failed.
+
+static int io61_uring_spill(io61_file* f) {
+    io61_uring* ur = f->ur;
+    if (ur->err) {
+        errno = ur->err;
+        return -1;
+    } else if (f->pos_tag == f->tag) {
+        return 0;
+    }
+
+    // wait for overlapping writes, or for pipes any write
+    io61_slot* cache = nullptr;
+    while (true) {
+        bool busy = false;
+        for (auto& s : ur->slots) {
+            if (s.state == slot_cache) {
+                cache = &s;
+            } else if (s.state == slot_inflight
+                       && (!ur->seekable
+                           || (s.off + off_t(s.start) < f->pos_tag
+                               && f->tag < s.off + off_t(s.start + s.len)))) {
+                busy = true;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        io61_uring_enter(f, true);
+    }
+    io61_uring_queue(f, cache, IORING_OP_WRITE, f->tag, 0, f->pos_tag - f->tag);
+
+    // continue in a free slot
+    io61_slot* next = nullptr;
+    while (true) {
+        for (auto& s : ur->slots) {
+            if (s.state == slot_free) {
+                next = &s;
+            }
+        }
+        if (next) {
+            break;
+        }
+        io61_uring_enter(f, true);
+    }
+    next->state = slot_cache;
+    f->cbuf = next->buf;
+    f->tag = f->end_tag = f->pos_tag;
+    return 0;
+}
+
+
+// io61_uring_flush(f)
+//    `io61_flush` for the io_uring engine.
+
+static int io61_uring_flush(io61_file* f) {
+    if (io61_uring_spill(f) == -1) {
+        return -1;
+    }
+    io61_uring_drain(f);
+    if (f->ur->err) {
+        errno = f->ur->err;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_uring_destroy(f)
+//    Wait for `f`'s operations and release its io_uring engine.
+
+static void io61_uring_destroy(io61_file* f) {
+    io61_uring* ur = f->ur;
+    io61_uring_drain(f);
+    munmap(ur->sqes, ur->sqes_size);
+    munmap(ur->cq_ring, ur->cq_ring_size);
+    munmap(ur->sq_ring, ur->sq_ring_size);
+    close(ur->fd);
+    delete ur;
+    f->ur = nullptr;
+    f->cbuf = f->buf;
+}
+
+
+// io61_write_dirty(f)
+//    Write all of `f`'s dirty extents in offset order. Returns 0 on
+//    success and -1 on error, in which case unwritten extents remain.
+
+static int io61_write_dirty(io61_file* f) {
+    while (!f->dirty.empty()) {
+        auto it = f->dirty.begin();
+        std::vector<unsigned char>& data = it->second;
+        size_t nwritten = 0;
+        while (nwritten != data.size()) {
+            ssize_t n = pwrite(f->fd, &data[nwritten], data.size() - nwritten,
+                               it->first + nwritten);
+            ++f->stats.syscalls;
+            if (n > 0) {
+                f->stats.io_bytes += n;
+                nwritten += n;
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                // keep the unwritten part
+                std::vector<unsigned char> rest(data.begin() + nwritten, data.end());
+                off_t off = it->first + nwritten;
+                f->ndirty -= nwritten;
+                f->dirty.erase(it);
+                f->dirty.emplace(off, std::move(rest));
+                return -1;
+            }
+        }
+        f->ndirty -= data.size();
+        f->dirty.erase(it);
+    }
+    return 0;
+}
+
+
+// io61_stash(f)
+//    Move `f`'s write cache into its dirty extents, merging it with any
+//    extents it overlaps or touches, and write the extents out if they
+//    have grown past `dirty_limit`. Returns 0 on success and -1 on error.
+
+static int io61_stash(io61_file* f) {
+    off_t lo = f->tag, hi = f->pos_tag;
+    if (lo == hi) {
+        return 0;
+    }
+
+    // find the extents touching [lo, hi)
+    auto first = f->dirty.upper_bound(lo);
+    if (first != f->dirty.begin()) {
+        auto prev = std::prev(first);
+        if (prev->first + off_t(prev->second.size()) >= lo) {
+            first = prev;
+        }
+    }
+    auto last = first;
+    off_t new_lo = lo, new_hi = hi;
+    while (last != f->dirty.end() && last->first <= hi) {
+        new_lo = std::min(new_lo, last->first);
+        new_hi = std::max(new_hi, last->first + off_t(last->second.size()));
+        f->ndirty -= last->second.size();
+        ++last;
+    }
+
+    // build the merged extent, reusing the first one's storage when it
+    // starts the range (the common case of appending to an extent)
+    std::vector<unsigned char> data;
+    auto it = first;
+    if (first != last && first->first == new_lo) {
+        data = std::move(first->second);
+        ++it;
+    }
+    data.resize(new_hi - new_lo);
+    for (; it != last; ++it) {
+        memcpy(&data[it->first - new_lo], it->second.data(), it->second.size());
+    }
+    memcpy(&data[lo - new_lo], f->cbuf, hi - lo);
+    f->dirty.erase(first, last);
+    f->ndirty += data.size();
+    f->dirty.emplace(new_lo, std::move(data));
+
+    f->tag = f->end_tag = f->pos_tag;
+    if (f->ndirty > f->dirty_limit) {
+        return io61_write_dirty(f);
+    }
+    return 0;
+}
+
+
+// io61_write_aligned(f, all)
+//    Write out the cache of O_DIRECT file `f`. Whole pages at page-aligned
+//    offsets are written directly. Bytes before the first page boundary,
+//    and, if `all`, bytes after the last, are written through `f->bfd`;
+//    otherwise those last bytes stay at the front of the cache. Returns 0
+//    on success and -1 on error.
+
+static int io61_write_aligned(io61_file* f, bool all) {
+    while (f->pos_tag != f->tag) {
+        size_t cached = f->pos_tag - f->tag;
+        size_t head = -f->tag & (f->pagesize - 1);
+        size_t len;
+        bool aligned = head == 0 && cached >= size_t(f->pagesize);
+        if (aligned) {
+            len = cached - cached % f->pagesize;
+        } else if (head != 0) {
+            len = std::min(head, cached);
+        } else if (all) {
+            len = cached;
+        } else {
+            break;
+        }
+
+        ssize_t n = pwrite(aligned ? f->fd : f->bfd, f->cbuf, len, f->tag);
+        ++f->stats.syscalls;
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            return -1;
+        }
+        f->stats.io_bytes += n;
+        memmove(&f->cbuf[0], &f->cbuf[n], cached - n);
+        f->tag += n;
+    }
+    return 0;
+}
+
+
+// io61_make_room(f)
+//    Make room in `f`'s full write cache. Returns 0 on success and -1 on
+//    error.
+
+static int io61_make_room(io61_file* f) {
+    if (f->pooled && !f->buf) {
+        // a file without a buffer has an empty cache
+        return io61_pool_use(f);
+    } else if (f->pooled) {
+        io61_pool_use(f);
+    }
+    io61_filter_out(f);
+    if (f->ur) {
+        return io61_uring_spill(f);
+    }
+    int r;
+    if (f->direct) {
+        r = io61_write_aligned(f, false);
+    } else if (!f->dirty.empty()) {
+        r = io61_stash(f);
+    } else {
+        r = io61_flush(f);
+    }
+    if (r == 0) {
+        io61_adapt(f, false);
+    }
+    return r;
+}
+
+
+// io61_close(f)
+//    Close the io61_file `f` and release all its resources.
+
+int io61_close(io61_file* f) {
+    if (f->ra) {
+        io61_readahead_stop(f);
+    }
+    if (f->sh) {
+        io61_shared_destroy(f);
+    }
+    io61_flush(f);
+    io61_profile_file(f->name, f->fd, f->mode, f->stats);
+    for (io61_file** pp = &pipe_writers; *pp; pp = &(*pp)->next_pipe) {
+        if (*pp == f) {
+            *pp = f->next_pipe;
+            break;
+        }
+    }
+    if (f->ur) {
+        io61_uring_destroy(f);
+    }
+    if (f->bc) {
+        munmap(f->bc->mem, f->bc->memsize);
+        delete f->bc;
+    }
+    if (f->mapped) {
+        munmap(f->cbuf, f->end_tag);
+    }
+    if (f->pooled) {
+        io61_pool_release(f);
+    } else if (f->buf) {
+        buffer_bytes -= f->bufsize;
+        free(f->buf);
+    }
+    if (f->bfd >= 0) {
+        close(f->bfd);
+    }
+    int r = close(f->fd);
+    delete f;
+    return r;
+}
+
+
+// io61_fill(f, len)
+//    Fill the read cache with up to `len` bytes of new data, starting at
+//    `f->end_tag`. Returns the number of bytes read, which is 0 at end of
+//    file, or -1 on error. Only called when `f`'s cached data has been
+//    consumed. `len == 0` means a sequential refill of the whole cache.
+//    The new data is passed to `f`'s filter.
+
+static ssize_t io61_fill_cache(io61_file* f, off_t len);
+
+static ssize_t io61_fill(io61_file* f, off_t len = 0) {
+    ssize_t n = io61_fill_cache(f, len);
+    if (n > 0 && f->filter) {
+        f->filter(f->filter_arg, &f->cbuf[f->pos_tag - f->tag],
+                  f->end_tag - f->pos_tag, f->pos_tag);
+    }
+    return n;
+}
+
+static ssize_t io61_fill_cache(io61_file* f, off_t len) {
+    assert(f->mode == O_RDONLY && f->pos_tag == f->end_tag);
+    if (f->mapped) {
+        return 0;
+    }
+    if (f->nseq != 0) {
+        io61_drop_behind(f, f->tag, f->end_tag - f->tag);
+    }
+    f->tag = f->pos_tag = f->end_tag;
+    if (f->pooled && io61_pool_use(f) == -1) {
+        return -1;
+    }
+    bool sequential = len == 0;
+    if (sequential) {
+        io61_adapt(f, false);
+        len = f->bufsize;
+    }
+    if (f->ur) {
+        return io61_uring_fill(f, len);
+    } else if (f->bc) {
+        return io61_blockcache_fill(f, len);
+    } else if (f->ra) {
+        // take the buffer the read-ahead thread filled
+        io61_readahead* ra = f->ra;
+        std::unique_lock<std::mutex> guard(ra->m);
+        ++(ra->ready ? f->stats.hits : f->stats.misses);
+        if (!ra->ready && f->pipe) {
+            io61_flush_pipe_writers();
+        }
+        ra->cv.wait(guard, [&] { return ra->ready; });
+        ssize_t n = ra->n;
+        ++f->stats.syscalls;    // the thread's read
+        f->stats.io_bytes += std::max(n, ssize_t(0));
+        if (n > 0) {
+            std::swap(f->cbuf, ra->spare);
+            f->end_tag = f->tag + n;
+        } else if (n < 0) {
+            errno = ra->err;
+        }
+        ra->ready = false;
+        ra->cv.notify_all();
+        return n;
+    } else if (f->pooled) {
+        ++f->stats.misses;
+        f->nseq += sequential;
+        ssize_t n = io61_pread_retry(f, f->cbuf, len, f->end_tag);
+        if (n > 0) {
+            f->end_tag += n;
+        }
+        return n;
+    }
+    ++f->stats.misses;
+    io61_before_read(f);
+    while (true) {
+        ssize_t n = read(f->fd, f->cbuf, len);
+        ++f->stats.syscalls;
+        if (n >= 0) {
+            f->stats.io_bytes += n;
+            f->end_tag = f->tag + n;
+            if (n != len) {
+                f->nseq = 0;    // short reads don't count as sustained
+            }
+            return n;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
+}
+
+
+// io61_read_direct(f, buf, sz)
+//    Read up to `sz` bytes into `buf`, bypassing `f`'s cache, which must be
+//    empty. Returns the number of bytes read, 0 at end of file, or -1 on
+//    error. The cache stays empty at the new file position.
 
-int io61_close(io61_file* f) {
-    io61_flush(f);
-    int r = close(f->fd);
-    delete f;
-    return r;
+static ssize_t io61_read_direct(io61_file* f, char* buf, size_t sz) {
+    assert(f->pos_tag == f->end_tag);
+    io61_before_read(f);
+    while (true) {
+        ssize_t n = f->bc || f->pooled ? pread(f->fd, buf, sz, f->end_tag)
+            : read(f->fd, buf, sz);
+        ++f->stats.syscalls;
+        if (n >= 0) {
+            f->stats.io_bytes += n;
+            io61_drop_behind(f, f->end_tag, n);
+            if (n > 0 && f->filter) {
+                f->filter(f->filter_arg, reinterpret_cast<unsigned char*>(buf),
+                          n, f->end_tag);
+            }
+            f->tag = f->pos_tag = f->end_tag = f->end_tag + n;
+            return n;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
 }
 
 
@@ -46,12 +1549,100 @@ int io61_close(io61_file* f) {
 //    (which is -1) on error or end-of-file.
 
 int io61_readc(io61_file* f) {
-    unsigned char buf[1];
-    if (read(f->fd, buf, 1) == 1) {
-        return buf[0];
-    } else {
+    if (f->pos_tag == f->end_tag && io61_fill(f) <= 0) {
         return EOF;
     }
+    unsigned char ch = f->cbuf[f->pos_tag - f->tag];
+    ++f->pos_tag;
+    ++f->stats.bytes;
+    return ch;
+}
+
+
+// io61_readline(f, buf, sz)
+//    Read characters from `f` into `buf` up to and including the next
+//    newline, stopping after `sz` characters. Returns the number of
+//    characters read, which is 0 at end of file, or -1 if an error
+//    occurred before any characters were read.
+//
+//    Newlines are found with memchr, which libc vectorizes.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        if (f->pos_tag == f->end_tag) {
+            ssize_t n = io61_fill(f);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                f->stats.bytes += nread;
+                return nread ? (ssize_t) nread : -1;
+            }
+        }
+        const unsigned char* p = &f->cbuf[f->pos_tag - f->tag];
+        size_t n = std::min(sz - nread, size_t(f->end_tag - f->pos_tag));
+        const void* nl = memchr(p, '\n', n);
+        if (nl) {
+            n = reinterpret_cast<const unsigned char*>(nl) - p + 1;
+        }
+        memcpy(&buf[nread], p, n);
+        f->pos_tag += n;
+        nread += n;
+        if (nl) {
+            break;
+        }
+    }
+    f->stats.bytes += nread;
+    return nread;
+}
+
+
+// io61_getline(f, line)
+//    Read the next line from `f`, including its newline (the file's last
+//    line may lack one), and set `*line` to point at it. Returns the
+//    line's length, 0 at end of file, or -1 if an error occurred before
+//    any characters were read. `*line` is valid until the next call on `f`.
+//
+//    A line that lies within the cache is returned in place, without
+//    copying; only lines that span a refill are assembled in `f->line`.
+
+ssize_t io61_getline(io61_file* f, const char** line) {
+    f->line.clear();
+    if (f->pooled && f->buf) {
+        // keep the buffer a returned line points into (see `io61_pool`)
+        io61_pool_use(f);
+    }
+    while (true) {
+        if (f->pos_tag == f->end_tag) {
+            ssize_t n = io61_fill(f);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                if (f->line.empty()) {
+                    return -1;
+                }
+                break;
+            }
+        }
+        const unsigned char* p = &f->cbuf[f->pos_tag - f->tag];
+        size_t n = f->end_tag - f->pos_tag;
+        const void* nl = memchr(p, '\n', n);
+        if (nl) {
+            n = reinterpret_cast<const unsigned char*>(nl) - p + 1;
+        }
+        f->pos_tag += n;
+        f->stats.bytes += n;
+        if (nl && f->line.empty()) {
+            *line = reinterpret_cast<const char*>(p);
+            return n;
+        }
+        f->line.append(reinterpret_cast<const char*>(p), n);
+        if (nl) {
+            break;
+        }
+    }
+    *line = f->line.data();
+    return f->line.size();
 }
 
 
@@ -63,21 +1654,93 @@ int io61_readc(io61_file* f) {
 //    were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    TRACE61_SCOPE("io61_read", sz);
     size_t nread = 0;
     while (nread != sz) {
-        int ch = io61_readc(f);
-        if (ch == EOF) {
-            break;
+        if (f->pos_tag == f->end_tag && !f->mapped && !f->ra && !f->ur
+            && !f->direct
+            && sz - nread >= size_t(std::max(f->bufsize, f->chunksize))) {
+            // big read with an empty cache: skip the copy
+            ssize_t n = io61_read_direct(f, &buf[nread], sz - nread);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                f->stats.bytes += nread;
+                return nread ? (ssize_t) nread : -1;
+            }
+            nread += n;
+            continue;
         }
-        buf[nread] = ch;
-        ++nread;
+        if (f->pos_tag == f->end_tag) {
+            ssize_t n = io61_fill(f);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                f->stats.bytes += nread;
+                return nread ? (ssize_t) nread : -1;
+            }
+        }
+        size_t n = std::min(sz - nread, size_t(f->end_tag - f->pos_tag));
+        memcpy(&buf[nread], &f->cbuf[f->pos_tag - f->tag], n);
+        f->pos_tag += n;
+        nread += n;
     }
+    f->stats.bytes += nread;
     return nread;
+}
+
+
+// io61_write_through(f, iov, iovcnt)
+//    Write `f`'s cached data followed by the `iovcnt` buffers in `iov`,
+//    gathering them into as few `writev` calls as possible, and leave the
+//    cache empty. Returns the number of bytes from `iov` written, which is
+//    short only on error, or -1 if an error occurred before any were.
+
+static ssize_t io61_write_through(io61_file* f, const struct iovec* iov,
+                                  int iovcnt) {
+    struct iovec v[IOV_MAX];
+    size_t nwritten = 0, skip = 0;      // progress through `iov`
+    int i = 0;
+    while (true) {
+        size_t cached = f->pos_tag - f->tag;
+        int nv = 0;
+        if (cached) {
+            v[nv++] = {f->cbuf, cached};
+        }
+        for (int j = i; j != iovcnt && nv != IOV_MAX; ++j) {
+            size_t off = j == i ? skip : 0;
+            v[nv] = {(char*) iov[j].iov_base + off, iov[j].iov_len - off};
+            nv += v[nv].iov_len != 0;
+        }
+        if (nv == 0) {
+            return nwritten;
+        }
 
-    // Note: This function never returns -1 because `io61_readc`
-    // does not distinguish between error and end-of-file.
-    // Your final version should return -1 if a system call indicates
-    // an error.
+        ssize_t n = writev(f->fd, v, nv);
+        ++f->stats.syscalls;
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        f->stats.io_bytes += n;
+        if (size_t(n) < cached) {
+            // keep any unwritten tail at the front of the cache
+            memmove(&f->cbuf[0], &f->cbuf[n], cached - n);
+            f->tag += n;
+            continue;
+        }
+        f->tag = f->pos_tag = f->end_tag = f->tag + n;
+        n -= cached;
+        nwritten += n;
+        while (i != iovcnt && size_t(n) >= iov[i].iov_len - skip) {
+            n -= iov[i].iov_len - skip;
+            skip = 0;
+            ++i;
+        }
+        skip += n;
+    }
 }
 
 
@@ -86,13 +1749,18 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 //    -1 on error.
 
 int io61_writec(io61_file* f, int ch) {
-    unsigned char buf[1];
-    buf[0] = ch;
-    if (write(f->fd, buf, 1) == 1) {
-        return 0;
-    } else {
+    if (f->sh) {
+        char c = ch;
+        return io61_shared_write(f, &c, 1) == 1 ? 0 : -1;
+    }
+    if (f->pos_tag - f->tag == f->bufsize && io61_make_room(f) == -1) {
         return -1;
     }
+    f->cbuf[f->pos_tag - f->tag] = ch;
+    ++f->pos_tag;
+    ++f->end_tag;
+    ++f->stats.bytes;
+    return 0;
 }
 
 
@@ -102,43 +1770,840 @@ int io61_writec(io61_file* f, int ch) {
 //    an error occurred before any characters were written.
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    TRACE61_SCOPE("io61_write", sz);
+    if (f->sh) {
+        return io61_shared_write(f, buf, sz);
+    }
+    if (sz >= size_t(std::max(f->bufsize, f->chunksize))
+        && !f->ur && !f->direct && f->dirty.empty()) {
+        // big write: send it along with the cache, skipping the copy
+        io61_filter_out(f);
+        if (f->filter) {
+            f->filter(f->filter_arg, reinterpret_cast<const unsigned char*>(buf),
+                      sz, f->pos_tag);
+        }
+        struct iovec iov = {const_cast<char*>(buf), sz};
+        ssize_t n = io61_write_through(f, &iov, 1);
+        f->stats.bytes += std::max(n, ssize_t(0));
+        return n;
+    }
     size_t nwritten = 0;
     while (nwritten != sz) {
-        if (io61_writec(f, buf[nwritten]) == -1) {
-            break;
+        if (f->pos_tag - f->tag == f->bufsize && io61_make_room(f) == -1) {
+            f->stats.bytes += nwritten;
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        size_t n = std::min(sz - nwritten, size_t(f->bufsize - (f->pos_tag - f->tag)));
+        memcpy(&f->cbuf[f->pos_tag - f->tag], &buf[nwritten], n);
+        f->pos_tag += n;
+        f->end_tag += n;
+        nwritten += n;
+    }
+    f->stats.bytes += nwritten;
+    return nwritten;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers in `iov` to `f`, in order. Returns the
+//    total number of characters written on success, or -1 if an error
+//    occurred before any characters were written.
+//
+//    Leading buffers that fit in the cache are copied into it, and
+//    trailing buffers that fit in an empty cache stay cached for later
+//    writes. Everything in between goes out with the cache's current
+//    contents in one `writev`, uncopied.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    if (f->ur || f->direct || !f->dirty.empty() || f->sh) {
+        // the io_uring engine, O_DIRECT, dirty extents, and shared files
+        // need the data copied
+        for (int i = 0; i != iovcnt; ++i) {
+            ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                                   iov[i].iov_len);
+            nwritten += std::max(n, ssize_t(0));
+            if (size_t(n) != iov[i].iov_len) {
+                return nwritten ? (ssize_t) nwritten : -1;
+            }
         }
-        ++nwritten;
+        return nwritten;
     }
-    if (nwritten != 0 || sz == 0) {
+    int i = 0;
+    while (i != iovcnt
+           && iov[i].iov_len <= size_t(f->bufsize - (f->pos_tag - f->tag))) {
+        memcpy(&f->cbuf[f->pos_tag - f->tag], iov[i].iov_base, iov[i].iov_len);
+        f->pos_tag += iov[i].iov_len;
+        f->end_tag += iov[i].iov_len;
+        nwritten += iov[i].iov_len;
+        ++i;
+    }
+    if (i == iovcnt) {
+        f->stats.bytes += nwritten;
         return nwritten;
-    } else {
-        return -1;
     }
+
+    int tail = iovcnt;
+    size_t tail_len = 0, middle_len = 0;
+    while (tail != i && tail_len + iov[tail - 1].iov_len <= size_t(f->bufsize)) {
+        --tail;
+        tail_len += iov[tail].iov_len;
+    }
+    io61_filter_out(f);
+    for (int j = i; j != tail; ++j) {
+        if (f->filter) {
+            f->filter(f->filter_arg,
+                      reinterpret_cast<const unsigned char*>(iov[j].iov_base),
+                      iov[j].iov_len, f->pos_tag + middle_len);
+        }
+        middle_len += iov[j].iov_len;
+    }
+    ssize_t n = io61_write_through(f, &iov[i], tail - i);
+    if (n < 0 || size_t(n) != middle_len) {
+        nwritten += std::max(n, ssize_t(0));
+        f->stats.bytes += nwritten;
+        return nwritten ? (ssize_t) nwritten : -1;
+    }
+    nwritten += n;
+
+    for (; tail != iovcnt; ++tail) {
+        memcpy(&f->cbuf[f->pos_tag - f->tag], iov[tail].iov_base, iov[tail].iov_len);
+        f->pos_tag += iov[tail].iov_len;
+        f->end_tag += iov[tail].iov_len;
+        nwritten += iov[tail].iov_len;
+    }
+    f->stats.bytes += nwritten;
+    return nwritten;
 }
 
 
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
-//    data buffered for reading, or do nothing.
+//    data buffered for reading, or do nothing. For a shared file (see
+//    `io61_share`), writes only the calling thread's buffered data.
 
 int io61_flush(io61_file* f) {
-    (void) f;
+    if (f->sh) {
+        return io61_shared_flush(f);
+    }
+    ++f->stats.flushes;
+    if (f->mode != O_WRONLY) {
+        return 0;
+    }
+    io61_filter_out(f);
+    if (f->ur) {
+        return io61_uring_flush(f);
+    } else if (f->direct) {
+        return io61_write_aligned(f, true);
+    } else if (!f->dirty.empty()) {
+        if (io61_stash(f) == -1) {
+            return -1;
+        }
+        return io61_write_dirty(f);
+    }
+    return io61_write_through(f, nullptr, 0) == -1 ? -1 : 0;
+}
+
+
+// io61_copy_kernel(inf, outf, n, method)
+//    Copy up to `n` bytes from `inf`'s position to `outf` inside the
+//    kernel, trying `*method` and then later methods until one applies to
+//    the two files. Returns the number of bytes copied, 0 at end of file,
+//    or -1 on error. If no method applies, sets `*method` to
+//    `copy_buffered` and returns -1.
+//
+//    `inf`'s cache must be empty and `outf`'s flushed. Inputs that don't
+//    maintain their OS file position (mapped files, files with a block
+//    cache, and pooled files) pass their offset explicitly.
+
+enum io61_copy_method {
+    copy_range, copy_sendfile, copy_splice, copy_buffered
+};
+
+static ssize_t io61_copy_kernel(io61_file* inf, io61_file* outf, size_t n,
+                                io61_copy_method* method) {
+    loff_t off = inf->mapped ? inf->pos_tag : inf->end_tag;
+    loff_t* offp = inf->mapped || inf->bc || inf->pooled ? &off : nullptr;
+    size_t len = std::min(n, size_t(1) << 30);
+    if (inf->mapped) {
+        len = std::min(len, size_t(inf->end_tag - inf->pos_tag));
+    }
+    if (len == 0) {
+        return 0;
+    }
+    while (*method != copy_buffered) {
+        ssize_t r;
+        if (*method == copy_range && !inf->pipe && !outf->pipe) {
+            r = copy_file_range(inf->fd, offp, outf->fd, nullptr, len, 0);
+        } else if (*method == copy_sendfile && !inf->pipe) {
+            r = sendfile(outf->fd, inf->fd, offp, len);
+        } else if (*method == copy_splice) {
+            r = splice(inf->fd, offp, outf->fd, nullptr, len, SPLICE_F_MOVE);
+        } else {
+            *method = io61_copy_method(*method + 1);
+            continue;
+        }
+        ++inf->stats.syscalls;
+        if (r >= 0) {
+            return r;
+        } else if (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                   || errno == EOPNOTSUPP || errno == ESPIPE) {
+            // this method doesn't apply to these files
+            *method = io61_copy_method(*method + 1);
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+// io61_copy(inf, outf, n)
+//    Copy up to `n` characters from `inf`, which must be read-only, to
+//    `outf`, which must be write-only. Returns the number of characters
+//    copied; this is less than `n` only if `inf` ended first. Returns -1
+//    if an error occurred before any characters were copied.
+//
+//    Data already in `inf`'s cache is written from there. The rest is
+//    copied inside the kernel with copy_file_range (file to file),
+//    sendfile (file to anything), or splice (pipe to anything), so large
+//    copies never pass through user space. Files using the read-ahead
+//    thread or the io_uring engine, filtered files, shared outputs, and
+//    files the kernel can't copy between, use the buffered path.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    assert(inf->mode == O_RDONLY && outf->mode == O_WRONLY);
+    size_t ncopied = 0;
+    io61_copy_method method = copy_range;
+    if (inf->ra || inf->ur || outf->ur || outf->direct || outf->sh
+        || inf->filter || outf->filter) {
+        method = copy_buffered;
+    }
+
+    while (ncopied != n) {
+        if (inf->pos_tag != inf->end_tag
+            && (method == copy_buffered || !inf->mapped)) {
+            // write cached input from the cache, which must not go to
+            // `outf` (see `io61_pool`)
+            if (inf->pooled) {
+                io61_pool_use(inf);
+            }
+            size_t k = std::min(n - ncopied, size_t(inf->end_tag - inf->pos_tag));
+            ssize_t w = io61_write(outf, reinterpret_cast<const char*>(
+                                       &inf->cbuf[inf->pos_tag - inf->tag]), k);
+            if (w > 0) {
+                inf->pos_tag += w;
+                inf->stats.bytes += w;
+                ncopied += w;
+            }
+            if (size_t(w) != k) {
+                return ncopied ? (ssize_t) ncopied : -1;
+            }
+            continue;
+        } else if (method == copy_buffered) {
+            // refill the cache
+            ssize_t r = io61_fill(inf);
+            if (r == 0) {
+                break;
+            } else if (r < 0) {
+                return ncopied ? (ssize_t) ncopied : -1;
+            }
+            continue;
+        }
+
+        if ((outf->pos_tag != outf->tag || outf->ndirty != 0)
+            && io61_flush(outf) == -1) {
+            return ncopied ? (ssize_t) ncopied : -1;
+        }
+        ssize_t r = io61_copy_kernel(inf, outf, n - ncopied, &method);
+        if (r == 0) {
+            break;
+        } else if (r < 0 && method != copy_buffered) {
+            return ncopied ? (ssize_t) ncopied : -1;
+        } else if (r > 0) {
+            if (inf->mapped) {
+                inf->pos_tag += r;
+            } else {
+                inf->tag = inf->pos_tag = inf->end_tag = inf->end_tag + r;
+            }
+            outf->tag = outf->pos_tag = outf->end_tag = outf->tag + r;
+            inf->stats.bytes += r;
+            inf->stats.io_bytes += r;
+            outf->stats.bytes += r;
+            outf->stats.io_bytes += r;
+            ncopied += r;
+        }
+    }
+    return ncopied;
+}
+
+
+// io61_set_filter(f, filter, arg)
+//    Install `filter` on `f`, replacing any previous filter; a null
+//    `filter` removes it. Returns 0 on success and -1 on error.
+//
+//    io61 calls `filter(arg, data, n, off)` on each chunk of data passing
+//    through `f`, while the chunk is in memory, where `off` is the file
+//    offset of `data[0]`. A sequentially read or written file passes each
+//    byte exactly once, in order, so the filter can checksum the stream
+//    (see `io61_checksum_filter`) without a second pass over the data.
+//    After seeks, chunks may skip ahead, go back, or repeat. Filters see
+//    reads from the cache as whole chunks when they are filled, and
+//    writes when they leave the cache: at latest on flush or close.
+//    Positional I/O isn't filtered, and filtered files don't copy inside
+//    the kernel.
+//
+//    A read-only mapped file stops being mapped so that its data streams
+//    through a cache. Data already cached for reading is passed to the new
+//    filter right away, and data written before the call goes to the old
+//    one.
+
+int io61_set_filter(io61_file* f, io61_filter_fn filter, void* arg) {
+    if (f->sh) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (f->mode == O_WRONLY) {
+        io61_filter_out(f);
+    } else if (f->mapped && filter) {
+        if ((++f->stats.syscalls, lseek(f->fd, f->pos_tag, SEEK_SET))
+            != f->pos_tag) {
+            return -1;
+        }
+        munmap(f->cbuf, f->end_tag);
+        f->mapped = false;
+        f->tag = f->end_tag = f->pos_tag;
+        f->cbuf = nullptr;
+        f->bc = io61_blockcache_create();
+        f->adaptive = !f->bc;
+        io61_resize(f, f->adaptive ? f->minbufsize : f->chunksize);
+    } else if (filter && f->pos_tag != f->end_tag) {
+        filter(arg, &f->cbuf[f->pos_tag - f->tag], f->end_tag - f->pos_tag,
+               f->pos_tag);
+    }
+    f->filter = filter;
+    f->filter_arg = arg;
+    return 0;
+}
+
+
+// io61_count(counter, n)
+//    Add `n` to a statistics counter that positional I/O may update from
+//    several threads at once.
+
+static void io61_count(unsigned long long& counter, unsigned long long n) {
+    __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+}
+
+
+// io61_positional_fd(f, buf, sz, off)
+//    Return the file descriptor for a positional transfer of `sz` bytes at
+//    `buf` and file offset `off`: `f->bfd` if `f` is an O_DIRECT file and
+//    the transfer is not page-aligned.
+
+static int io61_positional_fd(io61_file* f, const char* buf, size_t sz,
+                              off_t off) {
+    if (f->direct && ((uintptr_t) buf | sz | off) % f->pagesize != 0) {
+        return f->bfd;
+    }
+    return f->fd;
+}
+
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters from `f`, which must be read-only, at file
+//    offset `off` into `buf`. Returns the number of characters read; this
+//    is less than `sz` only if the file ended first. Returns -1 if an error
+//    occurred before any characters were read (for example, if `f` is not
+//    seekable).
+//
+//    Positional I/O neither uses nor changes `f`'s cache or file position,
+//    and several threads may call io61_pread and io61_pwrite on the same
+//    file at once. Mapped files copy from the mapping. O_DIRECT files
+//    transfer directly only if `buf`, `sz`, and `off` are page-aligned.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    assert(f->mode == O_RDONLY && off >= 0);
+    size_t nread = 0;
+    if (f->mapped) {
+        if (off < f->end_tag) {
+            nread = std::min(sz, size_t(f->end_tag - off));
+            memcpy(buf, &f->cbuf[off], nread);
+        }
+        sz = nread;
+    }
+    while (nread != sz) {
+        int fd = io61_positional_fd(f, &buf[nread], sz - nread, off + nread);
+        ssize_t n = pread(fd, &buf[nread], sz - nread, off + nread);
+        io61_count(f->stats.syscalls, 1);
+        if (n > 0) {
+            io61_count(f->stats.io_bytes, n);
+            nread += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            if (nread == 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    io61_count(f->stats.bytes, nread);
+    return nread;
+}
+
+
+// io61_pwrite(f, buf, sz, off)
+//    Write `sz` characters from `buf` to `f`, which must be write-only, at
+//    file offset `off`. Returns `sz` on success, a short count if an error
+//    occurred after some characters were written, and -1 if an error
+//    occurred before any were.
+//
+//    The write goes straight to the file. Data that io61_write cached for
+//    an overlapping range is written at the next flush and wins.
+
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off) {
+    assert(f->mode == O_WRONLY && off >= 0);
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        int fd = io61_positional_fd(f, &buf[nwritten], sz - nwritten,
+                                    off + nwritten);
+        ssize_t n = pwrite(fd, &buf[nwritten], sz - nwritten, off + nwritten);
+        io61_count(f->stats.syscalls, 1);
+        if (n > 0) {
+            io61_count(f->stats.io_bytes, n);
+            nwritten += n;
+        } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+            if (nwritten == 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    io61_count(f->stats.bytes, nwritten);
+    return nwritten;
+}
+
+
+// io61_shared
+//    Shared-writer state for a file passed to `io61_share`. Each writing
+//    thread appends to its own `io61_tbuf` without locking. When the buffer
+//    fills, the thread publishes the buffer's complete lines as one
+//    contiguous chunk, so lines from different threads never interleave
+//    (a line longer than the buffer is published in pieces).
+//
+//    A seekable file publishes a chunk by reserving the next bytes at
+//    `end` with an atomic add and writing them there with pwrite, so
+//    publishers never wait for each other. An unseekable file publishes
+//    with `write` under `lock`. `lock` also protects `tbufs`.
+//
+//    Threads find their buffers through `tbuf_cache`, keyed by `id`, which
+//    is never reused, so a stale entry can't match a later file.
+
+struct io61_tbuf {
+    std::thread::id owner;
+    size_t len = 0;             // bytes pending in `buf`
+    unsigned char buf[io61_file::chunksize];
+};
+
+struct io61_shared {
+    unsigned long long id;
+    std::atomic<off_t> end;     // file offset of the next chunk
+    std::mutex lock;
+    std::vector<io61_tbuf*> tbufs;
+};
+
+struct io61_tbuf_ref {
+    unsigned long long id;
+    io61_tbuf* tb;
+};
+
+static constexpr int tbuf_cache_size = 8;
+static thread_local io61_tbuf_ref tbuf_cache[tbuf_cache_size];
+
+
+// io61_share(f)
+//    Make write-only file `f` safe to write from several threads at once,
+//    flushing its cache. Returns 0 on success and -1 on error.
+//
+//    Afterwards io61_writec, io61_write, and io61_writev append to a
+//    buffer belonging to the calling thread, and io61_flush writes out the
+//    calling thread's buffer. Each write reaches the file as part of a
+//    contiguous chunk of whole lines. A thread's unflushed data is written
+//    when `f` is closed, which must happen after all threads stop writing.
+//    Shared files can't seek or have filters.
+
+int io61_share(io61_file* f) {
+    if (f->mode != O_WRONLY || f->filter) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->sh) {
+        return 0;
+    } else if (io61_flush(f) == -1) {
+        return -1;
+    }
+    static std::atomic<unsigned long long> next_id{1};
+    f->sh = new io61_shared;
+    f->sh->id = next_id++;
+    f->sh->end = f->pos_tag;
+    return 0;
+}
+
+
+// io61_tbuf_find(f)
+//    Return the calling thread's buffer for shared file `f`, creating it
+//    if necessary.
+
+static io61_tbuf* io61_tbuf_find(io61_file* f) {
+    io61_shared* sh = f->sh;
+    io61_tbuf_ref& ref = tbuf_cache[sh->id % tbuf_cache_size];
+    if (ref.id == sh->id) {
+        return ref.tb;
+    }
+    // a thread that exited leaves its buffer to the next thread with its ID
+    std::lock_guard<std::mutex> guard(sh->lock);
+    std::thread::id self = std::this_thread::get_id();
+    io61_tbuf* tb = nullptr;
+    for (io61_tbuf* t : sh->tbufs) {
+        if (t->owner == self) {
+            tb = t;
+            break;
+        }
+    }
+    if (!tb) {
+        tb = new io61_tbuf;
+        tb->owner = self;
+        sh->tbufs.push_back(tb);
+    }
+    ref = {sh->id, tb};
+    return tb;
+}
+
+
+// io61_publish(f, tb, n)
+//    Write the first `n` bytes of thread buffer `tb` to shared file `f` as
+//    one contiguous chunk and remove them from `tb`. Returns 0 on success
+//    and -1 on error; the bytes are removed either way.
+
+static int io61_publish(io61_file* f, io61_tbuf* tb, size_t n) {
+    io61_shared* sh = f->sh;
+    std::unique_lock<std::mutex> guard(sh->lock, std::defer_lock);
+    off_t off = 0;
+    if (f->seekable) {
+        off = sh->end.fetch_add(n);
+    } else {
+        guard.lock();
+    }
+    size_t nwritten = 0;
+    while (nwritten != n) {
+        const char* p = reinterpret_cast<const char*>(&tb->buf[nwritten]);
+        ssize_t r;
+        if (f->seekable) {
+            int fd = io61_positional_fd(f, p, n - nwritten, off + nwritten);
+            r = pwrite(fd, p, n - nwritten, off + nwritten);
+        } else {
+            r = write(f->fd, p, n - nwritten);
+        }
+        io61_count(f->stats.syscalls, 1);
+        if (r > 0) {
+            nwritten += r;
+        } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+            break;
+        }
+    }
+    io61_count(f->stats.bytes, nwritten);
+    io61_count(f->stats.io_bytes, nwritten);
+    memmove(tb->buf, &tb->buf[n], tb->len - n);
+    tb->len -= n;
+    return nwritten == n ? 0 : -1;
+}
+
+
+// io61_shared_write(f, buf, sz)
+//    `io61_write` for shared files.
+
+static ssize_t io61_shared_write(io61_file* f, const char* buf, size_t sz) {
+    io61_tbuf* tb = io61_tbuf_find(f);
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        if (tb->len == sizeof(tb->buf)) {
+            void* nl = memrchr(tb->buf, '\n', tb->len);
+            size_t n = nl ? reinterpret_cast<unsigned char*>(nl) - tb->buf + 1
+                : tb->len;
+            if (io61_publish(f, tb, n) == -1) {
+                return nwritten ? (ssize_t) nwritten : -1;
+            }
+        }
+        size_t n = std::min(sz - nwritten, sizeof(tb->buf) - tb->len);
+        memcpy(&tb->buf[tb->len], &buf[nwritten], n);
+        tb->len += n;
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+
+// io61_shared_flush(f)
+//    `io61_flush` for shared files.
+
+static int io61_shared_flush(io61_file* f) {
+    io61_count(f->stats.flushes, 1);
+    io61_tbuf* tb = io61_tbuf_find(f);
+    return tb->len ? io61_publish(f, tb, tb->len) : 0;
+}
+
+
+// io61_shared_destroy(f)
+//    Write out every thread's buffer for shared file `f` and make it an
+//    ordinary file again, positioned after all published data.
+
+static void io61_shared_destroy(io61_file* f) {
+    for (io61_tbuf* tb : f->sh->tbufs) {
+        if (tb->len) {
+            io61_publish(f, tb, tb->len);
+        }
+        delete tb;
+    }
+    if (f->seekable) {
+        f->tag = f->pos_tag = f->end_tag = f->sh->end;
+    }
+    delete f->sh;
+    f->sh = nullptr;
+}
+
+
+// io61_map_advise(f, pos)
+//    Update the madvise advice for mapped file `f` before it seeks to
+//    `pos`. Seeks more than `chunksize` bytes away from the current position
+//    count as far and near seeks count back down. Four far seeks in a row
+//    advise the mapping random, so the kernel stops reading ahead; after
+//    enough near seeks to cancel them, it is advised sequential again.
+
+static void io61_map_advise(io61_file* f, off_t pos) {
+    off_t distance = pos > f->pos_tag ? pos - f->pos_tag : f->pos_tag - pos;
+    if (distance > f->chunksize) {
+        f->nfar = std::min(f->nfar + 1, 4);
+    } else if (f->nfar > 0) {
+        --f->nfar;
+    }
+    int advice = f->nfar == 4 ? MADV_RANDOM
+        : f->nfar == 0 ? MADV_SEQUENTIAL : f->advice;
+    if (advice != f->advice) {
+        madvise(f->cbuf, f->end_tag, advice);
+        ++f->stats.syscalls;
+        f->advice = advice;
+    }
+}
+
+
+// io61_advise(f, off, len, hint)
+//    Tell io61 how the caller will access bytes [off, off + len) of `f`
+//    (through the end of the file if `len` is 0). `hint` is
+//    POSIX_FADV_WILLNEED (the bytes will be needed soon),
+//    POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, or POSIX_FADV_DONTNEED (the
+//    bytes won't be needed again). Returns 0 on success and -1 on error.
+//
+//    The hint goes to the kernel with madvise for mapped files and
+//    posix_fadvise otherwise, so WILLNEED starts reading the bytes into the
+//    page cache in the background. SEQUENTIAL and RANDOM also seed io61's
+//    own policy for the whole file: a mapping's advice and far-seek count
+//    (see `io61_map_advise`), the size of an adaptive cache, and whether a
+//    read-ahead thread keeps running.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int hint) {
+    if (off < 0 || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (f->mapped) {
+        int advice;
+        if (hint == POSIX_FADV_WILLNEED) {
+            advice = MADV_WILLNEED;
+        } else if (hint == POSIX_FADV_DONTNEED) {
+            advice = MADV_DONTNEED;
+        } else if (hint == POSIX_FADV_SEQUENTIAL || hint == POSIX_FADV_RANDOM) {
+            // the mapping has one access pattern
+            advice = hint == POSIX_FADV_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL;
+            off = len = 0;
+        } else {
+            errno = EINVAL;
+            return -1;
+        }
+        off_t start = std::min(off - off % f->pagesize, f->end_tag);
+        off_t end = len == 0 ? f->end_tag : std::min(off + len, f->end_tag);
+        if (start < end) {
+            ++f->stats.syscalls;
+            if (madvise(f->cbuf + start, end - start, advice) == -1) {
+                return -1;
+            }
+        }
+    } else {
+        ++f->stats.syscalls;
+        if (int err = posix_fadvise(f->fd, off, len, hint)) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    if (hint == POSIX_FADV_SEQUENTIAL) {
+        if (f->mapped) {
+            f->nfar = 0;
+            f->advice = MADV_SEQUENTIAL;
+        } else if (f->adaptive) {
+            // skip the slow start
+            while (f->bufsize < f->maxbufsize && io61_resize(f, f->bufsize * 2)) {
+            }
+        }
+    } else if (hint == POSIX_FADV_RANDOM) {
+        if (f->mapped) {
+            f->nfar = 4;
+            f->advice = MADV_RANDOM;
+        } else if (f->ra) {
+            // reading ahead would only waste I/O
+            io61_readahead_stop(f);
+            if (f->direct) {
+                f->bc = io61_blockcache_create();
+            } else if ((++f->stats.syscalls, lseek(f->fd, f->pos_tag, SEEK_SET))
+                       != f->pos_tag) {
+                return -1;
+            }
+        }
+        f->nseq = 0;
+    }
     return 0;
 }
 
 
+// io61_window(f, pos, start, len)
+//    Choose the window of buffered file `f` to load for a seek to `pos`,
+//    which missed the cache, based on the recent seek pattern. Sets
+//    `*start` and `*len`.
+//
+//    - No pattern: the bufsize-aligned block containing `pos`.
+//    - Forward by less than bufsize: a full buffer starting at the page
+//      containing `pos`.
+//    - Backward by less than bufsize (e.g., reverse61): a full buffer
+//      ending at the page containing `pos`.
+//    - Strides of bufsize or more: only the page containing `pos`, since
+//      the next access will miss anyway, and the page around the predicted
+//      next position is prefetched with posix_fadvise.
+
+static void io61_window(io61_file* f, off_t pos, off_t* start, off_t* len) {
+    off_t page = pos - pos % f->pagesize;
+    *len = f->bufsize;
+    if (f->nstride < 2 || f->stride == 0) {
+        *start = pos - pos % f->bufsize;
+    } else if (f->stride >= f->bufsize || f->stride <= -f->bufsize) {
+        *start = page;
+        *len = f->pagesize;
+        off_t next = pos + f->stride;
+        if (next >= 0) {
+            posix_fadvise(f->fd, next - next % f->pagesize, f->pagesize,
+                          POSIX_FADV_WILLNEED);
+            ++f->stats.syscalls;
+        }
+    } else if (f->stride > 0) {
+        *start = page;
+    } else {
+        *start = std::max(page + f->pagesize - f->bufsize, off_t(0));
+    }
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
-//    Returns 0 on success and -1 on failure.
+//    Returns 0 on success and -1 on failure. Shared files can't seek.
 
 int io61_seek(io61_file* f, off_t pos) {
-    off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
-    if (r == (off_t) pos) {
+    if (f->sh) {
+        errno = ESPIPE;
+        return -1;
+    }
+    ++f->stats.seeks;
+    if (f->mapped) {
+        if (pos < 0) {
+            return -1;
+        }
+        ++f->stats.hits;
+        io61_map_advise(f, pos);
+        f->pos_tag = std::min(pos, f->end_tag);
         return 0;
-    } else {
+    }
+    if (f->mode == O_RDONLY) {
+        off_t delta = pos - f->seek_pos;
+        f->nstride = delta == f->stride ? f->nstride + 1 : 0;
+        f->stride = delta;
+        f->seek_pos = pos;
+        if (pos >= f->tag && pos <= f->end_tag) {
+            ++f->stats.hits;
+            f->pos_tag = pos;
+            return 0;
+        }
+        if (f->ra) {
+            // seeking readers aren't sequential
+            io61_readahead_stop(f);
+            if (f->direct) {
+                f->bc = io61_blockcache_create();
+            }
+        }
+        if (f->nstride >= 2) {
+            f->nseq = 0;
+        } else if (f->adaptive) {
+            // the cache is being replaced, so it may shrink
+            f->tag = f->end_tag = f->pos_tag;
+            io61_adapt(f, true);
+        }
+        bool stream = false;
+        if (f->pooled) {
+            // a reader that isn't streaming gets a mapping instead
+            f->nseq = 0;
+            stream = io61_pool_streaming(f);
+            f->nfar = stream ? 0 : f->nfar + 1;
+            if (f->nfar >= 4 && io61_pool_map(f)) {
+                f->pos_tag = std::min(pos, f->end_tag);
+                return 0;
+            } else if (io61_pool_use(f) == -1) {
+                return -1;
+            }
+        }
+        off_t start, len;
+        io61_window(f, pos, &start, &len);
+        if (f->bc && (len == f->bufsize || f->direct)) {
+            // the block cache keeps aligned blocks; O_DIRECT files have
+            // no page cache to serve smaller windows
+            start = pos - pos % f->bc->blocksize;
+            len = f->bufsize;
+        }
+        if (!f->bc && !f->pooled
+            && (++f->stats.syscalls, lseek(f->fd, start, SEEK_SET) != start)) {
+            return -1;
+        }
+        if (stream) {
+            io61_drop_behind(f, f->tag, f->end_tag - f->tag);
+        }
+        f->tag = f->end_tag = f->pos_tag = start;
+        if (io61_fill(f, len) == -1) {
+            return -1;
+        }
+        f->pos_tag = std::min(pos, f->end_tag);
+        return 0;
+    }
+    if (pos == f->pos_tag && f->seekable) {
+        return 0;
+    }
+    io61_filter_out(f);
+    int r = f->ur ? io61_uring_spill(f)
+        : f->seekable && !f->direct && !f->pooled ? io61_stash(f)
+        : io61_flush(f);
+    if (r == 0) {
+        io61_adapt(f, true);
+    }
+    if (r == -1 || (++f->stats.syscalls, lseek(f->fd, pos, SEEK_SET) != pos)) {
         return -1;
     }
+    f->tag = f->end_tag = f->pos_tag = f->ftag = pos;
+    return 0;
 }
 
 
@@ -149,11 +2614,22 @@ int io61_seek(io61_file* f, off_t pos) {
 //    If `!filename`, returns either the standard input or the
 //    standard output, depending on `mode`. Exits with an error message if
 //    `filename != nullptr` and the named file cannot be opened.
+//
+//    `mode` may include O_DIRECT, as may named files if IO61_DIRECT is
+//    set; files on file systems without O_DIRECT support are opened
+//    without it.
 
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
+        if (io61_env_flag("IO61_DIRECT")) {
+            mode |= O_DIRECT;
+        }
         fd = open(filename, mode, 0666);
+        if (fd < 0 && errno == EINVAL && (mode & O_DIRECT)) {
+            mode &= ~O_DIRECT;
+            fd = open(filename, mode, 0666);
+        }
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -163,7 +2639,11 @@ io61_file* io61_open_check(const char* filename, int mode) {
         fprintf(stderr, "%s: %s\n", filename, strerror(errno));
         exit(1);
     }
-    return io61_fdopen(fd, mode & O_ACCMODE);
+    io61_file* f = io61_fdopen(fd, mode & (O_ACCMODE | O_DIRECT));
+    f->name = filename ? filename
+        : (mode & O_ACCMODE) == O_RDONLY ? "<stdin>" : "<stdout>";
+    ++f->stats.syscalls;        // the open
+    return f;
 }
 
 
@@ -4,9 +4,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cstdint>
 #include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 struct io61_file;
 
@@ -17,23 +19,85 @@ int io61_close(io61_file* f);
 off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t pos);
+int io61_advise(io61_file* f, off_t off, off_t len, int hint);
 
 int io61_readc(io61_file* f);
 int io61_writec(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz);
+ssize_t io61_getline(io61_file* f, const char** line);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off);
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off);
 
 int io61_flush(io61_file* f);
+int io61_share(io61_file* f);
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n);
+
+typedef void (*io61_filter_fn)(void* arg, const unsigned char* data,
+                               size_t n, off_t off);
+int io61_set_filter(io61_file* f, io61_filter_fn filter, void* arg);
+
+template <typename F>
+inline int io61_set_filter(io61_file* f, F& fn) {
+    return io61_set_filter(f, [] (void* arg, const unsigned char* data,
+                                  size_t n, off_t off) {
+        (*reinterpret_cast<F*>(arg))(data, n, off);
+    }, &fn);
+}
 
 void io61_profile_begin();
 void io61_profile_end();
 
 
+struct io61_stats {
+    unsigned long long syscalls = 0;    // system calls made for the file
+    unsigned long long bytes = 0;       // bytes read or written by callers
+    unsigned long long io_bytes = 0;    // bytes moved by system calls
+    unsigned long long hits = 0;        // refills and seeks served from memory
+    unsigned long long misses = 0;      // refills and seeks that needed I/O
+    unsigned long long seeks = 0;
+    unsigned long long flushes = 0;
+};
+
+void io61_profile_file(const char* name, int fd, int mode,
+                       const io61_stats& stats);
+
+
+uint32_t io61_crc32c(uint32_t crc, const void* data, size_t n);
+
+struct io61_xxh64 {
+    uint64_t v[4];              // stripe accumulators
+    unsigned char mem[32];      // partial stripe
+    size_t memsize;
+    uint64_t total;             // bytes hashed
+
+    io61_xxh64(uint64_t seed = 0);
+    void update(const void* data, size_t n);
+    uint64_t digest() const;
+};
+
+struct io61_checksum {
+    uint32_t crc32c = 0;
+    io61_xxh64 xxh64;
+    unsigned long long nbytes = 0;  // bytes checksummed
+    off_t next = 0;             // file offset after the last chunk
+    bool ordered = true;        // chunks arrived in file order, no gaps
+};
+
+void io61_checksum_filter(void* arg, const unsigned char* data, size_t n,
+                          off_t off);
+
+
 struct io61_arguments {
     size_t input_size;          // `-s` option: input size. Default SIZE_MAX
     size_t block_size;          // `-b` option: block size. Default 0
     size_t stride;              // `-t` option: stride. Default 1024
+    size_t nthreads;            // `-j` option: thread count. Default 0
     bool lines;                 // `-l` option: read by lines. Default false
     const char* output_file;    // `-o` option: output file. Default nullptr
     const char* input_file;     // input file. Default nullptr
@@ -0,0 +1,60 @@
+#include "io61.hh"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// Usage: ./parcat61 [-b CHUNKSIZE] [-j NTHREADS] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in parallel. NTHREADS threads
+//    (default: one per CPU) repeatedly claim the next CHUNKSIZE bytes
+//    (default 1MB) of the input and copy them with io61_pread and
+//    io61_pwrite. If either file is not seekable, copies sequentially
+//    with io61_copy instead.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "b:j:o:");
+    size_t chunk_size = args.block_size ? args.block_size : 1 << 20;
+    size_t nthreads = args.nthreads ? args.nthreads
+        : std::max(std::thread::hardware_concurrency(), 1U);
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    off_t size = io61_filesize(inf);
+    if (size < 0 || io61_filesize(outf) < 0) {
+        io61_copy(inf, outf, SIZE_MAX);
+    } else {
+        // Copy chunks on `nthreads` threads
+        std::atomic<off_t> next_off{0};
+        auto copy_chunks = [&] {
+            // page-aligned, so O_DIRECT files can transfer directly
+            char* buf = reinterpret_cast<char*>(aligned_alloc(4096, chunk_size));
+            off_t off;
+            while ((off = next_off.fetch_add(chunk_size)) < size) {
+                size_t len = std::min(chunk_size, size_t(size - off));
+                ssize_t amount = io61_pread(inf, buf, len, off);
+                if (amount <= 0) {
+                    break;
+                }
+                io61_pwrite(outf, buf, amount, off);
+            }
+            free(buf);
+        };
+
+        size_t nchunks = (size + chunk_size - 1) / chunk_size;
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(nthreads, nchunks); ++i) {
+            threads.emplace_back(copy_chunks);
+        }
+        copy_chunks();
+        for (auto& th : threads) {
+            th.join();
+        }
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -2,18 +2,70 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <cerrno>
+#include <string>
+#include <algorithm>
 
 // profile61.c
 //    The profile functions measure how much time and memory are used
 //    by your code. The io61_profile_end() function prints a simple
 //    report to standard error. The io61_parse_arguments() function
 //    parses common arguments into a structure.
+//
+//    The report includes a "files" array with the statistics of every
+//    file closed since io61_profile_begin(), as recorded by
+//    io61_profile_file(), plus their total system calls and bytes moved
+//    and the resulting throughput in bytes per second of elapsed time.
 
 static struct timeval tv_begin;
+static std::string file_reports;
+static unsigned long long total_syscalls, total_io_bytes;
+
+static void append_json_string(std::string& out, const char* str) {
+    out += '\"';
+    for (; *str; ++str) {
+        unsigned char ch = *str;
+        if (ch == '\"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    out += '\"';
+}
+
+void io61_profile_file(const char* name, int fd, int mode,
+                       const io61_stats& stats) {
+    if (!file_reports.empty()) {
+        file_reports += ", ";
+    }
+    file_reports += "{\"name\":";
+    if (name) {
+        append_json_string(file_reports, name);
+    } else {
+        file_reports += "null";
+    }
+    char buf[400];
+    sprintf(buf, ", \"fd\":%d, \"mode\":\"%s\", \"syscalls\":%llu, "
+            "\"bytes\":%llu, \"io_bytes\":%llu, \"hits\":%llu, "
+            "\"misses\":%llu, \"seeks\":%llu, \"flushes\":%llu}",
+            fd, (mode & O_ACCMODE) == O_RDONLY ? "r" : "w", stats.syscalls,
+            stats.bytes, stats.io_bytes, stats.hits, stats.misses,
+            stats.seeks, stats.flushes);
+    file_reports += buf;
+    total_syscalls += stats.syscalls;
+    total_io_bytes += stats.io_bytes;
+}
 
 void io61_profile_begin() {
     int r = gettimeofday(&tv_begin, 0);
     assert(r >= 0);
+    file_reports.clear();
+    total_syscalls = total_io_bytes = 0;
 }
 
 void io61_profile_end() {
@@ -32,11 +84,14 @@ void io61_profile_end() {
     timeradd(&usage.ru_stime, &cusage.ru_stime, &usage.ru_stime);
 
     char buf[1000];
-    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
-                      tv_end.tv_sec, (long) tv_end.tv_usec,
-                      usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
-                      usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
-                      usage.ru_maxrss + cusage.ru_maxrss);
+    sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld, \"syscalls\":%llu, \"io_bytes\":%llu, \"throughput\":%.0f, \"files\":[",
+            tv_end.tv_sec, (long) tv_end.tv_usec,
+            usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+            usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
+            usage.ru_maxrss + cusage.ru_maxrss,
+            total_syscalls, total_io_bytes,
+            total_io_bytes / std::max(tv_end.tv_sec + tv_end.tv_usec / 1e6, 1e-6));
+    std::string report = buf + file_reports + "]}\n";
 
     // Print the report to file descriptor 100 if it's available. Our
     // `check.pl` test harness uses this file descriptor.
@@ -45,8 +100,8 @@ void io61_profile_end() {
     if (fd == STDERR_FILENO) {
         fflush(stderr);
     }
-    ssize_t nwritten = write(fd, buf, len);
-    assert(nwritten == len);
+    ssize_t nwritten = write(fd, report.data(), report.size());
+    assert(nwritten == (ssize_t) report.size());
 }
 
 
@@ -54,6 +109,7 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
     input_size = -1;
     block_size = 0;
     stride = 1024;
+    nthreads = 0;
     lines = false;
     output_file = input_file = nullptr;
     opts = opts_;
@@ -81,6 +137,12 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
                 goto usage;
             }
             break;
+        case 'j':
+            nthreads = (size_t) strtoul(optarg, &endptr, 0);
+            if (nthreads == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case 'l':
             lines = true;
             break;
@@ -139,6 +201,9 @@ void io61_arguments::usage() {
     if (strchr(opts, 't')) {
         fprintf(stderr, " [-t STRIDE]");
     }
+    if (strchr(opts, 'j')) {
+        fprintf(stderr, " [-j NTHREADS]");
+    }
     if (strchr(opts, 'l')) {
         fprintf(stderr, " [-l]");
     }
@@ -29,6 +29,9 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "reordercat61: input file is not seekable\n");
         exit(1);
     }
+    // Every block will be read, in random order
+    io61_advise(inf, 0, args.input_size, POSIX_FADV_RANDOM);
+    io61_advise(inf, 0, args.input_size, POSIX_FADV_WILLNEED);
 
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
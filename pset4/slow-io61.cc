@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <climits>
 #include <cerrno>
+#include <string>
 
 // slow-io61.c
 //    This is a copy of the handout version of io61.c.
@@ -13,6 +14,10 @@
 
 struct io61_file {
     int fd;
+    std::string line;           // `io61_getline` buffer
+    io61_filter_fn filter = nullptr;
+    void* filter_arg = nullptr;
+    off_t filter_pos = 0;       // file offset of the next filtered byte
 };
 
 
@@ -48,6 +53,9 @@ int io61_close(io61_file* f) {
 int io61_readc(io61_file* f) {
     unsigned char buf[1];
     if (read(f->fd, buf, 1) == 1) {
+        if (f->filter) {
+            f->filter(f->filter_arg, buf, 1, f->filter_pos++);
+        }
         return buf[0];
     } else {
         return EOF;
@@ -81,6 +89,49 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Read characters from `f` into `buf` up to and including the next
+//    newline, stopping after `sz` characters. Returns the number of
+//    characters read, which is 0 at end of file, or -1 if an error
+//    occurred before any characters were read.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        int ch = io61_readc(f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[nread] = ch;
+        ++nread;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_getline(f, line)
+//    Read the next line from `f`, including its newline (the file's last
+//    line may lack one), and set `*line` to point at it. Returns the
+//    line's length, 0 at end of file, or -1 if an error occurred before
+//    any characters were read. `*line` is valid until the next call on `f`.
+
+ssize_t io61_getline(io61_file* f, const char** line) {
+    f->line.clear();
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        f->line += (char) ch;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    *line = f->line.data();
+    return f->line.size();
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
@@ -89,6 +140,9 @@ int io61_writec(io61_file* f, int ch) {
     unsigned char buf[1];
     buf[0] = ch;
     if (write(f->fd, buf, 1) == 1) {
+        if (f->filter) {
+            f->filter(f->filter_arg, buf, 1, f->filter_pos++);
+        }
         return 0;
     } else {
         return -1;
@@ -128,6 +182,93 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_share(f)
+//    Make write-only file `f` safe to write from several threads at once.
+//    Unbuffered files are already safe, though lines from different
+//    threads may interleave. Returns 0.
+
+int io61_share(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_filter(f, filter, arg)
+//    Install `filter` on `f`, replacing any previous filter; a null
+//    `filter` removes it. io61 calls `filter(arg, data, n, off)` on every
+//    character read from or written to `f`, where `off` is the
+//    character's file offset. Returns 0.
+
+int io61_set_filter(io61_file* f, io61_filter_fn filter, void* arg) {
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    f->filter = filter;
+    f->filter_arg = arg;
+    f->filter_pos = pos < 0 ? 0 : pos;
+    return 0;
+}
+
+
+// io61_copy(inf, outf, n)
+//    Copy up to `n` characters from `inf`, which must be read-only, to
+//    `outf`, which must be write-only. Returns the number of characters
+//    copied; this is less than `n` only if `inf` ended first. Returns -1
+//    if an error occurred before any characters were copied.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    size_t ncopied = 0;
+    while (ncopied != n) {
+        int ch = io61_readc(inf);
+        if (ch == EOF || io61_writec(outf, ch) == -1) {
+            break;
+        }
+        ++ncopied;
+    }
+    return ncopied;
+}
+
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters from `f` at file offset `off` into `buf`,
+//    without changing the file position. Returns the number of characters
+//    read, or -1 if an error occurred before any characters were read.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t n = pread(f->fd, &buf[nread], sz - nread, off + nread);
+        if (n <= 0) {
+            if (n < 0 && nread == 0) {
+                return -1;
+            }
+            break;
+        }
+        nread += n;
+    }
+    return nread;
+}
+
+
+// io61_pwrite(f, buf, sz, off)
+//    Write `sz` characters from `buf` to `f` at file offset `off`, without
+//    changing the file position. Returns the number of characters written,
+//    or -1 if an error occurred before any characters were written.
+
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off) {
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        ssize_t n = pwrite(f->fd, &buf[nwritten], sz - nwritten, off + nwritten);
+        if (n <= 0) {
+            if (nwritten == 0) {
+                return -1;
+            }
+            break;
+        }
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
@@ -135,6 +276,7 @@ int io61_flush(io61_file* f) {
 int io61_seek(io61_file* f, off_t pos) {
     off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
     if (r == (off_t) pos) {
+        f->filter_pos = pos;
         return 0;
     } else {
         return -1;
@@ -144,16 +286,30 @@ int io61_seek(io61_file* f, off_t pos) {
 
 // You shouldn't need to change these functions.
 
+// io61_advise(f, off, len, hint)
+//    Pass a posix_fadvise hint about bytes [off, off + len) of `f` to the
+//    kernel. Returns 0 on success and -1 on error.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int hint) {
+    if (int err = posix_fadvise(f->fd, off, len, hint)) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+
 // io61_open_check(filename, mode)
 //    Open the file corresponding to `filename` and return its io61_file.
 //    If `!filename`, returns either the standard input or the
 //    standard output, depending on `mode`. Exits with an error message if
 //    `filename != nullptr` and the named file cannot be opened.
+//    O_DIRECT in `mode` is ignored.
 
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
-        fd = open(filename, mode, 0666);
+        fd = open(filename, mode & ~O_DIRECT, 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
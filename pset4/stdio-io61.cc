@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
 
 // stdio-io61.c
 //    This version of io61.c is a simple wrapper on stdio. Can you beat it?
@@ -13,9 +14,26 @@
 
 struct io61_file {
     FILE* f;
+    char* line = nullptr;       // `io61_getline` buffer
+    size_t linecap = 0;
+    io61_filter_fn filter = nullptr;
+    void* filter_arg = nullptr;
+    off_t filter_pos = 0;       // file offset of the next filtered byte
 };
 
 
+// io61_filter_chunk(f, data, n)
+//    Pass `n` bytes just read from or written to `f` to its filter.
+
+static void io61_filter_chunk(io61_file* f, const void* data, size_t n) {
+    if (f->filter && n != 0) {
+        f->filter(f->filter_arg, reinterpret_cast<const unsigned char*>(data),
+                  n, f->filter_pos);
+        f->filter_pos += n;
+    }
+}
+
+
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
 //    either O_RDONLY for a read-only file or O_WRONLY for a
@@ -35,6 +53,7 @@ io61_file* io61_fdopen(int fd, int mode) {
 int io61_close(io61_file* f) {
     io61_flush(f);
     int r = fclose(f->f);
+    free(f->line);
     delete f;
     return r;
 }
@@ -45,7 +64,12 @@ int io61_close(io61_file* f) {
 //    (which is -1) on error or end-of-file.
 
 int io61_readc(io61_file* f) {
-    return fgetc(f->f);
+    int ch = fgetc(f->f);
+    if (ch != EOF && f->filter) {
+        unsigned char c = ch;
+        io61_filter_chunk(f, &c, 1);
+    }
+    return ch;
 }
 
 
@@ -58,6 +82,7 @@ int io61_readc(io61_file* f) {
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
     size_t n = fread(buf, 1, sz, f->f);
+    io61_filter_chunk(f, buf, n);
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -66,12 +91,63 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Read characters from `f` into `buf` up to and including the next
+//    newline, stopping after `sz` characters. Returns the number of
+//    characters read, which is 0 at end of file, or -1 if an error
+//    occurred before any characters were read.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t n = 0;
+    while (n != sz) {
+        int ch = fgetc(f->f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[n] = ch;
+        ++n;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    io61_filter_chunk(f, buf, n);
+    if (n != 0 || sz == 0 || !ferror(f->f)) {
+        return (ssize_t) n;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_getline(f, line)
+//    Read the next line from `f`, including its newline (the file's last
+//    line may lack one), and set `*line` to point at it. Returns the
+//    line's length, 0 at end of file, or -1 if an error occurred before
+//    any characters were read. `*line` is valid until the next call on `f`.
+
+ssize_t io61_getline(io61_file* f, const char** line) {
+    ssize_t n = getline(&f->line, &f->linecap, f->f);
+    if (n >= 0) {
+        io61_filter_chunk(f, f->line, n);
+        *line = f->line;
+        return n;
+    } else {
+        return ferror(f->f) ? -1 : 0;
+    }
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 
 int io61_writec(io61_file* f, int ch) {
-    return fputc(ch, f->f);
+    int r = fputc(ch, f->f);
+    if (r != EOF && f->filter) {
+        unsigned char c = ch;
+        io61_filter_chunk(f, &c, 1);
+    }
+    return r;
 }
 
 
@@ -82,6 +158,7 @@ int io61_writec(io61_file* f, int ch) {
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
     size_t n = fwrite(buf, 1, sz, f->f);
+    io61_filter_chunk(f, buf, n);
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -100,12 +177,123 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_share(f)
+//    Make write-only file `f` safe to write from several threads at once.
+//    stdio streams lock themselves on every call, so there is nothing to
+//    do, though lines from different threads may interleave. Returns 0.
+
+int io61_share(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_filter(f, filter, arg)
+//    Install `filter` on `f`, replacing any previous filter; a null
+//    `filter` removes it. io61 calls `filter(arg, data, n, off)` on the
+//    data of every read and write on `f`, where `off` is the file offset
+//    of `data[0]`. Returns 0.
+
+int io61_set_filter(io61_file* f, io61_filter_fn filter, void* arg) {
+    off_t pos = ftello(f->f);
+    f->filter = filter;
+    f->filter_arg = arg;
+    f->filter_pos = pos < 0 ? 0 : pos;
+    return 0;
+}
+
+
+// io61_copy(inf, outf, n)
+//    Copy up to `n` characters from `inf`, which must be read-only, to
+//    `outf`, which must be write-only. Returns the number of characters
+//    copied; this is less than `n` only if `inf` ended first. Returns -1
+//    if an error occurred before any characters were copied.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied != n) {
+        size_t k = fread(buf, 1, std::min(n - ncopied, sizeof(buf)), inf->f);
+        io61_filter_chunk(inf, buf, k);
+        if (k == 0 || fwrite(buf, 1, k, outf->f) != k) {
+            break;
+        }
+        io61_filter_chunk(outf, buf, k);
+        ncopied += k;
+    }
+    if (ncopied != 0 || n == 0 || (!ferror(inf->f) && !ferror(outf->f))) {
+        return (ssize_t) ncopied;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters from `f` at file offset `off` into `buf`,
+//    without changing the file position. Returns the number of characters
+//    read, or -1 if an error occurred before any characters were read.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t n = pread(fileno(f->f), &buf[nread], sz - nread, off + nread);
+        if (n <= 0) {
+            if (n < 0 && nread == 0) {
+                return -1;
+            }
+            break;
+        }
+        nread += n;
+    }
+    return nread;
+}
+
+
+// io61_pwrite(f, buf, sz, off)
+//    Write `sz` characters from `buf` to `f` at file offset `off`, without
+//    changing the file position. Returns the number of characters written,
+//    or -1 if an error occurred before any characters were written.
+
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off) {
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        ssize_t n = pwrite(fileno(f->f), &buf[nwritten], sz - nwritten, off + nwritten);
+        if (n <= 0) {
+            if (nwritten == 0) {
+                return -1;
+            }
+            break;
+        }
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
-    return fseek(f->f, pos, SEEK_SET);
+    int r = fseek(f->f, pos, SEEK_SET);
+    if (r == 0) {
+        f->filter_pos = pos;
+    }
+    return r;
+}
+
+
+// io61_advise(f, off, len, hint)
+//    Pass a posix_fadvise hint about bytes [off, off + len) of `f` to the
+//    kernel. Returns 0 on success and -1 on error.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int hint) {
+    if (int err = posix_fadvise(fileno(f->f), off, len, hint)) {
+        errno = err;
+        return -1;
+    }
+    return 0;
 }
 
 
@@ -116,11 +304,12 @@ int io61_seek(io61_file* f, off_t pos) {
 //    If `!filename`, returns either the standard input or the
 //    standard output, depending on `mode`. Exits with an error message if
 //    `filename != nullptr` and the named file cannot be opened.
+//    O_DIRECT in `mode` is ignored.
 
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
-        fd = open(filename, mode, 0666);
+        fd = open(filename, mode & ~O_DIRECT, 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
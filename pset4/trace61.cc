@@ -0,0 +1,273 @@
+#include "trace61.hh"
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// trace61.cc
+//    The tracing runtime: per-thread event rings, and the Chrome trace
+//    writer. See `trace61.hh`.
+
+std::atomic<int> trace61_state{0};
+
+
+// trace61_event
+//    One recorded event. For an async event, `arg` is its ID.
+
+struct trace61_event {
+    uint64_t start;
+    uint64_t end;
+    const char* name;
+    uint64_t arg;
+    uint32_t tid;
+    uint32_t async;
+};
+
+
+// trace61_ring
+//    A ring of events written by one thread at a time. `head` counts the
+//    events ever recorded; only the writing thread changes it. Rings are
+//    never freed: a thread's ring is kept for the trace when the thread
+//    exits, and reused by a later thread.
+
+struct trace61_ring {
+    std::unique_ptr<trace61_event[]> events;
+    std::atomic<uint64_t> head{0};
+    trace61_ring* next;                // in `all_rings`
+    trace61_ring* next_free;           // in `free_rings`
+};
+
+static std::mutex ring_lock;
+static trace61_ring* all_rings;
+static trace61_ring* free_rings;
+static size_t ring_size;               // events per ring, a power of 2
+static std::atomic<uint32_t> next_tid{1};
+
+static std::string trace_file;
+static pid_t trace_pid;                // process that started tracing
+static uint64_t start_tsc;             // `trace61_now()` and
+static uint64_t start_ns;              //   CLOCK_MONOTONIC at start
+
+
+// my_ring, ring_owner
+//    The calling thread's ring and thread ID. `ring_owner` returns the
+//    ring to `free_rings` when its thread exits.
+
+static thread_local trace61_ring* my_ring;
+static thread_local uint32_t my_tid;
+
+struct ring_owner {
+    ~ring_owner() {
+        if (my_ring) {
+            std::lock_guard<std::mutex> guard(ring_lock);
+            my_ring->next_free = free_rings;
+            free_rings = my_ring;
+            my_ring = nullptr;
+        }
+    }
+};
+static thread_local ring_owner my_ring_owner;
+
+static trace61_ring* current_ring() {
+    if (!my_ring) {
+        (void) &my_ring_owner;  // register the thread-exit release
+        my_tid = next_tid++;
+        std::lock_guard<std::mutex> guard(ring_lock);
+        if (free_rings) {
+            my_ring = free_rings;
+            free_rings = my_ring->next_free;
+        } else {
+            my_ring = new trace61_ring;
+            my_ring->events.reset(new trace61_event[ring_size]);
+            my_ring->next = all_rings;
+            all_rings = my_ring;
+        }
+    }
+    return my_ring;
+}
+
+
+static void push_event(const char* name, uint64_t start, uint64_t end,
+                       uint64_t arg, bool async) {
+    if (!trace61_enabled()) {
+        return;
+    }
+    trace61_ring* ring = current_ring();
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    ring->events[h & (ring_size - 1)] = {
+        start, end, name, arg, my_tid, async
+    };
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+void trace61_record(const char* name, uint64_t start, uint64_t end,
+                    uint64_t arg) {
+    push_event(name, start, end, arg, false);
+}
+
+void trace61_record_async(const char* name, uint64_t id,
+                          uint64_t start, uint64_t end) {
+    push_event(name, start, end, id, true);
+}
+
+
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void append_json_string(std::string& out, const char* str) {
+    out += '\"';
+    for (; *str; ++str) {
+        unsigned char ch = *str;
+        if (ch == '\"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    out += '\"';
+}
+
+
+// trace61_write()
+//    Write the trace file. Timestamps are converted to microseconds of
+//    CLOCK_MONOTONIC, so traces from several processes line up.
+
+static void trace61_write() {
+    static bool written = false;
+    if (written || trace61_state.load() <= 0) {
+        return;
+    }
+    written = true;
+    std::string path = trace_file;
+    size_t pct = path.find("%p");
+    if (pct != std::string::npos) {
+        path.replace(pct, 2, std::to_string(getpid()));
+    } else if (getpid() != trace_pid) {
+        return;
+    }
+
+    // time-stamp counter ticks per nanosecond
+    uint64_t end_tsc = trace61_now(), end_ns = monotonic_ns();
+    double tpns = 1;
+    if (end_ns > start_ns && end_tsc > start_tsc) {
+        tpns = double(end_tsc - start_tsc) / (end_ns - start_ns);
+    }
+    auto usec = [&] (uint64_t tsc) {
+        return (start_ns + (double(tsc) - double(start_tsc)) / tpns) / 1000;
+    };
+
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "trace61: %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    int pid = getpid();
+    std::string name;
+    append_json_string(name, program_invocation_short_name);
+    fprintf(f, "{\"traceEvents\":[\n"
+            "{\"ph\":\"M\", \"name\":\"process_name\", \"pid\":%d, "
+            "\"args\":{\"name\":%s}}", pid, name.c_str());
+
+    unsigned long long overwritten = 0;
+    std::lock_guard<std::mutex> guard(ring_lock);
+    for (trace61_ring* ring = all_rings; ring; ring = ring->next) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t n = std::min<uint64_t>(head, ring_size);
+        overwritten += head - n;
+        for (uint64_t i = head - n; i != head; ++i) {
+            const trace61_event& ev = ring->events[i & (ring_size - 1)];
+            name.clear();
+            append_json_string(name, ev.name);
+            if (ev.async) {
+                fprintf(f, ",\n{\"ph\":\"b\", \"cat\":\"async\", "
+                        "\"name\":%s, \"id\":\"0x%llx\", \"pid\":%d, "
+                        "\"tid\":%u, \"ts\":%.3f}"
+                        ",\n{\"ph\":\"e\", \"cat\":\"async\", "
+                        "\"name\":%s, \"id\":\"0x%llx\", \"pid\":%d, "
+                        "\"tid\":%u, \"ts\":%.3f}",
+                        name.c_str(), (unsigned long long) ev.arg, pid,
+                        ev.tid, usec(ev.start),
+                        name.c_str(), (unsigned long long) ev.arg, pid,
+                        ev.tid, usec(ev.end));
+            } else {
+                fprintf(f, ",\n{\"ph\":\"X\", \"name\":%s, \"pid\":%d, "
+                        "\"tid\":%u, \"ts\":%.3f, \"dur\":%.3f, "
+                        "\"args\":{\"arg\":%llu}}",
+                        name.c_str(), pid, ev.tid, usec(ev.start),
+                        usec(ev.end) - usec(ev.start),
+                        (unsigned long long) ev.arg);
+            }
+        }
+    }
+    fprintf(f, "\n],\n\"displayTimeUnit\":\"ns\", "
+            "\"otherData\":{\"overwritten\":%llu}}\n", overwritten);
+    fclose(f);
+}
+
+
+static void trace61_signal_handler(int signo) {
+    trace61_write();
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+
+// trace61_start()
+//    Decide whether to trace, from the environment: `TRACE61` names the
+//    trace file, and `TRACE61_EVENTS` sets the number of events each
+//    thread keeps (default 65536). If tracing, the trace is written at
+//    exit, or when SIGINT or SIGTERM kills the process, unless the
+//    program handles those signals itself. Writing from a signal handler
+//    is not async-signal-safe, so that trace is a best effort.
+
+bool trace61_start() {
+    static std::once_flag once;
+    std::call_once(once, [] () {
+        const char* file = getenv("TRACE61");
+        if (!file || !*file) {
+            trace61_state = -1;
+            return;
+        }
+        trace_file = file;
+        trace_pid = getpid();
+        ring_size = 65536;
+        if (const char* s = getenv("TRACE61_EVENTS")) {
+            size_t want = strtoul(s, nullptr, 0);
+            ring_size = 16;
+            while (ring_size < want && ring_size < (size_t(1) << 30)) {
+                ring_size <<= 1;
+            }
+        }
+        start_tsc = trace61_now();
+        start_ns = monotonic_ns();
+
+        atexit(trace61_write);
+        static const int signos[] = {SIGINT, SIGTERM};
+        for (int signo : signos) {
+            struct sigaction sa;
+            if (sigaction(signo, nullptr, &sa) == 0
+                && sa.sa_handler == SIG_DFL) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = trace61_signal_handler;
+                sigemptyset(&sa.sa_mask);
+                sigaction(signo, &sa, nullptr);
+            }
+        }
+        trace61_state = 1;
+    });
+    return trace61_state > 0;
+}
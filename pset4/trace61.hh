@@ -0,0 +1,115 @@
+#ifndef TRACE61_HH
+#define TRACE61_HH
+#include <cstdint>
+
+// trace61.hh
+//    Lightweight event tracing, shared by the user-space psets. Build with
+//    `make TRACE=1` (see `trace61.mk`) and run with `TRACE61=FILE` in the
+//    environment; the program writes a Chrome trace, which Perfetto and
+//    chrome://tracing can show as a timeline, to FILE when it exits. A
+//    `%p` in FILE is replaced by the process ID, so each process of a
+//    multi-process run writes its own file; otherwise only the process
+//    that started tracing writes one.
+//
+//    Each thread records events into its own ring buffer without locking.
+//    When a ring fills, its oldest events are overwritten. Timestamps are
+//    read from the CPU's time-stamp counter where there is one.
+//
+//    Unless `TRACE61` is defined, the macros below compile to nothing.
+
+#if TRACE61
+#include <atomic>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// trace61_now()
+///    Return the current timestamp, in time-stamp counter ticks.
+inline uint64_t trace61_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/// trace61_enabled()
+///    Return true if this process is tracing. The first call checks the
+///    environment.
+extern std::atomic<int> trace61_state;      // 0 unknown, 1 on, -1 off
+bool trace61_start();
+inline bool trace61_enabled() {
+    int state = trace61_state.load(std::memory_order_relaxed);
+    return state > 0 || (state == 0 && trace61_start());
+}
+
+/// trace61_record(name, start, end, arg)
+///    Record an event `name` on the calling thread from timestamp `start`
+///    to `end`, with argument `arg`. Events on a thread should nest.
+///    `name` must live as long as the program: a string literal, say.
+void trace61_record(const char* name, uint64_t start, uint64_t end,
+                    uint64_t arg);
+
+/// trace61_record_async(name, id, start, end)
+///    Record an event `name` that needn't nest in its thread's other
+///    events, such as one phase of a request that an event loop serves
+///    alongside others. Events with the same `id` are shown together.
+void trace61_record_async(const char* name, uint64_t id,
+                          uint64_t start, uint64_t end);
+
+/// trace61_scope
+///    Records an event for its own lifetime.
+class trace61_scope {
+public:
+    trace61_scope(const char* name, uint64_t arg)
+        : name_(trace61_enabled() ? name : nullptr), arg_(arg),
+          start_(name_ ? trace61_now() : 0) {
+    }
+    ~trace61_scope() {
+        if (name_) {
+            trace61_record(name_, start_, trace61_now(), arg_);
+        }
+    }
+    trace61_scope(const trace61_scope&) = delete;
+    trace61_scope& operator=(const trace61_scope&) = delete;
+
+private:
+    const char* name_;
+    uint64_t arg_;
+    uint64_t start_;
+};
+
+#define TRACE61_PASTE2(a, b) a##b
+#define TRACE61_PASTE(a, b) TRACE61_PASTE2(a, b)
+
+/// TRACE61_SCOPE(name, arg)
+///    Record an event `name`, with argument `arg`, from here to the end of
+///    the enclosing block.
+#define TRACE61_SCOPE(name, arg) \
+    trace61_scope TRACE61_PASTE(trace61_scope_, __LINE__)((name), (arg))
+
+/// TRACE61_NOW()
+///    Return a timestamp for a later `TRACE61_ASYNC`, or 0 if not tracing.
+#define TRACE61_NOW() (trace61_enabled() ? trace61_now() : 0)
+
+/// TRACE61_ASYNC(name, id, start)
+///    Record an async event `name` from `start`, a `TRACE61_NOW()`
+///    timestamp, to now. Does nothing if `start` is 0.
+#define TRACE61_ASYNC(name, id, start) do {                             \
+        uint64_t trace61_start_ = (start);                              \
+        if (trace61_start_ != 0) {                                      \
+            trace61_record_async((name), (id), trace61_start_,          \
+                                 trace61_now());                        \
+        }                                                               \
+    } while (0)
+
+#else
+#define TRACE61_SCOPE(name, arg) ((void) 0)
+#define TRACE61_NOW() ((uint64_t) 0)
+#define TRACE61_ASYNC(name, id, start) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+# trace61.mk
+#    Lets a pset build with event tracing: `make TRACE=1` compiles in the
+#    `TRACE61_` instrumentation and links the tracing runtime from this
+#    directory (see `trace61.hh`). Include this file before
+#    `build/rules.mk`, and add `$(TRACE61_OBJS)` to each program's
+#    objects. Without TRACE=1 the instrumentation compiles to nothing, but
+#    `trace61.hh` must still be found, so this directory is always on the
+#    include path.
+
+TRACE61DIR := $(dir $(lastword $(MAKEFILE_LIST)))
+
+DEFS += -I$(TRACE61DIR)
+ifeq ($(TRACE),1)
+DEFS += -DTRACE61=1
+TRACE61_OBJS = trace61-trace61.o
+endif
+
+# `$(BUILDSTAMP)` is defined by `build/rules.mk`, which comes later
+.SECONDEXPANSION:
+trace61-%.o: $(TRACE61DIR)%.cc $(TRACE61DIR)trace61.hh $$(BUILDSTAMP)
+	$(call run,$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(DEPCFLAGS) $(O) -o $@ -c,COMPILE,$<)
@@ -1,7 +1,6 @@
 #include "sh61.hh"
 #include <cctype>
 #include <cstring>
-#include <sstream>
 
 // isshellspecial(ch)
 //    Test if `ch` is a command that's special to the shell (that ends
@@ -46,7 +45,13 @@ void shell_token_iterator::update() {
     if (_s[_len] == '<' || _s[_len] == '>') {
         // Redirection
         ++_len;
-        if (_s[_len] == '>') {
+        if (_s[_len - 1] == '<' && _s[_len] == '<') {
+            // Here-document `<<` or here-string `<<<`
+            ++_len;
+            if (_s[_len] == '<') {
+                ++_len;
+            }
+        } else if (_s[_len] == '>') {
             ++_len;
         } else {
             while (isdigit((unsigned char) _s[_len])) {
@@ -114,24 +119,34 @@ std::string shell_token_iterator::str() const {
     if (!_quoted) {
         return std::string(_s, _len);
     } else {
-        std::ostringstream build;
-        int curquote = 0;
-        for (unsigned pos = 0; pos != _len; ++pos) {
-            if ((_s[pos] == '\"' || _s[pos] == '\'') && !curquote) {
-                curquote = _s[pos];
-            } else if (_s[pos] == curquote) {
-                curquote = 0;
-            } else if (_s[pos] == '\\'
-                       && _s[pos+1] != '\0'
-                       && curquote != '\'') {
-                build << _s[pos+1];
-                ++pos;
-            } else {
-                build << _s[pos];
-            }
+        std::string build(_len, '\0');
+        build.resize(unquote(&build[0]));
+        return build;
+    }
+}
+
+size_t shell_token_iterator::unquote(char* buf) const {
+    if (!_quoted) {
+        memcpy(buf, _s, _len);
+        return _len;
+    }
+    size_t n = 0;
+    int curquote = 0;
+    for (unsigned pos = 0; pos != _len; ++pos) {
+        if ((_s[pos] == '\"' || _s[pos] == '\'') && !curquote) {
+            curquote = _s[pos];
+        } else if (_s[pos] == curquote) {
+            curquote = 0;
+        } else if (_s[pos] == '\\'
+                   && _s[pos+1] != '\0'
+                   && curquote != '\'') {
+            buf[n++] = _s[pos+1];
+            ++pos;
+        } else {
+            buf[n++] = _s[pos];
         }
-        return build.str();
     }
+    return n;
 }
 
 
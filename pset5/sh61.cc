@@ -1,149 +1,1318 @@
 #include "sh61.hh"
+#include "trace61.hh"
 #include <cstring>
 #include <cerrno>
 #include <vector>
+#include <unordered_map>
+#include <memory_resource>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 
 // struct command
-//    Data structure describing a command. Add your own stuff.
+//    Data structure describing a command. A command line is a linked list
+//    of commands; each command's `op` is the control operator that ends
+//    it, so `a | b && c ; d &` is the list a(|) b(&&) c(;) d(&).
+//
+//    A command line's commands, and all their strings and arrays, live in
+//    a per-line arena (see `parse_line`), so parsing does no heap
+//    allocation in the common case. Strings are null-terminated, so
+//    `args[i].data()` is a C string.
 
 struct command {
-    std::vector<std::string> args;
+    std::pmr::vector<std::string_view> args;
     pid_t pid;      // process ID running this command, -1 if none
+    int status;     // wait status, once the command has finished
+    int op;         // operator following this command (`TYPE_SEQUENCE`,
+                    // `TYPE_BACKGROUND`, `TYPE_PIPE`, `TYPE_AND`, `TYPE_OR`)
+    command* next;  // next command in the list
+
+    // redirections, in command-line order
+    enum { REDIR_FILE, REDIR_HERE_STRING, REDIR_HERE_DOC };
+    struct redirection {
+        int fd;             // file descriptor to redirect
+        int kind;           // `REDIR_FILE`, or text for `REDIR_HERE_*`
+        int flags;          // `open` flags for `file`
+        std::string_view file;  // file name or here text; for a
+                                // here-document, the delimiter until
+                                // `collect_heredocs` runs
+    };
+    std::pmr::vector<redirection> redirs;
+
+    // pipe ends connected to standard input and output (-1 if none)
+    int in_fd;
+    int out_fd;
 
-    command();
-    ~command();
+    command(std::pmr::memory_resource* mr);
 
-    pid_t make_child(pid_t pgid);
+    void add_redirection(std::string_view redir_op, std::string_view file);
+    bool open_redirections(std::vector<int>& fds);
+    pid_t make_child(pid_t pgid, bool foreground);
+    void run_builtin(const struct builtin* b);
 };
 
 
-// command::command()
-//    This constructor function initializes a `command` structure. You may
-//    add stuff to it as you grow the command structure.
+// command::command(mr)
+//    This constructor function initializes a `command` structure whose
+//    arrays are allocated from `mr`.
 
-command::command() {
+command::command(std::pmr::memory_resource* mr)
+    : args(mr), redirs(mr) {
     this->pid = -1;
+    this->status = 0;
+    this->op = TYPE_SEQUENCE;
+    this->next = nullptr;
+    this->in_fd = -1;
+    this->out_fd = -1;
+}
+
+
+// command::add_redirection(redir_op, file)
+//    Record the redirection `redir_op` (a `TYPE_REDIRECT_OP` token, such
+//    as `<`, `>`, `>>`, or `2>`) of `file`. For `<<<`, `file` is the
+//    here-string; for `<<`, it is the here-document's delimiter.
+
+void command::add_redirection(std::string_view redir_op,
+                              std::string_view file) {
+    size_t i = 0;
+    int fd = 0;
+    while (i < redir_op.size() && isdigit((unsigned char) redir_op[i])) {
+        fd = 10 * fd + redir_op[i] - '0';
+        ++i;
+    }
+    redirection r;
+    bool input = redir_op[i] == '<';
+    r.fd = i > 0 ? fd : (input ? 0 : 1);
+    r.kind = REDIR_FILE;
+    if (redir_op.substr(i) == "<<<") {
+        r.kind = REDIR_HERE_STRING;
+    } else if (redir_op.substr(i) == "<<") {
+        r.kind = REDIR_HERE_DOC;
+    }
+    if (input) {
+        r.flags = O_RDONLY;
+    } else if (redir_op.substr(i, 2) == ">>") {
+        r.flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        r.flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    r.file = file;
+    this->redirs.push_back(r);
+}
+
+
+static int write_all(int fd, std::string_view s) {
+    size_t pos = 0;
+    while (pos != s.size()) {
+        ssize_t w = write(fd, s.data() + pos, s.size() - pos);
+        if (w < 0 && errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+        pos += w > 0 ? w : 0;
+    }
+    return 0;
+}
+
+
+// open_here_text(text, newline)
+//    Return a readable file descriptor, positioned at the start, for
+//    `text` (followed by a newline if `newline`). The text lives in a
+//    `memfd_create` file: no temporary file on disk, and unlike a pipe,
+//    no helper process to keep a long text from filling the buffer.
+
+static int open_here_text(std::string_view text, bool newline) {
+    int fd = memfd_create("sh61-here", MFD_CLOEXEC);
+    if (fd >= 0
+        && (write_all(fd, text) < 0
+            || (newline && write_all(fd, "\n") < 0)
+            || lseek(fd, 0, SEEK_SET) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+
+// command::open_redirections(fds)
+//    Open this command's redirection files, close-on-exec, and append
+//    their file descriptors to `fds`, in order. On failure, prints an
+//    error, closes the files opened so far, sets `this->status` to a
+//    failing status, and returns false.
+
+bool command::open_redirections(std::vector<int>& fds) {
+    size_t n = fds.size();
+    for (auto& r : this->redirs) {
+        int fd;
+        if (r.kind == REDIR_FILE) {
+            fd = open(r.file.data(), r.flags | O_CLOEXEC, 0666);
+        } else {
+            fd = open_here_text(r.file, r.kind == REDIR_HERE_STRING);
+        }
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n",
+                    r.kind == REDIR_FILE ? r.file.data() : "sh61",
+                    strerror(errno));
+            this->status = W_EXITCODE(1, 0);
+            while (fds.size() != n) {
+                close(fds.back());
+                fds.pop_back();
+            }
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    return true;
+}
+
+
+// COMMAND HASH
+//    Like bash's `hash`, the shell remembers where it found each command
+//    on `PATH`, so a loop running the same commands thousands of times
+//    searches `PATH` once per command rather than once per run. The
+//    cache is flushed when `PATH` changes, and an entry is dropped when
+//    its file has gone away.
+
+static std::unordered_map<std::string, std::string> command_hash;
+static std::string command_hash_path;   // `PATH` the cache is valid for
+
+
+// find_command(name)
+//    Return the path of command `name`: `name` itself if it contains a
+//    slash, otherwise the first executable regular file called `name` in
+//    a `PATH` directory. Returns `nullptr` if there is none. The result
+//    is valid until the next call.
+
+static const char* find_command(std::string_view name) {
+    if (name.find('/') != std::string_view::npos) {
+        return name.data();
+    }
+    const char* path = getenv("PATH");
+    if (!path) {
+        path = "/bin:/usr/bin";    // `execvp`'s default
+    }
+    if (command_hash_path != path) {
+        command_hash.clear();
+        command_hash_path = path;
+    }
+    static std::string key;
+    key = name;
+    auto it = command_hash.find(key);
+    if (it != command_hash.end()) {
+        return it->second.c_str();
+    }
+
+    static std::string file;
+    for (const char* dir = path; ; ++dir) {
+        const char* colon = strchrnul(dir, ':');
+        file.assign(dir, colon - dir);
+        file += file.empty() ? "./" : "/";
+        file += name;
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0
+            && S_ISREG(st.st_mode)
+            && access(file.c_str(), X_OK) == 0) {
+            // relative directories depend on the working directory,
+            // so don't remember those
+            if (dir[0] != '/') {
+                return file.c_str();
+            }
+            return command_hash.emplace(key, file).first->second.c_str();
+        }
+        if (!*colon) {
+            return nullptr;
+        }
+        dir = colon;
+    }
+}
+
+
+// interrupted
+//    Set when the user interrupts the shell or a foreground command with
+//    Control-C. The rest of the command line is abandoned.
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt_handler(int) {
+    interrupted = 1;
+}
+
+
+// background_jobs
+//    Number of background chains started and not yet reaped.
+
+static unsigned background_jobs = 0;
+
+
+// job_pgid
+//    If nonzero, the process group that pipelines join rather than each
+//    starting their own. Set in `parallel` jobs, so one signal reaches
+//    everything a job started.
+
+static pid_t job_pgid = 0;
+
+
+command* parse_line(const char* s, std::pmr::memory_resource* mr,
+                    bool report_errors = true);
+static void destroy_line(command* c);
+static bool collect_heredocs(command* c, const char*& s, const char* end,
+                             bool at_eof);
+int run(command* c, bool foreground = true);
+
+
+// BUILTINS
+//    Builtin commands run inside the shell, with no child process. `cd`
+//    must (it changes the shell's own state); the others are just much
+//    cheaper than a `posix_spawn` and `waitpid`, which matters for the
+//    `&&`/`||` tests in loops. Each returns an exit status.
+
+struct builtin {
+    const char* name;
+    int (*run)(command* c);
+};
+
+static int builtin_cd(command* c) {
+    const char* dir = c->args.size() > 1 ? c->args[1].data() : getenv("HOME");
+    if (!dir) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    } else if (chdir(dir) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_true(command*) {
+    return 0;
+}
+
+static int builtin_false(command*) {
+    return 1;
+}
+
+static int builtin_echo(command* c) {
+    size_t i = 1;
+    bool newline = true;
+    if (i < c->args.size() && c->args[i] == "-n") {
+        newline = false;
+        ++i;
+    }
+    std::string out;
+    for (; i < c->args.size(); ++i) {
+        out += c->args[i];
+        if (i + 1 < c->args.size()) {
+            out += ' ';
+        }
+    }
+    if (newline) {
+        out += '\n';
+    }
+    return write_all(STDOUT_FILENO, out) == 0 ? 0 : 1;
 }
 
+// test_expr(args, n)
+//    Evaluate the `test` expression in `args[0..n)`: `!` negation,
+//    a single string, unary file and string tests, and binary string
+//    and integer comparisons. Returns 0 for true, 1 for false, and 2
+//    for a malformed expression.
+static int test_expr(const std::string_view* args, size_t n) {
+    if (n > 0 && args[0] == "!") {
+        int r = test_expr(args + 1, n - 1);
+        return r == 2 ? r : !r;
+    } else if (n == 0) {
+        return 1;
+    } else if (n == 1) {
+        return args[0].empty();
+    } else if (n == 2) {
+        std::string_view op = args[0];
+        const char* arg = args[1].data();
+        struct stat st;
+        if (op == "-n") {
+            return args[1].empty();
+        } else if (op == "-z") {
+            return !args[1].empty();
+        } else if (op == "-r" || op == "-w" || op == "-x") {
+            int mode = op[1] == 'r' ? R_OK : (op[1] == 'w' ? W_OK : X_OK);
+            return access(arg, mode) != 0;
+        } else if (op.size() != 2 || op[0] != '-'
+                   || !strchr("efds", op[1])) {
+            return 2;
+        } else if (stat(arg, &st) != 0) {
+            return 1;
+        } else if (op[1] == 'f') {
+            return !S_ISREG(st.st_mode);
+        } else if (op[1] == 'd') {
+            return !S_ISDIR(st.st_mode);
+        } else if (op[1] == 's') {
+            return st.st_size == 0;
+        } else {
+            return 0;
+        }
+    } else if (n == 3) {
+        std::string_view op = args[1];
+        if (op == "=" || op == "==") {
+            return args[0] != args[2];
+        } else if (op == "!=") {
+            return args[0] == args[2];
+        }
+        static const char* const intops[] = {
+            "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+        };
+        for (int i = 0; i != 6; ++i) {
+            if (op == intops[i]) {
+                char* end1;
+                char* end2;
+                long a = strtol(args[0].data(), &end1, 10);
+                long b = strtol(args[2].data(), &end2, 10);
+                if (args[0].empty() || *end1 || args[2].empty() || *end2) {
+                    return 2;
+                }
+                bool result[] = { a == b, a != b, a < b,
+                                  a <= b, a > b, a >= b };
+                return !result[i];
+            }
+        }
+    }
+    return 2;
+}
 
-// command::~command()
-//    This destructor function is called to delete a command.
+static int builtin_test(command* c) {
+    size_t n = c->args.size() - 1;
+    if (c->args[0] == "[") {
+        if (n == 0 || c->args[n] != "]") {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        --n;
+    }
+    int r = test_expr(c->args.data() + 1, n);
+    if (r == 2) {
+        fprintf(stderr, "%s: syntax error\n", c->args[0].data());
+    }
+    return r;
+}
 
-command::~command() {
+static int builtin_hash(command* c) {
+    if (c->args.size() > 1 && c->args[1] == "-r") {
+        command_hash.clear();
+        return 0;
+    }
+    std::string out;
+    for (auto& entry : command_hash) {
+        out += entry.first + "\t" + entry.second + "\n";
+    }
+    return write_all(STDOUT_FILENO, out) == 0 ? 0 : 1;
+}
+
+// parallel [-j N]
+//    Run each line of standard input as a command line, with at most N
+//    (default: the number of CPUs) running at once, like `xargs -P`.
+//    Each job is a forked copy of the shell, in its own process group,
+//    that runs its line with `run`. A job's standard output and error
+//    go to memory files, copied out when the job finishes, so jobs'
+//    output never interleaves. Control-C interrupts every running job.
+//    Exits with status 0 if all jobs succeed and 1 otherwise.
+
+struct parallel_job {
+    pid_t pid;
+    int out_fd;
+    int err_fd;
+};
+
+static void copy_memfd(int fd, int dst) {
+    char buf[BUFSIZ];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (write_all(dst, std::string_view(buf, n)) < 0) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static pid_t start_parallel_job(const char* line, parallel_job& job) {
+    job.out_fd = memfd_create("sh61-parallel-out", MFD_CLOEXEC);
+    job.err_fd = memfd_create("sh61-parallel-err", MFD_CLOEXEC);
+    if (job.out_fd < 0 || job.err_fd < 0) {
+        perror("parallel: memfd_create");
+        job.pid = -1;
+    } else if ((job.pid = fork()) < 0) {
+        perror("parallel: fork");
+    }
+    if (job.pid < 0) {
+        close(job.out_fd);
+        close(job.err_fd);
+        return -1;
+    }
+    if (job.pid == 0) {
+        setpgid(0, 0);
+        job_pgid = getpid();
+        int nullfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        dup2(nullfd, STDIN_FILENO);
+        dup2(job.out_fd, STDOUT_FILENO);
+        dup2(job.err_fd, STDERR_FILENO);
+        int status = 0;
+        const char* end = line + strlen(line);
+        command* c = parse_line(line, std::pmr::get_default_resource());
+        if (c && collect_heredocs(c, end, end, true)) {
+            status = run(c, false);
+        }
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+    setpgid(job.pid, job.pid);
+    return job.pid;
+}
+
+static int builtin_parallel(command* c) {
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (size_t i = 1; i < c->args.size(); ++i) {
+        std::string_view arg = c->args[i];
+        const char* value = nullptr;
+        if (arg == "-j" && i + 1 < c->args.size()) {
+            value = c->args[++i].data();
+        } else if (arg.substr(0, 2) == "-j" && arg.size() > 2) {
+            value = arg.data() + 2;
+        }
+        char* end;
+        if (!value || (njobs = strtol(value, &end, 10)) <= 0 || *end) {
+            fprintf(stderr, "usage: parallel [-j N]\n");
+            return 2;
+        }
+    }
+
+    // read the job list
+    std::string input;
+    char buf[BUFSIZ];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+        if (n > 0) {
+            input.append(buf, n);
+        } else if (errno != EINTR || interrupted) {
+            break;
+        }
+    }
+
+    std::vector<parallel_job> running;
+    size_t pos = 0;
+    bool failed = false;
+    while (true) {
+        // start jobs until N are running
+        while (!interrupted
+               && running.size() < size_t(njobs)
+               && pos < input.size()) {
+            size_t nl = input.find('\n', pos);
+            if (nl == std::string::npos) {
+                nl = input.size();
+                input += '\n';
+            }
+            input[nl] = '\0';
+            parallel_job job;
+            if (start_parallel_job(&input[pos], job) > 0) {
+                running.push_back(job);
+            } else {
+                failed = true;
+            }
+            pos = nl + 1;
+        }
+        if (running.empty()) {
+            break;
+        }
+
+        // wait for any job to finish
+        int status;
+        pid_t p;
+        {
+            TRACE61_SCOPE("waitpid", running.size());
+            p = waitpid(-1, &status, 0);
+        }
+        if (p < 0 && errno == EINTR && interrupted) {
+            for (auto& job : running) {
+                kill(-job.pid, SIGINT);
+            }
+            continue;
+        } else if (p < 0) {
+            continue;
+        }
+        auto it = running.begin();
+        while (it != running.end() && it->pid != p) {
+            ++it;
+        }
+        if (it == running.end()) {
+            // a background job of the shell itself
+            --background_jobs;
+            continue;
+        }
+        copy_memfd(it->out_fd, STDOUT_FILENO);
+        copy_memfd(it->err_fd, STDERR_FILENO);
+        failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        running.erase(it);
+    }
+    return failed || interrupted ? 1 : 0;
+}
+
+static const builtin builtins[] = {
+    { "cd", builtin_cd },
+    { "true", builtin_true },
+    { "false", builtin_false },
+    { "echo", builtin_echo },
+    { "test", builtin_test },
+    { "[", builtin_test },
+    { "hash", builtin_hash },
+    { "parallel", builtin_parallel }
+};
+
+// find_builtin(c)
+//    Return the builtin that runs command `c`, or `nullptr` if none does.
+
+static const builtin* find_builtin(const command* c) {
+    if (c->args.empty()) {
+        return nullptr;
+    }
+    for (auto& b : builtins) {
+        if (c->args[0] == b.name) {
+            return &b;
+        }
+    }
+    return nullptr;
+}
+
+
+// command::run_builtin(b)
+//    Run builtin `b` for this command inside the current process, and
+//    set `this->status` to its exit status. Redirections are applied by
+//    moving the shell's own file descriptors aside (close-on-exec, above
+//    fd 10), `dup2`ing the files into place, and moving them back after.
+
+void command::run_builtin(const builtin* b) {
+    std::vector<int> redir_fds;
+    if (!this->open_redirections(redir_fds)) {
+        return;
+    }
+    std::vector<int> saved_fds;
+    for (size_t i = 0; i != redir_fds.size(); ++i) {
+        saved_fds.push_back(fcntl(this->redirs[i].fd, F_DUPFD_CLOEXEC, 10));
+        dup2(redir_fds[i], this->redirs[i].fd);
+        close(redir_fds[i]);
+    }
+
+    this->status = W_EXITCODE(b->run(this), 0);
+
+    for (size_t i = saved_fds.size(); i-- != 0; ) {
+        if (saved_fds[i] >= 0) {
+            dup2(saved_fds[i], this->redirs[i].fd);
+            close(saved_fds[i]);
+        } else {
+            close(this->redirs[i].fd);
+        }
+    }
 }
 
 
 // COMMAND EXECUTION
 
-// command::make_child(pgid)
+// foreground_ttyfd()
+//    Return a file descriptor for the shell's terminal if the shell's
+//    process group is in the terminal's foreground, and -1 otherwise.
+
+static int foreground_ttyfd() {
+    static int ttyfd = -2;
+    if (ttyfd == -2) {
+        ttyfd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (ttyfd >= 0) {
+            int fd = fcntl(ttyfd, F_DUPFD_CLOEXEC, 10);
+            close(ttyfd);
+            ttyfd = fd;
+        }
+    }
+    if (ttyfd >= 0 && tcgetpgrp(ttyfd) == getpgrp()) {
+        return ttyfd;
+    }
+    return -1;
+}
+
+
+// command::make_child(pgid, foreground)
 //    Create a single child process running the command in `this`.
-//    Sets `this->pid` to the pid of the child process and returns `this->pid`.
+//    Sets `this->pid` to the pid of the child process and returns
+//    `this->pid`. If no child can be started, prints an error, sets
+//    `this->status` to a failing status, and returns -1.
+//
+//    The child is started with `posix_spawn` of the path `find_command`
+//    returns, rather than `fork` and `execvp`. glibc implements it with
+//    `clone(CLONE_VM | CLONE_VFORK)`, so no page tables are copied and
+//    launch cost doesn't grow with the shell's size. Everything the
+//    child would have done between `fork` and `exec` becomes a spawn
+//    attribute or file action:
+//    - The child joins process group `pgid`, or its own group if
+//      `pgid == 0`. The shell calls `setpgid` too, so the group exists
+//      by the time `make_child` returns.
+//    - A new `foreground` group takes the terminal in the child, before
+//      `exec`. Otherwise a child that is itself a shell could check for
+//      the terminal before our `claim_foreground` call, and lose it.
+//    - Signals the shell ignores get their default dispositions back,
+//      and the signals it blocks are unblocked.
+//    - The pipe ends `in_fd` and `out_fd` become standard input and
+//      output. Pipes are created close-on-exec, so the child needs no
+//      file actions to close the pipeline's other pipe ends.
+//    - Redirection files are opened by the shell, so errors can name the
+//      file, and are `dup2`ed into place after the pipes.
 //
-//    PART 1: Fork a child process and run the command using `execvp`.
-//       This will require creating an array of `char*` arguments using
-//       `this->args[N].c_str()`.
-//    PART 5: Set up a pipeline if appropriate. This may require creating a
-//       new pipe (`pipe` system call), and/or replacing the child process's
-//       standard input/output with parts of the pipe (`dup2` and `close`).
-//       Draw pictures!
-//    PART 7: Handle redirections.
-//    PART 8: The child process should be in the process group `pgid`, or
-//       its own process group (if `pgid == 0`). To avoid race conditions,
-//       this will require TWO calls to `setpgid`.
-
-pid_t command::make_child(pid_t pgid) {
-    assert(this->args.size() > 0);
-    (void) pgid; // You won’t need `pgid` until part 8.
-    // Your code here!
-
-    fprintf(stderr, "command::make_child not done yet\n");
+//    A builtin in a pipeline must run concurrently with the other
+//    stages, so it gets a `fork`ed child that runs `run_builtin` and
+//    exits.
+
+pid_t command::make_child(pid_t pgid, bool foreground) {
+    TRACE61_SCOPE("make_child", 0);
+    if (const builtin* b = find_builtin(this)) {
+        pid_t child = fork();
+        if (child == 0) {
+            setpgid(0, pgid);
+            set_signal_handler(SIGINT, SIG_DFL);
+            set_signal_handler(SIGTTOU, SIG_DFL);
+            if (this->in_fd >= 0) {
+                dup2(this->in_fd, STDIN_FILENO);
+            }
+            if (this->out_fd >= 0) {
+                dup2(this->out_fd, STDOUT_FILENO);
+            }
+            this->run_builtin(b);
+            _exit(WEXITSTATUS(this->status));
+        } else if (child > 0) {
+            setpgid(child, pgid ? pgid : child);
+            this->pid = child;
+        } else {
+            perror("sh61: fork");
+            this->status = W_EXITCODE(1, 0);
+        }
+        return this->pid;
+    }
+
+    std::vector<int> redir_fds;
+    if (this->args.empty() || !this->open_redirections(redir_fds)) {
+        // nothing to run, or a redirection failed
+        return this->pid;
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigdefault;
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGTTOU);
+    sigaddset(&sigdefault, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    sigset_t sigmask;   // the shell blocks SIGCHLD (see `main`)
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+                             | POSIX_SPAWN_SETSIGDEF
+                             | POSIX_SPAWN_SETSIGMASK);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (this->in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, this->in_fd, 0);
+    }
+    if (this->out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, this->out_fd, 1);
+    }
+    if (foreground && pgid == 0) {
+        // the child blocks signals until `exec`, so no SIGTTOU here
+        int ttyfd = foreground_ttyfd();
+        if (ttyfd >= 0) {
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, ttyfd);
+        }
+    }
+    for (size_t i = 0; i != redir_fds.size(); ++i) {
+        posix_spawn_file_actions_adddup2(&actions, redir_fds[i],
+                                         this->redirs[i].fd);
+    }
+
+    std::pmr::vector<char*> argv(this->args.get_allocator());
+    argv.reserve(this->args.size() + 1);
+    for (auto arg : this->args) {
+        argv.push_back(const_cast<char*>(arg.data()));
+    }
+    argv.push_back(nullptr);
+
+    extern char** environ;
+    pid_t child;
+    const char* file = find_command(this->args[0]);
+    int r = !file ? ENOENT
+        : posix_spawn(&child, file, &actions, &attr, argv.data(), environ);
+    if (r == ENOENT && command_hash.erase(std::string(this->args[0]))) {
+        // stale cache entry: search again
+        file = find_command(this->args[0]);
+        r = !file ? ENOENT
+            : posix_spawn(&child, file, &actions, &attr, argv.data(),
+                          environ);
+    }
+    if (r == 0) {
+        setpgid(child, pgid ? pgid : child);
+        this->pid = child;
+    } else {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(r));
+        this->status = W_EXITCODE(127, 0);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (int fd : redir_fds) {
+        close(fd);
+    }
     return this->pid;
 }
 
 
-// run(c)
-//    Run the command *list* starting at `c`. Initially this just calls
-//    `make_child` and `waitpid`; you’ll extend it to handle command lists,
-//    conditionals, and pipelines.
+// pipe_size
+//    If nonzero, the buffer size requested for pipeline pipes with
+//    `F_SETPIPE_SZ` (set by the `-p SIZE` option). Linux pipes default
+//    to 64 KiB; a larger buffer lets a fast writer run further ahead of
+//    its reader, which means fewer context switches per byte.
+
+static int pipe_size = 0;
+
+
+// PIPELINE TIMING
+//    With `-t FD`, the shell reports every pipeline it runs as a JSON
+//    line on file descriptor FD, with the same fields and formats as
+//    `io61_profile_end` in pset4: elapsed `time`, `utime` and `stime`
+//    summed over the pipeline's processes (from `wait4`, or from the
+//    shell's own usage for an in-shell builtin), and their summed
+//    `maxrss` in kilobytes. For example:
+//
+//    {"command":"sort | uniq", "time":0.010231, "utime":0.003998,
+//     "stime":0.004001, "maxrss":4608, "status":0}
+
+static int timing_fd = -1;
+
+static void append_json_string(std::string& out, std::string_view str) {
+    out += '\"';
+    for (unsigned char ch : str) {
+        if (ch == '\"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    out += '\"';
+}
+
+static void report_timing(command* first, command* last,
+                          const timeval& tv_begin, const rusage& usage) {
+    timeval tv_end;
+    gettimeofday(&tv_end, nullptr);
+    timersub(&tv_end, &tv_begin, &tv_end);
+
+    std::string text;
+    for (command* c = first; ; c = c->next) {
+        for (size_t i = 0; i != c->args.size(); ++i) {
+            text += i ? " " : "";
+            text += c->args[i];
+        }
+        if (c == last) {
+            break;
+        }
+        text += " | ";
+    }
+    int status = WIFEXITED(last->status) ? WEXITSTATUS(last->status)
+        : 128 + WTERMSIG(last->status);
+
+    std::string report = "{\"command\":";
+    append_json_string(report, text);
+    char buf[200];
+    sprintf(buf, ", \"time\":%ld.%06ld, \"utime\":%ld.%06ld,"
+            " \"stime\":%ld.%06ld, \"maxrss\":%ld, \"status\":%d}\n",
+            tv_end.tv_sec, (long) tv_end.tv_usec,
+            usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+            usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
+            usage.ru_maxrss, status);
+    report += buf;
+    // one `write`, so lines from concurrent jobs stay whole
+    write_all(timing_fd, report);
+}
+
+static void add_rusage(rusage& sum, const rusage& ru) {
+    timeradd(&sum.ru_utime, &ru.ru_utime, &sum.ru_utime);
+    timeradd(&sum.ru_stime, &ru.ru_stime, &sum.ru_stime);
+    sum.ru_maxrss += ru.ru_maxrss;
+}
+
+
+// run_pipeline(c, foreground)
+//    Run the pipeline starting at `c` and return its end (the first
+//    command whose `op` is not `TYPE_PIPE`). All stages are started
+//    before any is waited for, in one process group. A foreground
+//    pipeline gets the terminal while it runs. The pipeline's status,
+//    that of its last command, is left in the returned command.
 //
-//    PART 1: Start the single command `c` with `c->make_child(0)`,
-//        and wait for it to finish using `waitpid`.
-//    The remaining parts may require that you change `struct command`
-//    (e.g., to track whether a command is in the background)
-//    and write code in `run` (or in helper functions).
-//    PART 2: Treat background commands differently.
-//    PART 3: Introduce a loop to run all commands in the list.
-//    PART 4: Change the loop to handle conditionals.
-//    PART 5: Change the loop to handle pipelines. Start all processes in
-//       the pipeline in parallel. The status of a pipeline is the status of
-//       its LAST command.
-//    PART 8: - Choose a process group for each pipeline and pass it to
-//         `make_child`.
-//       - Call `claim_foreground(pgid)` before waiting for the pipeline.
-//       - Call `claim_foreground(0)` once the pipeline is complete.
-
-void run(command* c) {
-    c->make_child(0);
-    fprintf(stderr, "command::run not done yet\n");
-}
-
-
-// parse_line(s)
+//    Each pipe end is closed in the shell as soon as the stage using it
+//    has started, so at most one pipe is open in the shell at a time.
+
+static command* run_pipeline(command* c, bool foreground) {
+    pid_t pgid = job_pgid;
+    command* first = c;
+    int in_fd = -1;
+    timeval tv_begin;
+    rusage usage = {};
+    if (timing_fd >= 0) {
+        gettimeofday(&tv_begin, nullptr);
+    }
+    while (true) {
+        c->in_fd = in_fd;
+        in_fd = -1;
+        if (c->op == TYPE_PIPE) {
+            int pfd[2];
+            if (pipe2(pfd, O_CLOEXEC) < 0) {
+                perror("sh61: pipe");
+                c->status = W_EXITCODE(1, 0);
+                if (c->in_fd >= 0) {
+                    close(c->in_fd);
+                }
+                break;
+            }
+            if (pipe_size > 0) {
+                // best effort: fails beyond /proc/sys/fs/pipe-max-size
+                fcntl(pfd[1], F_SETPIPE_SZ, pipe_size);
+            }
+            c->out_fd = pfd[1];
+            in_fd = pfd[0];
+        }
+        const builtin* b;
+        if (c == first && c->op != TYPE_PIPE && (b = find_builtin(c))) {
+            rusage before, after;
+            if (timing_fd >= 0) {
+                getrusage(RUSAGE_SELF, &before);
+            }
+            c->run_builtin(b);
+            if (timing_fd >= 0) {
+                getrusage(RUSAGE_SELF, &after);
+                timersub(&after.ru_utime, &before.ru_utime, &usage.ru_utime);
+                timersub(&after.ru_stime, &before.ru_stime, &usage.ru_stime);
+                usage.ru_maxrss = after.ru_maxrss;
+            }
+        } else {
+            c->make_child(pgid, foreground);
+        }
+        if (c->in_fd >= 0) {
+            close(c->in_fd);
+        }
+        if (c->out_fd >= 0) {
+            close(c->out_fd);
+        }
+        if (pgid == 0 && c->pid > 0) {
+            pgid = c->pid;
+            if (foreground) {
+                claim_foreground(pgid);
+            }
+        }
+        if (c->op != TYPE_PIPE) {
+            break;
+        }
+        c = c->next;
+    }
+
+    for (command* w = first; ; w = w->next) {
+        if (w->pid > 0) {
+            TRACE61_SCOPE("waitpid", w->pid);
+            rusage ru;
+            while (wait4(w->pid, &w->status, 0, &ru) < 0 && errno == EINTR) {
+            }
+            add_rusage(usage, ru);
+            if (WIFSIGNALED(w->status) && WTERMSIG(w->status) == SIGINT) {
+                interrupted = 1;
+            }
+        }
+        if (w == c) {
+            break;
+        }
+    }
+    if (foreground && pgid != 0) {
+        claim_foreground(0);
+    }
+    if (timing_fd >= 0) {
+        report_timing(first, c, tv_begin, usage);
+    }
+    return c;
+}
+
+
+// run_conditional(c, foreground)
+//    Run the conditional chain (pipelines joined by `&&` and `||`)
+//    starting at `c` and return its last command, whose `status` is the
+//    chain's status. A pipeline after `&&` runs only if the status so far
+//    is success, and one after `||` only if it is failure; a skipped
+//    pipeline leaves the status alone.
+
+static command* run_conditional(command* c, bool foreground) {
+    int status = 0;
+    bool skip = false;
+    while (true) {
+        command* end;
+        if (skip) {
+            end = c;
+            while (end->op == TYPE_PIPE) {
+                end = end->next;
+            }
+            end->status = status;
+        } else {
+            end = run_pipeline(c, foreground);
+            status = end->status;
+        }
+        bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (interrupted
+            || (end->op != TYPE_AND && end->op != TYPE_OR)) {
+            return end;
+        }
+        skip = (end->op == TYPE_AND) != success;
+        c = end->next;
+    }
+}
+
+
+// run(c, foreground)
+//    Run the command *list* starting at `c`, and return the wait status
+//    of its last foreground chain. Each conditional chain runs in turn,
+//    except that a chain ending in `&` runs in the background, in a
+//    forked copy of the shell. (That copy does not `exec`, so it can't
+//    be spawned.) If `foreground` is false, no chain takes the terminal.
+
+int run(command* c, bool foreground) {
+    int status = 0;
+    while (c && !interrupted) {
+        command* end = c;
+        while (end->op == TYPE_AND || end->op == TYPE_OR
+               || end->op == TYPE_PIPE) {
+            end = end->next;
+        }
+        if (end->op == TYPE_BACKGROUND) {
+            pid_t p = fork();
+            if (p == 0) {
+                run_conditional(c, false);
+                _exit(0);
+            } else if (p > 0) {
+                ++background_jobs;
+            } else {
+                perror("sh61: fork");
+            }
+        } else {
+            status = run_conditional(c, foreground)->status;
+        }
+        c = end->next;
+    }
+    return status;
+}
+
+
+// destroy_line(c)
+//    Destroy the command list `c` returned by `parse_line`. Its memory
+//    belongs to the arena, and is reclaimed when the arena is released.
+
+static void destroy_line(command* c) {
+    while (c) {
+        command* next = c->next;
+        c->~command();
+        c = next;
+    }
+}
+
+
+// token_string(it, mr)
+//    Return a null-terminated copy of the contents of token `it`,
+//    allocated from `mr`. Only quoted tokens are unquoted.
+
+static std::string_view token_string(const shell_token_iterator& it,
+                                     std::pmr::memory_resource* mr) {
+    std::string_view raw = it.view();
+    char* buf = static_cast<char*>(mr->allocate(raw.size() + 1, 1));
+    size_t n = raw.size();
+    if (it.quoted()) {
+        n = it.unquote(buf);
+    } else {
+        memcpy(buf, raw.data(), n);
+    }
+    buf[n] = '\0';
+    return std::string_view(buf, n);
+}
+
+
+// parse_line(s, mr, report_errors)
 //    Parse the command list in `s` and return it. Returns `nullptr` if
-//    `s` is empty (only spaces). You’ll extend it to handle more token
-//    types.
+//    `s` is empty (only spaces) or has a syntax error, which is printed
+//    if `report_errors` is true. The commands are allocated from `mr`,
+//    which is normally an arena released after the line runs; call
+//    `destroy_line` first.
 
-command* parse_line(const char* s) {
+command* parse_line(const char* s, std::pmr::memory_resource* mr,
+                    bool report_errors) {
     shell_parser parser(s);
-    // Your code here!
-
-    // Build the command
-    // The handout code treats every token as a normal command word.
-    // You'll add code to handle operators.
-    command* c = nullptr;
+    std::pmr::polymorphic_allocator<command> alloc(mr);
+    command* chead = nullptr;   // first command in list
+    command* clast = nullptr;   // last command in list
+    command* c = nullptr;       // current command being built
     for (shell_token_iterator it = parser.begin(); it != parser.end(); ++it) {
-        if (!c) {
-            c = new command;
+        if (!c && (it.type() == TYPE_NORMAL
+                   || it.type() == TYPE_REDIRECT_OP)) {
+            c = alloc.allocate(1);
+            alloc.construct(c, mr);
+            if (clast) {
+                clast->next = c;
+            } else {
+                chead = c;
+            }
+            clast = c;
+        }
+        switch (it.type()) {
+        case TYPE_NORMAL:
+            c->args.push_back(token_string(it, mr));
+            break;
+        case TYPE_REDIRECT_OP: {
+            std::string_view op = it.view();
+            ++it;
+            if (it == parser.end() || it.type() != TYPE_NORMAL) {
+                if (report_errors) {
+                    fprintf(stderr, "sh61: syntax error near `%.*s`\n",
+                            int(op.size()), op.data());
+                }
+                destroy_line(chead);
+                return nullptr;
+            }
+            c->add_redirection(op, token_string(it, mr));
+            break;
+        }
+        default:
+            // control operators end the current command
+            if (c) {
+                c->op = it.type();
+                c = nullptr;
+            }
+            break;
         }
-        c->args.push_back(it.str());
     }
-    return c;
+    return chead;
+}
+
+
+// collect_heredocs(c, s, end, at_eof)
+//    Fill in the here-documents of command list `c` from the lines that
+//    follow it, which are `[s, end)`. Each here-document's text is the
+//    lines up to its delimiter line, as a view into the input. Advances
+//    `s` past the delimiters. Returns false if a delimiter is missing
+//    and more input may come (`!at_eof`); at EOF, a here-document
+//    missing its delimiter takes the rest of the input.
+
+static bool collect_heredocs(command* c, const char*& s, const char* end,
+                             bool at_eof) {
+    const char* p = s;
+    for (; c; c = c->next) {
+        for (auto& r : c->redirs) {
+            if (r.kind != command::REDIR_HERE_DOC) {
+                continue;
+            }
+            const char* body = p;
+            while (true) {
+                if (p == end) {
+                    if (!at_eof) {
+                        return false;
+                    }
+                    r.file = std::string_view(body, p - body);
+                    break;
+                }
+                auto nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                const char* eol = nl ? nl : end;
+                if (std::string_view(p, eol - p) == r.file) {
+                    r.file = std::string_view(body, p - body);
+                    p = nl ? nl + 1 : end;
+                    break;
+                }
+                p = nl ? nl + 1 : end;
+            }
+        }
+    }
+    s = p;
+    return true;
+}
+
+
+// reap_background(sigfd)
+//    Reap every finished background process, if SIGCHLD has arrived on
+//    signalfd `sigfd` since the last call. Foreground processes are
+//    waited for by `run_pipeline`, so any child that has exited by the
+//    time the main loop runs is a background one.
+
+static void reap_background(int sigfd) {
+    signalfd_siginfo si;
+    bool any = false;
+    while (read(sigfd, &si, sizeof(si)) > 0) {
+        any = true;
+    }
+    while (any && waitpid(-1, nullptr, WNOHANG) > 0) {
+        --background_jobs;
+    }
+}
+
+
+// run_script(data, size, sigfd, arena)
+//    Run the script in `data[0..size)`, which is writable, as `sh61 FILE`
+//    does when FILE is a regular file. Unlike the interactive loop, this
+//    has no prompts, no `poll`, and no copying: it splits lines in place,
+//    parses up to `batch_lines` of them ahead into `arena`, and then runs
+//    them in order.
+
+static void run_script(char* data, size_t size, int sigfd,
+                       std::pmr::monotonic_buffer_resource& arena) {
+    constexpr int batch_lines = 64;
+    struct {
+        const char* line;
+        command* c;
+    } batch[batch_lines];
+    std::string last;   // final line, if it lacks a newline
+    char* s = data;
+    char* end = data + size;
+
+    while (s != end) {
+        int n = 0;
+        for (; n != batch_lines && s != end; ++n) {
+            char* nl = static_cast<char*>(memchr(s, '\n', end - s));
+            if (nl) {
+                *nl = '\0';
+                batch[n].line = s;
+                s = nl + 1;
+            } else {
+                last.assign(s, end - s);
+                batch[n].line = last.c_str();
+                s = end;
+            }
+            batch[n].c = parse_line(batch[n].line, &arena, false);
+            // here-document lines come from the unsplit text that
+            // follows
+            const char* next = s;
+            collect_heredocs(batch[n].c, next, end, true);
+            s = const_cast<char*>(next);
+        }
+
+        for (int i = 0; i != n; ++i) {
+            if (background_jobs) {
+                reap_background(sigfd);
+            }
+            interrupted = 0;
+            if (command* c = batch[i].c) {
+                run(c);
+                destroy_line(c);
+            } else {
+                // blank, or a syntax error: parse again to report it
+                // in order with the output of earlier lines
+                parse_line(batch[i].line, &arena);
+            }
+        }
+        arena.release();
+    }
 }
 
 
 int main(int argc, char* argv[]) {
-    FILE* command_file = stdin;
+    int command_fd = STDIN_FILENO;
     bool quiet = false;
 
-    // Check for '-q' option: be quiet (print no prompts)
-    if (argc > 1 && strcmp(argv[1], "-q") == 0) {
-        quiet = true;
-        --argc, ++argv;
+    // Check for options:
+    // '-q': be quiet (print no prompts)
+    // '-p SIZE': request SIZE-byte pipe buffers
+    // '-t FD': report each pipeline's timing on file descriptor FD
+    while (argc > 1) {
+        if (strcmp(argv[1], "-q") == 0) {
+            quiet = true;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-p") == 0 && argc > 2) {
+            pipe_size = strtol(argv[2], nullptr, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+            // keep the report file out of the way of redirections and
+            // out of spawned commands
+            int fd = strtol(argv[2], nullptr, 0);
+            timing_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            if (timing_fd < 0) {
+                perror("sh61: -t");
+                exit(1);
+            }
+            if (fd > 2) {
+                // never close the shell's own standard descriptors
+                close(fd);
+            }
+            argc -= 2, argv += 2;
+        } else {
+            break;
+        }
     }
 
-    // Check for filename option: read commands from file
+    // Check for filename option: read commands from file. A regular
+    // file is mapped into memory (copy-on-write, so lines can be split
+    // in place) and run in batch mode.
+    char* script = nullptr;
+    size_t script_size = 0;
     if (argc > 1) {
-        command_file = fopen(argv[1], "rb");
-        if (!command_file) {
+        command_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (command_fd < 0) {
             perror(argv[1]);
             exit(1);
         }
+        struct stat st;
+        if (fstat(command_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            script_size = st.st_size;
+            void* p = script_size == 0 ? MAP_FAILED
+                : mmap(nullptr, script_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, command_fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, script_size, MADV_SEQUENTIAL);
+                script = static_cast<char*>(p);
+            }
+        }
     }
 
     // - Put the shell into the foreground
     // - Ignore the SIGTTOU signal, which is sent when the shell is put back
     //   into the foreground
+    // - Catch SIGINT, which abandons the current command line
+    // - Block SIGCHLD and receive it through a signalfd instead, so the
+    //   main loop can wait for input and for finished background jobs in
+    //   one `poll`
     claim_foreground(0);
     set_signal_handler(SIGTTOU, SIG_IGN);
+    set_signal_handler(SIGINT, interrupt_handler);
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, nullptr);
+    int sigfd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+    assert(sigfd >= 0);
 
-    char buf[BUFSIZ];
-    int bufpos = 0;
+    // Per-line arena: most lines fit in `arena_buffer` and need no heap
+    // allocation at all
+    static char arena_buffer[16384];
+    std::pmr::monotonic_buffer_resource arena(arena_buffer,
+                                              sizeof(arena_buffer));
+
+    if (script) {
+        run_script(script, script_size, sigfd, arena);
+        return 0;
+    }
+
+    std::string input;      // command input not yet run
     bool needprompt = true;
+    bool eof = false;
 
-    while (!feof(command_file)) {
+    while (!eof) {
         // Print the prompt at the beginning of the line
         if (needprompt && !quiet) {
             printf("sh61[%d]$ ", getpid());
@@ -151,33 +1320,74 @@ int main(int argc, char* argv[]) {
             needprompt = false;
         }
 
-        // Read a string, checking for error or EOF
-        if (fgets(&buf[bufpos], BUFSIZ - bufpos, command_file) == nullptr) {
-            if (ferror(command_file) && errno == EINTR) {
-                // ignore EINTR errors
-                clearerr(command_file);
-                buf[bufpos] = 0;
-            } else {
-                if (ferror(command_file)) {
-                    perror("sh61");
-                }
+        // Wait for input or a finished background job
+        pollfd pfds[2] = {
+            { command_fd, POLLIN, 0 }, { sigfd, POLLIN, 0 }
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR && interrupted) {
+                // Control-C at the prompt: discard the partial line
+                // and prompt again
+                interrupted = 0;
+                input.clear();
+                printf("\n");
+                needprompt = true;
+            } else if (errno != EINTR) {
+                perror("sh61: poll");
                 break;
             }
+            continue;
+        }
+        if (!pfds[0].revents) {
+            reap_background(sigfd);
+            continue;
         }
 
-        // If a complete command line has been provided, run it
-        bufpos = strlen(buf);
-        if (bufpos == BUFSIZ - 1 || (bufpos > 0 && buf[bufpos - 1] == '\n')) {
-            if (command* c = parse_line(buf)) {
-                run(c);
-                delete c;
+        // Read input, checking for error or EOF
+        char buf[BUFSIZ];
+        ssize_t n = read(command_fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        } else if (n < 0) {
+            perror("sh61");
+            break;
+        } else if (n == 0) {
+            // run a final line with no newline
+            eof = true;
+            if (!input.empty()) {
+                input += '\n';
             }
-            bufpos = 0;
-            needprompt = 1;
         }
+        input.append(buf, n);
 
-        // Handle zombie processes and/or interrupt requests
-        // Your code here!
+        // Run each complete command line, reaping background jobs that
+        // finished during the previous one
+        size_t pos = 0, nl;
+        while ((nl = input.find('\n', pos)) != std::string::npos) {
+            if (background_jobs) {
+                reap_background(sigfd);
+            }
+            input[nl] = '\0';
+            command* c = parse_line(&input[pos], &arena);
+            const char* next = input.data() + nl + 1;
+            if (!collect_heredocs(c, next, input.data() + input.size(),
+                                  eof)) {
+                // wait for the rest of a here-document
+                destroy_line(c);
+                arena.release();
+                input[nl] = '\n';
+                break;
+            }
+            interrupted = 0;
+            if (c) {
+                run(c);
+                destroy_line(c);
+            }
+            arena.release();
+            pos = next - input.data();
+            needprompt = true;
+        }
+        input.erase(0, pos);
     }
 
     return 0;
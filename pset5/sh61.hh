@@ -7,9 +7,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string>
+#include <string_view>
 
 #define TYPE_NORMAL        0   // normal command word
-#define TYPE_REDIRECT_OP   1   // redirection operator (>, <, 2>)
+#define TYPE_REDIRECT_OP   1   // redirection operator (>, <, 2>, <<, <<<)
 
 // All other tokens are control operators that terminate the current command.
 #define TYPE_SEQUENCE      2   // `;` sequence operator
@@ -58,11 +59,23 @@ private:
 //        // character contents.
 //    }
 //    ```
+//
+//    To parse without allocating, use `it.view()`, which returns the
+//    token's raw characters in the command line, and check `it.quoted()`:
+//    only quoted tokens need `it.unquote(buf)`.
 
 struct shell_token_iterator {
     std::string str() const;    // current token’s character contents
     inline int type() const;    // current token’s type
 
+    // current token’s raw characters, including quotes and escapes
+    inline std::string_view view() const;
+    // does the current token contain quotes or escapes?
+    inline bool quoted() const;
+    // write the current token’s character contents to `buf`, which has
+    // room for `view().size()` characters; return the number written
+    size_t unquote(char* buf) const;
+
     // compare iterators
     inline bool operator==(const shell_token_iterator& x) const;
     inline bool operator!=(const shell_token_iterator& x) const;
@@ -113,6 +126,14 @@ inline int shell_token_iterator::type() const {
     return _type;
 }
 
+inline std::string_view shell_token_iterator::view() const {
+    return std::string_view(_s, _len);
+}
+
+inline bool shell_token_iterator::quoted() const {
+    return _quoted;
+}
+
 inline bool shell_token_iterator::operator==(const shell_token_iterator& x) const {
     return _s == x._s;
 }
@@ -1,18 +1,70 @@
 #include "helpers.hh"
 #include <random>
+#include <thread>
+#include <functional>
+#include <cstdint>
 #include <cstdlib>
 #include <cctype>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <strings.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+// xoshiro256
+//    The xoshiro256** generator: small, fast, and good enough for ball
+//    placement. Each thread has its own, so `random_int` never contends.
+namespace {
+struct xoshiro256 {
+    typedef uint64_t result_type;
+    uint64_t s_[4];
+
+    explicit xoshiro256(uint64_t seed) {
+        // expand `seed` with splitmix64, which never yields all zeros
+        for (auto& x : s_) {
+            seed += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            x = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr uint64_t min() {
+        return 0;
+    }
+    static constexpr uint64_t max() {
+        return ~uint64_t(0);
+    }
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+    uint64_t operator()() {
+        uint64_t result = rotl(s_[1] * 5, 7) * 9;
+        uint64_t t = s_[1] << 17;
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 45);
+        return result;
+    }
+};
+}
 
 // random_int(min, max)
 //    Returns a random number in the range [`min`, `max`], inclusive.
+//    Each thread's generator is seeded from `std::random_device` and the
+//    thread's ID, so threads started together get different sequences.
 int random_int(int min, int max) {
-    static thread_local std::default_random_engine* random_engine;
-    if (!random_engine) {
-        random_engine = new std::default_random_engine{std::random_device()()};
-    }
-    return std::uniform_int_distribution<int>(min, max)(*random_engine);
+    static thread_local xoshiro256 random_engine{
+        (uint64_t(std::random_device()()) << 32)
+        ^ std::hash<std::thread::id>()(std::this_thread::get_id())
+    };
+    return std::uniform_int_distribution<int>(min, max)(random_engine);
 }
 
 // is_integer_string, is_real_string
@@ -71,3 +123,155 @@ simple_printer& simple_printer::operator<<(long i) {
     }
     return (*this << static_cast<unsigned long>(i));
 }
+
+// latency_histogram::bucket(usec)
+//    Return the bucket for `usec`. Values below 16 have their own
+//    buckets; larger values are bucketed by their top 5 bits.
+int latency_histogram::bucket(unsigned long usec) {
+    if (usec >> max_bits) {
+        usec = (1UL << max_bits) - 1;
+    }
+    if (usec < (1UL << sub_bits)) {
+        return usec;
+    }
+    int e = 63 - __builtin_clzl(usec);
+    return ((e - sub_bits + 1) << sub_bits)
+        + ((usec >> (e - sub_bits)) & ((1 << sub_bits) - 1));
+}
+
+// latency_histogram::bucket_max(b)
+//    Return the largest value in bucket `b`.
+unsigned long latency_histogram::bucket_max(int b) {
+    if (b < (1 << sub_bits)) {
+        return b;
+    }
+    int e = (b >> sub_bits) + sub_bits - 1;
+    unsigned long lo = ((1UL << sub_bits) + (b & ((1 << sub_bits) - 1)))
+        << (e - sub_bits);
+    return lo + (1UL << (e - sub_bits)) - 1;
+}
+
+// latency_histogram::record(usec)
+//    Record a latency of `usec` microseconds.
+void latency_histogram::record(unsigned long usec) {
+    this->counts_[bucket(usec)].fetch_add(1, std::memory_order_relaxed);
+    this->count_.fetch_add(1, std::memory_order_relaxed);
+    unsigned long m = this->max_.load(std::memory_order_relaxed);
+    while (usec > m
+           && !this->max_.compare_exchange_weak(m, usec,
+                                                std::memory_order_relaxed)) {
+    }
+}
+
+// latency_histogram::percentile(p)
+//    Return the latency at or below which a fraction `p` of recorded
+//    latencies lie, or 0 if nothing was recorded.
+unsigned long latency_histogram::percentile(double p) const {
+    unsigned long n = this->count();
+    unsigned long rank = (unsigned long) (p * n + 0.5);
+    rank = rank ? rank : 1;
+    unsigned long seen = 0;
+    for (int b = 0; b != nbuckets && n != 0; ++b) {
+        seen += this->counts_[b].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucket_max(b),
+                            this->max_.load(std::memory_order_relaxed));
+        }
+    }
+    return this->max_.load(std::memory_order_relaxed);
+}
+
+// latency_histogram::print(pr)
+//    Print a summary of this histogram, in microseconds, to `pr`.
+void latency_histogram::print(simple_printer& pr) const {
+    pr << this->count() << " samples, p50 " << this->percentile(0.5)
+       << "us, p99 " << this->percentile(0.99)
+       << "us, p999 " << this->percentile(0.999)
+       << "us, max " << this->max_.load(std::memory_order_relaxed) << "us";
+}
+
+// http_find_crlf(s, len)
+//    Return the offset of the first "\r\n" in the `len` bytes at `s`, or
+//    `len` if there is none. The SSE2 loop compares 16 positions at a time
+//    against '\r' and the following positions against '\n'.
+size_t http_find_crlf(const char* s, size_t len) {
+    size_t i = 0;
+#if __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 17 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, cr), _mm_cmpeq_epi8(b, lf)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i + 1 < len) {
+        const char* p = reinterpret_cast<const char*>(
+            memchr(s + i, '\r', len - i - 1));
+        if (!p) {
+            break;
+        } else if (p[1] == '\n') {
+            return p - s;
+        }
+        i = p + 1 - s;
+    }
+    return len;
+}
+
+// http_headers_end(s, len, from)
+//    Return the offset just past the "\r\n\r\n" that ends the HTTP
+//    headers at `s`, or 0 if the first `len` bytes don't contain it.
+size_t http_headers_end(const char* s, size_t len, size_t from) {
+    // the marker may straddle the end of the previously scanned data
+    size_t i = from > 3 ? from - 3 : 0;
+    while (i < len) {
+        i += http_find_crlf(s + i, len - i);
+        if (i + 4 > len) {
+            break;
+        } else if (s[i + 2] == '\r' && s[i + 3] == '\n') {
+            return i + 4;
+        }
+        i += 2;
+    }
+    return 0;
+}
+
+// http_content_length(s, len)
+//    Return the value of the `Content-Length` header among the complete
+//    headers in the `len` bytes at `s`, or -1 if there is none.
+long http_content_length(const char* s, size_t len) {
+    const size_t cllen = 15;
+    for (size_t i = 0; i + cllen < len; ) {
+        if (strncasecmp(s + i, "content-length:", cllen) == 0) {
+            const char* p = s + i + cllen;
+            while (*p == ' ' || *p == '\t') {
+                ++p;
+            }
+            return isdigit((unsigned char) *p) ? strtol(p, nullptr, 10) : -1;
+        }
+        i += http_find_crlf(s + i, len - i) + 2;
+    }
+    return -1;
+}
+
+// http_connection_close(s, len)
+//    Return true if the complete headers in the `len` bytes at `s` include
+//    `Connection: close`.
+bool http_connection_close(const char* s, size_t len) {
+    const size_t clen = 11;
+    for (size_t i = 0; i + clen < len; ) {
+        if (strncasecmp(s + i, "connection:", clen) == 0) {
+            const char* p = s + i + clen;
+            while (*p == ' ' || *p == '\t') {
+                ++p;
+            }
+            return strncasecmp(p, "close", 5) == 0;
+        }
+        i += http_find_crlf(s + i, len - i) + 2;
+    }
+    return false;
+}
@@ -1,6 +1,7 @@
 #ifndef PONG_HELPERS_HH
 #define PONG_HELPERS_HH
 #include <cstddef>
+#include <atomic>
 
 // random_int(min, max)
 //    Return a random integer between [min, max], inclusive.
@@ -37,4 +38,53 @@ struct simple_printer {
     simple_printer& operator<<(long i);
 };
 
+// latency_histogram
+//    Records latencies in microseconds, HdrHistogram-style: each
+//    power-of-two range of values is split into 16 linear sub-buckets, so
+//    reported percentiles are within 1/16 of the true value. Recording is
+//    lock-free, and `print` is signal-safe.
+struct latency_histogram {
+    static constexpr int sub_bits = 4;
+    static constexpr int max_bits = 36;     // values up to ~19 hours
+    static constexpr int nbuckets = (max_bits - sub_bits + 1) << sub_bits;
+
+    std::atomic<unsigned long> counts_[nbuckets] = {};
+    std::atomic<unsigned long> count_{0};
+    std::atomic<unsigned long> max_{0};
+
+    void record(unsigned long usec);
+    void record_seconds(double sec) {
+        this->record(sec > 0 ? (unsigned long) (sec * 1e6) : 0);
+    }
+    unsigned long count() const {
+        return this->count_.load(std::memory_order_relaxed);
+    }
+    unsigned long percentile(double p) const;
+    void print(simple_printer& pr) const;
+
+    static int bucket(unsigned long usec);
+    static unsigned long bucket_max(int b);
+};
+
+// http_find_crlf(s, len)
+//    Return the offset of the first "\r\n" in the `len` bytes at `s`, or
+//    `len` if there is none. Uses SSE2 where available.
+size_t http_find_crlf(const char* s, size_t len);
+
+// http_headers_end(s, len, from)
+//    Return the offset just past the "\r\n\r\n" that ends the HTTP
+//    headers at `s`, or 0 if the first `len` bytes don't contain it. The
+//    first `from` bytes were scanned by an earlier call that returned 0.
+size_t http_headers_end(const char* s, size_t len, size_t from = 0);
+
+// http_content_length(s, len)
+//    Return the value of the `Content-Length` header among the complete
+//    headers in the `len` bytes at `s`, or -1 if there is none.
+long http_content_length(const char* s, size_t len);
+
+// http_connection_close(s, len)
+//    Return true if the complete headers in the `len` bytes at `s` include
+//    `Connection: close`.
+bool http_connection_close(const char* s, size_t len);
+
 #endif
@@ -0,0 +1,189 @@
+#include "serverinfo.h"
+#include "helpers.hh"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <cassert>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+// mockpong61
+//    A loopback stand-in for the pong server, for benchmarking the pong
+//    HTTP stack without the class server. It understands three RPCs:
+//
+//    reset             Responds "100 31", a 100x31 board.
+//    move?...          Responds "0".
+//    bench?size=N      Responds with an N-byte body.
+//
+//    Connections are kept alive if the request asks for it with
+//    "Connection: keep-alive". Each connection is served by its own
+//    thread.
+
+static int mock_port = MOCK_PORT;
+
+
+// write_all(fd, buf, sz)
+//    Write all `sz` bytes at `buf` to `fd`. Returns false on error.
+static bool write_all(int fd, const char* buf, size_t sz) {
+    for (size_t pos = 0; pos != sz; ) {
+        ssize_t nw = write(fd, buf + pos, sz - pos);
+        if (nw > 0) {
+            pos += nw;
+        } else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// respond(fd, req, keepalive)
+//    Send the response to the request line `req` on `fd`. Returns false
+//    on error.
+static bool respond(int fd, const char* req, bool keepalive) {
+    // request lines look like "POST /USER/RPC HTTP/1.0"
+    const char* uri = strchr(req, '/');
+    uri = uri ? strchr(uri + 1, '/') : nullptr;
+    int status = 200;
+    std::string body;
+    if (!uri) {
+        status = 400;
+        body = "bad request\n";
+    } else if (strncmp(uri, "/reset", 6) == 0) {
+        body = "100 31\n";
+    } else if (strncmp(uri, "/move?", 6) == 0) {
+        body = "0\n";
+    } else if (strncmp(uri, "/bench?size=", 12) == 0) {
+        body.assign(strtoul(uri + 12, nullptr, 10), 'x');
+    } else {
+        status = 404;
+        body = "not found\n";
+    }
+
+    char hdr[BUFSIZ];
+    int hdrlen = snprintf(hdr, sizeof(hdr),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: %s\r\n"
+                          "\r\n",
+                          status, status == 200 ? "OK" : "Error",
+                          body.size(), keepalive ? "keep-alive" : "close");
+    assert(hdrlen > 0 && size_t(hdrlen) < sizeof(hdr));
+    return write_all(fd, hdr, hdrlen)
+        && write_all(fd, body.data(), body.size());
+}
+
+
+// serve_client(fd)
+//    Serve requests on connection `fd` until it closes.
+static void serve_client(int fd) {
+    char buf[BUFSIZ];
+    size_t len = 0;
+    while (true) {
+        // read a complete request
+        size_t hend = 0;
+        while ((hend = http_headers_end(buf, len)) == 0) {
+            if (len == sizeof(buf) - 1) {
+                goto done;      // request headers too long
+            }
+            ssize_t nr = read(fd, buf + len, sizeof(buf) - 1 - len);
+            if (nr == 0 || (nr == -1 && errno != EINTR)) {
+                goto done;
+            } else if (nr > 0) {
+                len += nr;
+            }
+        }
+
+        // requests have no bodies worth keeping
+        long cl = http_content_length(buf, hend);
+        char ch = buf[hend];
+        buf[hend] = 0;
+        bool keepalive =
+            strcasestr(buf, "\r\nconnection: keep-alive") != nullptr;
+        buf[hend] = ch;
+        size_t consumed = std::min(len, hend + (cl > 0 ? cl : 0));
+        buf[hend - 4] = 0;
+        bool ok = respond(fd, buf, keepalive);
+        memmove(buf, buf + consumed, len - consumed);
+        len -= consumed;
+        if (!ok || !keepalive) {
+            break;
+        }
+    }
+done:
+    close(fd);
+}
+
+
+// usage()
+//    Explain how mockpong61 should be run.
+static void usage() {
+    fprintf(stderr, "Usage: ./mockpong61 [-p PORT]\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    // parse arguments
+    int ch;
+    while ((ch = getopt(argc, argv, "p:")) != -1) {
+        if (ch == 'p') {
+            mock_port = strtol(optarg, nullptr, 0);
+            if (mock_port <= 0 || mock_port > 65535) {
+                usage();
+            }
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+
+    // listen on loopback
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    (void) setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(mock_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(listenfd, 1024) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    fprintf(stderr, "Mock pong server on port %d\n", mock_port);
+
+    while (true) {
+        int cfd = accept(listenfd, nullptr, nullptr);
+        if (cfd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        // responses are written header and body separately
+        (void) setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+        std::thread(serve_client, cfd).detach();
+    }
+}
@@ -4,13 +4,18 @@
 #include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <memory>
+#include <thread>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include "helpers.hh"
+#include "trace61.hh"
 struct pong_ball;
 int random_int(int min, int max);
 
 
-enum pong_celltype {
+enum pong_celltype : uint8_t {
     cell_empty,
     cell_sticky,
     cell_obstacle,
@@ -18,26 +23,166 @@ enum pong_celltype {
 };
 
 
+// pong_cell
+//    A board position, packed into 8 bytes so a cache line holds 8 cells.
+//    `type_` is set before any ball moves and never changes, so it can be
+//    read without locking. `ball_` is an index into the board's ball
+//    array (0 means no ball); it, and the direction of that ball, are
+//    protected by the cell's lock stripe (see `pong_board::mutex`).
+//    `ball_` is atomic only so snapshots can read it without locking.
+
 struct pong_cell {
     pong_celltype type_ = cell_empty;  // type of cell
-    pong_ball* ball_ = nullptr;        // pointer to ball currently in cell
+    std::atomic<uint32_t> ball_{0};    // index of ball currently in cell
+
+    uint32_t ball_index() const {
+        return this->ball_.load(std::memory_order_relaxed);
+    }
+    void set_ball_index(uint32_t b) {
+        this->ball_.store(b, std::memory_order_relaxed);
+    }
+};
+
+
+// pong_lock
+//    One lock stripe, padded to a cache line so neighboring stripes
+//    don't false-share. `seq_` is a sequence lock for readers that don't
+//    take `mutex_`: a locked writer makes it odd while changing cells.
+//    The ordering comes from read-modify-writes on `seq_` rather than
+//    standalone fences, which ThreadSanitizer can't check: the acquire
+//    in `write_begin` keeps the writer's cell stores after it, and a
+//    reader re-reads `seq_` with a release `fetch_add(0)` (see
+//    `pong_board::render_attempt`).
+
+struct alignas(64) pong_lock {
+    std::mutex mutex_;
+    std::atomic<unsigned> seq_{0};
+
+    void write_begin() {
+        this->seq_.fetch_add(1, std::memory_order_acquire);
+    }
+    void write_end() {
+        this->seq_.fetch_add(1, std::memory_order_release);
+    }
+};
+
+
+// pong_counter
+//    A statistics counter split into cache-line-sized shards, so threads
+//    updating it on different shards don't contend. Signal-safe to read.
+
+struct pong_counter {
+    static constexpr int nshards = 16;
+    struct alignas(64) shard {
+        std::atomic<unsigned long> n{0};
+    };
+    shard shards_[nshards];
+
+    void add(unsigned hint) {
+        shards_[hint % nshards].n.fetch_add(1, std::memory_order_relaxed);
+    }
+    unsigned long load() const {
+        unsigned long sum = 0;
+        for (auto& sh : shards_) {
+            sum += sh.n.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
+
+
+// pong_region
+//    Lock contention statistics for one region of the board: how often a
+//    move found a lock stripe for one of the region's cells already held,
+//    and how long it waited. Padded so regions don't false-share.
+
+struct alignas(64) pong_region {
+    std::atomic<unsigned long> nwaits_{0};
+    std::atomic<unsigned long> wait_ns_{0};
+};
+
+
+// pong_stepper
+//    The helper threads of `pong_board::step_all`, started by its first
+//    multithreaded call and kept until the board is destroyed, so a tick
+//    costs a wakeup per phase rather than a thread creation. `run`
+//    publishes a phase by bumping `generation_`; each helper steps
+//    stripes until none remain and checks out, and `run` returns only
+//    after every helper has checked out (a barrier per phase).
+
+struct pong_board;
+
+struct pong_stepper {
+    pong_board& board_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable start_;    // signaled when a phase begins
+    std::condition_variable done_;     // signaled when `nbusy_` hits 0
+    unsigned long generation_ = 0;     // number of phases begun
+    int nbusy_ = 0;                    // helpers still in this phase
+    bool stop_ = false;
+    int nstripes_ = 0;
+    std::atomic<int> next_stripe_{0};
+    std::atomic<unsigned long> nfell_{0};
+
+    pong_stepper(pong_board& board, int nhelpers);
+    ~pong_stepper();
+    unsigned long run(int phase, int nstripes);
+    void helper();
+    void work();
 };
 
 
 struct pong_board {
+    static constexpr int tile_shift = 3;         // tiles are 8x8 cells
+    static constexpr int tile_size = 1 << tile_shift;
+    static constexpr unsigned nlocks = 4096;     // power of 2
+    static constexpr int stripe_height = 16;     // rows; see `step_all`
+    static constexpr int region_shift = 4;       // regions are 16x16 cells
+
     int width_;
     int height_;
-    std::vector<pong_cell> cells_;     // `width_ * height_`, row-major order
+    bool tiled_;
+    int tile_columns_ = 0;             // tiles per row, if `tiled_`
+    size_t ncells_;
+    std::unique_ptr<pong_cell[]> cells_;  // row-major order, or row-major
+                                          // order of row-major tiles
+    std::vector<pong_ball*> balls_;    // indexed by `pong_cell::ball_`
     pong_cell obstacle_cell_;          // represents off-board positions
-    unsigned long ncollisions_ = 0;
+    std::unique_ptr<pong_lock[]> locks_;
+    int region_columns_;               // regions per row
+    int nregions_;
+    std::unique_ptr<pong_region[]> regions_;
+    pong_counter ncollisions_;
+    uint32_t tick_ = 0;                // number of `step_all` calls
+    std::atomic<bool> frozen_{false};  // set while `render` waits for
+    std::mutex freeze_mutex_;          // moves to pause
+    std::condition_variable thawed_;
+    std::vector<uint32_t> placeable_;  // `y * width_ + x` of empty and
+    std::once_flag placeable_once_;    // sticky cells; see `placeable`
+    std::unique_ptr<pong_stepper> stepper_;  // see `step_all`
 
 
-    // pong_board(width, height)
+    // pong_board(width, height, tiled)
     //    Construct a new `width x height` pong board with all empty cells.
-    pong_board(int width, int height)
-        : width_(width), height_(height),
-          cells_(width * height, pong_cell()) {
+    //    If `tiled` is true, cells are laid out in 8x8 tiles, so a ball's
+    //    neighborhood usually spans 1-2 cache lines rather than 3 rows.
+    pong_board(int width, int height, bool tiled = false)
+        : width_(width), height_(height), tiled_(tiled),
+          balls_(1, nullptr), locks_(new pong_lock[nlocks]) {
+        if (tiled) {
+            tile_columns_ = (width + tile_size - 1) >> tile_shift;
+            int tile_rows = (height + tile_size - 1) >> tile_shift;
+            ncells_ = size_t(tile_columns_) * tile_rows
+                * tile_size * tile_size;
+        } else {
+            ncells_ = size_t(width) * height;
+        }
+        cells_.reset(new pong_cell[ncells_]);
         obstacle_cell_.type_ = cell_obstacle;
+        region_columns_ = ((width - 1) >> region_shift) + 1;
+        nregions_ = region_columns_ * (((height - 1) >> region_shift) + 1);
+        regions_.reset(new pong_region[nregions_]);
     }
 
     // destroy a pong_board
@@ -56,8 +201,118 @@ struct pong_board {
     pong_cell& cell(int x, int y) {
         if (x < 0 || x >= this->width_ || y < 0 || y >= this->height_) {
             return obstacle_cell_;
+        } else if (this->tiled_) {
+            size_t tile = size_t(y >> tile_shift) * this->tile_columns_
+                + (x >> tile_shift);
+            return this->cells_[(tile << (2 * tile_shift))
+                                + ((y & (tile_size - 1)) << tile_shift)
+                                + (x & (tile_size - 1))];
         } else {
-            return this->cells_[y * this->width_ + x];
+            return this->cells_[size_t(y) * this->width_ + x];
+        }
+    }
+
+    // placeable()
+    //    Return the positions where a ball may be placed (empty and
+    //    sticky cells), as `y * width_ + x`. Built on first use; cell
+    //    types must not change afterwards.
+    const std::vector<uint32_t>& placeable() {
+        std::call_once(this->placeable_once_, [this] () {
+            for (int y = 0; y != this->height_; ++y) {
+                for (int x = 0; x != this->width_; ++x) {
+                    pong_celltype t = this->cell(x, y).type_;
+                    if (t == cell_empty || t == cell_sticky) {
+                        this->placeable_.push_back(y * this->width_ + x);
+                    }
+                }
+            }
+        });
+        return this->placeable_;
+    }
+
+    // ball(c)
+    //    Return the ball in cell `c`, or nullptr if there is none.
+    pong_ball* ball(const pong_cell& c) const {
+        return this->balls_[c.ball_index()];
+    }
+
+    // add_ball(b)
+    //    Add `b` to the ball array and return its index. Not thread-safe;
+    //    balls are created before any ball moves.
+    uint32_t add_ball(pong_ball* b) {
+        this->balls_.push_back(b);
+        return this->balls_.size() - 1;
+    }
+
+    // stripe(c), mutex(c)
+    //    Return the lock stripe protecting board cell `c`, or its mutex.
+    //    Distinct cells may share a stripe. `obstacle_cell_` is never
+    //    locked.
+    pong_lock& stripe(const pong_cell& c) {
+        assert(&c != &this->obstacle_cell_);
+        return this->locks_[(&c - this->cells_.get()) & (nlocks - 1)];
+    }
+    std::mutex& mutex(const pong_cell& c) {
+        return this->stripe(c).mutex_;
+    }
+
+    // region(x, y)
+    //    Return the index of the region containing position `x, y`, which
+    //    must be on the board. Regions are `1 << region_shift` cells
+    //    square, numbered in row-major order.
+    int region(int x, int y) const {
+        assert(x >= 0 && x < this->width_ && y >= 0 && y < this->height_);
+        return (y >> region_shift) * this->region_columns_
+            + (x >> region_shift);
+    }
+
+    // lock(m, region)
+    //    Lock stripe mutex `m` for a cell in `region`. If another thread
+    //    holds it, record the wait in that region's statistics.
+    void lock(std::mutex& m, int region) {
+        if (!m.try_lock()) {
+            auto start = std::chrono::steady_clock::now();
+            m.lock();
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            pong_region& r = this->regions_[region];
+            r.nwaits_.fetch_add(1, std::memory_order_relaxed);
+            r.wait_ns_.fetch_add(ns, std::memory_order_relaxed);
+        }
+    }
+
+    // render(buf, locked)
+    //    Draw the board into `buf`, one line per row; see below.
+    void render(char* buf, bool locked);
+    bool render_attempt(char* buf);
+    void draw(char* buf);
+
+    // wait_thawed()
+    //    Block while `render` has frozen the board.
+    void wait_thawed() {
+        std::unique_lock<std::mutex> guard(this->freeze_mutex_);
+        while (this->frozen_) {
+            this->thawed_.wait(guard);
+        }
+    }
+
+    // step_all(nthreads)
+    //    Move every ball once, deterministically; see below.
+    unsigned long step_all(int nthreads = 1);
+    unsigned long step_stripe(int stripe);
+
+    // lock_pair(a, b, region)
+    //    Lock stripes `a` and `b`, which must differ, in address order,
+    //    recording waits in `region`. A thread that holds two stripes must
+    //    have locked them this way.
+    void lock_pair(std::mutex& a, std::mutex& b, int region) {
+        assert(&a != &b);
+        if (&a < &b) {
+            this->lock(a, region);
+            this->lock(b, region);
+        } else {
+            this->lock(b, region);
+            this->lock(a, region);
         }
     }
 };
@@ -66,26 +321,31 @@ struct pong_board {
 
 struct pong_ball {
     pong_board& board_;
+    uint32_t index_;                   // index in `board_.balls_`
+    uint32_t stepped_ = 0;             // last `board_.tick_` stepped
     bool placed_ = false;
     int x_ = -1;
     int y_ = -1;
     int dx_ = 0;
     int dy_ = 0;
+    std::condition_variable unstuck_;  // signaled when a collision frees
+                                       // this ball from a sticky cell
 
 
     // pong_ball(board)
     //    Construct a new ball on `board`.
     pong_ball(pong_board& board)
-        : board_(board) {
+        : board_(board), index_(board.add_ball(this)) {
     }
 
     // pong_ball(board, x, y, dx, dy)
     //    Construct a new ball on `board` at a known position.
     pong_ball(pong_board& board, int x, int y, int dx, int dy)
-        : board_(board), placed_(true), x_(x), y_(y), dx_(dx), dy_(dy) {
+        : board_(board), index_(board.add_ball(this)), placed_(true),
+          x_(x), y_(y), dx_(dx), dy_(dy) {
         assert(x >= 0 && x < board_.width_ && y >= 0 && y < board_.height_);
-        assert(board_.cell(x, y).ball_ == nullptr);
-        board_.cell(x, y).ball_ = this;
+        assert(board_.cell(x, y).ball_index() == 0);
+        board_.cell(x, y).set_ball_index(this->index_);
     }
 
     // balls can't be copied, moved, or assigned
@@ -95,7 +355,11 @@ struct pong_ball {
 
     // place()
     //    Place this ball onto the board at a random empty or sticky position,
-    //    moving in a random direction.
+    //    moving in a random direction. Starts at a random position from
+    //    `board_.placeable()` and scans forward from there, so a nearly
+    //    full board takes at most one pass rather than unbounded random
+    //    probing. (If every placeable cell holds a ball, it keeps scanning
+    //    until one leaves.)
     void place() {
         pong_board& board = this->board_;
 
@@ -103,17 +367,31 @@ struct pong_ball {
         this->dx_ = random_int(0, 1) ? 1 : -1;
         this->dy_ = random_int(0, 1) ? 1 : -1;
 
-        // pick random positions until a suitable position is found
-        while (!this->placed_) {
-            int x = random_int(0, board.width_ - 1);
-            int y = random_int(0, board.height_ - 1);
+        const std::vector<uint32_t>& placeable = board.placeable();
+        assert(!placeable.empty());
+        size_t i = random_int(0, placeable.size() - 1);
+        for (size_t n = 0; !this->placed_; ++n, ++i) {
+            if (i == placeable.size()) {
+                i = 0;
+            }
+            if (n != 0 && n % placeable.size() == 0) {
+                std::this_thread::yield();
+            }
+            int x = placeable[i] % board.width_;
+            int y = placeable[i] / board.width_;
             pong_cell& cell = board.cell(x, y);
+            if (cell.ball_index()) {
+                continue;
+            }
 
-            if ((cell.type_ == cell_empty || cell.type_ == cell_sticky)
-                && !cell.ball_) {
+            pong_lock& stripe = board.stripe(cell);
+            std::lock_guard<std::mutex> guard(stripe.mutex_);
+            if (!cell.ball_index()) {
                 this->x_ = x;
                 this->y_ = y;
-                cell.ball_ = this;
+                stripe.write_begin();
+                cell.set_ball_index(this->index_);
+                stripe.write_end();
                 this->placed_ = true;
             }
         }
@@ -130,9 +408,17 @@ struct pong_ball {
     //    This function is complex because it must consider obstacles,
     //    collisions, holes, and sticky cells.
     //
-    //    You should preserve its current logic while adding sufficient
-    //    synchronization to make it thread-safe.
+    //    Synchronization: only the thread moving a ball changes its
+    //    position, but a colliding ball may change its direction, so the
+    //    direction is read under the current cell's lock. The move then
+    //    holds the current and next cells' locks, taken in address order
+    //    (once, if both cells share a stripe). When the next lock comes
+    //    first, the current lock is dropped to take both; if the
+    //    direction changed meanwhile, the move starts over. Time spent
+    //    waiting for locks is charged to the current cell's region.
     int move() {
+        TRACE61_SCOPE("pong_ball::move", this->index_);
+
         // return -1 if ball has been removed from board
         if (this->x_ < 0 || this->y_ < 0) {
             assert(this->x_ < 0 && this->y_ < 0
@@ -143,36 +429,123 @@ struct pong_ball {
         // otherwise, ball is on board
         // assert that this ball is stored in the board correctly
         pong_board& board = this->board_;
+        if (board.frozen_.load(std::memory_order_relaxed)) {
+            board.wait_thawed();
+        }
         pong_cell& cur_cell = board.cell(this->x_, this->y_);
-        assert(cur_cell.ball_ == this);
+        int region = board.region(this->x_, this->y_);
+        std::mutex& cur_mutex = board.mutex(cur_cell);
+        board.lock(cur_mutex, region);
+        assert(cur_cell.ball_index() == this->index_);
+
+        pong_cell* nextp;
+        std::mutex* next_mutex;
+        while (true) {
+            // sticky cell: nothing to do
+            if (this->dx_ == 0 && this->dy_ == 0) {
+                cur_mutex.unlock();
+                return 0;
+            }
+
+            this->bounce();
+
+            // lock next cell
+            nextp = &board.cell(this->x_ + this->dx_, this->y_ + this->dy_);
+            next_mutex = nullptr;
+            if (nextp == &board.obstacle_cell_) {
+                break;
+            }
+            next_mutex = &board.mutex(*nextp);
+            if (next_mutex == &cur_mutex) {
+                next_mutex = nullptr;
+                break;
+            } else if (next_mutex > &cur_mutex) {
+                board.lock(*next_mutex, region);
+                break;
+            }
+            int dx = this->dx_, dy = this->dy_;
+            cur_mutex.unlock();
+            board.lock_pair(cur_mutex, *next_mutex, region);
+            if (this->dx_ == dx && this->dy_ == dy) {
+                break;
+            }
+            next_mutex->unlock();
+        }
+        pong_cell& next_cell = *nextp;
+        std::lock_guard<std::mutex> cur_guard(cur_mutex, std::adopt_lock);
+        std::unique_lock<std::mutex> next_guard;
+        if (next_mutex) {
+            next_guard = std::unique_lock<std::mutex>(*next_mutex,
+                                                      std::adopt_lock);
+        }
 
-        // sticky cell: nothing to do
-        if (this->dx_ == 0 && this->dy_ == 0) {
+        pong_lock& cur_stripe = board.stripe(cur_cell);
+        pong_lock* next_stripe = next_mutex ? &board.stripe(next_cell) : nullptr;
+        cur_stripe.write_begin();
+        if (next_stripe) {
+            next_stripe->write_begin();
+        }
+        int r = this->finish_move(cur_cell, next_cell);
+        if (next_stripe) {
+            next_stripe->write_end();
+        }
+        cur_stripe.write_end();
+        return r;
+    }
+
+
+    // step()
+    //    Move this ball once, like `move()`, but without locking. Only
+    //    for use by `pong_board::step_all`, which ensures that no other
+    //    thread touches this ball's neighborhood meanwhile.
+    int step() {
+        if (this->x_ < 0) {
+            return -1;
+        } else if (this->dx_ == 0 && this->dy_ == 0) {
             return 0;
         }
+        pong_board& board = this->board_;
+        this->bounce();
+        return this->finish_move(board.cell(this->x_, this->y_),
+                                 board.cell(this->x_ + this->dx_,
+                                            this->y_ + this->dy_));
+    }
+
 
-        // obstacle: change direction on hitting a board edge
-        if (board.cell(this->x_ + this->dx_, this->y_).type_ == cell_obstacle) {
+    // bounce()
+    //    Change direction on hitting a board edge.
+    void bounce() {
+        pong_board& board = this->board_;
+        if (board.cell(this->x_ + this->dx_, this->y_).type_
+            == cell_obstacle) {
             this->dx_ = -this->dx_;
         }
-        if (board.cell(this->x_, this->y_ + this->dy_).type_ == cell_obstacle) {
+        if (board.cell(this->x_, this->y_ + this->dy_).type_
+            == cell_obstacle) {
             this->dy_ = -this->dy_;
         }
+    }
 
-        // check next cell
-        pong_cell& next_cell = board.cell(this->x_ + this->dx_,
-                                          this->y_ + this->dy_);
-        if (next_cell.ball_) {
+    // finish_move(cur_cell, next_cell)
+    //    Move this ball from `cur_cell` toward `next_cell`, handling
+    //    collisions, obstacles, holes, and sticky cells. Returns as for
+    //    `move()`. The caller must own both cells.
+    int finish_move(pong_cell& cur_cell, pong_cell& next_cell) {
+        pong_board& board = this->board_;
+        if (pong_ball* next_ball = board.ball(next_cell)) {
             // collision: change both balls' directions without moving them
-            if (next_cell.ball_->dx_ != this->dx_) {
-                next_cell.ball_->dx_ = this->dx_;
+            if (next_ball->dx_ == 0 && next_ball->dy_ == 0) {
+                next_ball->unstuck_.notify_one();
+            }
+            if (next_ball->dx_ != this->dx_) {
+                next_ball->dx_ = this->dx_;
                 this->dx_ = -this->dx_;
             }
-            if (next_cell.ball_->dy_ != this->dy_) {
-                next_cell.ball_->dy_ = this->dy_;
+            if (next_ball->dy_ != this->dy_) {
+                next_ball->dy_ = this->dy_;
                 this->dy_ = -this->dy_;
             }
-            ++board.ncollisions_;
+            board.ncollisions_.add(&cur_cell - board.cells_.get());
             return 0;
         } else if (next_cell.type_ == cell_obstacle) {
             // obstacle: reverse direction
@@ -184,14 +557,14 @@ struct pong_ball {
             this->x_ = this->y_ = -1;
             this->dx_ = this->dy_ = 0;
             this->placed_ = false;
-            cur_cell.ball_ = nullptr;
+            cur_cell.set_ball_index(0);
             return -1;
         } else {
             // otherwise, move into the next cell
             this->x_ += this->dx_;
             this->y_ += this->dy_;
-            cur_cell.ball_ = nullptr;
-            next_cell.ball_ = this;
+            cur_cell.set_ball_index(0);
+            next_cell.set_ball_index(this->index_);
             // stop if the next cell is sticky
             if (next_cell.type_ == cell_sticky) {
                 this->dx_ = this->dy_ = 0;
@@ -199,6 +572,262 @@ struct pong_ball {
             return 1;
         }
     }
+
+
+    // stuck()
+    //    Return true if this ball is on a sticky cell waiting for a
+    //    collision to free it.
+    bool stuck() {
+        if (this->x_ < 0) {
+            return false;
+        }
+        pong_cell& cur_cell = this->board_.cell(this->x_, this->y_);
+        std::lock_guard<std::mutex> guard(this->board_.mutex(cur_cell));
+        return this->dx_ == 0 && this->dy_ == 0;
+    }
+
+
+    // wait_unstuck()
+    //    Block until this ball can move: that is, until it is off the
+    //    board or moving. A ball stuck on a sticky cell only moves again
+    //    when another ball collides with it, which signals `unstuck_`.
+    void wait_unstuck() {
+        if (this->x_ < 0) {
+            return;
+        }
+        pong_cell& cur_cell = this->board_.cell(this->x_, this->y_);
+        std::unique_lock<std::mutex> guard(this->board_.mutex(cur_cell));
+        while (this->dx_ == 0 && this->dy_ == 0) {
+            this->unstuck_.wait(guard);
+        }
+    }
 };
 
+
+// pong_board::step_all(nthreads)
+//    Move every ball on the board once, using up to `nthreads` threads,
+//    and return the number of balls that fell off the board.
+//
+//    The board is split into stripes of `stripe_height` rows. A move
+//    touches only the ball's own row and its neighbors, so stripes two
+//    apart never interfere: all even stripes step in parallel, then all
+//    odd stripes. Within a stripe, balls move in row-major order of the
+//    cells they start the phase in. The result depends only on the
+//    board, never on `nthreads` or on timing. Must not run concurrently
+//    with `pong_ball::move()`. The extra threads come from `stepper_`,
+//    which is started on first use (after any `fork`) and reused by
+//    later ticks.
+
+inline unsigned long pong_board::step_all(int nthreads) {
+    ++this->tick_;
+    int nstripes = (this->height_ + stripe_height - 1) / stripe_height;
+    int nhelpers = std::min(nthreads, (nstripes + 1) / 2) - 1;
+    if (nhelpers > 0
+        && (!this->stepper_
+            || int(this->stepper_->threads_.size()) != nhelpers)) {
+        this->stepper_.reset();
+        this->stepper_.reset(new pong_stepper(*this, nhelpers));
+    }
+    unsigned long nfell = 0;
+    for (int phase = 0; phase < 2; ++phase) {
+        if (nhelpers > 0) {
+            nfell += this->stepper_->run(phase, nstripes);
+        } else {
+            for (int stripe = phase; stripe < nstripes; stripe += 2) {
+                nfell += this->step_stripe(stripe);
+            }
+        }
+    }
+    return nfell;
+}
+
+// pong_stepper::pong_stepper(board, nhelpers)
+//    Start `nhelpers` threads, which wait for `run` to begin a phase.
+inline pong_stepper::pong_stepper(pong_board& board, int nhelpers)
+    : board_(board) {
+    for (int i = 0; i < nhelpers; ++i) {
+        this->threads_.emplace_back(&pong_stepper::helper, this);
+    }
+}
+
+// pong_stepper::~pong_stepper()
+//    Stop and join the helper threads. No phase may be running.
+inline pong_stepper::~pong_stepper() {
+    {
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        this->stop_ = true;
+    }
+    this->start_.notify_all();
+    for (auto& t : this->threads_) {
+        t.join();
+    }
+}
+
+// pong_stepper::run(phase, nstripes)
+//    Step stripes `phase`, `phase + 2`, ... below `nstripes`, sharing
+//    them with the helpers, and return the number of balls that fell off
+//    the board. The mutex hand-offs at the start and end of the phase
+//    order every helper's moves before the caller's next phase.
+inline unsigned long pong_stepper::run(int phase, int nstripes) {
+    {
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        this->nstripes_ = nstripes;
+        this->next_stripe_.store(phase, std::memory_order_relaxed);
+        this->nfell_.store(0, std::memory_order_relaxed);
+        this->nbusy_ = this->threads_.size();
+        ++this->generation_;
+    }
+    this->start_.notify_all();
+    this->work();
+    std::unique_lock<std::mutex> guard(this->mutex_);
+    while (this->nbusy_ != 0) {
+        this->done_.wait(guard);
+    }
+    return this->nfell_.load(std::memory_order_relaxed);
+}
+
+// pong_stepper::helper()
+//    Helper thread body: join each phase as it begins.
+inline void pong_stepper::helper() {
+    unsigned long generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(this->mutex_);
+            while (!this->stop_ && this->generation_ == generation) {
+                this->start_.wait(guard);
+            }
+            if (this->stop_) {
+                return;
+            }
+            generation = this->generation_;
+        }
+        this->work();
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        if (--this->nbusy_ == 0) {
+            this->done_.notify_one();
+        }
+    }
+}
+
+// pong_stepper::work()
+//    Claim and step stripes of the current phase until none remain.
+inline void pong_stepper::work() {
+    unsigned long n = 0;
+    int stripe;
+    while ((stripe = this->next_stripe_.fetch_add(2)) < this->nstripes_) {
+        n += this->board_.step_stripe(stripe);
+    }
+    this->nfell_ += n;
+}
+
+// pong_board::step_stripe(stripe)
+//    Step the balls in `stripe` that haven't moved yet this tick.
+
+inline unsigned long pong_board::step_stripe(int stripe) {
+    unsigned long nfell = 0;
+    int y1 = std::min((stripe + 1) * stripe_height, this->height_);
+    for (int y = stripe * stripe_height; y < y1; ++y) {
+        // scan the row in contiguous runs: whole rows, or tile rows
+        for (int x = 0; x < this->width_; ) {
+            pong_cell* run = &this->cell(x, y);
+            int n = this->width_ - x;
+            if (this->tiled_) {
+                n = std::min(n, tile_size);
+            }
+            for (int i = 0; i != n; ++i) {
+                if (uint32_t b = run[i].ball_index()) {
+                    pong_ball* ball = this->balls_[b];
+                    if (ball->stepped_ != this->tick_) {
+                        ball->stepped_ = this->tick_;
+                        nfell += ball->step() < 0;
+                    }
+                }
+            }
+            x += n;
+        }
+    }
+    return nfell;
+}
+
+
+// pong_board::render(buf, locked)
+//    Draw the board into `buf`, which must have room for
+//    `(width_ + 1) * height_` characters: one line per row, with `O` for
+//    a ball, `.` for an empty cell, `_` for sticky, and `#` for a hole.
+//
+//    The picture is consistent: it shows the board as it was at one
+//    instant. If `locked` is false, the board is read optimistically
+//    under the stripes' sequence locks, so moving balls aren't held up.
+//    Only if balls keep moving during every read does `render` freeze
+//    the board: new moves then wait, and the moves already under way
+//    finish, so a read soon succeeds. If `locked` is true, the caller
+//    guarantees that no ball moves.
+
+inline void pong_board::render(char* buf, bool locked) {
+    if (locked) {
+        this->draw(buf);
+        return;
+    }
+    for (int attempt = 0; attempt != 8; ++attempt) {
+        if (this->render_attempt(buf)) {
+            return;
+        }
+    }
+    this->frozen_ = true;
+    while (!this->render_attempt(buf)) {
+        std::this_thread::yield();
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->freeze_mutex_);
+        this->frozen_ = false;
+    }
+    this->thawed_.notify_all();
+}
+
+// pong_board::render_attempt(buf)
+//    Draw the board into `buf` if no cell changes meanwhile. Returns
+//    false if some cell might have changed.
+
+inline bool pong_board::render_attempt(char* buf) {
+    static thread_local std::unique_ptr<unsigned[]> seqs;
+    if (!seqs) {
+        seqs.reset(new unsigned[nlocks]);
+    }
+    for (unsigned i = 0; i != nlocks; ++i) {
+        seqs[i] = this->locks_[i].seq_.load(std::memory_order_acquire);
+        if (seqs[i] & 1) {
+            return false;
+        }
+    }
+    this->draw(buf);
+    // a release read-modify-write reads the latest `seq_`, and orders
+    // the reads in `draw` before any later writer's `write_begin`
+    for (unsigned i = 0; i != nlocks; ++i) {
+        if (this->locks_[i].seq_.fetch_add(0, std::memory_order_release)
+            != seqs[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void pong_board::draw(char* buf) {
+    for (int y = 0; y < this->height_; ++y) {
+        for (int x = 0; x < this->width_; ++x) {
+            pong_cell& c = this->cell(x, y);
+            if (c.ball_index()) {
+                *buf = 'O';
+            } else if (c.type_ == cell_sticky) {
+                *buf = '_';
+            } else if (c.type_ == cell_hole) {
+                *buf = '#';
+            } else {
+                *buf = '.';
+            }
+            ++buf;
+        }
+        *buf++ = '\n';
+    }
+}
+
 #endif
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <cstdlib>
 #include <cstring>
@@ -17,13 +18,19 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <algorithm>
 #include <list>
+#include <map>
+#include <vector>
 // stuff students might use
 #include <syslog.h>
 #include <semaphore.h>
 
 const bool debugging = false;
 
+struct proxy_client;
+struct proxy_endpoint;
+
 struct proxy_config {
     int index = -1;
     int port = -1;
@@ -31,10 +38,31 @@ struct proxy_config {
     unsigned delay = 0;
     size_t max_connections = 0;
     int listenfd = -1;
+    int splicefd[2] = {-1, -1};         // pipe for forwarding bodies
+
+    // event loop state (see `accept_connections`)
+    int epfd = -1;
+    size_t nactive = 0;                 // open client connections
+    bool accepting = false;             // `listenfd` is in `epfd`
+    std::vector<proxy_endpoint*> idle_upstreams;
+    std::multimap<double, proxy_client*> timers;
+    std::vector<proxy_endpoint*> retired_endpoints;  // freed after each
+    std::vector<proxy_client*> retired_clients;      // `epoll_wait` batch
+
+    static constexpr size_t idle_capacity = 16;
 
     int open_listen_socket();
     void accept_connections();
-    void handle_client(int clientfd);
+
+private:
+    void set_accepting(bool on);
+    void accept_client();
+    void client_readable(proxy_client* c);
+    void upstream_readable(proxy_client* c);
+    void close_client(proxy_client* c);
+    int get_upstream();
+    void put_upstream(int fd);
+    void watch(proxy_endpoint* ep, int op);
 };
 
 
@@ -46,6 +74,17 @@ static const int proxy_start_port = PROXY_START_PORT;
 static bool listen_all = false;
 
 
+// STATISTICS
+//    Per-proxy latencies, printed on `SIGUSR2` by `summary_handler`.
+struct proxy_stats {
+    latency_histogram connect;   // upstream connection setup
+    latency_histogram response;  // request received to response forwarded
+};
+static proxy_stats stats[nproxies];
+static const char* proxy_types[nproxies];
+static double start_ms;
+
+
 // open_listen_socket(port)
 //    Open a socket for listening on `port`. The socket will accept
 //    connections from any host, and has a listen queue of 100
@@ -96,55 +135,40 @@ int proxy_config::open_listen_socket() {
     return fd;
 }
 
-void proxy_config::accept_connections() {
-    size_t nconnections = 0;
-
-    while (true) {
-        // when a client connects, spawn a new thread to handle it.
-        socklen_t clientlen;
-        struct sockaddr_in clientaddr;
-        int cfd = accept(this->listenfd, (struct sockaddr *)&clientaddr, &clientlen);
-        if (cfd < 0) {
-            perror("accept");
-        }
-
-        ++nconnections;
-        if (this->max_connections != 0
-            && nconnections >= this->max_connections) {
-            fprintf(stderr, "Wrong proxy!!!\n");
-        }
-
-        std::thread t([this, cfd] () {
-            this->handle_client(cfd);
-        });
-        t.detach();
-    }
-}
-
 struct http_transfer_buffer {
     char buf[BUFSIZ];
     ssize_t len = 0;
 
-    ssize_t clpos = 0;
-    const char* const clmsg = "content-length:";
-    const ssize_t cllen = 15;
+    bool in_body = false;               // headers have been forwarded
+    ssize_t scanpos = 0;                // `buf` prefix without header end
     ssize_t content_length = -1;
-
-    ssize_t ehpos = 0;
-    const char* const ehmsg = "\r\n\r\n";
-    const ssize_t ehlen = 4;
+    bool closing = false;               // message had `Connection:
+                                        // close` (cleared by the user)
 
     const char* insertmsg;
     ssize_t insertlen = 0;
 
+    bool want_read = true;
+
     http_transfer_buffer(const char* insertmsg_, ssize_t insertlen_)
         : insertmsg(insertmsg_), insertlen(insertlen_) {
     }
-    ssize_t run(int fromfd, int tofd, unsigned delay);
+
+    // return values for `step`
+    static constexpr ssize_t transfer_error = -1;
+    static constexpr ssize_t transfer_eof = 0;
+    static constexpr ssize_t transfer_done = 1;
+    static constexpr ssize_t transfer_again = 2;
+    ssize_t step(int fromfd, int tofd, const int* splicefd);
+
+private:
+    ssize_t flush_headers(int tofd);
+    ssize_t splice_body(int fromfd, int tofd, const int* splicefd);
+    ssize_t finish_step();
 };
 
 static ssize_t my_read(int fd, char* buf, size_t sz) {
-    ssize_t nr = read(fd, buf, sz);
+    ssize_t nr = recv(fd, buf, sz, MSG_DONTWAIT);
     if (debugging && nr > 0) {
         fprintf(stderr, "read[%d] \"%.*s\"\n", fd, int(nr), buf);
     }
@@ -159,104 +183,473 @@ static ssize_t my_write(int fd, const char* buf, size_t sz) {
     return nw;
 }
 
-ssize_t http_transfer_buffer::run(int fromfd, int tofd, unsigned delay) {
-    while (true) {
-        // refresh buffer if necessary
-        if (this->len == 0) {
-            size_t capacity = sizeof(this->buf) - this->insertlen - this->ehlen;
-            this->len = my_read(fromfd, this->buf, capacity);
-            if (this->len == 0) {
-                return 0;
-            } else if (this->len == -1) {
-                if (errno != EINTR && errno != EAGAIN) {
-                    perror("read");
-                    return -1;
-                } else {
-                    this->len = 0;
-                    continue; // retry
-                }
-            } else if (delay > 0) {
-                usleep(delay * 1000);
-            }
+// write_all(fd, buf, sz)
+//    Write all `sz` bytes at `buf` to `fd`. Returns false if the peer
+//    went away.
+static bool write_all(int fd, const char* buf, size_t sz) {
+    for (size_t pos = 0; pos != sz; ) {
+        ssize_t nw = my_write(fd, buf + pos, sz - pos);
+        if (nw > 0) {
+            pos += nw;
+        } else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
+            return false;
         }
+    }
+    return true;
+}
 
-        // transfer headers, parsing `content-length`
-        ssize_t pos = 0;
-        for (; pos != this->len && this->ehpos != this->ehlen; ++pos) {
-            char ch = this->buf[pos];
-            if (ch == this->ehmsg[this->ehpos]) {
-                ++this->ehpos;
-            } else {
-                this->ehpos = 0;
-            }
-            if (this->clpos == this->cllen) {
-                if (ch >= '0' && ch <= '9') {
-                    this->content_length = ch - '0'
-                        + std::max(this->content_length, ssize_t(0)) * 10;
-                } else if (ch != ' ' && ch != '\t') {
-                    ++this->clpos;
-                }
-            } else if (this->clpos < this->cllen) {
-                if (tolower((unsigned char) ch) == this->clmsg[this->clpos]) {
-                    ++this->clpos;
-                } else {
-                    this->clpos = 0;
-                }
+// http_transfer_buffer::step(fromfd, tofd, splicefd)
+//    Read whatever data is available from `fromfd`, without blocking, and
+//    forward as much of the current message as possible to `tofd`.
+//    Returns `transfer_done` once a full message has been forwarded (any
+//    following data stays buffered for the next message),
+//    `transfer_again` if more data must arrive first, `transfer_eof` at
+//    end of file, and `transfer_error` on error.
+//
+//    Headers are collected in `this->buf` until complete (or until the
+//    buffer fills), then scanned for `Content-Length` and forwarded, with
+//    `this->insertmsg` added at their end. Only headers pass through
+//    `this->buf`. Once they are forwarded, the rest of the body moves
+//    from `fromfd` to `tofd` with `splice` through the empty pipe
+//    `splicefd`, and never enters user space.
+ssize_t http_transfer_buffer::step(int fromfd, int tofd,
+                                   const int* splicefd) {
+    if (this->in_body && this->content_length > 0) {
+        assert(this->len == 0);
+        return this->splice_body(fromfd, tofd, splicefd);
+    }
+
+    // refresh buffer if necessary
+    if (this->len == 0 || this->want_read) {
+        ssize_t capacity = sizeof(this->buf) - this->insertlen - this->len;
+        if (capacity <= 0) {
+            fprintf(stderr, "message headers too long\n");
+            return transfer_error;
+        }
+        ssize_t nr = my_read(fromfd, this->buf + this->len, capacity);
+        if (nr == 0) {
+            return transfer_eof;
+        } else if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+            return transfer_again;
+        } else if (nr == -1) {
+            perror("read");
+            return transfer_error;
+        }
+        this->len += nr;
+    }
+
+    // wait for complete headers, then add `this->insertmsg` before the
+    // blank line that ends them
+    ssize_t pos = 0;
+    if (!this->in_body) {
+        ssize_t hend = http_headers_end(this->buf, this->len, this->scanpos);
+        if (hend == 0) {
+            return this->flush_headers(tofd);
+        }
+        long cl = http_content_length(this->buf, hend);
+        if (cl >= 0) {
+            this->content_length = cl;
+        }
+        this->closing = this->closing
+            || http_connection_close(this->buf, hend);
+        memmove(this->buf + hend - 4 + this->insertlen,
+                this->buf + hend - 4,
+                this->len - (hend - 4));
+        memcpy(this->buf + hend - 4, this->insertmsg, this->insertlen);
+        this->len += this->insertlen;
+        pos = hend + this->insertlen;
+        this->in_body = true;
+        this->scanpos = 0;
+    }
+
+    // include available message body if any
+    if (this->content_length > 0) {
+        ssize_t ncopy = std::min(this->len - pos, this->content_length);
+        pos += ncopy;
+        this->content_length -= ncopy;
+    }
+
+    // copy data
+    if (!write_all(tofd, this->buf, pos)) {
+        return transfer_error;
+    }
+
+    // shift remaining data down
+    memmove(this->buf, this->buf + pos, this->len - pos);
+    this->len -= pos;
+    return this->finish_step();
+}
+
+// http_transfer_buffer::flush_headers(tofd)
+//    Called when `this->buf` holds incomplete headers. If the buffer is
+//    full, forward the complete header lines, noting any `Content-Length`,
+//    to make room.
+ssize_t http_transfer_buffer::flush_headers(int tofd) {
+    this->want_read = true;
+    this->scanpos = this->len;
+    if (this->len + this->insertlen < ssize_t(sizeof(this->buf))) {
+        return transfer_again;
+    }
+
+    // keep the last CRLF, which may begin the end-of-headers marker
+    ssize_t flush = 0;
+    for (ssize_t i = 0; i != this->len; i += 2) {
+        i += http_find_crlf(this->buf + i, this->len - i);
+        if (i == this->len) {
+            break;
+        }
+        flush = i;
+    }
+    if (flush == 0) {
+        fprintf(stderr, "message headers too long\n");
+        return transfer_error;
+    }
+    long cl = http_content_length(this->buf, flush + 2);
+    if (cl >= 0) {
+        this->content_length = cl;
+    }
+    this->closing = this->closing
+        || http_connection_close(this->buf, flush + 2);
+    if (!write_all(tofd, this->buf, flush)) {
+        return transfer_error;
+    }
+    memmove(this->buf, this->buf + flush, this->len - flush);
+    this->len -= flush;
+    this->scanpos = 0;
+    return transfer_again;
+}
+
+// http_transfer_buffer::splice_body(fromfd, tofd, splicefd)
+//    Forward available body data from `fromfd` to `tofd` through the
+//    pipe `splicefd`. The pipe is empty again on return.
+ssize_t http_transfer_buffer::splice_body(int fromfd, int tofd,
+                                          const int* splicefd) {
+    ssize_t nr = splice(fromfd, nullptr, splicefd[1], nullptr,
+                        std::min(this->content_length, ssize_t(1) << 16),
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nr == 0) {
+        return transfer_eof;
+    } else if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return transfer_again;
+    } else if (nr == -1) {
+        perror("splice");
+        return transfer_error;
+    }
+    this->content_length -= nr;
+
+    for (ssize_t wpos = 0; wpos != nr; ) {
+        ssize_t nw = splice(splicefd[0], nullptr, tofd, nullptr, nr - wpos,
+                            SPLICE_F_MOVE);
+        if (nw > 0) {
+            wpos += nw;
+        } else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
+            // the peer went away; drain the pipe for the next user
+            while (wpos != nr) {
+                ssize_t nd = read(splicefd[0], this->buf,
+                                  std::min(nr - wpos, ssize_t(sizeof(this->buf))));
+                assert(nd > 0);
+                wpos += nd;
             }
+            return transfer_error;
+        }
+    }
+    return this->finish_step();
+}
+
+// http_transfer_buffer::finish_step()
+//    Return the result of a `step` that forwarded all it could.
+ssize_t http_transfer_buffer::finish_step() {
+    // report success if we transferred a full message
+    if (this->in_body && this->content_length <= 0) {
+        this->in_body = false;
+        this->content_length = -1;
+        this->want_read = false;
+        return transfer_done;
+    }
+    this->want_read = true;
+    return transfer_again;
+}
+
+// EVENT LOOP
+//    Each proxy runs one thread, which multiplexes its listening socket,
+//    all its client connections, and their upstream server connections
+//    with `epoll`. Reads never block (`my_read` uses `MSG_DONTWAIT`);
+//    writes do, but messages are small.
+//
+//    A client connection alternates between forwarding a request to the
+//    server and forwarding the response back. Upstream connections are
+//    kept alive between requests in `idle_upstreams`, where `epoll`
+//    watches them so that connections the server closes are dropped. At
+//    most `max_connections` clients are served at once; further clients
+//    wait in the listen backlog until a client leaves.
+//
+//    Events carry `proxy_endpoint` pointers, and a batch from
+//    `epoll_wait` may still hold events for an endpoint that an earlier
+//    event in the batch closed. So closed endpoints and clients are only
+//    marked `retired` and queued; events for retired endpoints are
+//    ignored, and the queues are freed once the batch is done.
+
+struct proxy_endpoint {
+    proxy_client* client;   // nullptr for the listener or idle upstreams
+    int fd;
+    bool upstream;
+    bool retired = false;   // closed; ignore its events
+};
+
+struct proxy_client {
+    proxy_endpoint client_end;
+    proxy_endpoint upstream_end;
+    bool responding = false;   // forwarding a response
+    bool delayed = false;      // `delay` applied to this response
+    bool delay_pending = false;  // in `timers`, upstream not watched
+    double requested_at = 0;   // when the current request was forwarded
+    http_transfer_buffer to_server;
+    http_transfer_buffer to_client;
+
+    proxy_client(int cfd, const char* proxymsg, size_t proxylen)
+        : client_end{this, cfd, false}, upstream_end{this, -1, true},
+          to_server(proxymsg, proxylen), to_client("", 0) {
+    }
+};
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// proxy_config::watch(ep, op)
+//    Add `ep`'s fd to the epoll set (`op == EPOLL_CTL_ADD`) or remove it
+//    (`op == EPOLL_CTL_DEL`).
+void proxy_config::watch(proxy_endpoint* ep, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ep;
+    int r = epoll_ctl(this->epfd, op, ep->fd, &ev);
+    assert(r == 0);
+}
+
+// proxy_config::set_accepting(on)
+//    Start or stop accepting new clients.
+void proxy_config::set_accepting(bool on) {
+    if (on != this->accepting) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        int r = epoll_ctl(this->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                          this->listenfd, &ev);
+        assert(r == 0);
+        this->accepting = on;
+    }
+}
+
+// proxy_config::accept_connections()
+//    Serve clients forever.
+void proxy_config::accept_connections() {
+    this->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if (pipe2(this->splicefd, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        exit(1);
+    }
+    this->set_accepting(true);
+
+    struct epoll_event evs[64];
+    while (true) {
+        // responses whose delay has passed
+        double now = now_ms();
+        while (!this->timers.empty() && this->timers.begin()->first <= now) {
+            proxy_client* c = this->timers.begin()->second;
+            this->timers.erase(this->timers.begin());
+            c->delay_pending = false;
+            this->watch(&c->upstream_end, EPOLL_CTL_ADD);
         }
 
-        // add `this->insertmsg` after headers
-        if (pos > 0 && this->insertlen > 0) {
-            if (this->ehpos == this->ehlen && pos >= this->ehlen) {
-                memmove(this->buf + this->insertlen + pos - this->ehlen,
-                        this->buf + pos - this->ehlen,
-                        this->len - (pos - this->ehlen));
-                memcpy(this->buf + pos - this->ehlen, this->insertmsg, this->insertlen);
-                this->len += this->insertlen;
-                pos += this->insertlen;
-            } else if (this->ehpos == this->ehlen) {
-                memmove(this->buf + this->insertlen + this->ehlen,
-                        this->buf + pos,
-                        this->len - pos);
-                memcpy(this->buf, this->insertmsg, this->insertlen);
-                memcpy(this->buf + this->insertlen, this->ehmsg, this->ehlen);
-                this->len += this->insertlen + this->ehlen - pos;
-                pos = this->insertlen + this->ehlen;
+        int timeout = -1;
+        if (!this->timers.empty()) {
+            timeout = std::max(int(this->timers.begin()->first - now + 1), 0);
+        }
+        int n = epoll_wait(this->epfd, evs, 64, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; ++i) {
+            proxy_endpoint* ep = (proxy_endpoint*) evs[i].data.ptr;
+            if (!ep) {
+                this->accept_client();
+            } else if (ep->retired) {
+                // closed by an earlier event in this batch
+            } else if (!ep->client) {
+                // an idle upstream connection was closed (or sent junk)
+                auto it = std::find(this->idle_upstreams.begin(),
+                                    this->idle_upstreams.end(), ep);
+                assert(it != this->idle_upstreams.end());
+                this->idle_upstreams.erase(it);
+                this->watch(ep, EPOLL_CTL_DEL);
+                close(ep->fd);
+                ep->retired = true;
+                this->retired_endpoints.push_back(ep);
+            } else if (ep->upstream) {
+                this->upstream_readable(ep->client);
             } else {
-                pos -= this->ehpos;
+                this->client_readable(ep->client);
             }
         }
 
-        // include available message body if any
-        if (this->ehpos == this->ehlen && this->content_length > 0) {
-            ssize_t ncopy = std::min(this->len - pos, this->content_length);
-            pos += ncopy;
-            this->content_length -= ncopy;
+        for (proxy_endpoint* ep : this->retired_endpoints) {
+            delete ep;
+        }
+        this->retired_endpoints.clear();
+        for (proxy_client* c : this->retired_clients) {
+            delete[] c->to_server.insertmsg;
+            delete c;
         }
+        this->retired_clients.clear();
+    }
+}
 
-        // copy data
-        ssize_t nw = my_write(tofd, this->buf, pos);
-        assert(nw == pos);
+// proxy_config::accept_client()
+//    Accept a new client connection.
+void proxy_config::accept_client() {
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int cfd = accept4(this->listenfd, (struct sockaddr*) &clientaddr,
+                      &clientlen, SOCK_CLOEXEC);
+    if (cfd < 0) {
+        perror("accept");
+        return;
+    }
 
-        // shift remaining data down
-        memmove(this->buf, this->buf + pos, this->len - pos);
-        this->len -= pos;
+    // transfers to server insert proxy header
+    char proxybuf[512];
+    size_t proxylen = sprintf(proxybuf, "\r\nX-CS61-Proxy: %s-%d;delay=%u",
+                              this->type, this->port, this->delay);
+    char* proxymsg = new char[proxylen + 1];
+    memcpy(proxymsg, proxybuf, proxylen + 1);
+    proxy_client* c = new proxy_client(cfd, proxymsg, proxylen);
+    this->watch(&c->client_end, EPOLL_CTL_ADD);
+
+    ++this->nactive;
+    if (this->max_connections != 0
+        && this->nactive >= this->max_connections) {
+        fprintf(stderr, "Wrong proxy!!!\n");
+        this->set_accepting(false);
+    }
+}
 
-        // report success if we transferred a full message
-        if (this->ehpos == this->ehlen && this->content_length <= 0) {
-            this->ehpos = this->clpos = 0;
-            this->content_length = -1;
-            return 1;
+// proxy_config::client_readable(c)
+//    Forward request data from client `c` to its upstream connection.
+//    An upstream connection is taken only once there is request data to
+//    forward, so a client that just disconnects leaves the pool intact.
+void proxy_config::client_readable(proxy_client* c) {
+    if (c->upstream_end.fd < 0 && c->to_server.len == 0) {
+        char ch;
+        ssize_t nr = recv(c->client_end.fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        } else if (nr <= 0) {
+            this->close_client(c);
+            return;
         }
     }
+    if (c->upstream_end.fd < 0) {
+        c->upstream_end.fd = this->get_upstream();
+    }
+    ssize_t r = c->to_server.step(c->client_end.fd, c->upstream_end.fd,
+                                  this->splicefd);
+    if (r == http_transfer_buffer::transfer_done) {
+        // wait for the response; ignore the client meanwhile
+        this->watch(&c->client_end, EPOLL_CTL_DEL);
+        this->watch(&c->upstream_end, EPOLL_CTL_ADD);
+        c->responding = true;
+        c->delayed = false;
+        c->requested_at = now_ms();
+    } else if (r != http_transfer_buffer::transfer_again) {
+        this->close_client(c);
+    }
+}
+
+// proxy_config::upstream_readable(c)
+//    Forward response data from `c`'s upstream connection to the client,
+//    after the proxy's `delay`.
+void proxy_config::upstream_readable(proxy_client* c) {
+    if (this->delay > 0 && !c->delayed) {
+        this->watch(&c->upstream_end, EPOLL_CTL_DEL);
+        this->timers.emplace(now_ms() + this->delay, c);
+        c->delayed = c->delay_pending = true;
+        return;
+    }
+    ssize_t r = c->to_client.step(c->upstream_end.fd, c->client_end.fd,
+                                  this->splicefd);
+    if (r == http_transfer_buffer::transfer_done) {
+        stats[this->index].response.record(
+            (unsigned long) ((now_ms() - c->requested_at) * 1000));
+        this->watch(&c->upstream_end, EPOLL_CTL_DEL);
+        if (c->to_client.closing) {
+            // the server is closing this connection; don't pool it
+            close(c->upstream_end.fd);
+            c->to_client.closing = false;
+        } else {
+            this->put_upstream(c->upstream_end.fd);
+        }
+        c->upstream_end.fd = -1;
+        c->responding = false;
+        this->watch(&c->client_end, EPOLL_CTL_ADD);
+        if (c->to_server.len != 0) {
+            // a pipelined request is already buffered
+            this->client_readable(c);
+        }
+    } else if (r != http_transfer_buffer::transfer_again) {
+        this->close_client(c);
+    }
+}
+
+// proxy_config::close_client(c)
+//    Close client `c`, and its upstream connection unless that is idle.
+void proxy_config::close_client(proxy_client* c) {
+    if (c->delay_pending) {
+        for (auto it = this->timers.begin(); it != this->timers.end(); ) {
+            it = it->second == c ? this->timers.erase(it) : std::next(it);
+        }
+    } else if (c->responding) {
+        this->watch(&c->upstream_end, EPOLL_CTL_DEL);
+    }
+    if (!c->responding) {
+        this->watch(&c->client_end, EPOLL_CTL_DEL);
+    }
+    // an upstream connection with a request in progress (or partly
+    // sent) can't be reused
+    if (c->upstream_end.fd >= 0) {
+        close(c->upstream_end.fd);
+    }
+    close(c->client_end.fd);
+    c->client_end.retired = c->upstream_end.retired = true;
+    this->retired_clients.push_back(c);
+
+    --this->nactive;
+    if (this->max_connections == 0
+        || this->nactive < this->max_connections) {
+        this->set_accepting(true);
+    }
 }
 
-//forwards the client's requests to the server and sends the response back to the client
-void proxy_config::handle_client(int cfd) {
-    //printf("handle client at proxy %d\n", proxyid);
+// proxy_config::get_upstream()
+//    Return an idle upstream connection, or connect a new one.
+int proxy_config::get_upstream() {
+    if (!this->idle_upstreams.empty()) {
+        proxy_endpoint* ep = this->idle_upstreams.back();
+        this->idle_upstreams.pop_back();
+        this->watch(ep, EPOLL_CTL_DEL);
+        ep->retired = true;
+        this->retired_endpoints.push_back(ep);
+        return ep->fd;
+    }
 
-    // connect to server
-    int serverfd = socket(AF_INET, SOCK_STREAM, 0);
+    int serverfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (serverfd < 0) {
         perror("server socket");
         exit(1);
@@ -265,27 +658,52 @@ void proxy_config::handle_client(int cfd) {
     int yes = 1;
     (void) setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
+    double connect_at = now_ms();
     int r = connect(serverfd, pong_addrinfo->ai_addr, pong_addrinfo->ai_addrlen);
     if (r < 0) {
         perror("server connect");
         exit(1);
     }
+    stats[this->index].connect.record(
+        (unsigned long) ((now_ms() - connect_at) * 1000));
+    return serverfd;
+}
 
-    // transfers to server insert proxy header
-    char proxybuf[512];
-    size_t proxylen = sprintf(proxybuf, "\r\nX-CS61-Proxy: %s-%d;delay=%u",
-                              this->type, this->port, this->delay);
-    http_transfer_buffer to_server(proxybuf, proxylen);
+// proxy_config::put_upstream(fd)
+//    Keep upstream connection `fd`, which just completed a response, for
+//    reuse.
+void proxy_config::put_upstream(int fd) {
+    if (this->idle_upstreams.size() >= idle_capacity) {
+        close(fd);
+        return;
+    }
+    proxy_endpoint* ep = new proxy_endpoint{nullptr, fd, true};
+    this->idle_upstreams.push_back(ep);
+    this->watch(ep, EPOLL_CTL_ADD);
+}
 
-    // transfers to client insert nothing
-    http_transfer_buffer to_client("", 0);
 
-    while (to_server.run(cfd, serverfd, 0) > 0
-           && to_client.run(serverfd, cfd, this->delay) > 0) {
+// summary_handler
+//    Runs when `SIGUSR2` is received; prints each proxy's request latency
+//    and throughput statistics to standard output.
+void summary_handler(int) {
+    char buf[BUFSIZ];
+    simple_printer pr(buf, sizeof(buf));
+    double t = (now_ms() - start_ms) / 1000;
+    for (int i = 0; i != nproxies; ++i) {
+        unsigned long n = stats[i].response.count();
+        pr << "port " << (long) (proxy_start_port + i) << " ("
+           << (proxy_types[i] ? proxy_types[i] : "?") << "): "
+           << n << " requests, "
+           << (unsigned long) (t > 0 ? n / t : 0) << " requests/sec\n"
+           << "  upstream connect: ";
+        stats[i].connect.print(pr);
+        pr << "\n  response: ";
+        stats[i].response.print(pr);
+        pr << "\n";
     }
-
-    close(cfd);
-    close(serverfd);
+    ssize_t nw = write(STDOUT_FILENO, pr.data(), pr.length());
+    (void) nw;
 }
 
 
@@ -298,6 +716,21 @@ static void usage() {
 
 
 int main(int argc, char** argv) {
+    // a client may close its connection at any time; report that as a
+    // write error, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    // print statistics on receiving a signal
+    start_ms = now_ms();
+    {
+        struct sigaction sa;
+        sa.sa_handler = summary_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        int r = sigaction(SIGUSR2, &sa, nullptr);
+        assert(r == 0);
+    }
+
     // parse arguments
     int ch;
     while ((ch = getopt(argc, argv, "ah:p:")) != -1) {
@@ -348,6 +781,7 @@ int main(int argc, char** argv) {
             cfg.delay = random_int(50, 200);
             cfg.max_connections = 3;
         }
+        proxy_types[i] = cfg.type;
 
         if (cfg.open_listen_socket() < 0) {
             exit(1);
@@ -25,4 +25,8 @@
 #define PROXY_COUNT 4
 #endif
 
+#ifndef MOCK_PORT
+#define MOCK_PORT 6170
+#endif
+
 #endif
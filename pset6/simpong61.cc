@@ -1,31 +1,181 @@
 #include "pongboard.hh"
 #include "helpers.hh"
 #include <unistd.h>
+#include <getopt.h>
+#include <semaphore.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <cerrno>
 #include <csignal>
 #include <cassert>
+#include <climits>
 #include <atomic>
 #include <thread>
 #include <random>
 #include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <array>
+#include <algorithm>
 
 
 // pong board
 pong_board* main_board;
 
+// collisions on other shards, as last reported (sharded mode only)
+static std::atomic<unsigned long> remote_collisions;
+
 // delay between moves, in microseconds
 static unsigned long delay;
 
+// ball_queue
+//    A blocking multi-producer, multi-consumer queue of balls. `pop`
+//    sleeps on a condition variable until a ball is available, so
+//    waiting threads use no CPU.
+
+struct ball_queue {
+    std::mutex mutex_;
+    std::condition_variable nonempty_;
+    std::deque<pong_ball*> balls_;
+
+    void push(pong_ball* ball) {
+        {
+            std::lock_guard<std::mutex> guard(this->mutex_);
+            this->balls_.push_back(ball);
+        }
+        this->nonempty_.notify_one();
+    }
+
+    pong_ball* pop() {
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        while (this->balls_.empty()) {
+            this->nonempty_.wait(guard);
+        }
+        pong_ball* ball = this->balls_.front();
+        this->balls_.pop_front();
+        return ball;
+    }
+};
+
 // balls waiting to run
-static std::deque<pong_ball*> ball_reserve;
+static ball_queue ball_reserve;
 
-// number of running threads
+// number of running threads; `nrunning` decreases under `thread_mutex`,
+// with `thread_exited` signaled
 static std::atomic<unsigned long> nstarted;
 static std::atomic<long> nrunning;
+static std::mutex thread_mutex;
+static std::condition_variable thread_exited;
+
+
+// now_usec(), sleep_until_usec(t)
+//    Read the monotonic clock in microseconds, or sleep until it reaches
+//    `t`. Sleeping to an absolute time doesn't drift.
+
+static unsigned long now_usec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_usec(unsigned long t) {
+    timespec ts;
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)
+           == EINTR) {
+    }
+}
+
+
+// sleep_wheel
+//    Where ball threads (`ball_thread`) wait out `delay` after a move.
+//    Instead of every ball thread programming its own timer, a sleeping
+//    ball waits on the condition variable of the wheel slot for its
+//    wake-up time, and one timer thread (`run`) sleeps until the next
+//    nonempty slot is due and wakes all that slot's balls at once. Slots
+//    are `delay / 64` wide, and slot `cur_` expired at `cur_time_`.
+//
+//    Every wait is `delay`, so a new sleeper is never due before the
+//    slot the timer thread is sleeping toward, and one level of slots
+//    suffices.
+
+struct sleep_wheel {
+    static constexpr size_t nslots = 128;
+    std::mutex mutex_;
+    unsigned long tick_ = 1;
+    size_t cur_ = 0;
+    unsigned long cur_time_ = 0;
+    unsigned long nexpired_ = 0;       // slots expired so far
+    unsigned long nwaiting_ = 0;       // sleeping balls
+    unsigned long waiting_[nslots] = {};
+    std::condition_variable slot_cv_[nslots];
+    std::condition_variable nonempty_;
+
+    // sleep(wait)
+    //    Block for `wait` microseconds, rounded up to a whole slot.
+    void sleep(unsigned long wait) {
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        unsigned long now = now_usec();
+        if (this->nwaiting_ == 0) {
+            // the wheel was idle; restart it from now
+            this->cur_time_ = now;
+        }
+        unsigned long n = (now + wait - this->cur_time_ + this->tick_ - 1)
+            / this->tick_;
+        n = std::min(std::max(n, 1UL), nslots - 1);
+        size_t slot = (this->cur_ + n) % nslots;
+        unsigned long target = this->nexpired_ + n;
+        ++this->waiting_[slot];
+        if (++this->nwaiting_ == 1) {
+            this->nonempty_.notify_one();
+        }
+        while (this->nexpired_ < target) {
+            this->slot_cv_[slot].wait(guard);
+        }
+    }
+
+    // run()
+    //    The timer thread: expire slots as they come due, forever.
+    void run() {
+        std::unique_lock<std::mutex> guard(this->mutex_);
+        while (true) {
+            while (this->nwaiting_ == 0) {
+                this->nonempty_.wait(guard);
+            }
+            size_t n = 1;
+            while (this->waiting_[(this->cur_ + n) % nslots] == 0) {
+                ++n;
+            }
+            unsigned long due = this->cur_time_ + n * this->tick_;
+            guard.unlock();
+            sleep_until_usec(due);
+            guard.lock();
+
+            unsigned long now = now_usec();
+            while (this->nwaiting_ != 0
+                   && this->cur_time_ + this->tick_ <= now) {
+                this->cur_ = (this->cur_ + 1) % nslots;
+                this->cur_time_ += this->tick_;
+                ++this->nexpired_;
+                if (this->waiting_[this->cur_] != 0) {
+                    this->nwaiting_ -= this->waiting_[this->cur_];
+                    this->waiting_[this->cur_] = 0;
+                    this->slot_cv_[this->cur_].notify_all();
+                }
+            }
+        }
+    }
+};
+
+static sleep_wheel move_wheel;
 
 
 // ball_thread(ball)
@@ -35,13 +185,7 @@ static std::atomic<long> nrunning;
 //    3. Put it back on the `ball_reserve`.
 
 void ball_thread() {
-    pong_ball* ball = nullptr;
-    while (!ball) {
-        if (!ball_reserve.empty()) {
-            ball = ball_reserve.front();
-            ball_reserve.pop_front();
-        }
-    }
+    pong_ball* ball = ball_reserve.pop();
     ball->place();
 
     while (true) {
@@ -49,16 +193,247 @@ void ball_thread() {
         if (mval > 0) {
             // ball successfully moved; wait `delay` to move it again
             if (delay > 0) {
-                usleep(delay);
+                move_wheel.sleep(delay);
             }
         } else if (mval < 0) {
             // ball fell down hole; exit
             break;
+        } else {
+            // ball didn't move; if it is stuck, sleep until it isn't
+            ball->wait_unstuck();
+        }
+    }
+
+    ball_reserve.push(ball);
+    {
+        std::lock_guard<std::mutex> guard(thread_mutex);
+        --nrunning;
+    }
+    thread_exited.notify_one();
+}
+
+
+// timer_wheel
+//    A hashed timer wheel of balls waiting for their next move, used by
+//    the worker pool (`-P`). Slot `cur_` is the one being processed, at
+//    time `cur_time_`; slot `cur_ + i` holds balls due `i` ticks later.
+//    Every wait is at most `delay`, and the wheel spans twice that, so
+//    scheduling and expiry are O(1) with no overflow list.
+
+struct timer_wheel {
+    static constexpr size_t nslots = 128;
+    unsigned long tick_;       // slot width in microseconds
+    size_t cur_ = 0;
+    unsigned long cur_time_;
+    size_t n_ = 0;             // number of scheduled balls
+    std::vector<pong_ball*> slots_[nslots];
+
+    timer_wheel(unsigned long max_wait)
+        : tick_(std::max(max_wait / (nslots / 2), 1UL)),
+          cur_time_(now_usec()) {
+    }
+
+    // schedule(ball, wait)
+    //    Move `ball` again `wait` microseconds from now (but always in a
+    //    later slot than the current one).
+    void schedule(pong_ball* ball, unsigned long wait) {
+        size_t n = std::max((wait + tick_ - 1) / tick_, 1UL);
+        assert(n < nslots);
+        slots_[(cur_ + n) % nslots].push_back(ball);
+        ++n_;
+    }
+
+    // schedule_at(ball, t)
+    //    Move `ball` at time `t`, or as close to it as the wheel allows.
+    void schedule_at(pong_ball* ball, unsigned long t) {
+        unsigned long wait = t > cur_time_ ? t - cur_time_ : 0;
+        schedule(ball, std::min(wait, (nslots - 1) * tick_));
+    }
+
+    // empty(), reset(t)
+    //    Return true if no balls are scheduled. An empty wheel may be
+    //    reset to start at time `t`.
+    bool empty() const {
+        return n_ == 0;
+    }
+    void reset(unsigned long t) {
+        assert(n_ == 0);
+        cur_time_ = t;
+    }
+
+    // next_time()
+    //    Return the time the next nonempty slot is due. The wheel must
+    //    not be empty.
+    unsigned long next_time() const {
+        assert(n_ != 0);
+        size_t i = 1;
+        while (slots_[(cur_ + i) % nslots].empty()) {
+            ++i;
+        }
+        return cur_time_ + i * tick_;
+    }
+
+    // advance(due)
+    //    Sleep until the next nonempty slot is due, then move its balls
+    //    into `due`, which must be empty.
+    void advance(std::vector<pong_ball*>& due) {
+        do {
+            cur_ = (cur_ + 1) % nslots;
+            cur_time_ += tick_;
+        } while (slots_[cur_].empty());
+        sleep_until_usec(cur_time_);
+        due.swap(slots_[cur_]);
+        n_ -= due.size();
+    }
+};
+
+
+// pool_worker
+//    Worker pool mode groups balls by board region. Each worker owns a
+//    contiguous run of regions, in row-major order, and moves only the
+//    balls in them; a ball that moves or is placed into another worker's
+//    region is posted to that worker's mailbox. So a region's cells and
+//    lock stripes are touched almost only by its owner, their cache
+//    lines stay with one core, and locks are contended only where two
+//    workers' regions meet (see `pong_board::lock`).
+//
+//    Workers keep pace with each other in wheel time: a worker doesn't
+//    move balls due more than `pool_slack` ticks after the earliest time
+//    another worker still has balls due (its `clock_`). Otherwise a
+//    busier worker's balls would move less often, so balls arriving from
+//    a less busy neighbor would jam against them at the boundary, making
+//    that worker busier still.
+
+struct pool_mail {
+    pong_ball* ball;
+    unsigned long due;         // time to move the ball next
+};
+
+struct pool_worker {
+    std::mutex mutex_;
+    std::condition_variable nonempty_;
+    std::vector<pool_mail> mailbox_;
+    // time the worker's next balls are due, or ULONG_MAX if it has none
+    std::atomic<unsigned long> clock_{ULONG_MAX};
+
+    // post(ball, due)
+    //    Hand `ball` to this worker, to be moved at time `due`.
+    void post(pong_ball* ball, unsigned long due) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        mailbox_.push_back({ball, due});
+        if (mailbox_.size() == 1) {
+            nonempty_.notify_one();
+        }
+    }
+
+    // collect(mail, deadline)
+    //    Wait until mail arrives or until time `deadline` (if nonzero),
+    //    then move any mail into `mail`, which must be empty.
+    void collect(std::vector<pool_mail>& mail, unsigned long deadline) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        while (mailbox_.empty()) {
+            unsigned long now = now_usec();
+            if (!deadline) {
+                nonempty_.wait(guard);
+            } else if (now < deadline) {
+                nonempty_.wait_for(guard, std::chrono::microseconds(
+                                              deadline - now));
+            } else {
+                break;
+            }
+        }
+        mail.swap(mailbox_);
+    }
+};
+
+static std::unique_ptr<pool_worker[]> pool_workers;
+static int npool_workers;
+static constexpr unsigned long pool_slack = 1;
+
+// pool_clock(self)
+//    Return the earliest `clock_` of the workers other than `self`.
+static unsigned long pool_clock(int self) {
+    unsigned long t = ULONG_MAX;
+    for (int i = 0; i != npool_workers; ++i) {
+        if (i != self) {
+            t = std::min(t, pool_workers[i].clock_.load(
+                                std::memory_order_relaxed));
         }
     }
+    return t;
+}
 
-    ball_reserve.push_back(ball);
-    --nrunning;
+// pool_owner(ball)
+//    Return the worker that owns the region `ball` is in.
+static int pool_owner(pong_ball* ball) {
+    pong_board& board = ball->board_;
+    return long(board.region(ball->x_, ball->y_)) * npool_workers
+        / board.nregions_;
+}
+
+
+// pool_thread(self, balls)
+//    Run worker `self` of the worker pool: place the balls in `balls`,
+//    then repeatedly move whichever of this worker's balls are due. A
+//    ball that moved waits `delay`; a stuck ball checks again after
+//    `delay`; a ball that bounced moves again at once; and a ball that
+//    fell down a hole is placed again. Balls that land in another
+//    worker's region are handed over to it.
+
+void pool_thread(int self, std::vector<pong_ball*> balls) {
+    timer_wheel wheel(delay);
+    auto route = [&] (pong_ball* ball, unsigned long wait) {
+        int owner = pool_owner(ball);
+        if (owner == self) {
+            wheel.schedule(ball, wait);
+        } else {
+            pool_workers[owner].post(ball, wheel.cur_time_ + wait);
+        }
+    };
+    for (pong_ball* ball : balls) {
+        ball->place();
+        route(ball, 0);
+    }
+
+    std::vector<pool_mail> mail;
+    std::vector<pong_ball*> due;
+    std::atomic<unsigned long>& clock = pool_workers[self].clock_;
+    while (true) {
+        bool idle = wheel.empty();
+        clock.store(idle ? ULONG_MAX : wheel.next_time());
+        pool_workers[self].collect(mail, idle ? 0 : wheel.next_time());
+        if (idle && !mail.empty()) {
+            // rejoin the other workers' time, which may lag the clock
+            wheel.reset(std::min(now_usec(), pool_clock(self)));
+        }
+        for (auto& m : mail) {
+            wheel.schedule_at(m.ball, m.due);
+        }
+        mail.clear();
+        if (wheel.empty() || wheel.next_time() > now_usec()) {
+            continue;
+        }
+
+        // wait for workers that lag behind (see `pool_worker`)
+        unsigned long t = wheel.next_time();
+        clock.store(t);
+        while (pool_clock(self) < t - pool_slack * wheel.tick_) {
+            std::this_thread::yield();
+        }
+        wheel.advance(due);
+        for (pong_ball* ball : due) {
+            int mval = ball->move();
+            if (mval > 0) {
+                route(ball, delay);
+            } else if (mval < 0) {
+                ball->place();
+                route(ball, 0);
+            } else {
+                wheel.schedule(ball, ball->stuck() ? delay : 0);
+            }
+        }
+        due.clear();
+    }
 }
 
 
@@ -68,8 +443,15 @@ void ball_thread() {
 //    Explain how simpong61 should be run.
 static void usage() {
     fprintf(stderr, "\
-Usage: ./simpong61 [-1] [-w WIDTH] [-h HEIGHT] [-b NBALLS] [-s NSTICKY]\n\
-                   [-H NHOLES] [-j NTHREADS] [-d MOVEPAUSE] [-p PRINTTIMER]\n");
+Usage: ./simpong61 [-1 | -P | -B] [-w WIDTH] [-h HEIGHT] [-b NBALLS] [-s NSTICKY]\n\
+                   [-H NHOLES] [-j NTHREADS] [-d MOVEPAUSE] [-p PRINTTIMER]\n\
+                   [-T] [-S NSHARDS]\n\
+  -P  worker pool: NTHREADS threads share all the balls\n\
+  -B  batch: NTHREADS threads step every ball in lockstep, deterministically\n\
+  -T  lay out the board in cache-friendly 8x8 tiles\n\
+  -S, --shards NSHARDS\n\
+      split the board into NSHARDS bands of rows, each stepped in lockstep\n\
+      by its own process; balls migrate between neighboring bands\n");
     exit(1);
 }
 
@@ -77,58 +459,521 @@ Usage: ./simpong61 [-1] [-w WIDTH] [-h HEIGHT] [-b NBALLS] [-s NSTICKY]\n\
 // summary_handler
 //    Runs when `SIGUSR2` is received; prints out summary statistics for the
 //    board to standard output.
+static size_t format_summary(char* buf, size_t size) {
+    simple_printer pr(buf, size);
+    pr << nstarted << " threads started, "
+       << nrunning << " running, "
+       << main_board->ncollisions_.load() + remote_collisions.load()
+       << " collisions";
+
+    // lock contention, and the region that suffers most from it, go on
+    // the same line (`checksim.pl` expects one line per summary)
+    unsigned long nwaits = 0, wait_ns = 0, hot_ns = 0;
+    int hot = 0;
+    for (int r = 0; r != main_board->nregions_; ++r) {
+        pong_region& region = main_board->regions_[r];
+        unsigned long ns = region.wait_ns_.load(std::memory_order_relaxed);
+        nwaits += region.nwaits_.load(std::memory_order_relaxed);
+        wait_ns += ns;
+        if (ns > hot_ns) {
+            hot = r;
+            hot_ns = ns;
+        }
+    }
+    if (nwaits != 0) {
+        pr << ", " << nwaits << " lock waits, " << wait_ns / 1000
+           << " us waiting; most in region at "
+           << long(hot % main_board->region_columns_
+                   << pong_board::region_shift)
+           << "," << long(hot / main_board->region_columns_
+                          << pong_board::region_shift)
+           << " (" << hot_ns / 1000 << " us)";
+    }
+    pr << "\n";
+    return pr.length();
+}
+
 void summary_handler(int) {
     char buf[BUFSIZ];
     ssize_t nw = 0;
     if (main_board) {
-        simple_printer pr(buf, sizeof(buf));
-        pr << nstarted << " threads started, "
-           << nrunning << " running, "
-           << main_board->ncollisions_ << " collisions\n";
-        nw = write(STDOUT_FILENO, pr.data(), pr.length());
+        nw = write(STDOUT_FILENO, buf, format_summary(buf, sizeof(buf)));
     }
     assert(nw >= 0);
 }
 
 // signal_handler
-//    Runs when `SIGUSR1` is received; prints out the current state of the
-//    board to standard output.
-//
-//    NOTE: This function accesses the board in a thread-unsafe way. There is no
-//    easy way to fix this and you aren't expected to fix it.
+//    Runs when `SIGUSR1` is received; requests a printout of the current
+//    state of the board. The board is printed by `dump_board`, in
+//    `dumper_thread` or the batch-mode loop, since a signal handler can
+//    neither lock the board nor wait for a consistent view of it.
+static sem_t dump_sem;
+
 void signal_handler(int) {
-    char buf[BUFSIZ];
-    ssize_t nw = 0;
-    if (main_board) {
-        summary_handler(0);
-
-        for (int y = 0; y < main_board->height_; ++y) {
-            for (int x = 0; x < main_board->width_; ++x) {
-                pong_cell& c = main_board->cell(x, y);
-                char ch = '?';
-                if (c.ball_) {
-                    assert(c.type_ == cell_empty || c.type_ == cell_sticky);
-                    ch = 'O';
-                } else if (c.type_ == cell_empty) {
-                    ch = '.';
-                } else if (c.type_ == cell_sticky) {
-                    ch = '_';
-                } else if (c.type_ == cell_obstacle) {
-                    ch = 'X';
-                } else if (c.type_ == cell_hole) {
-                    ch = '#';
-                }
-                if (x < BUFSIZ - 1) {
-                    buf[x] = ch;
+    sem_post(&dump_sem);
+}
+
+// dump_board(locked)
+//    Print summary statistics and a consistent snapshot of the board to
+//    standard output with one `writev`. `locked` is as for
+//    `pong_board::render`.
+static void dump_board(bool locked) {
+    static std::vector<char> board_buf;    // only one thread dumps
+    char summary_buf[BUFSIZ];
+    pong_board& board = *main_board;
+    board_buf.resize(size_t(board.width_ + 1) * board.height_ + 1);
+    board.render(board_buf.data(), locked);
+    board_buf.back() = '\n';
+
+    iovec iov[2];
+    iov[0].iov_base = summary_buf;
+    iov[0].iov_len = format_summary(summary_buf, sizeof(summary_buf));
+    iov[1].iov_base = board_buf.data();
+    iov[1].iov_len = board_buf.size();
+    iovec* iop = iov;
+    int niov = 2;
+    while (niov != 0) {
+        ssize_t nw = writev(STDOUT_FILENO, iop, niov);
+        if (nw < 0 && errno != EINTR && errno != EAGAIN) {
+            return;
+        }
+        // skip past what was written
+        while (nw > 0 && size_t(nw) >= iop->iov_len) {
+            nw -= iop->iov_len;
+            ++iop;
+            --niov;
+        }
+        if (nw > 0) {
+            iop->iov_base = reinterpret_cast<char*>(iop->iov_base) + nw;
+            iop->iov_len -= nw;
+        }
+    }
+}
+
+// dumper_thread()
+//    Print the board whenever it is requested. Requests that arrive
+//    while a dump is running are coalesced.
+void dumper_thread() {
+    while (true) {
+        if (sem_wait(&dump_sem) == 0) {
+            while (sem_trywait(&dump_sem) == 0) {
+            }
+            dump_board(false);
+        }
+    }
+}
+
+
+// SHARDED MODE (`-S`, `--shards`)
+//    The board is split into `nshards` bands of whole rows. Each band is
+//    owned by its own process, with its own `pong_board`, so a shard
+//    touches only its band's memory. Shards step in lockstep, as in
+//    batch mode. A ball about to cross into a neighboring band is held
+//    back from the local step and sent to that neighbor as a
+//    `shard_ball` migration message; the neighbor resolves it against
+//    its own cells (the ball moves in, or collides with the ball there)
+//    and replies. Neighbors talk over a socketpair. Each tick:
+//
+//    1. Step every ball except those crossing a band edge.
+//    2. Exchange a `shard_header` and the crossing balls with each
+//       neighbor.
+//    3. Resolve the neighbors' balls, and exchange a `shard_reply` for
+//       each.
+//    4. Apply the replies, and place balls that fell down holes again.
+//
+//    Even shards send before receiving and odd shards receive before
+//    sending, so exchanges never deadlock, however full the sockets.
+//
+//    Shard 0 is the original process; it handles signals and printing.
+//    A dump request travels down the chain in headers and takes effect
+//    `nshards` ticks later, so every shard renders the same tick. Shards
+//    then print their bands in order, passing a token down the chain.
+
+struct shard_header {
+    uint32_t nballs;            // number of `shard_ball`s that follow
+    uint32_t dump_tick;         // tick to print at, or 0
+    uint64_t collisions;        // on the sender and the shards beyond it
+};
+
+struct shard_ball {
+    int32_t x, y, dx, dy;       // global position and direction
+};
+
+struct shard_reply {
+    int32_t moved;              // 1 if the ball moved into the receiver
+    int32_t dx, dy;             // otherwise, the ball's new direction
+};
+
+// shard_write(fd, buf, sz), shard_read(fd, buf, sz)
+//    Send or receive exactly `sz` bytes on a neighbor link. If the
+//    neighbor has gone away, so does this shard.
+static void shard_write(int fd, const void* buf, size_t sz) {
+    const char* p = reinterpret_cast<const char*>(buf);
+    while (sz != 0) {
+        ssize_t nw = write(fd, p, sz);
+        if (nw > 0) {
+            p += nw;
+            sz -= nw;
+        } else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
+            exit(0);
+        }
+    }
+}
+
+static void shard_read(int fd, void* buf, size_t sz) {
+    char* p = reinterpret_cast<char*>(buf);
+    while (sz != 0) {
+        ssize_t nr = read(fd, p, sz);
+        if (nr > 0) {
+            p += nr;
+            sz -= nr;
+        } else if (nr == 0 || (errno != EINTR && errno != EAGAIN)) {
+            exit(0);
+        }
+    }
+}
+
+struct pong_shard {
+    int index_;
+    int nshards_;
+    int y0_;                           // global row of local row 0
+    pong_board board_;
+    int fd_[2] = {-1, -1};             // links to the shards above, below
+    std::vector<pong_ball*> balls_;    // every ball object of this shard
+    std::vector<pong_ball*> away_;     // ball objects now on other shards
+    std::vector<pong_ball*> out_[2];   // balls crossing to each neighbor
+    uint64_t beyond_[2] = {0, 0};      // collisions reported by neighbors
+    uint32_t dump_tick_ = 0;
+    bool refill_ = false;              // some ball needs placing
+
+    pong_shard(int index, int nshards, int y0, int width, int height,
+               bool tiled)
+        : index_(index), nshards_(nshards), y0_(y0),
+          board_(width, height, tiled) {
+    }
+
+    void run(int nthreads);
+
+private:
+    void hold_crossing(int side);
+    void exchange_balls();
+    void exchange_replies(std::vector<shard_ball>* in);
+    shard_reply resolve(const shard_ball& m);
+    void dump(uint32_t tick);
+};
+
+// pong_shard::hold_crossing(side)
+//    Find the balls about to cross the band edge toward neighbor `side`
+//    (0 = above, 1 = below), and keep them out of this tick's local step.
+void pong_shard::hold_crossing(int side) {
+    out_[side].clear();
+    if (fd_[side] < 0) {
+        return;
+    }
+    int y = side == 0 ? 0 : board_.height_ - 1;
+    int dy = side == 0 ? -1 : 1;
+    for (int x = 0; x != board_.width_; ++x) {
+        pong_ball* ball = board_.ball(board_.cell(x, y));
+        if (ball && ball->dy_ == dy) {
+            ball->stepped_ = board_.tick_ + 1;
+            out_[side].push_back(ball);
+        }
+    }
+}
+
+// pong_shard::resolve(m)
+//    Move the ball `m` from a neighbor into this band, as
+//    `pong_ball::finish_move` would, and return the reply.
+shard_reply pong_shard::resolve(const shard_ball& m) {
+    int x = m.x + m.dx, y = m.y + m.dy - y0_;
+    assert(x >= 0 && x < board_.width_ && y >= 0 && y < board_.height_);
+    pong_cell& cell = board_.cell(x, y);
+    if (pong_ball* next_ball = board_.ball(cell)) {
+        // collision: change both balls' directions; `m` stays put
+        shard_reply r = {0, m.dx, m.dy};
+        if (next_ball->dx_ != r.dx) {
+            next_ball->dx_ = r.dx;
+            r.dx = -r.dx;
+        }
+        if (next_ball->dy_ != r.dy) {
+            next_ball->dy_ = r.dy;
+            r.dy = -r.dy;
+        }
+        board_.ncollisions_.add(x);
+        return r;
+    }
+
+    pong_ball* ball;
+    if (!away_.empty()) {
+        ball = away_.back();
+        away_.pop_back();
+    } else {
+        ball = new pong_ball(board_);
+        balls_.push_back(ball);
+    }
+    ball->stepped_ = board_.tick_;
+    if (cell.type_ == cell_hole) {
+        ball->x_ = ball->y_ = -1;
+        ball->dx_ = ball->dy_ = 0;
+        ball->placed_ = false;
+        refill_ = true;
+    } else {
+        ball->x_ = x;
+        ball->y_ = y;
+        ball->dx_ = cell.type_ == cell_sticky ? 0 : m.dx;
+        ball->dy_ = cell.type_ == cell_sticky ? 0 : m.dy;
+        ball->placed_ = true;
+        cell.set_ball_index(ball->index_);
+    }
+    return {1, 0, 0};
+}
+
+// pong_shard::exchange_balls()
+//    Send the crossing balls to the neighbors, and resolve theirs.
+void pong_shard::exchange_balls() {
+    std::vector<shard_ball> msgs[2];
+    for (int side = 0; side != 2; ++side) {
+        // a collision during the local step may have turned a ball back
+        auto& out = out_[side];
+        int dy = side == 0 ? -1 : 1;
+        out.erase(std::remove_if(out.begin(), out.end(),
+                                 [dy] (pong_ball* b) {
+                                     return b->dy_ != dy;
+                                 }),
+                  out.end());
+        for (pong_ball* ball : out) {
+            if (ball->x_ + ball->dx_ < 0
+                || ball->x_ + ball->dx_ >= board_.width_) {
+                ball->dx_ = -ball->dx_;
+            }
+            msgs[side].push_back({ball->x_, y0_ + ball->y_,
+                                  ball->dx_, ball->dy_});
+        }
+    }
+
+    std::vector<shard_ball> in[2];
+    auto send = [&] (int side) {
+        if (fd_[side] >= 0) {
+            shard_header h = {
+                uint32_t(msgs[side].size()),
+                side == 1 ? dump_tick_ : 0,
+                board_.ncollisions_.load() + beyond_[1 - side]
+            };
+            shard_write(fd_[side], &h, sizeof(h));
+            shard_write(fd_[side], msgs[side].data(),
+                        msgs[side].size() * sizeof(shard_ball));
+        }
+    };
+    auto receive = [&] (int side) {
+        if (fd_[side] >= 0) {
+            shard_header h;
+            shard_read(fd_[side], &h, sizeof(h));
+            beyond_[side] = h.collisions;
+            if (side == 0 && h.dump_tick) {
+                dump_tick_ = h.dump_tick;
+            }
+            in[side].resize(h.nballs);
+            shard_read(fd_[side], in[side].data(),
+                       h.nballs * sizeof(shard_ball));
+        }
+    };
+    if (index_ % 2 == 0) {
+        send(0), send(1), receive(0), receive(1);
+    } else {
+        receive(0), receive(1), send(0), send(1);
+    }
+    this->exchange_replies(in);
+}
+
+// pong_shard::exchange_replies(in)
+//    Resolve the neighbors' crossing balls `in`, reply, and apply the
+//    neighbors' replies to our own crossing balls.
+void pong_shard::exchange_replies(std::vector<shard_ball>* in) {
+    std::vector<shard_reply> replies[2], results[2];
+    for (int side = 0; side != 2; ++side) {
+        for (auto& m : in[side]) {
+            replies[side].push_back(this->resolve(m));
+        }
+        results[side].resize(out_[side].size());
+    }
+
+    auto send = [&] (int side) {
+        if (fd_[side] >= 0) {
+            shard_write(fd_[side], replies[side].data(),
+                        replies[side].size() * sizeof(shard_reply));
+        }
+    };
+    auto receive = [&] (int side) {
+        if (fd_[side] >= 0) {
+            shard_read(fd_[side], results[side].data(),
+                       results[side].size() * sizeof(shard_reply));
+        }
+    };
+    if (index_ % 2 == 0) {
+        send(0), send(1), receive(0), receive(1);
+    } else {
+        receive(0), receive(1), send(0), send(1);
+    }
+
+    for (int side = 0; side != 2; ++side) {
+        for (size_t i = 0; i != out_[side].size(); ++i) {
+            pong_ball* ball = out_[side][i];
+            const shard_reply& r = results[side][i];
+            if (r.moved) {
+                board_.cell(ball->x_, ball->y_).set_ball_index(0);
+                ball->x_ = ball->y_ = -1;
+                ball->dx_ = ball->dy_ = 0;
+                ball->placed_ = true;       // not ours to place
+                away_.push_back(ball);
+            } else {
+                ball->dx_ = r.dx;
+                ball->dy_ = r.dy;
+            }
+        }
+    }
+}
+
+// pong_shard::dump(tick)
+//    Print this band, after the shards above have printed theirs.
+void pong_shard::dump(uint32_t tick) {
+    std::vector<char> buf(size_t(board_.width_ + 1) * board_.height_ + 1);
+    board_.render(buf.data(), true);
+    size_t len = buf.size() - 1;
+    if (fd_[1] < 0) {
+        buf[len++] = '\n';         // the last band ends the picture
+    }
+
+    char token;
+    if (fd_[0] >= 0) {
+        shard_read(fd_[0], &token, 1);
+    } else {
+        char summary[BUFSIZ];
+        remote_collisions = beyond_[1];
+        size_t n = format_summary(summary, sizeof(summary));
+        shard_write(STDOUT_FILENO, summary, n);
+    }
+    shard_write(STDOUT_FILENO, buf.data(), len);
+    if (fd_[1] >= 0) {
+        token = char(tick);
+        shard_write(fd_[1], &token, 1);
+    }
+}
+
+// pong_shard::run(nthreads)
+//    Step this band forever, using `nthreads` threads.
+void pong_shard::run(int nthreads) {
+    for (uint32_t tick = 1; true; ++tick) {
+        if (index_ == 0 && dump_tick_ == 0
+            && sem_trywait(&dump_sem) == 0) {
+            while (sem_trywait(&dump_sem) == 0) {
+            }
+            dump_tick_ = tick + nshards_;
+        }
+
+        this->hold_crossing(0);
+        this->hold_crossing(1);
+        refill_ = board_.step_all(nthreads) != 0;
+        this->exchange_balls();
+        if (refill_) {
+            for (pong_ball* ball : balls_) {
+                if (!ball->placed_) {
+                    ball->place();
                 }
             }
-            buf[std::min(main_board->width_, BUFSIZ - 1)] = '\n';
-            nw = write(STDOUT_FILENO, buf,
-                       std::min(main_board->width_ + 1, BUFSIZ));
         }
-        nw = write(STDOUT_FILENO, "\n", 1);
+
+        if (tick == dump_tick_) {
+            this->dump(tick);
+            dump_tick_ = 0;
+        }
+        if (delay) {
+            usleep(delay);
+        }
     }
-    assert(nw >= 0);
+}
+
+// run_shards(width, height, nballs, nsticky, nholes, nthreads, nshards,
+//            tiled)
+//    Run the simulation in sharded mode. Never returns.
+[[noreturn]] static void run_shards(int width, int height, int nballs,
+                                    int nsticky, int nholes, int nthreads,
+                                    int nshards, bool tiled) {
+    // choose sticky cells and holes for the whole board, and make sure
+    // every band has room for its balls
+    std::set<std::pair<int, int>> special;
+    std::vector<std::pair<int, int>> cells[2];
+    for (int n = 0; n < nsticky + nholes; ++n) {
+        std::pair<int, int> xy;
+        do {
+            xy = {random_int(0, width - 1), random_int(0, height - 1)};
+        } while (special.count(xy));
+        special.insert(xy);
+        cells[n >= nsticky].push_back(xy);
+    }
+    std::vector<int> y0s, band_balls;
+    for (int i = 0; i <= nshards; ++i) {
+        y0s.push_back(long(height) * i / nshards);
+    }
+    for (int i = 0; i != nshards; ++i) {
+        band_balls.push_back(long(nballs) * (i + 1) / nshards
+                             - long(nballs) * i / nshards);
+        long nspecial = 0;
+        for (auto& xy : special) {
+            nspecial += xy.second >= y0s[i] && xy.second < y0s[i + 1];
+        }
+        if (band_balls[i] + nspecial
+            >= long(width) * (y0s[i + 1] - y0s[i])) {
+            usage();
+        }
+    }
+
+    // connect neighbors, then start a process per shard
+    std::vector<std::array<int, 2>> links(nshards - 1);
+    for (auto& link : links) {
+        int r = socketpair(AF_UNIX, SOCK_STREAM, 0, link.data());
+        assert(r == 0);
+    }
+    int index = 0;
+    for (int i = 1; i != nshards && index == 0; ++i) {
+        pid_t p = fork();
+        assert(p >= 0);
+        if (p == 0) {
+            index = i;
+        }
+    }
+    for (int i = 0; i != nshards - 1; ++i) {
+        if (i != index - 1) {
+            close(links[i][1]);
+        }
+        if (i != index) {
+            close(links[i][0]);
+        }
+    }
+
+    pong_shard shard(index, nshards, y0s[index], width,
+                     y0s[index + 1] - y0s[index], tiled);
+    if (index > 0) {
+        shard.fd_[0] = links[index - 1][1];
+    }
+    if (index < nshards - 1) {
+        shard.fd_[1] = links[index][0];
+    }
+    main_board = &shard.board_;
+    for (int type = 0; type != 2; ++type) {
+        for (auto& xy : cells[type]) {
+            if (xy.second >= y0s[index] && xy.second < y0s[index + 1]) {
+                shard.board_.cell(xy.first, xy.second - y0s[index]).type_ =
+                    type == 0 ? cell_sticky : cell_hole;
+            }
+        }
+    }
+    for (int n = 0; n != band_balls[index]; ++n) {
+        shard.balls_.push_back(new pong_ball(shard.board_));
+        shard.balls_.back()->place();
+    }
+    nstarted = nrunning = long(nthreads) * nshards;
+    shard.run(nthreads);
+    abort();
 }
 
 
@@ -137,11 +982,13 @@ void signal_handler(int) {
 int main(int argc, char** argv) {
     // print information on receiving a signal
     {
+        int r = sem_init(&dump_sem, 0, 0);
+        assert(r == 0);
         struct sigaction sa;
         sa.sa_handler = signal_handler;
         sigemptyset(&sa.sa_mask);
         sa.sa_flags = 0;
-        int r = sigaction(SIGUSR1, &sa, nullptr);
+        r = sigaction(SIGUSR1, &sa, nullptr);
         assert(r == 0);
         r = sigaction(SIGALRM, &sa, nullptr);
         assert(r == 0);
@@ -155,8 +1002,17 @@ int main(int argc, char** argv) {
         nholes = 0, nthreads = -1;
     long print_interval = 0;
     bool single_threaded = false;
+    bool pool = false;
+    bool batch = false;
+    bool tiled = false;
+    int nshards = 1;
+    static const struct option longopts[] = {
+        {"shards", required_argument, nullptr, 'S'},
+        {nullptr, 0, nullptr, 0}
+    };
     int ch;
-    while ((ch = getopt(argc, argv, "w:h:b:s:d:p:H:j:1")) != -1) {
+    while ((ch = getopt_long(argc, argv, "w:h:b:s:d:p:H:j:1PBTS:",
+                             longopts, nullptr)) != -1) {
         if (ch == 'w' && is_integer_string(optarg)) {
             width = strtol(optarg, nullptr, 10);
         } else if (ch == 'h' && is_integer_string(optarg)) {
@@ -175,17 +1031,37 @@ int main(int argc, char** argv) {
             print_interval = (long) (strtod(optarg, nullptr) * 1000000);
         } else if (ch == '1') {
             single_threaded = true;
+        } else if (ch == 'P') {
+            pool = true;
+        } else if (ch == 'B') {
+            batch = true;
+        } else if (ch == 'T') {
+            tiled = true;
+        } else if (ch == 'S' && is_integer_string(optarg)) {
+            nshards = strtol(optarg, nullptr, 10);
         } else {
             usage();
         }
     }
+    bool sharded = nshards > 1;
     if (nthreads < 0) {
-        nthreads = nballs;
+        if (pool || batch || sharded) {
+            nthreads = std::thread::hardware_concurrency();
+        } else {
+            nthreads = nballs;
+        }
+        nthreads = std::max(std::min(nthreads, nballs), 1);
     }
+    // (the pool, batch, and sharded modes place every ball at once)
+    int nplaced = pool || batch || sharded
+        ? nballs : std::min(nthreads, nballs);
     if (optind != argc
         || width < 2
         || height < 2
-        || std::min(nthreads, nballs) + nsticky + nholes >= width * height
+        || single_threaded + pool + batch + sharded > 1
+        || nshards < 1
+        || nshards > height
+        || (long) nplaced + nsticky + nholes >= (long) width * height
         || nthreads == 0
         || nthreads > nballs) {
         usage();
@@ -199,8 +1075,13 @@ int main(int argc, char** argv) {
         assert(r == 0);
     }
 
+    if (sharded) {
+        run_shards(width, height, nballs, nsticky, nholes, nthreads,
+                   nshards, tiled);
+    }
+
     // create pong board
-    pong_board board(width, height);
+    pong_board board(width, height, tiled);
     main_board = &board;
 
     // create sticky locations
@@ -224,11 +1105,70 @@ int main(int argc, char** argv) {
     }
 
     // create balls
+    std::vector<pong_ball*> balls;
     for (int n = 0; n < nballs; ++n) {
-        ball_reserve.push_back(new pong_ball(board));
+        balls.push_back(new pong_ball(board));
+        ball_reserve.push(balls.back());
+    }
+
+    // the batch-mode loop prints the board itself, between steps
+    if (!batch) {
+        std::thread t(dumper_thread);
+        t.detach();
     }
 
-    if (!single_threaded) {
+    if (pool) {
+        // worker pool mode: deal the balls out among `nthreads` workers
+        // to place; then each ball is moved by its region's owner
+        npool_workers = nthreads;
+        pool_workers.reset(new pool_worker[nthreads]);
+        std::vector<std::vector<pong_ball*>> shares(nthreads);
+        for (int n = 0; n < nballs; ++n) {
+            shares[n % nthreads].push_back(balls[n]);
+        }
+        for (int i = 0; i != nthreads; ++i) {
+            std::thread t(pool_thread, i, std::move(shares[i]));
+            t.detach();
+            ++nstarted;
+            ++nrunning;
+        }
+        while (true) {
+            select(0, nullptr, nullptr, nullptr, nullptr);
+        }
+    } else if (batch) {
+        // batch mode: step all balls at once; balls that fall down holes
+        // are placed again between steps
+        for (pong_ball* ball : balls) {
+            ball->place();
+        }
+        nstarted = nrunning = nthreads;
+        while (true) {
+            if (board.step_all(nthreads) != 0) {
+                for (pong_ball* ball : balls) {
+                    if (!ball->placed_) {
+                        ball->place();
+                    }
+                }
+            }
+            if (sem_trywait(&dump_sem) == 0) {
+                while (sem_trywait(&dump_sem) == 0) {
+                }
+                dump_board(true);
+            }
+            if (delay) {
+                usleep(delay);
+            }
+        }
+    } else if (!single_threaded) {
+        // the timer thread wakes sleeping ball threads
+        if (delay > 0) {
+            move_wheel.tick_ = std::max(delay / 64, 1UL);
+            std::thread t([] () {
+                move_wheel.run();
+            });
+            t.detach();
+        }
+
         // initial ball threads
         for (int i = 0; i < nthreads; ++i) {
             std::thread t(ball_thread);
@@ -244,15 +1184,16 @@ int main(int argc, char** argv) {
                 select(0, nullptr, nullptr, nullptr, nullptr);
             }
         } else {
-            // otherwise, start new threads periodically as ball threads exit
+            // otherwise, start new threads as ball threads exit
+            std::unique_lock<std::mutex> guard(thread_mutex);
             while (true) {
-                if (nrunning < nthreads) {
-                    std::thread t(ball_thread);
-                    t.detach();
-                    ++nstarted;
-                    ++nrunning;
-                    usleep(1000);
+                while (nrunning >= nthreads) {
+                    thread_exited.wait(guard);
                 }
+                std::thread t(ball_thread);
+                t.detach();
+                ++nstarted;
+                ++nrunning;
             }
         }
     } else {
@@ -261,7 +1202,7 @@ int main(int argc, char** argv) {
         assert(nholes == 0);
         while (true) {
             for (int n = 0; n < nballs; ++n) {
-                ball_reserve[n]->move();
+                balls[n]->move();
             }
             if (delay) {
                 usleep(delay);